@@ -43,15 +43,56 @@ blk_t		block_to_dump, bitmap_to_dump, inode_block_to_dump;
 unsigned int	group_to_dump, inode_offset_to_dump;
 ext2_ino_t	inode_to_dump;
 
+/*
+ * Reads are served from a window of the journal which is refilled
+ * with one large sequential read, so scanning the log does not cost a
+ * seek and a system call for every block.
+ */
+#define JOURNAL_READAHEAD	(1024 * 1024)
+
 struct journal_source
 {
 	enum journal_location where;
 	int fd;
 	ext2_file_t file;
+	char *ra_buf;
+	off_t ra_start;
+	unsigned int ra_len;
+};
+
+/*
+ * When only looking for one block or inode, the log is first indexed:
+ * for each transaction we keep its sequence number, where it starts
+ * in the log, and the filesystem blocks it logs or revokes.  Only the
+ * transactions which touch the blocks we want are then decoded.
+ */
+struct txn_index {
+	tid_t		transaction;
+	unsigned int	blocknr;	/* first journal block */
+	unsigned int	first_target;	/* index into log_index.targets */
+	unsigned int	num_targets;
+};
+
+struct log_target {
+	__u32		block;
+	__u32		revoked;
+};
+
+struct log_index {
+	struct txn_index	*txns;
+	unsigned int		num_txns, max_txns;
+	struct log_target	*targets;
+	unsigned int		num_targets, max_targets;
 };
 
 static void dump_journal(char *, FILE *, struct journal_source *);
 
+static int dump_log(char *, FILE *, struct journal_source *,
+		    journal_superblock_t *, int, unsigned int, tid_t, int);
+
+static void dump_indexed(char *, FILE *, struct journal_source *,
+			 journal_superblock_t *, int, unsigned int, tid_t);
+
 static void dump_descriptor_block(FILE *, struct journal_source *,
 				  char *, journal_superblock_t *,
 				  unsigned int *, int, tid_t);
@@ -89,9 +130,8 @@ void do_logdump(int argc, char **argv)
 	struct journal_source journal_source;
 	struct ext2_super_block *es = NULL;
 
+	memset(&journal_source, 0, sizeof(journal_source));
 	journal_source.where = JOURNAL_IS_INTERNAL;
-	journal_source.fd = 0;
-	journal_source.file = 0;
 	dump_all = 0;
 	dump_contents = 0;
 	dump_descriptors = 1;
@@ -252,7 +292,9 @@ void do_logdump(int argc, char **argv)
 		journal_source.fd = journal_fd;
 	}
 
+	journal_source.ra_buf = malloc(JOURNAL_READAHEAD);
 	dump_journal(argv[0], out_file, &journal_source);
+	free(journal_source.ra_buf);
 
 	if (journal_source.where == JOURNAL_IS_INTERNAL)
 		ext2fs_file_close(journal_file);
@@ -271,16 +313,23 @@ print_usage:
 }
 
 
-static int read_journal_block(const char *cmd, struct journal_source *source,
-			      off_t offset, char *buf, int size,
-			      unsigned int *got)
+/*
+ * Read directly from the journal.  Errors are only reported if cmd is
+ * non-NULL, so that a failed readahead can quietly fall back to reading
+ * just the block that was asked for.
+ */
+static int read_journal_raw(const char *cmd, struct journal_source *source,
+			    off_t offset, char *buf, int size,
+			    unsigned int *got)
 {
 	int retval;
 
 	if (source->where == JOURNAL_IS_EXTERNAL) {
 		if (lseek(source->fd, offset, SEEK_SET) < 0) {
 			retval = errno;
-			com_err(cmd, retval, "while seeking in reading journal");
+			if (cmd)
+				com_err(cmd, retval,
+					"while seeking in reading journal");
 			return retval;
 		}
 		retval = read(source->fd, buf, size);
@@ -289,26 +338,74 @@ static int read_journal_block(const char *cmd, struct journal_source *source,
 			retval = 0;
 		} else
 			retval = errno;
+#ifdef POSIX_FADV_WILLNEED
+		/* Have the kernel fetch the next window in the meantime */
+		if (!retval)
+			posix_fadvise(source->fd, offset + size, size,
+				      POSIX_FADV_WILLNEED);
+#endif
 	} else {
 		retval = ext2fs_file_lseek(source->file, offset,
 					   EXT2_SEEK_SET, NULL);
 		if (retval) {
-			com_err(cmd, retval, "while seeking in reading journal");
+			if (cmd)
+				com_err(cmd, retval,
+					"while seeking in reading journal");
 			return retval;
 		}
 
 		retval = ext2fs_file_read(source->file, buf, size, got);
 	}
-
-	if (retval)
+	if (retval && cmd)
 		com_err(cmd, retval, "while reading journal");
-	else if (*got != (unsigned int) size) {
+	return retval;
+}
+
+static int read_journal_block(const char *cmd, struct journal_source *source,
+			      off_t offset, char *buf, int size,
+			      unsigned int *got)
+{
+	int retval;
+
+	if (!source->ra_buf) {
+		retval = read_journal_raw(cmd, source, offset, buf, size, got);
+		if (retval)
+			return retval;
+	} else {
+		if (offset < source->ra_start ||
+		    offset + size > source->ra_start + source->ra_len) {
+			source->ra_len = 0;
+			source->ra_start = offset;
+			/*
+			 * The window may run into damaged parts of the
+			 * journal that would never be read otherwise, so
+			 * keep whatever was read before the error and only
+			 * complain if the block itself cannot be read.
+			 */
+			read_journal_raw(NULL, source, offset, source->ra_buf,
+					 JOURNAL_READAHEAD, &source->ra_len);
+			if (source->ra_len < (unsigned int) size) {
+				source->ra_len = 0;
+				retval = read_journal_raw(cmd, source, offset,
+							  buf, size, got);
+				if (retval)
+					return retval;
+				goto check;
+			}
+		}
+		*got = source->ra_start + source->ra_len - offset;
+		if (*got > (unsigned int) size)
+			*got = size;
+		memcpy(buf, source->ra_buf + (offset - source->ra_start), *got);
+	}
+
+check:
+	if (*got != (unsigned int) size) {
 		com_err(cmd, 0, "short read (read %d, expected %d) "
 			"while reading journal", *got, size);
-		retval = -1;
+		return -1;
 	}
-
-	return retval;
+	return 0;
 }
 
 static const char *type_to_name(int btype)
@@ -339,8 +436,6 @@ static void dump_journal(char *cmdname, FILE *out_file,
 	unsigned int		blocksize = 1024;
 	unsigned int		got;
 	int			retval;
-	__u32			magic, sequence, blocktype;
-	journal_header_t	*header;
 
 	tid_t			transaction;
 	unsigned int		blocknr = 0;
@@ -397,12 +492,37 @@ static void dump_journal(char *cmdname, FILE *out_file,
 		/* Empty journal, nothing to do. */
 		return;
 
+	if (dump_all || dump_descriptors)
+		dump_log(cmdname, out_file, source, jsb, blocksize,
+			 blocknr, transaction, 0);
+	else
+		dump_indexed(cmdname, out_file, source, jsb, blocksize,
+			     blocknr, transaction);
+}
+
+/*
+ * Decode the log starting at blocknr, which should hold the first
+ * block of the given transaction.  Stops at the end of the journal, or
+ * after the first commit block if one_transaction is set.  Returns 1
+ * if the end of the journal was reached.
+ */
+static int dump_log(char *cmdname, FILE *out_file,
+		    struct journal_source *source, journal_superblock_t *jsb,
+		    int blocksize, unsigned int blocknr, tid_t transaction,
+		    int one_transaction)
+{
+	char			buf[8192];
+	unsigned int		got;
+	int			retval;
+	__u32			magic, sequence, blocktype;
+	journal_header_t	*header;
+
 	while (1) {
 		retval = read_journal_block(cmdname, source,
 					    blocknr*blocksize, buf,
 					    blocksize, &got);
-		if (retval || got != blocksize)
-			return;
+		if (retval || got != (unsigned int) blocksize)
+			return 1;
 
 		header = (journal_header_t *) buf;
 
@@ -413,14 +533,14 @@ static void dump_journal(char *cmdname, FILE *out_file,
 		if (magic != JFS_MAGIC_NUMBER) {
 			fprintf (out_file, "No magic number at block %u: "
 				 "end of journal.\n", blocknr);
-			return;
+			return 1;
 		}
 
 		if (sequence != transaction) {
 			fprintf (out_file, "Found sequence %u (not %u) at "
 				 "block %u: end of journal.\n",
 				 sequence, transaction, blocknr);
-			return;
+			return 1;
 		}
 
 		if (dump_descriptors) {
@@ -441,6 +561,8 @@ static void dump_journal(char *cmdname, FILE *out_file,
 			transaction++;
 			blocknr++;
 			WRAP(jsb, blocknr);
+			if (one_transaction)
+				return 0;
 			continue;
 
 		case JFS_REVOKE_BLOCK:
@@ -454,9 +576,181 @@ static void dump_journal(char *cmdname, FILE *out_file,
 		default:
 			fprintf (out_file, "Unexpected block type %u at "
 				 "block %u.\n", blocktype, blocknr);
-			return;
+			return 1;
+		}
+	}
+}
+
+static int index_add_target(struct log_index *index, __u32 block,
+			    int revoked)
+{
+	struct log_target	*t;
+	unsigned int		new_max;
+
+	if (index->num_targets >= index->max_targets) {
+		new_max = index->max_targets * 2 + 1024;
+		t = realloc(index->targets, new_max * sizeof(*t));
+		if (!t)
+			return ENOMEM;
+		index->targets = t;
+		index->max_targets = new_max;
+	}
+	t = &index->targets[index->num_targets++];
+	t->block = block;
+	t->revoked = revoked;
+	index->txns[index->num_txns - 1].num_targets++;
+	return 0;
+}
+
+static int index_add_txn(struct log_index *index, tid_t transaction,
+			 unsigned int blocknr)
+{
+	struct txn_index	*txn;
+	unsigned int		new_max;
+
+	if (index->num_txns >= index->max_txns) {
+		new_max = index->max_txns * 2 + 64;
+		txn = realloc(index->txns, new_max * sizeof(*txn));
+		if (!txn)
+			return ENOMEM;
+		index->txns = txn;
+		index->max_txns = new_max;
+	}
+	txn = &index->txns[index->num_txns++];
+	txn->transaction = transaction;
+	txn->blocknr = blocknr;
+	txn->first_target = index->num_targets;
+	txn->num_targets = 0;
+	return 0;
+}
+
+/*
+ * Walk the log reading only the descriptor, commit and revoke blocks,
+ * and record each transaction and the blocks it touches.  The last
+ * entry is for the transaction at which the walk stopped, which was
+ * never committed (it may not have any blocks at all).
+ */
+static int index_log(char *cmdname, struct journal_source *source,
+		     journal_superblock_t *jsb, int blocksize,
+		     unsigned int blocknr, tid_t transaction,
+		     struct log_index *index)
+{
+	char			buf[8192];
+	unsigned int		got;
+	int			retval, offset, max;
+	int			tag_size = JBD_TAG_SIZE32;
+	journal_header_t	*header;
+	journal_block_tag_t	*tag;
+	__u32			tag_flags;
+
+	if (be32_to_cpu(jsb->s_feature_incompat) & JFS_FEATURE_INCOMPAT_64BIT)
+		tag_size = JBD_TAG_SIZE64;
+
+	retval = index_add_txn(index, transaction, blocknr);
+	while (!retval) {
+		retval = read_journal_block(cmdname, source,
+					    blocknr*blocksize, buf,
+					    blocksize, &got);
+		if (retval || got != (unsigned int) blocksize)
+			return 0;
+
+		header = (journal_header_t *) buf;
+		if (be32_to_cpu(header->h_magic) != JFS_MAGIC_NUMBER ||
+		    be32_to_cpu(header->h_sequence) != transaction)
+			return 0;
+
+		switch (be32_to_cpu(header->h_blocktype)) {
+		case JFS_DESCRIPTOR_BLOCK:
+			offset = sizeof(journal_header_t);
+			do {
+				tag = (journal_block_tag_t *) &buf[offset];
+				offset += tag_size;
+				if (offset > blocksize)
+					break;
+				tag_flags = be32_to_cpu(tag->t_flags);
+				if (!(tag_flags & JFS_FLAG_SAME_UUID))
+					offset += 16;
+				retval = index_add_target(index,
+						be32_to_cpu(tag->t_blocknr), 0);
+				++blocknr;
+				WRAP(jsb, blocknr);
+			} while (!retval && !(tag_flags & JFS_FLAG_LAST_TAG));
+			blocknr++;
+			WRAP(jsb, blocknr);
+			continue;
+
+		case JFS_COMMIT_BLOCK:
+			transaction++;
+			blocknr++;
+			WRAP(jsb, blocknr);
+			retval = index_add_txn(index, transaction, blocknr);
+			continue;
+
+		case JFS_REVOKE_BLOCK:
+			max = be32_to_cpu(((journal_revoke_header_t *)
+					   buf)->r_count);
+			offset = sizeof(journal_revoke_header_t);
+			for (; !retval && offset < max; offset += 4)
+				retval = index_add_target(index,
+					be32_to_cpu(*(__u32 *) (buf + offset)),
+					1);
+			blocknr++;
+			WRAP(jsb, blocknr);
+			continue;
+
+		default:
+			return 0;
+		}
+	}
+	com_err(cmdname, retval, "while indexing journal");
+	return retval;
+}
+
+static int txn_matches(struct log_index *index, struct txn_index *txn)
+{
+	struct log_target	*t = index->targets + txn->first_target;
+	unsigned int		i;
+
+	for (i = 0; i < txn->num_targets; i++, t++) {
+		if (t->revoked) {
+			if (t->block == block_to_dump)
+				return 1;
+		} else if (t->block == block_to_dump ||
+			   t->block == inode_block_to_dump ||
+			   t->block == bitmap_to_dump)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Dump only the transactions touching the block or inode we were asked
+ * about.  The transaction at which the index stopped is always decoded,
+ * so the end of the journal is reported as in a full scan.
+ */
+static void dump_indexed(char *cmdname, FILE *out_file,
+			 struct journal_source *source,
+			 journal_superblock_t *jsb, int blocksize,
+			 unsigned int blocknr, tid_t transaction)
+{
+	struct log_index	index;
+	struct txn_index	*txn;
+	unsigned int		i;
+
+	memset(&index, 0, sizeof(index));
+	if (index_log(cmdname, source, jsb, blocksize, blocknr,
+		      transaction, &index) == 0) {
+		for (i = 0; i < index.num_txns; i++) {
+			txn = &index.txns[i];
+			if (i + 1 < index.num_txns && !txn_matches(&index, txn))
+				continue;
+			if (dump_log(cmdname, out_file, source, jsb, blocksize,
+				     txn->blocknr, txn->transaction, 1))
+				break;
 		}
 	}
+	free(index.txns);
+	free(index.targets);
 }
 
 
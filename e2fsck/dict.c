@@ -516,6 +516,7 @@ dnode_t *dict_lower_bound(dict_t *dict, const void *key)
 
     return tentative;
 }
+#endif /* E2FSCK_NOTUSED */
 
 /*
  * Look for the node corresponding to the greatest key that is equal to or
@@ -548,7 +549,6 @@ dnode_t *dict_upper_bound(dict_t *dict, const void *key)
 
     return tentative;
 }
-#endif
 
 /*
  * Insert a node into the dictionary. The node should have been
@@ -649,7 +649,6 @@ void dict_insert(dict_t *dict, dnode_t *node, const void *key)
     assert (dict_verify(dict));
 }
 
-#ifdef E2FSCK_NOTUSED
 /*
  * Delete the given node from the dictionary. If the given node does not belong
  * to the given dictionary, undefined behavior results.  A pointer to the
@@ -824,7 +823,6 @@ dnode_t *dict_delete(dict_t *dict, dnode_t *delete)
 
     return delete;
 }
-#endif /* E2FSCK_NOTUSED */
 
 /*
  * Allocate a node using the dictionary's allocator routine, give it
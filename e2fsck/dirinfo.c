@@ -10,10 +10,33 @@
 #include "e2fsck.h"
 #include <sys/stat.h>
 #include <fcntl.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 #include "uuid/uuid.h"
 
 #include <ext2fs/tdb.h>
 
+/*
+ * The dense directory index records every directory inode in a
+ * bitmap, split into blocks of 64 inodes.  Each block also carries the
+ * number of directories in all of the blocks before it, so the slot
+ * for a directory is found in constant time by adding the population
+ * count of the lower bits in its block to that rank.  The slots
+ * themselves only hold the dotdot and parent inode numbers.
+ */
+#define DIR_INDEX_BITS		64
+
+struct dir_index_blk {
+	__u32		rank;	/* Directories in all preceding blocks */
+	__u32		bits[DIR_INDEX_BITS / 32];
+};
+
+struct dir_info_ent {
+	ext2_ino_t		dotdot;	/* Parent according to '..' */
+	ext2_ino_t		parent; /* Parent according to treewalk */
+};
+
 struct dir_info_db {
 	int		count;
 	int		size;
@@ -21,28 +44,33 @@ struct dir_info_db {
 	struct dir_info *last_lookup;
 	char		*tdb_fn;
 	TDB_CONTEXT	*tdb;
+	struct dir_index_blk *index;
+	struct dir_info_ent *slots;
+	ext2_ino_t	index_blocks;	/* Number of blocks in the index */
+	ext2_ino_t	index_filled;	/* Blocks whose rank is valid */
+	int		index_fd;	/* Scratch file backing the index */
+	void		*index_map;
+	size_t		index_map_size;
 };
 
 struct dir_info_iter {
 	int	i;
+	ext2_ino_t	ino;
 	TDB_DATA	tdb_iter;
 };
 
-struct dir_info_ent {
-	ext2_ino_t		dotdot;	/* Parent according to '..' */
-	ext2_ino_t		parent; /* Parent according to treewalk */
-};
-
 
 static void e2fsck_put_dir_info(e2fsck_t ctx, struct dir_info *dir);
 
-static void setup_tdb(e2fsck_t ctx, ext2_ino_t num_dirs)
+/*
+ * Returns the scratch file directory if the dirinfo database should
+ * be spilled to disk, or NULL if it should be kept in memory.
+ */
+static char *scratch_dir(e2fsck_t ctx, ext2_ino_t num_dirs)
 {
-	struct dir_info_db	*db = ctx->dir_info;
 	unsigned int		threshold;
-	errcode_t		retval;
-	char			*tdb_dir, uuid[40];
-	int			fd, enable;
+	char			*tdb_dir;
+	int			enable;
 
 	profile_get_string(ctx->profile, "scratch_files", "directory", 0, 0,
 			   &tdb_dir);
@@ -53,6 +81,269 @@ static void setup_tdb(e2fsck_t ctx, ext2_ino_t num_dirs)
 
 	if (!enable || !tdb_dir || access(tdb_dir, W_OK) ||
 	    (threshold && num_dirs <= threshold))
+		return 0;
+	return tdb_dir;
+}
+
+static unsigned int index_popcount(__u32 w)
+{
+	w = w - ((w >> 1) & 0x55555555);
+	w = (w & 0x33333333) + ((w >> 2) & 0x33333333);
+	w = (w + (w >> 4)) & 0x0F0F0F0F;
+	return (w * 0x01010101) >> 24;
+}
+
+#ifdef HAVE_MMAP
+/*
+ * (Re)map the scratch file so that it holds the index blocks followed
+ * by the given number of slots.  The old mapping is only dropped once
+ * the new one is in place, so it is still valid if this fails.
+ */
+static errcode_t map_index_file(struct dir_info_db *db, int slots)
+{
+	size_t	size;
+	void	*map;
+
+	size = db->index_blocks * sizeof(struct dir_index_blk) +
+		slots * sizeof(struct dir_info_ent);
+	if (ftruncate(db->index_fd, size) < 0)
+		return errno;
+	map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   db->index_fd, 0);
+	if (map == MAP_FAILED)
+		return errno;
+	if (db->index_map)
+		munmap(db->index_map, db->index_map_size);
+	db->index_map = map;
+	db->index_map_size = size;
+	db->index = (struct dir_index_blk *) map;
+	db->slots = (struct dir_info_ent *) (db->index + db->index_blocks);
+	db->size = slots;
+	return 0;
+}
+
+/*
+ * Copy the index out of the scratch file into memory, when the file
+ * cannot be grown any more.
+ */
+static errcode_t index_to_memory(struct dir_info_db *db)
+{
+	struct dir_index_blk	*index;
+	struct dir_info_ent	*slots;
+	errcode_t		retval;
+
+	retval = ext2fs_get_mem(db->index_blocks *
+				sizeof(struct dir_index_blk), &index);
+	if (retval)
+		return retval;
+	retval = ext2fs_get_mem(db->size * sizeof(struct dir_info_ent),
+				&slots);
+	if (retval) {
+		ext2fs_free_mem(&index);
+		return retval;
+	}
+	memcpy(index, db->index,
+	       db->index_blocks * sizeof(struct dir_index_blk));
+	memcpy(slots, db->slots, db->size * sizeof(struct dir_info_ent));
+
+	munmap(db->index_map, db->index_map_size);
+	close(db->index_fd);
+	unlink(db->tdb_fn);
+	ext2fs_free_mem(&db->tdb_fn);
+	db->index_map = 0;
+	db->index_fd = -1;
+	db->index = index;
+	db->slots = slots;
+	return 0;
+}
+
+static void setup_index_file(e2fsck_t ctx, char *dir)
+{
+	struct dir_info_db	*db = ctx->dir_info;
+	char			uuid[40];
+
+	if (ext2fs_get_mem(strlen(dir) + 64, &db->tdb_fn))
+		return;
+
+	uuid_unparse(ctx->fs->super->s_uuid, uuid);
+	sprintf(db->tdb_fn, "%s/%s-dirindex-XXXXXX", dir, uuid);
+	db->index_fd = mkstemp(db->tdb_fn);
+	if (db->index_fd < 0)
+		goto errout;
+	if (map_index_file(db, db->size) == 0)
+		return;
+	close(db->index_fd);
+	unlink(db->tdb_fn);
+errout:
+	db->index_fd = -1;
+	ext2fs_free_mem(&db->tdb_fn);
+}
+#endif
+
+static errcode_t index_grow(struct dir_info_db *db, int slots)
+{
+	errcode_t	retval;
+
+#ifdef HAVE_MMAP
+	if (db->index_map) {
+		if (map_index_file(db, slots) == 0)
+			return 0;
+		/* Out of scratch space, carry on in memory */
+		retval = index_to_memory(db);
+		if (retval)
+			return retval;
+	}
+#endif
+	retval = ext2fs_resize_mem(db->size * sizeof(struct dir_info_ent),
+				   slots * sizeof(struct dir_info_ent),
+				   &db->slots);
+	if (retval)
+		return retval;
+	db->size = slots;
+	return 0;
+}
+
+static void setup_index(e2fsck_t ctx, ext2_ino_t num_dirs)
+{
+	struct dir_info_db	*db = ctx->dir_info;
+	char			*dir;
+
+	db->index_blocks = (ctx->fs->super->s_inodes_count +
+			    DIR_INDEX_BITS - 1) / DIR_INDEX_BITS;
+	db->size = num_dirs + 10;
+	db->index_fd = -1;
+
+#ifdef HAVE_MMAP
+	dir = scratch_dir(ctx, num_dirs);
+	if (dir) {
+		setup_index_file(ctx, dir);
+		if (db->index_map) {
+#ifdef DIRINFO_DEBUG
+			printf("Note: using mmap'ed dir index!\n");
+#endif
+			return;
+		}
+	}
+#endif
+	db->index = (struct dir_index_blk *)
+		e2fsck_allocate_memory(ctx, db->index_blocks *
+				       sizeof(struct dir_index_blk),
+				       "directory index");
+	db->slots = (struct dir_info_ent *)
+		e2fsck_allocate_memory(ctx, db->size *
+				       sizeof(struct dir_info_ent),
+				       "directory index slots");
+}
+
+/*
+ * Returns the slot for the given inode, or -1 if it is not a directory
+ * known to the index.  If the inode is not present and ret_slot is
+ * non-NULL, the slot where it would be inserted is returned there.
+ */
+static int index_lookup(struct dir_info_db *db, ext2_ino_t ino,
+			int *ret_slot)
+{
+	struct dir_index_blk	*blk;
+	ext2_ino_t		bit;
+	__u32			mask;
+	int			slot;
+
+	bit = (ino - 1) % DIR_INDEX_BITS;
+	blk = db->index + (ino - 1) / DIR_INDEX_BITS;
+	mask = 1U << (bit % 32);
+
+	slot = blk->rank;
+	if (bit >= 32)
+		slot += index_popcount(blk->bits[0]);
+	slot += index_popcount(blk->bits[bit / 32] & (mask - 1));
+	if (ret_slot)
+		*ret_slot = slot;
+	return (blk->bits[bit / 32] & mask) ? slot : -1;
+}
+
+static void index_add(e2fsck_t ctx, ext2_ino_t ino, ext2_ino_t parent)
+{
+	struct dir_info_db	*db = ctx->dir_info;
+	struct dir_index_blk	*blk;
+	ext2_ino_t		b, bit;
+	int			slot;
+	errcode_t		retval;
+
+	if (ino == 0 || ino > ctx->fs->super->s_inodes_count)
+		return;
+
+	b = (ino - 1) / DIR_INDEX_BITS;
+	for (; db->index_filled <= b; db->index_filled++)
+		db->index[db->index_filled].rank = db->count;
+
+	if (index_lookup(db, ino, &slot) >= 0) {
+		db->slots[slot].dotdot = parent;
+		db->slots[slot].parent = parent;
+		return;
+	}
+
+	if (db->count >= db->size) {
+		retval = index_grow(db, db->size + db->size / 4 + 16);
+		if (retval)
+			return;
+	}
+
+	/*
+	 * Directories found out of order (when pass 3 recreates the
+	 * root directory or lost+found) need to move the following
+	 * slots up and bump the ranks of the following blocks.
+	 */
+	if (slot < db->count)
+		memmove(db->slots + slot + 1, db->slots + slot,
+			(db->count - slot) * sizeof(struct dir_info_ent));
+	for (blk = db->index + b + 1; blk < db->index + db->index_filled;
+	     blk++)
+		blk->rank++;
+
+	bit = (ino - 1) % DIR_INDEX_BITS;
+	db->index[b].bits[bit / 32] |= 1U << (bit % 32);
+	db->slots[slot].dotdot = parent;
+	db->slots[slot].parent = parent;
+	db->count++;
+}
+
+/*
+ * Find the next directory in the index at or after the given inode.
+ */
+static ext2_ino_t index_next(struct dir_info_db *db, ext2_ino_t ino)
+{
+	struct dir_index_blk	*blk;
+	ext2_ino_t		b, bit;
+	__u32			w;
+
+	if (ino == 0)
+		ino = 1;
+	b = (ino - 1) / DIR_INDEX_BITS;
+	bit = (ino - 1) % DIR_INDEX_BITS;
+	for (blk = db->index + b; b < db->index_filled; b++, blk++, bit = 0) {
+		for (; bit < DIR_INDEX_BITS; bit = (bit | 31) + 1) {
+			w = blk->bits[bit / 32] >> (bit % 32);
+			if (!w)
+				continue;
+			while (!(w & 1)) {
+				w >>= 1;
+				bit++;
+			}
+			return b * DIR_INDEX_BITS + bit + 1;
+		}
+	}
+	return 0;
+}
+
+static void setup_tdb(e2fsck_t ctx, ext2_ino_t num_dirs)
+{
+	struct dir_info_db	*db = ctx->dir_info;
+	errcode_t		retval;
+	char			*tdb_dir, uuid[40];
+	int			fd;
+
+	tdb_dir = scratch_dir(ctx, num_dirs);
+	if (!tdb_dir)
 		return;
 
 	retval = ext2fs_get_mem(strlen(tdb_dir) + 64, &db->tdb_fn);
@@ -72,6 +363,7 @@ static void setup_db(e2fsck_t ctx)
 	struct dir_info_db	*db;
 	ext2_ino_t		num_dirs;
 	errcode_t		retval;
+	int			use_index;
 
 	db = (struct dir_info_db *)
 		e2fsck_allocate_memory(ctx, sizeof(struct dir_info_db),
@@ -85,6 +377,13 @@ static void setup_db(e2fsck_t ctx)
 	if (retval)
 		num_dirs = 1024;	/* Guess */
 
+	profile_get_boolean(ctx->profile, "options", "dirinfo_index", 0, 0,
+			    &use_index);
+	if (use_index) {
+		setup_index(ctx, num_dirs);
+		return;
+	}
+
 	setup_tdb(ctx, num_dirs);
 
 	if (db->tdb) {
@@ -121,6 +420,11 @@ void e2fsck_add_dir_info(e2fsck_t ctx, ext2_ino_t ino, ext2_ino_t parent)
 		setup_db(ctx);
 	db = ctx->dir_info;
 
+	if (db->index) {
+		index_add(ctx, ino, parent);
+		return;
+	}
+
 	if (ctx->dir_info->count >= ctx->dir_info->size) {
 		old_size = ctx->dir_info->size * sizeof(struct dir_info);
 		ctx->dir_info->size += 10;
@@ -178,6 +482,7 @@ static struct dir_info *e2fsck_get_dir_info(e2fsck_t ctx, ext2_ino_t ino)
 	int			low, high, mid;
 	struct dir_info_ent	*buf;
 	static struct dir_info	ret_dir_info;
+	int			slot;
 
 	if (!db)
 		return 0;
@@ -186,6 +491,19 @@ static struct dir_info *e2fsck_get_dir_info(e2fsck_t ctx, ext2_ino_t ino)
 	printf("e2fsck_get_dir_info %d...", ino);
 #endif
 
+	if (db->index) {
+		if (ino == 0 || ino > ctx->fs->super->s_inodes_count ||
+		    (ino - 1) / DIR_INDEX_BITS >= db->index_filled)
+			return 0;
+		slot = index_lookup(db, ino, 0);
+		if (slot < 0)
+			return 0;
+		ret_dir_info.ino = ino;
+		ret_dir_info.dotdot = db->slots[slot].dotdot;
+		ret_dir_info.parent = db->slots[slot].parent;
+		return &ret_dir_info;
+	}
+
 	if (db->tdb) {
 		TDB_DATA key, data;
 
@@ -264,6 +582,16 @@ static void e2fsck_put_dir_info(e2fsck_t ctx, struct dir_info *dir)
 	       dir->parent);
 #endif
 
+	if (db->index) {
+		int slot = index_lookup(db, dir->ino, 0);
+
+		if (slot >= 0) {
+			db->slots[slot].dotdot = dir->dotdot;
+			db->slots[slot].parent = dir->parent;
+		}
+		return;
+	}
+
 	if (!db->tdb)
 		return;
 
@@ -289,10 +617,23 @@ void e2fsck_free_dir_info(e2fsck_t ctx)
 	if (ctx->dir_info) {
 		if (ctx->dir_info->tdb)
 			tdb_close(ctx->dir_info->tdb);
+#ifdef HAVE_MMAP
+		if (ctx->dir_info->index_map) {
+			munmap(ctx->dir_info->index_map,
+			       ctx->dir_info->index_map_size);
+			close(ctx->dir_info->index_fd);
+			ctx->dir_info->index = 0;
+			ctx->dir_info->slots = 0;
+		}
+#endif
 		if (ctx->dir_info->tdb_fn) {
 			unlink(ctx->dir_info->tdb_fn);
 			free(ctx->dir_info->tdb_fn);
 		}
+		if (ctx->dir_info->index)
+			ext2fs_free_mem(&ctx->dir_info->index);
+		if (ctx->dir_info->slots)
+			ext2fs_free_mem(&ctx->dir_info->slots);
 		if (ctx->dir_info->array)
 			ext2fs_free_mem(&ctx->dir_info->array);
 		ctx->dir_info->array = 0;
@@ -366,6 +707,17 @@ struct dir_info *e2fsck_dir_info_iter(e2fsck_t ctx, struct dir_info_iter *iter)
 		return &ret_dir_info;
 	}
 
+	if (db->index) {
+		iter->ino = index_next(db, iter->ino);
+		if (!iter->ino)
+			return 0;
+		ret_dir_info.ino = iter->ino++;
+		buf = db->slots + index_lookup(db, ret_dir_info.ino, 0);
+		ret_dir_info.dotdot = buf->dotdot;
+		ret_dir_info.parent = buf->parent;
+		return &ret_dir_info;
+	}
+
 	if (iter->i >= ctx->dir_info->count)
 		return 0;
 
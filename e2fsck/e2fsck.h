@@ -336,11 +336,13 @@ struct e2fsck_struct {
 	 */
 	io_channel	journal_io;
 	char	*journal_name;
+	char	*journal_stats_file;
 
 	/* lustre support */
 	int                      lustre_devtype;
 	char                    *lustre_mdsdb;
 	char                    *lustre_ostdb;
+	char                    *lfsck_export;
 	struct lfsck_outdb_info *lfsck_oinfo;
 
 #ifdef RESOURCE_TRACK
@@ -16,6 +16,7 @@
 
 struct buffer_head {
 	e2fsck_t	b_ctx;
+	struct kdev_s	*b_dev;
 	io_channel 	b_io;
 	int	 	b_size;
 	blk_t	 	b_blocknr;
@@ -34,6 +35,13 @@ struct inode {
 struct kdev_s {
 	e2fsck_t	k_ctx;
 	int		k_dev;
+	/* Journal blocks [k_ra_start, k_ra_end) have been read ahead */
+	unsigned int	k_ra_start;
+	unsigned int	k_ra_end;
+	/* Dirty blocks held back during replay; see journal.c */
+	struct replay_cache *k_replay;
+	/* Where to account I/O while recovering, if anywhere */
+	struct recovery_stats *k_stats;
 };
 
 #define K_DEV_FS	1
@@ -43,8 +51,7 @@ typedef struct kdev_s *kdev_t;
 
 #define lock_buffer(bh) do {} while(0)
 #define unlock_buffer(bh) do {} while(0)
-#define buffer_req(bh) 1
-#define do_readahead(journal, start) do {} while(0)
+#define buffer_req(bh) 0
 
 extern e2fsck_t e2fsck_global_ctx;  /* Try your very best not to use this! */
 
@@ -129,6 +136,40 @@ void mark_buffer_uptodate(struct buffer_head *bh, int val);
 void brelse(struct buffer_head *bh);
 int buffer_uptodate(struct buffer_head *bh);
 void wait_on_buffer(struct buffer_head *bh);
+void do_readahead(journal_t *journal, unsigned int start);
+
+/*
+ * Revoke table statistics, see revoke.c
+ */
+struct revoke_stats {
+	unsigned long	records;
+	unsigned long	hash_size;
+	unsigned long	lookups;
+	unsigned long	filtered;	/* lookups rejected by the filter */
+};
+
+void journal_get_revoke_stats(journal_t *journal, struct revoke_stats *stats);
+
+/*
+ * Statistics gathered while recovering the journal, for e2fsck -t
+ */
+enum passtype {PASS_SCAN, PASS_REVOKE, PASS_REPLAY};
+
+struct recovery_stats {
+	double		pass_time[3];	/* seconds, indexed by passtype */
+	tid_t		start_transaction;
+	tid_t		end_transaction;
+	unsigned long	nr_replays;
+	unsigned long	nr_revokes;
+	unsigned long	nr_revoke_hits;
+	unsigned long long bytes_read;
+	unsigned long long bytes_written;
+	unsigned long	nr_reads;
+	unsigned long	nr_writes;
+	unsigned long long bytes_readahead;
+	unsigned long	nr_readaheads;	/* requests, not completed I/Os */
+	struct revoke_stats revoke;
+};
 
 /*
  * Define newer 2.5 interfaces
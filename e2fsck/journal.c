@@ -83,6 +83,7 @@ struct buffer_head *getblk(kdev_t kdev, blk_t blocknr, int blocksize)
 		  (unsigned long) blocknr, blocksize, bh_count);
 
 	bh->b_ctx = kdev->k_ctx;
+	bh->b_dev = kdev;
 	if (kdev->k_dev == K_DEV_FS)
 		bh->b_io = kdev->k_ctx->fs->io;
 	else
@@ -93,6 +94,192 @@ struct buffer_head *getblk(kdev_t kdev, blk_t blocknr, int blocksize)
 	return bh;
 }
 
+/*
+ * While the journal is being replayed, dirty filesystem blocks are not
+ * written out when they are released.  They are kept in a hash table
+ * keyed by block number instead, so that a block which was logged by
+ * many transactions is only written once (the last copy wins), and
+ * they are written out in block order, coalescing adjacent blocks into
+ * a single write, when the device is synced or too much is pending.
+ */
+#define REPLAY_CACHE_MAX	(128 * 1024 * 1024)
+#define REPLAY_WRITE_MAX	(1024 * 1024)
+
+struct replay_cache {
+	struct buffer_head	**hash;
+	unsigned int		size;
+	unsigned int		count;
+	unsigned int		max_count;
+};
+
+static void free_buffer(struct buffer_head *bh)
+{
+	jfs_debug(3, "freeing block %lu/%p (total %d)\n",
+		  (unsigned long) bh->b_blocknr, (void *) bh, --bh_count);
+	ext2fs_free_mem(&bh);
+}
+
+static unsigned int replay_slot(struct replay_cache *rc, blk_t blk)
+{
+	unsigned int	i = (blk * 0x9E3779B1U) & (rc->size - 1);
+
+	while (rc->hash[i] && rc->hash[i]->b_blocknr != blk)
+		i = (i + 1) & (rc->size - 1);
+	return i;
+}
+
+static errcode_t replay_cache_grow(struct replay_cache *rc)
+{
+	struct buffer_head	**old = rc->hash;
+	unsigned int		i, old_size = rc->size;
+	errcode_t		retval;
+
+	retval = ext2fs_get_array(old_size * 2, sizeof(*rc->hash), &rc->hash);
+	if (retval) {
+		rc->hash = old;
+		return retval;
+	}
+	memset(rc->hash, 0, old_size * 2 * sizeof(*rc->hash));
+	rc->size = old_size * 2;
+	for (i = 0; i < old_size; i++)
+		if (old[i])
+			rc->hash[replay_slot(rc, old[i]->b_blocknr)] = old[i];
+	ext2fs_free_mem(&old);
+	return 0;
+}
+
+static int replay_blk_cmp(const void *a, const void *b)
+{
+	const struct buffer_head *bha = *(const struct buffer_head **) a;
+	const struct buffer_head *bhb = *(const struct buffer_head **) b;
+
+	if (bha->b_blocknr < bhb->b_blocknr)
+		return -1;
+	return bha->b_blocknr > bhb->b_blocknr;
+}
+
+static void replay_cache_flush(kdev_t kdev)
+{
+	struct replay_cache	*rc = kdev->k_replay;
+	struct buffer_head	**bhs = rc->hash, *bh;
+	io_channel		io = kdev->k_ctx->fs->io;
+	unsigned int		i, j, k, n, max_run;
+	char			*buf = 0;
+	errcode_t		retval;
+
+	if (!rc->count)
+		return;
+
+	/* Pack the pending buffers at the front of the table and sort them */
+	for (i = 0, n = 0; i < rc->size; i++)
+		if (bhs[i])
+			bhs[n++] = bhs[i];
+	qsort(bhs, n, sizeof(*bhs), replay_blk_cmp);
+
+	max_run = REPLAY_WRITE_MAX / kdev->k_ctx->fs->blocksize;
+	if (ext2fs_get_mem(REPLAY_WRITE_MAX, &buf))
+		max_run = 1;
+
+	for (i = 0; i < n; i = j) {
+		bh = bhs[i];
+		for (j = i + 1; j < n && j - i < max_run; j++)
+			if (bhs[j]->b_blocknr != bh->b_blocknr + (j - i))
+				break;
+		jfs_debug(3, "writing blocks %lu-%lu\n",
+			  (unsigned long) bh->b_blocknr,
+			  (unsigned long) bh->b_blocknr + (j - i) - 1);
+		if (j - i == 1)
+			retval = io_channel_write_blk(io, bh->b_blocknr, 1,
+						      bh->b_data);
+		else {
+			for (k = i; k < j; k++)
+				memcpy(buf + (k - i) * bh->b_size,
+				       bhs[k]->b_data, bh->b_size);
+			retval = io_channel_write_blk(io, bh->b_blocknr,
+						      j - i, buf);
+		}
+		if (retval)
+			com_err(kdev->k_ctx->device_name, retval,
+				"while writing blocks %lu-%lu\n",
+				(unsigned long) bh->b_blocknr,
+				(unsigned long) bh->b_blocknr + (j - i) - 1);
+		else if (kdev->k_stats) {
+			kdev->k_stats->bytes_written +=
+				(unsigned long long) (j - i) * bh->b_size;
+			kdev->k_stats->nr_writes++;
+		}
+	}
+	for (i = 0; i < rc->size; i++) {
+		if (i < n)
+			free_buffer(bhs[i]);
+		bhs[i] = NULL;
+	}
+	rc->count = 0;
+	if (buf)
+		ext2fs_free_mem(&buf);
+}
+
+/*
+ * Take over a dirty buffer being released.  Returns 0 if the buffer
+ * now belongs to the replay cache, or an error if the caller should
+ * write it out itself.
+ */
+static errcode_t replay_cache_add(kdev_t kdev, struct buffer_head *bh)
+{
+	struct replay_cache	*rc = kdev->k_replay;
+	unsigned int		i;
+	errcode_t		retval;
+
+	if (rc->count >= rc->max_count)
+		replay_cache_flush(kdev);
+	if ((rc->count + 1) * 4 > rc->size * 3) {
+		retval = replay_cache_grow(rc);
+		if (retval)
+			return retval;
+	}
+	i = replay_slot(rc, bh->b_blocknr);
+	if (rc->hash[i])
+		free_buffer(rc->hash[i]);
+	else
+		rc->count++;
+	rc->hash[i] = bh;
+	bh->b_dirty = 0;
+	return 0;
+}
+
+static errcode_t e2fsck_replay_cache_start(kdev_t kdev)
+{
+	struct replay_cache	*rc;
+	errcode_t		retval;
+
+	retval = ext2fs_get_mem(sizeof(struct replay_cache), &rc);
+	if (retval)
+		return retval;
+	rc->size = 1024;
+	rc->count = 0;
+	rc->max_count = REPLAY_CACHE_MAX / kdev->k_ctx->fs->blocksize;
+	retval = ext2fs_get_array(rc->size, sizeof(*rc->hash), &rc->hash);
+	if (retval) {
+		ext2fs_free_mem(&rc);
+		return retval;
+	}
+	memset(rc->hash, 0, rc->size * sizeof(*rc->hash));
+	kdev->k_replay = rc;
+	return 0;
+}
+
+static void e2fsck_replay_cache_stop(kdev_t kdev)
+{
+	struct replay_cache	*rc = kdev->k_replay;
+
+	if (!rc)
+		return;
+	replay_cache_flush(kdev);
+	ext2fs_free_mem(&rc->hash);
+	ext2fs_free_mem(&rc);
+	kdev->k_replay = NULL;
+}
+
 void sync_blockdev(kdev_t kdev)
 {
 	io_channel	io;
@@ -102,9 +289,68 @@ void sync_blockdev(kdev_t kdev)
 	else
 		io = kdev->k_ctx->journal_io;
 
+	if (kdev->k_replay)
+		replay_cache_flush(kdev);
 	io_channel_flush(io);
 }
 
+/*
+ * Recovery reads the log one block at a time, so keep the kernel
+ * reading well ahead of it; the reads then come from the page cache.
+ */
+#define JOURNAL_READAHEAD	(4 * 1024 * 1024)
+
+static void journal_readahead(journal_t *journal, io_channel io,
+			      unsigned long start, unsigned long len)
+{
+	struct recovery_stats *stats = journal->j_dev->k_stats;
+
+	io_channel_readahead(io, start, len);
+	if (stats) {
+		stats->bytes_readahead +=
+			(unsigned long long) len * journal->j_blocksize;
+		stats->nr_readaheads++;
+	}
+}
+
+void do_readahead(journal_t *journal, unsigned int start)
+{
+	kdev_t		kdev = journal->j_dev;
+	io_channel	io = kdev->k_ctx->journal_io;
+	unsigned int	next, end, window;
+	unsigned long	blk, run_start = 0, run_len = 0;
+
+	if (!io->manager->readahead)
+		return;
+	window = JOURNAL_READAHEAD / journal->j_blocksize;
+	if (start >= kdev->k_ra_start && start + window / 2 < kdev->k_ra_end)
+		return;
+
+	next = start;
+	if (start >= kdev->k_ra_start && start < kdev->k_ra_end)
+		next = kdev->k_ra_end;
+	end = start + window;
+	if (end > journal->j_maxlen)
+		end = journal->j_maxlen;
+
+	for (; next < end; next++) {
+		if (journal_bmap(journal, next, &blk))
+			break;
+		if (run_len && blk == run_start + run_len) {
+			run_len++;
+			continue;
+		}
+		if (run_len)
+			journal_readahead(journal, io, run_start, run_len);
+		run_start = blk;
+		run_len = 1;
+	}
+	if (run_len)
+		journal_readahead(journal, io, run_start, run_len);
+	kdev->k_ra_start = start;
+	kdev->k_ra_end = next;
+}
+
 void ll_rw_block(int rw, int nr, struct buffer_head *bhp[])
 {
 	int retval;
@@ -125,6 +371,10 @@ void ll_rw_block(int rw, int nr, struct buffer_head *bhp[])
 				bh->b_err = retval;
 				continue;
 			}
+			if (bh->b_dev->k_stats) {
+				bh->b_dev->k_stats->bytes_read += bh->b_size;
+				bh->b_dev->k_stats->nr_reads++;
+			}
 			bh->b_uptodate = 1;
 		} else if (rw == WRITE && bh->b_dirty) {
 			jfs_debug(3, "writing block %lu/%p\n",
@@ -139,6 +389,10 @@ void ll_rw_block(int rw, int nr, struct buffer_head *bhp[])
 				bh->b_err = retval;
 				continue;
 			}
+			if (bh->b_dev->k_stats) {
+				bh->b_dev->k_stats->bytes_written += bh->b_size;
+				bh->b_dev->k_stats->nr_writes++;
+			}
 			bh->b_dirty = 0;
 			bh->b_uptodate = 1;
 		} else {
@@ -161,11 +415,12 @@ static void mark_buffer_clean(struct buffer_head * bh)
 
 void brelse(struct buffer_head *bh)
 {
+	if (bh->b_dirty && bh->b_dev->k_replay &&
+	    !replay_cache_add(bh->b_dev, bh))
+		return;
 	if (bh->b_dirty)
 		ll_rw_block(WRITE, 1, &bh);
-	jfs_debug(3, "freeing block %lu/%p (total %d)\n",
-		  (unsigned long) bh->b_blocknr, (void *) bh, --bh_count);
-	ext2fs_free_mem(&bh);
+	free_buffer(bh);
 }
 
 int buffer_uptodate(struct buffer_head *bh)
@@ -805,9 +1060,91 @@ no_has_journal:
 	return retval;
 }
 
+/*
+ * Report the journal recovery statistics: for people with -t, and as
+ * "name value" lines in the file given with -E journal_stats=, for
+ * scripts collecting them.  The log is read one block at a time behind
+ * the readahead, while replayed blocks are written in runs, so reads,
+ * readahead and writes are each averaged on their own.
+ */
+static void e2fsck_journal_report(e2fsck_t ctx, struct recovery_stats *st)
+{
+	unsigned long		avg_read, avg_ra, avg_write;
+	tid_t			trans;
+	FILE			*f;
+
+	avg_read = st->nr_reads ? st->bytes_read / st->nr_reads : 0;
+	avg_ra = st->nr_readaheads ?
+		st->bytes_readahead / st->nr_readaheads : 0;
+	avg_write = st->nr_writes ? st->bytes_written / st->nr_writes : 0;
+	trans = st->end_transaction - st->start_transaction;
+	if (ctx->options & E2F_OPT_TIME) {
+		printf(_("Journal recovery: %u transactions, %lu blocks "
+			 "replayed, %lu revoke records, %lu blocks revoked\n"),
+		       trans, st->nr_replays, st->nr_revokes,
+		       st->nr_revoke_hits);
+		printf(_("Journal recovery: scan %.2fs, revoke %.2fs, "
+			 "replay %.2fs\n"), st->pass_time[PASS_SCAN],
+		       st->pass_time[PASS_REVOKE], st->pass_time[PASS_REPLAY]);
+		printf(_("Journal recovery: read %lluk in %lu I/Os "
+			 "(average %luk), readahead %lluk in %lu requests "
+			 "(average %luk)\n"),
+		       st->bytes_read >> 10, st->nr_reads, avg_read >> 10,
+		       st->bytes_readahead >> 10, st->nr_readaheads,
+		       avg_ra >> 10);
+		printf(_("Journal recovery: wrote %lluk in %lu I/Os "
+			 "(average %luk)\n"),
+		       st->bytes_written >> 10, st->nr_writes,
+		       avg_write >> 10);
+		printf(_("Journal revoke: %lu records, %lu buckets, "
+			 "%lu lookups, %lu filtered\n"), st->revoke.records,
+		       st->revoke.hash_size, st->revoke.lookups,
+		       st->revoke.filtered);
+	}
+
+	if (!ctx->journal_stats_file)
+		return;
+	if (strcmp(ctx->journal_stats_file, "-") == 0)
+		f = stdout;
+	else if (!(f = fopen(ctx->journal_stats_file, "w"))) {
+		com_err(ctx->program_name, errno,
+			_("while opening %s for journal statistics"),
+			ctx->journal_stats_file);
+		return;
+	}
+	fprintf(f, "journal_first_transaction %u\n", st->start_transaction);
+	fprintf(f, "journal_transactions %u\n", trans);
+	fprintf(f, "journal_blocks_replayed %lu\n", st->nr_replays);
+	fprintf(f, "journal_revokes %lu\n", st->nr_revokes);
+	fprintf(f, "journal_blocks_revoked %lu\n", st->nr_revoke_hits);
+	fprintf(f, "journal_revoke_records %lu\n", st->revoke.records);
+	fprintf(f, "journal_revoke_buckets %lu\n", st->revoke.hash_size);
+	fprintf(f, "journal_revoke_lookups %lu\n", st->revoke.lookups);
+	fprintf(f, "journal_revoke_filtered %lu\n", st->revoke.filtered);
+	fprintf(f, "journal_scan_seconds %.6f\n", st->pass_time[PASS_SCAN]);
+	fprintf(f, "journal_revoke_seconds %.6f\n",
+		st->pass_time[PASS_REVOKE]);
+	fprintf(f, "journal_replay_seconds %.6f\n",
+		st->pass_time[PASS_REPLAY]);
+	fprintf(f, "journal_bytes_read %llu\n", st->bytes_read);
+	fprintf(f, "journal_reads %lu\n", st->nr_reads);
+	fprintf(f, "journal_average_read_bytes %lu\n", avg_read);
+	fprintf(f, "journal_bytes_readahead %llu\n", st->bytes_readahead);
+	fprintf(f, "journal_readaheads %lu\n", st->nr_readaheads);
+	fprintf(f, "journal_average_readahead_bytes %lu\n", avg_ra);
+	fprintf(f, "journal_bytes_written %llu\n", st->bytes_written);
+	fprintf(f, "journal_writes %lu\n", st->nr_writes);
+	fprintf(f, "journal_average_write_bytes %lu\n", avg_write);
+	if (f == stdout)
+		fflush(f);
+	else
+		fclose(f);
+}
+
 static errcode_t recover_ext3_journal(e2fsck_t ctx)
 {
 	struct problem_context	pctx;
+	struct recovery_stats	stats;
 	journal_t *journal;
 	int retval;
 
@@ -826,7 +1163,17 @@ static errcode_t recover_ext3_journal(e2fsck_t ctx)
 	if (retval)
 		goto errout;
 
+	retval = e2fsck_replay_cache_start(journal->j_fs_dev);
+	if (retval)
+		goto errout;
+
+	memset(&stats, 0, sizeof(stats));
+	journal->j_dev->k_stats = journal->j_fs_dev->k_stats = &stats;
+
 	retval = -journal_recover(journal);
+	e2fsck_replay_cache_stop(journal->j_fs_dev);
+	journal->j_dev->k_stats = journal->j_fs_dev->k_stats = NULL;
+	e2fsck_journal_report(ctx, &stats);
 	if (retval)
 		goto errout;
 
@@ -58,6 +58,7 @@
 #include <stdarg.h>
 #include <string.h>
 #include <time.h>
+#include <sys/time.h>
 #include <errno.h>
 #include <limits.h>
 #include <stdlib.h>
@@ -80,16 +81,78 @@
 
 struct lfsck_fids {
 	int depth;
+	int cached;	/* fids[depth] is a cached directory, not ROOT */
 	__u64 *fids;
 };
 
+struct lfsck_saved_duplicates;
+
+/* Where the time goes, for each checking thread and for pass4/pass5 */
+struct lfsck_stats {
+	unsigned long chunks;
+	unsigned long objects[3];	/* records checked by pass1..pass3 */
+	unsigned long lookups;		/* paths resolved */
+	unsigned long fixes;		/* repairs attempted */
+	double pass_time[5];
+	double lookup_time;
+	double fix_time;		/* includes lookups done for repairs */
+	double lock_time;		/* llapi_cancel_osc_locks() in pass4 */
+};
+
 struct lfsck_thread_info {
 	struct lfsck_mds_hdr *mds_hdr;
-	DB *mds_direntdb;
-	DB *mds_sizeinfodb;
-	__u32 start_ost_idx;
-	__u32 end_ost_idx;
+	struct lfsck_table *mds_direntdb;
+	struct lfsck_table *mds_sizeinfodb;
+	struct lfsck_saved_duplicates *dups;	/* merged after the join */
+	int dup_saved;
+	int status;
+	struct lfsck_stats stats;
+};
+
+/* Per-OST state shared by all of the chunks of that OST */
+struct lfsck_ost_work {
+	__u32 ost_idx;
+	struct lfsck_table *mds_ostdb;
+	struct lfsck_table *ost_db;	/* NULL if no OST database given */
+	struct lfsck_ost_hdr ost_hdr;
+	__u64 last_id;
+	__u64 size;			/* records in both tables */
+	int chunks_left;
+	int started;
 	int status;
+	unsigned long count[3];		/* per pass1..pass3 */
+	int error[3];
+	__u64 bytes;
+};
+
+/*
+ * A range of object ids on one OST, given as the matching record ranges
+ * of the MDS and OST tables.  Passes 1-3 only look at the records of the
+ * chunk, so the threads can work on any chunk of any OST at once.
+ */
+struct lfsck_chunk {
+	struct lfsck_ost_work *ow;
+	__u64 mds_start, mds_end;
+	__u64 ost_start, ost_end;
+};
+
+/*
+ * A resolved directory path.  Entries are hashed by FID into a number of
+ * independently locked stripes, each of which keeps its own LRU list, so
+ * that threads looking up paths in different directories don't contend.
+ */
+struct lfsck_path_ent {
+	struct lfsck_path_ent *pe_hnext;		/* hash chain */
+	struct lfsck_path_ent *pe_prev, *pe_next;	/* LRU, newest first */
+	__u64 pe_fid;
+	char pe_path[0];
+};
+
+struct lfsck_path_stripe {
+	pthread_mutex_t ps_lock;
+	struct lfsck_path_ent **ps_hash;
+	struct lfsck_path_ent *ps_head, *ps_tail;
+	int ps_count;
 };
 
 struct lfsck_renamed_fid {
@@ -112,6 +175,16 @@ struct lfsck_saved_duplicates {
 #define LOG_PATH "/var/log/lfsck.log"
 #define RLIMIT 1024
 #define FID_RENAME_CHUNK sizeof(struct lfsck_renamed_fid) * RLIMIT
+/* Number of records of the larger table checked as one unit of work */
+#define LFSCK_CHUNK_RECS (128 * 1024)
+/* Seconds between progress reports while the OSTs are checked */
+#define LFSCK_PROGRESS_INTERVAL 60
+/* Locks for the size info records, picked by FID */
+#define LFSCK_SIZE_LOCKS 64
+/* Directory paths remembered by lfsck_get_path(), and how they are split */
+#define LFSCK_PATH_CACHE (64 * 1024)
+#define LFSCK_PATH_STRIPES 64
+#define LFSCK_PATH_HASH 1024		/* hash buckets per stripe */
 
 /* Procedure declarations */
 
@@ -123,10 +196,12 @@ int lfsck_save;
 int lfsck_delete;
 int lfsck_create;
 int lfsck_force;
+int lfsck_incremental;
 int lfsck_verbose;
 int lfsck_yes;
 
 int num_threads = 1;
+char *stats_file;
 
 char mnt_path[PATH_MAX];
 char *mds_file;
@@ -146,10 +221,23 @@ int fix_failed;
 
 pthread_cond_t init_cond = PTHREAD_COND_INITIALIZER;
 pthread_mutex_t init_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t phase_lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t size_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t size_locks[LFSCK_SIZE_LOCKS];
+pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
 int all_started;
 
+struct lfsck_chunk *lfsck_chunks;
+int lfsck_num_chunks;
+int lfsck_next_chunk;
+int lfsck_chunks_done;
+unsigned long lfsck_objects_done;
+double lfsck_start_time, lfsck_last_progress;
+struct lfsck_stats lfsck_main_stats;
+
+struct lfsck_path_stripe lfsck_path_cache[LFSCK_PATH_STRIPES];
+
+/* Inodes changed since the previous e2fsck run, NULL to check them all */
+struct lfsck_table *lfsck_changes;
+
 #define VERBOSE(lvl, fmt, args...)					\
 do { if (lfsck_verbose >= lvl) printf(fmt, ## args); } while (0)
 
@@ -202,10 +290,18 @@ void log_write(char *fmt, ...)
 	va_end(args);
 }
 
+double lfsck_time(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
 void usage()
 {
 	printf("\n");
-	printf("usage: lfsck [-cdfhlnv] --mdsdb mdsdb "
+	printf("usage: lfsck [-cdfhilnv] --mdsdb mdsdb "
 	       "--ostdb ostdb1 [ostdb2 ...] filesystem\n\n");
 	printf("\t-m|--mdsdb mdsdb  MDS database from e2fsck --mdsdb\n");
 	printf("\t-o|--ostdb ostdb  OST databases from e2fsck --ostdb\n");
@@ -214,8 +310,11 @@ void usage()
 	printf("\t[-d|--delete]     delete orphan objects\n");
 	printf("\t[-f|--force]      force running if fs appears unmounted\n");
 	printf("\t[-h|--help]       print this message\n");
+	printf("\t[-i|--incremental] only check files changed since last run\n");
 	printf("\t[-l|--lostfound]  save orphans objects to lost+found\n");
 	printf("\t[-n|--nofix]      do not fix filesystem errors (default)\n");
+	printf("\t[-s|--stats file] write per-thread statistics to file\n");
+	printf("\t[-t|--threads n]  number of checking threads\n");
 	printf("\t[-v|--verbose]    print verbose runtime messages\n");
 	//printf("\t[-y|--yes]        do all cleanup automatically\n");
 	printf("\n");
@@ -276,11 +375,13 @@ int parse_args(int argc, char *argv[])
 		{ "delete", 0, NULL, 'd' },
 		{ "force", 0, NULL, 'f' },
 		{ "help", 0, NULL, 'h' },
+		{ "incremental", 0, NULL, 'i' },
 		{ "lostfound", 0, NULL, 'l' },
 		{ "mdsdb", 1, NULL, 'm' },
 		{ "mdtdb", 1, NULL, 'm' },
 		{ "nofix", 0, NULL, 'n' },
 		{ "ostdb", 1, NULL, 'o' },
+		{ "stats", 1, NULL, 's' },
 		{ "threads", 1, NULL, 't' },
 		{ "verbose", 0, NULL, 'v' },
 		//{ "yes", 0, NULL, 'y' },
@@ -297,7 +398,7 @@ int parse_args(int argc, char *argv[])
 		return(-EINVAL);
 	}
 
-	while ((c = getopt_long(argc, argv, "-cdfhlm:no:t:vy",
+	while ((c = getopt_long(argc, argv, "-cdfhilm:no:s:t:vy",
 				long_options, &option_index)) != -1) {
 		switch (c) {
 		case 'c':
@@ -312,6 +413,9 @@ int parse_args(int argc, char *argv[])
 		case 'h':
 			lfsck_help++;
 			break;
+		case 'i':
+			lfsck_incremental++;
+			break;
 		case 'l':
 			lfsck_save++;
 			break;
@@ -381,6 +485,9 @@ int parse_args(int argc, char *argv[])
 
 			break;
 		}
+		case 's':
+			stats_file = optarg;
+			break;
 		case 't':
 			num_threads = strtol(optarg, NULL, 0);
 			if (num_threads == ULONG_MAX)
@@ -450,6 +557,174 @@ int parse_args(int argc, char *argv[])
 	return(0);
 }
 
+int lfsck_path_cache_init()
+{
+	struct lfsck_path_stripe *ps;
+	int i;
+
+	for (i = 0; i < LFSCK_PATH_STRIPES; i++) {
+		ps = &lfsck_path_cache[i];
+		pthread_mutex_init(&ps->ps_lock, NULL);
+		ps->ps_hash = calloc(LFSCK_PATH_HASH, sizeof(*ps->ps_hash));
+		if (ps->ps_hash == NULL)
+			return (-ENOMEM);
+	}
+	return (0);
+}
+
+void lfsck_path_cache_free()
+{
+	struct lfsck_path_stripe *ps;
+	struct lfsck_path_ent *pe;
+	int i;
+
+	for (i = 0; i < LFSCK_PATH_STRIPES; i++) {
+		ps = &lfsck_path_cache[i];
+		while ((pe = ps->ps_head) != NULL) {
+			ps->ps_head = pe->pe_next;
+			free(pe);
+		}
+		if (ps->ps_hash)
+			free(ps->ps_hash);
+		memset(ps, 0, sizeof(*ps));
+	}
+}
+
+static struct lfsck_path_stripe *lfsck_path_stripe(__u64 fid,
+						   struct lfsck_path_ent ***hp)
+{
+	struct lfsck_path_stripe *ps;
+	__u64 hash = fid * 0x9E3779B97F4A7C15ULL;
+
+	ps = &lfsck_path_cache[(hash >> 32) % LFSCK_PATH_STRIPES];
+	*hp = &ps->ps_hash[(hash >> 48) % LFSCK_PATH_HASH];
+	return (ps);
+}
+
+static void lfsck_path_unlink(struct lfsck_path_stripe *ps,
+			      struct lfsck_path_ent *pe)
+{
+	if (pe->pe_prev)
+		pe->pe_prev->pe_next = pe->pe_next;
+	else
+		ps->ps_head = pe->pe_next;
+	if (pe->pe_next)
+		pe->pe_next->pe_prev = pe->pe_prev;
+	else
+		ps->ps_tail = pe->pe_prev;
+}
+
+static void lfsck_path_push(struct lfsck_path_stripe *ps,
+			    struct lfsck_path_ent *pe)
+{
+	pe->pe_prev = NULL;
+	pe->pe_next = ps->ps_head;
+	if (ps->ps_head)
+		ps->ps_head->pe_prev = pe;
+	else
+		ps->ps_tail = pe;
+	ps->ps_head = pe;
+}
+
+/* Remove the entry for fid from its hash chain, the caller unlinks it */
+static void lfsck_path_unhash(struct lfsck_path_ent **hp,
+			      struct lfsck_path_ent *pe)
+{
+	while (*hp != pe)
+		hp = &(*hp)->pe_hnext;
+	*hp = pe->pe_hnext;
+}
+
+/* Copy the cached path of directory fid into path, if it is known */
+static int lfsck_path_lookup(__u64 fid, char *path, int path_len)
+{
+	struct lfsck_path_stripe *ps;
+	struct lfsck_path_ent **hp, *pe;
+	int rc = -ENOENT;
+
+	ps = lfsck_path_stripe(fid, &hp);
+	if (ps->ps_hash == NULL)
+		return (rc);
+
+	pthread_mutex_lock(&ps->ps_lock);
+	for (pe = *hp; pe != NULL; pe = pe->pe_hnext) {
+		if (pe->pe_fid != fid)
+			continue;
+		if (strlen(pe->pe_path) + 1 > path_len) {
+			rc = -ENOMEM;
+			break;
+		}
+		strcpy(path, pe->pe_path);
+		if (pe != ps->ps_head) {
+			lfsck_path_unlink(ps, pe);
+			lfsck_path_push(ps, pe);
+		}
+		rc = 0;
+		break;
+	}
+	pthread_mutex_unlock(&ps->ps_lock);
+	return (rc);
+}
+
+static void lfsck_path_insert(__u64 fid, const char *path)
+{
+	struct lfsck_path_stripe *ps;
+	struct lfsck_path_ent **hp, *pe;
+	size_t len = strlen(path);
+
+	ps = lfsck_path_stripe(fid, &hp);
+	if (ps->ps_hash == NULL)
+		return;
+
+	pthread_mutex_lock(&ps->ps_lock);
+	for (pe = *hp; pe != NULL; pe = pe->pe_hnext)
+		if (pe->pe_fid == fid)
+			goto out;
+
+	pe = malloc(sizeof(*pe) + len + 1);
+	if (pe == NULL)
+		goto out;
+	pe->pe_fid = fid;
+	memcpy(pe->pe_path, path, len + 1);
+	pe->pe_hnext = *hp;
+	*hp = pe;
+	lfsck_path_push(ps, pe);
+
+	if (++ps->ps_count > LFSCK_PATH_CACHE / LFSCK_PATH_STRIPES) {
+		pe = ps->ps_tail;
+		lfsck_path_unlink(ps, pe);
+		lfsck_path_stripe(pe->pe_fid, &hp);
+		lfsck_path_unhash(hp, pe);
+		free(pe);
+		ps->ps_count--;
+	}
+out:
+	pthread_mutex_unlock(&ps->ps_lock);
+}
+
+/* Forget a cached path which turned out to be stale */
+static void lfsck_path_forget(__u64 fid)
+{
+	struct lfsck_path_stripe *ps;
+	struct lfsck_path_ent **hp, *pe;
+
+	ps = lfsck_path_stripe(fid, &hp);
+	if (ps->ps_hash == NULL)
+		return;
+
+	pthread_mutex_lock(&ps->ps_lock);
+	for (pe = *hp; pe != NULL; pe = pe->pe_hnext) {
+		if (pe->pe_fid == fid) {
+			lfsck_path_unhash(hp, pe);
+			lfsck_path_unlink(ps, pe);
+			free(pe);
+			ps->ps_count--;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&ps->ps_lock);
+}
+
 /*
  * This is called from lfsck_get_path and also recursively.
  * This function is used on error paths when the name of an mds fid has
@@ -463,27 +738,34 @@ int parse_args(int argc, char *argv[])
  * current search point as well. Basically is just traverses the list once.
  * For a file like <mntpt>/aaa/ccc/ddd the fids of aaa ccc and the fid
  * for ddd would also be returned.
+ * The walk stops early at a directory whose path is already cached, in
+ * which case that path is copied to path, otherwise path is left alone.
  */
-int lfsck_get_fids(__u64 mds_fid, DB *mds_direntdb, int depth,
-		   struct lfsck_fids *lfidp)
+int lfsck_get_fids(__u64 mds_fid, struct lfsck_table *mds_direntdb, int depth,
+		   struct lfsck_fids *lfidp, char *path, int path_len)
 {
 	struct lfsck_mds_dirent mds_dirent1;
 	int rc = 0;
-	DBT key, data;
+	__u64 idx;
 
-	memset(&key, 0, sizeof(key));
-	memset(&data, 0, sizeof(data));
-	key.data = &mds_fid;
-	key.size = sizeof(mds_fid);
-	data.data = &mds_dirent1;
-	data.size = data.ulen = sizeof(mds_dirent1);
-	data.flags = DB_DBT_USERMEM;
+	if (depth > 0 && lfsck_path_lookup(mds_fid, path, path_len) == 0) {
+		lfidp->fids = malloc(sizeof(*lfidp->fids) * (depth+1));
+		if (lfidp->fids == NULL) {
+			return (-ENOMEM);
+		}
+		lfidp->depth = depth;
+		lfidp->fids[depth] = mds_fid;
+		lfidp->cached = 1;
+		return (0);
+	}
 
-	rc = mds_direntdb->get(mds_direntdb, NULL, &key, &data, 0);
+	rc = lfsck_table_find(mds_direntdb, mds_fid, &idx);
 	if (rc) {
 		log_write("Failed to find fid "LPU64"\n", mds_fid);
 		return (-ENOENT);
 	}
+	memcpy(&mds_dirent1, lfsck_table_rec(mds_direntdb, idx),
+	       sizeof(mds_dirent1));
 	letocpu_mds_dirent(&mds_dirent1);
 	if (mds_dirent1.mds_dirfid == EXT2_ROOT_INO) {
 		lfidp->fids = malloc(sizeof(*lfidp->fids) * (depth+1));
@@ -496,7 +778,7 @@ int lfsck_get_fids(__u64 mds_fid, DB *mds_direntdb, int depth,
 		return (0);
 	}
 	rc = lfsck_get_fids(mds_dirent1.mds_dirfid, mds_direntdb,
-			    depth + 1, lfidp);
+			    depth + 1, lfidp, path, path_len);
 	if (rc) {
 		return(rc);
 	}
@@ -510,40 +792,51 @@ int lfsck_get_fids(__u64 mds_fid, DB *mds_direntdb, int depth,
  * fid return a list of directory fids from the "root" directory to
  * the fid in question. Using these fids we can construct the path to
  * the file by using readir()
+ * The paths of the directories found on the way are cached, so the
+ * lookups for other files in the same directories start from there.
  */
-int lfsck_get_path(__u64 mds_fid, DB *mds_direntdb, char *path, int path_len)
+int lfsck_get_path(__u64 mds_fid, struct lfsck_table *mds_direntdb,
+		   char *path, int path_len)
 {
 	struct lfsck_fids lfids;
 	DIR *dir;
 	struct dirent *dent;
 	int rc, i;
 	int cur_len = 0;
+	int stale = 0;
 
 	VERBOSE(2, "lookup path for FID "LPU64"\n", mds_fid);
 
+retry:
 	lfids.fids = NULL;
+	lfids.cached = 0;
 
 	lfids.depth = 0;
 	/*XXX - use define ROOT_INO */
-	rc = lfsck_get_fids(mds_fid, mds_direntdb, 0, &lfids);
+	rc = lfsck_get_fids(mds_fid, mds_direntdb, 0, &lfids, path, path_len);
 	if (rc != 0) {
 		rc = -ENOENT;
 		goto out;
 	}
 
-	if (strlen(mnt_path) + 1 > path_len) {
-		rc = -ENOMEM;
-		goto out;
+	if (lfids.cached) {
+		cur_len = strlen(path);
+	} else {
+		if (strlen(mnt_path) + 1 > path_len) {
+			rc = -ENOMEM;
+			goto out;
+		}
+		cur_len = strlen(mnt_path);
+		path[strlen(mnt_path)] = 0;
+		memcpy(path, mnt_path, strlen(mnt_path));
 	}
-	cur_len = strlen(mnt_path);
-	path[strlen(mnt_path)] = 0;
-	memcpy(path, mnt_path, strlen(mnt_path));
-	/* Skip the first dir since this would be "ROOT" */
+	/* Skip the first dir since this would be "ROOT" or already known */
 	rc = 0;
 	for (i = lfids.depth - 1; i >= 0; i--) {
 		dir = opendir(path);
 		if (dir == NULL) {
 			rc = -errno;
+			stale = lfids.cached && i == lfids.depth - 1;
 			goto out;
 		}
 		while (1) {
@@ -556,6 +849,7 @@ int lfsck_get_path(__u64 mds_fid, DB *mds_direntdb, char *path, int path_len)
 			if (dent->d_ino == lfids.fids[i]) {
 				if (cur_len + 1 + strlen(dent->d_name) >
 					path_len) {
+					closedir(dir);
 					rc = -ENOMEM;
 					goto out;
 				}
@@ -569,111 +863,158 @@ int lfsck_get_path(__u64 mds_fid, DB *mds_direntdb, char *path, int path_len)
 				break;
 			}
 		}
+		if (i > 0)
+			lfsck_path_insert(lfids.fids[i], path);
 	}
 out:
+	/* A cached directory may have been renamed, look it up again */
+	if (stale)
+		lfsck_path_forget(lfids.fids[lfids.depth]);
 	if (lfids.fids)
 		free(lfids.fids);
+	if (stale) {
+		stale = 0;
+		goto retry;
+	}
 	return(rc);
 }
 
+/* Whether the file needs checking in an incremental run */
+static int lfsck_fid_changed(__u64 mds_fid)
+{
+	__u64 idx;
+
+	if (lfsck_changes == NULL)
+		return (1);
+
+	return (lfsck_table_find(lfsck_changes, mds_fid, &idx) == 0);
+}
+
+/* lfsck_get_path(), counted in the statistics */
+static int lfsck_lookup_path(struct lfsck_stats *st, __u64 mds_fid,
+			     struct lfsck_table *mds_direntdb,
+			     char *path, int path_len)
+{
+	double start = lfsck_time();
+	int rc;
+
+	rc = lfsck_get_path(mds_fid, mds_direntdb, path, path_len);
+	st->lookups++;
+	st->lookup_time += lfsck_time() - start;
+	return (rc);
+}
+
 /*
  * Used by pass1 to save the ids of files which reference the same
- * objects. This is then used by pass4 to repair these files
+ * objects. This is then used by pass4 to repair these files.  Each
+ * thread keeps its own list, so no lock is needed until they are merged.
  */
-int lfsck_save_duplicate(__u64 mds_fid, __u32 mds_generation,
-			 __u32 ost_idx, __u64 objid)
+int lfsck_save_duplicate(struct lfsck_thread_info *tinfo, __u64 mds_fid,
+			 __u32 mds_generation, __u32 ost_idx, __u64 objid)
 {
+	struct lfsck_saved_duplicates *dup;
+
 	VERBOSE(2, "save duplicate object %u:"LPU64" FID "LPU64"/%u\n",
 		ost_idx, objid, mds_fid, mds_generation);
 
-	pthread_mutex_lock(&phase_lock);
-	if (lfsck_duplicates == NULL) {
-		lfsck_duplicates = malloc(sizeof(*lfsck_duplicates) *
-					  RLIMIT);
-		if (lfsck_duplicates == NULL)
-			return (-EINVAL);
-
-	} else if (!((lfsck_dup_saved + 1) % RLIMIT)) {
-		size_t size = (((lfsck_dup_saved + 1) / RLIMIT) + 1 ) *
-			      sizeof(*lfsck_duplicates) * RLIMIT;
+	if (!(tinfo->dup_saved % RLIMIT)) {
+		size_t size = (tinfo->dup_saved / RLIMIT + 1) *
+			      sizeof(*tinfo->dups) * RLIMIT;
 		void *tmp;
-		tmp = realloc(lfsck_duplicates, size);
+		tmp = realloc(tinfo->dups, size);
 		if (tmp == NULL)
 			return (-ENOMEM);
 
-		lfsck_duplicates = tmp;
+		tinfo->dups = tmp;
 	}
-	lfsck_duplicates[lfsck_dup_saved].mds_fid = mds_fid;
-	lfsck_duplicates[lfsck_dup_saved].mds_generation = mds_generation;
-	lfsck_duplicates[lfsck_dup_saved].ost_idx = ost_idx;
-	lfsck_duplicates[lfsck_dup_saved].objid = objid;
-	lfsck_dup_saved++;
-	pthread_mutex_unlock(&phase_lock);
+	dup = &tinfo->dups[tinfo->dup_saved];
+	dup->mds_fid = mds_fid;
+	dup->mds_generation = mds_generation;
+	dup->ost_idx = ost_idx;
+	dup->objid = objid;
+	tinfo->dup_saved++;
 	return(0);
 }
 
+/* Collect the duplicates found by each of the threads for pass4 */
+int lfsck_merge_duplicates(struct lfsck_thread_info *tinfo, int count)
+{
+	void *tmp;
+	int i, total = lfsck_dup_saved;
+
+	for (i = 0; i < count; i++)
+		total += tinfo[i].dup_saved;
+	if (total == lfsck_dup_saved)
+		return (0);
+
+	tmp = realloc(lfsck_duplicates, total * sizeof(*lfsck_duplicates));
+	if (tmp == NULL)
+		return (-ENOMEM);
+	lfsck_duplicates = tmp;
+
+	for (i = 0; i < count; i++) {
+		if (tinfo[i].dup_saved == 0)
+			continue;
+		memcpy(&lfsck_duplicates[lfsck_dup_saved], tinfo[i].dups,
+		       tinfo[i].dup_saved * sizeof(*lfsck_duplicates));
+		lfsck_dup_saved += tinfo[i].dup_saved;
+	}
+	return (0);
+}
+
 /*
  * Check for duplicate ost objects on mds. Run through the table of
  * mds_fid/ost object to make sure that each ost object is only
- * refrenced by one mds entry. If a duplicate is found save the information
- * for repair in pass4
+ * refrenced by one mds entry. The table is sorted by object id, so all
+ * of the references to an object are next to each other, and always in
+ * the same chunk. If a duplicate is found save the information for
+ * repair in pass4
  */
-int lfsck_run_pass1(__u32 ost_idx, DB *mds_ostdb, DB *ost_db, DB *mds_direntdb)
+int lfsck_run_pass1(struct lfsck_chunk *ch, struct lfsck_thread_info *tinfo)
 {
-	int i = 0;
+	struct lfsck_ost_work *ow = ch->ow;
+	struct lfsck_table *mds_ostdb = ow->mds_ostdb;
+	__u32 ost_idx = ow->ost_idx;
 	int error = 0;
-	int rc = 0;
 	struct lfsck_mds_objent mds_obj1, mds_obj2;
 	unsigned long count = 0;
-	DBT key, data, data1;
-	DBC *dbcp = NULL;
-
-	log_write("%s: ost_idx %d: pass1: check for duplicate objects\n",
-		  progname, ost_idx);
-
-	if ((rc = mds_ostdb->cursor(mds_ostdb, NULL, &dbcp, 0)) != 0) {
-		log_write("%s: error acquiring cursor for database: %s\n",
-			  progname, db_strerror(rc));
-		goto out;
-	}
-	memset(&key, 0, sizeof(key));
-	memset(&data, 0, sizeof(data));
-	data.data = &mds_obj1;
-	data.size = data.ulen = sizeof(mds_obj1);
-	data.flags = DB_DBT_USERMEM;
-
-	while ((rc = dbcp->c_get(dbcp, &key, &data, DB_NEXT)) == 0)  {
-		db_recno_t num_dup;
+	__u64 i, j, k, objid;
 
+	for (i = ch->mds_start; i < ch->mds_end; i = j) {
 		count++;
-		if ((rc = dbcp->c_count(dbcp, &num_dup, 0)) != 0) {
-			log_write("%s: [%u] getting object refcount: %s\n",
-				  progname, ost_idx, db_strerror(rc));
-			rc = -EINVAL;
-			goto out;
-		}
-		if (num_dup <= 1)
+		objid = lfsck_table_key(mds_ostdb, i);
+		for (j = i + 1; j < ch->mds_end &&
+		     lfsck_table_key(mds_ostdb, j) == objid; j++)
+			;
+		if (j - i <= 1)
 			continue;
 
+		/* reported already, unless one of the files has changed */
+		if (lfsck_changes != NULL) {
+			for (k = i; k < j; k++) {
+				memcpy(&mds_obj1, lfsck_table_rec(mds_ostdb, k),
+				       sizeof(mds_obj1));
+				letocpu_mds_objent(&mds_obj1);
+				if (lfsck_fid_changed(mds_obj1.mds_fid))
+					break;
+			}
+			if (k == j)
+				continue;
+		}
+
+		memcpy(&mds_obj1, lfsck_table_rec(mds_ostdb, i),
+		       sizeof(mds_obj1));
 		letocpu_mds_objent(&mds_obj1);
 
-		if (lfsck_save_duplicate(mds_obj1.mds_fid,
+		if (lfsck_save_duplicate(tinfo, mds_obj1.mds_fid,
 					 mds_obj1.mds_generation, ost_idx,
 					 mds_obj1.mds_objid)) {
 			fix_failed++;
 		}
 
-		for (i = 1; i < num_dup; i++) {
-			memset(&data1, 0, sizeof(data1));
-			data1.data = &mds_obj2;
-			data1.size = data1.ulen = sizeof(mds_obj2);
-			data1.flags = DB_DBT_USERMEM;
-			if ((rc = dbcp->c_get(dbcp, &key,&data1,DB_NEXT)) != 0){
-				log_write("%s: acquiring duplicate info: %s\n",
-					  progname, db_strerror(rc));
-				rc = -EINVAL;
-				goto out;
-			}
+		for (i++; i < j; i++) {
+			memcpy(&mds_obj2, lfsck_table_rec(mds_ostdb, i),
+			       sizeof(mds_obj2));
 			letocpu_mds_objent(&mds_obj2);
 
 			if (mds_obj1.mds_fid == mds_obj2.mds_fid &&
@@ -685,7 +1026,7 @@ int lfsck_run_pass1(__u32 ost_idx, DB *mds_ostdb, DB *ost_db, DB *mds_direntdb)
 				continue;
 			}
 
-			if (lfsck_save_duplicate(mds_obj2.mds_fid,
+			if (lfsck_save_duplicate(tinfo, mds_obj2.mds_fid,
 						 mds_obj2.mds_generation,
 						 ost_idx, mds_obj2.mds_objid)) {
 				fix_failed++;
@@ -693,27 +1034,12 @@ int lfsck_run_pass1(__u32 ost_idx, DB *mds_ostdb, DB *ost_db, DB *mds_direntdb)
 		}
 	}
 
-	if (rc != DB_NOTFOUND) {
-		log_write("%s: error reading from inode database: %s\n",
-			  progname, db_strerror(rc));
-		rc = -EINVAL;
-		goto out;
-	}
-
-	rc = 0;
-	if (error == 0) {
-		log_write("%s: ost_idx %d: pass1 OK (%lu files total)\n",
-			  progname, ost_idx, count);
-	} else {
-		log_write("%s: ost_idx %d: pass1 ERROR: %d duplicate "
-			  "entries found (fixed in pass4) (%lu files total)\n",
-			  progname, ost_idx, error, count);
-	}
-out:
-	if (dbcp)
-		dbcp->c_close(dbcp);
+	pthread_mutex_lock(&work_lock);
+	ow->count[0] += count;
+	ow->error[0] += error;
+	pthread_mutex_unlock(&work_lock);
 
-	return(rc);
+	return(0);
 }
 
 /* If an mds file is missing an object recreate object using an ioctl call */
@@ -761,30 +1087,27 @@ int lfsck_recreate_obj(__u64 mds_fid, __u64 objid, __u32 ost_idx, char *path)
  */
 int lfsck_calc_size(struct lfsck_mds_objent *mds_obj,
 		    struct lfsck_ost_objent *ost_obj,
-		    DB *mds_sizeinfodb)
+		    struct lfsck_table *mds_sizeinfodb)
 {
 	struct lfsck_mds_szinfo mds_szinfo1;
+	pthread_mutex_t *size_lock;
 	__u64 calc_size;
 	int rc = 0;
-	DBT key, data;
-	__u64 chunks, rem;
+	__u64 chunks, rem, idx;
 
 	if (ost_obj->ost_size == 0)
 		return(0);
 
-	pthread_mutex_lock(&size_lock);
-	memset(&key, 0, sizeof(key));
-	memset(&data, 0, sizeof(data));
-	key.data = &mds_obj->mds_fid;
-	key.size = sizeof(mds_obj->mds_fid);
-	data.data = &mds_szinfo1;
-	data.size = data.ulen = sizeof(mds_szinfo1);
-	data.flags = DB_DBT_USERMEM;
-	if ((rc = mds_sizeinfodb->get(mds_sizeinfodb, NULL, &key, &data, 0))) {
+	if ((rc = lfsck_table_find(mds_sizeinfodb, mds_obj->mds_fid, &idx))) {
 		log_write("Failure to get sizeinfo "LPU64"\n",mds_obj->mds_fid);
-		pthread_mutex_unlock(&size_lock);
 		return (-ENOENT);
 	}
+
+	/* only the objects of the same file update the same record */
+	size_lock = &size_locks[mds_obj->mds_fid % LFSCK_SIZE_LOCKS];
+	pthread_mutex_lock(size_lock);
+	memcpy(&mds_szinfo1, lfsck_table_rec(mds_sizeinfodb, idx),
+	       sizeof(mds_szinfo1));
 	letocpu_mds_szinfo(&mds_szinfo1);
 	assert (mds_szinfo1.mds_stripe_pattern == LOV_PATTERN_RAID0);
 	chunks = ost_obj->ost_size / mds_szinfo1.mds_stripe_size;
@@ -806,51 +1129,44 @@ int lfsck_calc_size(struct lfsck_mds_objent *mds_obj,
 		}
 	}
 	if (calc_size > mds_szinfo1.mds_calc_size) {
-		__u64 mds_fid;
+		/* the table is mapped privately, so this is only kept
+		 * for pass5 and never written back to the file */
 		mds_szinfo1.mds_calc_size = calc_size;
-		memset(&key, 0, sizeof(key));
-		memset(&data, 0, sizeof(data));
-		mds_fid = mds_obj->mds_fid;
-		key.data = &mds_fid;
-		assert(sizeof(mds_obj->mds_fid) == sizeof(mds_fid));
-		key.size = sizeof(mds_fid);
-		data.data = &mds_szinfo1;
-		data.size = sizeof(mds_szinfo1);
 		cputole_mds_szinfo(&mds_szinfo1);
-		/* Make sure we overwrite */
-		if ((rc = mds_sizeinfodb->put(mds_sizeinfodb,
-					      NULL, &key, &data, 0)) != 0 ) {
-			log_write("Failure to update sizeinfo data\n");
-			pthread_mutex_unlock(&size_lock);
-			return (-EIO);
-		}
+		memcpy(lfsck_table_rec(mds_sizeinfodb, idx), &mds_szinfo1,
+		       sizeof(mds_szinfo1));
 	}
-	pthread_mutex_unlock(&size_lock);
+	pthread_mutex_unlock(size_lock);
 	return(0);
 }
 
 /*
  * Check for dangling inode.
  * pass runs through the mds table for an ost and checks again the ost table
- * that the object refrenced on the mds exists on the ost
+ * that the object refrenced on the mds exists on the ost.  Both tables are
+ * sorted by object id so this is a single pass over each of them.
  */
-int lfsck_run_pass2(__u32 ost_idx, struct lfsck_mds_hdr *mds_hdr,
-		    DB *mds_ostdb, DB *ostdb,
-		    DB *mds_direntdb, DB *mds_sizeinfodb)
+int lfsck_run_pass2(struct lfsck_chunk *ch, struct lfsck_thread_info *tinfo)
 {
+	struct lfsck_mds_hdr *mds_hdr = tinfo->mds_hdr;
+	struct lfsck_table *mds_direntdb = tinfo->mds_direntdb;
+	struct lfsck_stats *st = &tinfo->stats;
+	struct lfsck_ost_work *ow = ch->ow;
+	struct lfsck_table *mds_ostdb = ow->mds_ostdb;
+	struct lfsck_table *ostdb = ow->ost_db;
+	__u32 ost_idx = ow->ost_idx;
 	struct lfsck_mds_objent mds_obj1;
 	struct lfsck_ost_objent ost_obj1;
 	int error = 0, rc = 0;
+#ifdef CHECK_SIZE
+	int rc2;
+#endif
 	unsigned long count = 0;
 	char *path;
-	DBC *dbcp = NULL;
-	DBT key, data;
-	DBT key1, data1;
+	double start;
+	__u64 i, j = ch->ost_start;
 	__u64 objid, max_objid = mds_hdr->mds_max_ost_id[ost_idx];
 
-	log_write("lfsck: ost_idx %d: pass2: check for missing inode objects\n",
-		  ost_idx);
-
 	path = malloc(PATH_MAX);
 	if (path == NULL) {
 		log_write("lfsck: [%u]: pass2 ERROR: out of memory\n",
@@ -858,21 +1174,10 @@ int lfsck_run_pass2(__u32 ost_idx, struct lfsck_mds_hdr *mds_hdr,
 		return (-ENOMEM);
 	}
 
-	rc = mds_ostdb->cursor(mds_ostdb, NULL, &dbcp, 0);
-	if (rc != 0) {
-		log_write("[%u]: error acquiring cursor for mds table: %s\n",
-			  ost_idx, db_strerror(rc));
-		rc = -EINVAL;
-		goto out;
-	}
-
-	memset(&key, 0, sizeof(key));
-	memset(&data, 0, sizeof(data));
-	data.data = &mds_obj1;
-	data.size = data.ulen = sizeof(mds_obj1);
-	data.flags = DB_DBT_USERMEM;
-	while ((rc = dbcp->c_get(dbcp, &key, &data, DB_NEXT)) == 0) {
+	for (i = ch->mds_start; i < ch->mds_end; i++) {
 		count++;
+		memcpy(&mds_obj1, lfsck_table_rec(mds_ostdb, i),
+		       sizeof(mds_obj1));
 		letocpu_mds_objent(&mds_obj1);
 		objid = mds_obj1.mds_objid;
 
@@ -883,64 +1188,45 @@ int lfsck_run_pass2(__u32 ost_idx, struct lfsck_mds_hdr *mds_hdr,
 			continue;
 		}
 
-		memset(&key1, 0, sizeof(key1));
-		memset(&data1, 0, sizeof(data1));
-		key1.data = &objid;
-		key1.size = sizeof(objid);
-		data1.data = &ost_obj1;
-		data1.size = data1.ulen = sizeof(ost_obj1);
-		data1.flags = DB_DBT_USERMEM;
-		if ((rc = ostdb->get(ostdb, NULL, &key1, &data1, 0)) != 0) {
-			letocpu_ost_objent(&ost_obj1);
-			if (rc == DB_NOTFOUND) {
-				if (lfsck_get_path(mds_obj1.mds_fid,
-						   mds_direntdb,path,PATH_MAX)){
-					VERBOSE(1, "[%u]: mds fid "LPU64
-						" object "LPU64" deleted?\n",
-						ost_idx, mds_obj1.mds_fid,
-						objid);
-					continue;
-				}
-				error++;
-				lfsck_recreate_obj(mds_obj1.mds_fid,
-						   mds_obj1.mds_objid,
-						   ost_idx, path);
-			} else {
-				log_write("[%u]: error looking up object "
-					  LPU64": %s\n", ost_idx, objid,
-					  db_strerror(rc));
-				rc = -EINVAL;
-				goto out;
+		j = lfsck_table_seek(ostdb, objid, j, ch->ost_end);
+		if (j == ch->ost_end || lfsck_table_key(ostdb, j) != objid) {
+			if (lfsck_lookup_path(st, mds_obj1.mds_fid,
+					      mds_direntdb, path, PATH_MAX)) {
+				VERBOSE(1, "[%u]: mds fid "LPU64
+					" object "LPU64" deleted?\n",
+					ost_idx, mds_obj1.mds_fid, objid);
+				continue;
 			}
+			error++;
+			start = lfsck_time();
+			lfsck_recreate_obj(mds_obj1.mds_fid,
+					   mds_obj1.mds_objid, ost_idx, path);
+			st->fixes++;
+			st->fix_time += lfsck_time() - start;
+			continue;
 		}
+		memcpy(&ost_obj1, lfsck_table_rec(ostdb, j), sizeof(ost_obj1));
+		letocpu_ost_objent(&ost_obj1);
 #ifdef CHECK_SIZE
-		if (lfsck_calc_size(&mds_obj1, &ost_obj1, mds_sizeinfodb)) {
+		/* go on with the other objects, but fail the chunk */
+		rc2 = lfsck_calc_size(&mds_obj1, &ost_obj1,
+				      tinfo->mds_sizeinfodb);
+		if (rc2) {
 			log_write("[%u]: error updating file size for object "
-				  LPU64": %s\n", ost_idx,objid,db_strerror(rc));
-			rc = -EINVAL;
-			goto out;
+				  LPU64"\n", ost_idx, objid);
+			if (rc == 0)
+				rc = rc2;
 		}
 #endif
 	}
-	if (rc != DB_NOTFOUND) {
-		log_write("[%u]: error getting next inode: %s\n",
-			  ost_idx, db_strerror(rc));
-		rc = -EINVAL;
-		goto out;
-	}
-	rc = 0;
-	if (error == 0) {
-		log_write("lfsck: ost_idx %d: pass2 OK (%lu objects)\n",
-			  ost_idx, count);
-	} else {
-		log_write("lfsck: ost_idx %d: pass2 ERROR: %d dangling inodes "
-			  "found (%lu files total)\n", ost_idx, error, count);
-	}
 
-out:
-	dbcp->c_close(dbcp);
+	pthread_mutex_lock(&work_lock);
+	ow->count[1] += count;
+	ow->error[1] += error;
+	pthread_mutex_unlock(&work_lock);
+
 	free(path);
-	return(0);
+	return(rc);
 }
 
 /*
@@ -1016,39 +1302,25 @@ out_free:
  * Run through each entry in ost table and check the mds ost table for
  * a corresponding entry. If not found report and repair.
  */
-int lfsck_run_pass3(__u32 ost_idx, DB *mds_ostdb, DB *ostdb,
-		    struct obd_uuid uuid, __u64 last_id)
+int lfsck_run_pass3(struct lfsck_chunk *ch, struct lfsck_thread_info *tinfo)
 {
+	struct lfsck_stats *st = &tinfo->stats;
+	struct lfsck_ost_work *ow = ch->ow;
+	struct lfsck_table *mds_ostdb = ow->mds_ostdb;
+	struct lfsck_table *ostdb = ow->ost_db;
+	struct obd_uuid uuid = ow->ost_hdr.ost_uuid;
+	__u32 ost_idx = ow->ost_idx;
+	__u64 last_id = ow->last_id;
 	int error = 0, rc = 0;
-	struct lfsck_mds_objent mds_obj1;
 	struct lfsck_ost_objent ost_obj1;
 	unsigned long count = 0;
-	DBT key, data;
-	DBT key1, data1;
-	DBC *dbcp = NULL;
+	double start;
+	__u64 i, j = ch->mds_start;
 	__u64 objid, bytes = 0;
 
-	log_write("lfsck: ost_idx %d: pass3: check for orphan objects\n",
-		  ost_idx);
-
-	VERBOSE(1, "[%u] uuid %s\n", ost_idx, uuid.uuid);
-	VERBOSE(1, "[%u] last_id "LPU64"\n", ost_idx, last_id);
-
-	rc = ostdb->cursor(ostdb, NULL, &dbcp, 0);
-	if (rc != 0) {
-		log_write("[%u]: error acquiring cursor for mds table: %s\n",
-			  ost_idx, db_strerror(rc));
-		rc = -EINVAL;
-		goto out;
-	}
-
-	memset(&key, 0, sizeof(key));
-	memset(&data, 0, sizeof(data));
-	data.data = &ost_obj1;
-	data.size = data.ulen = sizeof(ost_obj1);
-	data.flags = DB_DBT_USERMEM;
-	while ((rc = dbcp->c_get(dbcp, &key, &data, DB_NEXT)) == 0) {
+	for (i = ch->ost_start; i < ch->ost_end; i++) {
 		count++;
+		memcpy(&ost_obj1, lfsck_table_rec(ostdb, i), sizeof(ost_obj1));
 		letocpu_ost_objent(&ost_obj1);
 		objid = ost_obj1.ost_objid;
 
@@ -1059,33 +1331,23 @@ int lfsck_run_pass3(__u32 ost_idx, DB *mds_ostdb, DB *ostdb,
 		}
 		VERBOSE(2, "[%u] processing objid "LPU64"\n", ost_idx, objid);
 
-		memset(&key1, 0, sizeof(key1));
-		memset(&data1, 0, sizeof(data1));
-		key1.data = &objid;
-		key1.size = sizeof(objid);
-		data1.data = &mds_obj1;
-		data1.size = data1.ulen = sizeof(mds_obj1);
-		data1.flags = DB_DBT_USERMEM;
-		rc = mds_ostdb->get(mds_ostdb, NULL, &key1, &data1, 0);
-		if (rc == 0) {
+		j = lfsck_table_seek(mds_ostdb, objid, j, ch->mds_end);
+		if (j < ch->mds_end && lfsck_table_key(mds_ostdb, j) == objid) {
 			VERBOSE(2, "[%u] found objid "LPU64" reference\n",
 				ost_idx, objid);
 			continue;
 		}
 
-		letocpu_mds_objent(&mds_obj1);
-		if (rc != DB_NOTFOUND) {
-			log_write("Failed to check mds db for entry\n");
-			rc = -EINVAL;
-			goto out;
-		}
 		if (ost_obj1.ost_size == 0) {
 			/* don't report errors for normal orphan recovery */
 			VERBOSE(1, "[%u] zero-length orphan objid "LPU64"\n",
 				ost_idx, objid);
 			if (lfsck_save || lfsck_delete) {
 				/* No reason to save just delete*/
+				start = lfsck_time();
 				rc = lfsck_fix_orphan(ost_idx, objid, 0,uuid,1);
+				st->fixes++;
+				st->fix_time += lfsck_time() - start;
 				if (rc) {
 					log_write("lfsck: [%u]: pass3 "
 						  "error fixing zero-length "
@@ -1102,8 +1364,11 @@ int lfsck_run_pass3(__u32 ost_idx, DB *mds_ostdb, DB *ostdb,
 		error++;
 		bytes += ost_obj1.ost_bytes;
 		if (lfsck_save || lfsck_delete) {
+			start = lfsck_time();
 			rc = lfsck_fix_orphan(ost_idx, objid, 0, uuid,
 					      lfsck_delete);
+			st->fixes++;
+			st->fix_time += lfsck_time() - start;
 			if (rc) {
 				log_write("lfsck: [%u]: failed to fix orphan "
 					  "objid "LPU64", "LPU64" bytes\n",
@@ -1123,70 +1388,37 @@ int lfsck_run_pass3(__u32 ost_idx, DB *mds_ostdb, DB *ostdb,
 				  objid, ost_obj1.ost_bytes);
 		}
 	}
-	if (rc != DB_NOTFOUND) {
-		log_write("[%u]: error getting next object in db %d\n",
-			  ost_idx, db_strerror(rc));
-		rc = -EINVAL;
-		goto out;
-	}
 
-	if (error == 0) {
-		log_write("lfsck: ost_idx %d: pass3 OK (%lu files total)\n",
-			  ost_idx, count);
-	} else {
-		log_write("lfsck: ost_idx %d: pass3 %s: %4gMB of orphan "
-			  "data (%lu of %lu files total)\n", ost_idx,
-			  (lfsck_save | lfsck_delete) ? "FIXED" : "ERROR",
-			  (double)bytes / (1024 * 1024), error, count);
-	}
-out:
-	if (dbcp)
-		dbcp->c_close(dbcp);
+	pthread_mutex_lock(&work_lock);
+	ow->count[2] += count;
+	ow->error[2] += error;
+	ow->bytes += bytes;
+	pthread_mutex_unlock(&work_lock);
+
 	return (0);
 }
 
 /* Missing ost information report affected file names */
-int lfsck_list_affected_files(char *mds_file, struct lfsck_mds_hdr *mds_hdr,
-			      DB *mds_direntdb, __u32 ost_idx)
+int lfsck_list_affected_files(struct lfsck_stats *st,
+			      struct lfsck_table *mds_db,
+			      struct lfsck_table *mds_direntdb, __u32 ost_idx)
 {
 	struct lfsck_mds_objent mds_obj1;
-	char dbname[256];
 	char *path;
-	DB *mds_db = NULL;
-	DBT key,data;
-	DBC *dbcp = NULL;
-	int rc = 0;
+	__u64 i;
 
 	path = malloc(PATH_MAX);
 	if (path == NULL) {
 		return (-ENOMEM);
 	}
 
-	sprintf(dbname, "%s.%d", MDS_OSTDB, ost_idx);
-	if ((rc = lfsck_opendb(mds_file, dbname, &mds_db, 1, 0, 0)) != 0) {
-		log_write("failed to open mds db file %s\n", mds_file);
-		rc = -EINVAL;
-		goto out;
-	}
-
-	if ((rc = mds_db->cursor(mds_db, NULL, &dbcp, 0)) != 0) {
-		log_write("Failed to acquire cursor for mds table\n");
-		rc = -EINVAL;
-		goto out;
-	}
-
-	memset(&key, 0, sizeof(key));
-	memset(&data, 0, sizeof(data));
-	data.data = &mds_obj1;
-	data.size = data.ulen = sizeof(mds_obj1);
-	data.flags = DB_DBT_USERMEM;
-
 	log_write("Files affected by missing ost info are : -\n");
-	while ((rc = dbcp->c_get(dbcp, &key, &data, DB_NEXT)) == 0) {
+	for (i = 0; i < lfsck_table_count(mds_db); i++) {
+		memcpy(&mds_obj1, lfsck_table_rec(mds_db, i), sizeof(mds_obj1));
 		letocpu_mds_objent(&mds_obj1);
 
-		if (lfsck_get_path(mds_obj1.mds_fid, mds_direntdb,
-				   path, PATH_MAX)) {
+		if (lfsck_lookup_path(st, mds_obj1.mds_fid, mds_direntdb,
+				      path, PATH_MAX)) {
 			log_write("Failed to get path for fid "LPU64"\n",
 				  mds_obj1.mds_fid);
 			fix_failed++;
@@ -1194,89 +1426,120 @@ int lfsck_list_affected_files(char *mds_file, struct lfsck_mds_hdr *mds_hdr,
 			log_write("%s\n",path);
 		}
 	}
-	if (rc != DB_NOTFOUND) {
-		log_write("Error getting next element in db %d\n", rc);
-		rc = -EINVAL;
-		goto out;
-	}
-	rc = 0;
 
-out:
-	if (dbcp)
-		dbcp->c_close(dbcp);
-	if (mds_db)
-		mds_db->close(mds_db, 0);
-	return(rc);
+	free(path);
+	return(0);
 }
 
 /*
- * For each ost index run checks 1 2 and 3.
- * 1) Check for object referenced by more than one file
- * 2) Check that objects exist on ost
- * 3) Check that containg mds entry exists for an object
+ * A database given as a pack, as written by e2fsck -E lfsck_export, is
+ * unpacked into table files named after the pack, where the checks
+ * look for the tables of the database.  The header is read from the
+ * pack itself.
  */
-int run_test(__u32 ost_idx, struct lfsck_mds_hdr *mds_hdr,
-	     DB *mds_direntdb, DB *mds_sizeinfodb )
+static int lfsck_unpack_dbs(void)
 {
-	struct lfsck_ost_hdr *ost_hdr = NULL;
-	char dbname[256];
-	DB *mds_ostdb = NULL;
-	DB *ost_db = NULL;
-	DBT key, data;
-	__u64 last_id;
+	const char *dbfile;
+	double start;
 	int i, rc;
 
-	sprintf(dbname, "%s.%d", MDS_OSTDB, ost_idx);
-
-	VERBOSE(2, "testing ost_idx %d\n", ost_idx);
-
-	rc = lfsck_opendb(mds_file, dbname, &mds_ostdb, 1, 0, 0);
-	if (rc != 0) {
-		log_write("failed to open mds db file %s: %s\n",
-			  mds_file, db_strerror(rc));
-		goto out;
-	}
+	for (i = -1; i < num_ost_files; i++) {
+		dbfile = i < 0 ? mds_file : ost_files[i];
+		if (!lfsck_pack_is_pack(dbfile))
+			continue;
 
-	ost_hdr = malloc(sizeof(*ost_hdr));
-	if (ost_hdr == NULL) {
-		log_write("Failure to alloc memory\n");
-		rc = -ENOMEM;
-		goto out;
+		start = lfsck_time();
+		rc = lfsck_pack_extract(dbfile, dbfile, MDS_OSTDB);
+		if (rc != 0) {
+			log_write("%s: error unpacking %s: %s\n", progname,
+				  dbfile, strerror(rc));
+			return (-rc);
+		}
+		VERBOSE(1, "%s: unpacked %s in %.1fs\n", progname, dbfile,
+			lfsck_time() - start);
 	}
+	return (0);
+}
 
-
-	VERBOSE(2, "looking for index %u UUID %s\n", ost_idx,
-		lfsck_uuid[ost_idx].uuid);
+/*
+ * Read the header of each OST database once, so that each OST index
+ * can be matched against them without reopening every file.  Entries
+ * for files which can't be used have ost_magic cleared.
+ */
+int lfsck_read_ost_hdrs(struct lfsck_ost_hdr *ost_hdrs)
+{
+	struct lfsck_ost_hdr *ost_hdr;
+	int i, rc;
 
 	for (i = 0; i < num_ost_files; i++) {
+		ost_hdr = &ost_hdrs[i];
 		VERBOSE(2, "checking file %s\n", ost_files[i]);
-		rc = lfsck_opendb(ost_files[i], OST_HDR, &ost_db, 0, 0, 0);
-		if (rc != 0) {
+		ost_hdr->ost_magic = OST_MAGIC;
+		rc = lfsck_read_hdr(ost_files[i], OST_HDR, ost_hdr,
+				    sizeof(*ost_hdr));
+		if (rc == EIO || rc < 0) {
 			log_write("Error opening ost_data_file %s: rc %d\n",
 				ost_files[i], rc);
-			goto out;
+			return (rc);
 		}
-		memset(&key, 0, sizeof(key));
-		memset(&data, 0, sizeof(data));
-		ost_hdr->ost_magic = OST_MAGIC;
-		key.data = &ost_hdr->ost_magic;
-		key.size = sizeof(ost_hdr->ost_magic);
-		data.size = data.ulen = sizeof(*ost_hdr);
-		data.data = ost_hdr;
-		data.flags = DB_DBT_USERMEM;
-
-		rc = ost_db->get(ost_db, NULL, &key, &data, 0);
-		ost_db->close(ost_db, 0);
-		ost_db = NULL;
 		if (rc != 0) {
 			log_write("Invalid ost magic on file %s: rc %s\n",
 				  ost_files[i], db_strerror(rc));
+			ost_hdr->ost_magic = 0;
 			continue;
 		}
 
 		letocpu_ost_hdr(ost_hdr);
 		VERBOSE(2, "%s has ost UUID %s\n", ost_files[i],
 			ost_hdr->ost_uuid.uuid);
+		if (!(ost_hdr->ost_flags & LFSCK_FL_TABLES)) {
+			log_write("%s was written by an older e2fsck, please "
+				  "regenerate it\n", ost_files[i]);
+			ost_hdr->ost_magic = 0;
+			continue;
+		}
+	}
+	return (0);
+}
+
+/*
+ * Find the database for an ost index and open the tables that checks
+ * 1 2 and 3 are run against.
+ * 1) Check for object referenced by more than one file
+ * 2) Check that objects exist on ost
+ * 3) Check that containg mds entry exists for an object
+ */
+int lfsck_prepare_ost(struct lfsck_ost_work *ow, struct lfsck_mds_hdr *mds_hdr,
+		      struct lfsck_ost_hdr *ost_hdrs)
+{
+	__u32 ost_idx = ow->ost_idx;
+	struct lfsck_ost_hdr *ost_hdr;
+	char dbname[256];
+	char fname[PATH_MAX];
+	int i, rc;
+
+	sprintf(dbname, "%s.%d", MDS_OSTDB, ost_idx);
+
+	VERBOSE(2, "testing ost_idx %d\n", ost_idx);
+
+	/* an OST with no objects referenced from the MDS has no table */
+	lfsck_tablefile(fname, mds_file, dbname);
+	rc = lfsck_table_open(fname, sizeof(struct lfsck_mds_objent),
+			      LFSCK_TABLE_EMPTY_OK, &ow->mds_ostdb);
+	if (rc != 0) {
+		log_write("failed to open mds table %s: %s\n",
+			  fname, strerror(rc));
+		return (rc);
+	}
+	ow->size = lfsck_table_count(ow->mds_ostdb);
+
+	VERBOSE(2, "looking for index %u UUID %s\n", ost_idx,
+		lfsck_uuid[ost_idx].uuid);
+
+	for (i = 0; i < num_ost_files; i++) {
+		ost_hdr = &ost_hdrs[i];
+		if (ost_hdr->ost_magic != OST_MAGIC)
+			continue;
 
 		if (obd_uuid_equals(&lfsck_uuid[ost_idx], &ost_hdr->ost_uuid)) {
 			if (ost_hdr->ost_index != ost_idx) {
@@ -1292,52 +1555,217 @@ int run_test(__u32 ost_idx, struct lfsck_mds_hdr *mds_hdr,
 
 	if (i == num_ost_files) {
 		log_write("lfsck: can't find file for ost_idx %d\n", ost_idx);
-		rc = lfsck_list_affected_files(mds_file, mds_hdr,
-					       mds_direntdb, ost_idx);
-		goto out;
+		return (0);
 	}
-	rc = lfsck_opendb(ost_files[i], OST_OSTDB, &ost_db, 0, 0, 0);
+	ow->ost_hdr = *ost_hdr;
+
+	lfsck_tablefile(fname, ost_files[i], OST_OSTDB);
+	rc = lfsck_table_open(fname, sizeof(struct lfsck_ost_objent), 0,
+			      &ow->ost_db);
 	if (rc != 0) {
-		log_write("error opening ost_data_file %s: rc %d\n",
-			ost_files[i], rc);
-		goto out;
+		log_write("error opening ost table %s: %s\n",
+			  fname, strerror(rc));
+		return (rc);
 	}
+	ow->size += lfsck_table_count(ow->ost_db);
 
 	VERBOSE(1, "MDS: max_id "LPU64" OST: max_id "LPU64"\n",
 		mds_hdr->mds_max_ost_id[ost_idx], ost_hdr->ost_last_id);
 
-	rc = lfsck_run_pass1(ost_idx, mds_ostdb, ost_db, mds_direntdb);
+	ow->last_id = (ost_hdr->ost_flags & E2F_OPT_READONLY ||
+		       mds_hdr->mds_flags & E2F_OPT_READONLY) ?
+			mds_hdr->mds_max_ost_id[ost_idx] : ost_hdr->ost_last_id;
+
+	return (0);
+}
+
+static int lfsck_add_chunk(struct lfsck_ost_work *ow, __u64 mds_start,
+			   __u64 mds_end, __u64 ost_start, __u64 ost_end)
+{
+	struct lfsck_chunk *ch;
+
+	if (!(lfsck_num_chunks % RLIMIT)) {
+		void *tmp;
+		tmp = realloc(lfsck_chunks, (lfsck_num_chunks + RLIMIT) *
+			      sizeof(*lfsck_chunks));
+		if (tmp == NULL)
+			return (-ENOMEM);
+
+		lfsck_chunks = tmp;
+	}
+	ch = &lfsck_chunks[lfsck_num_chunks++];
+	ch->ow = ow;
+	ch->mds_start = mds_start;
+	ch->mds_end = mds_end;
+	ch->ost_start = ost_start;
+	ch->ost_end = ost_end;
+	ow->chunks_left++;
+
+	return (0);
+}
+
+/*
+ * Split an OST into chunks of about LFSCK_CHUNK_RECS records at object id
+ * boundaries taken from the larger of its two tables.  All references to
+ * one object id are in the same chunk, which pass1 relies on.
+ */
+int lfsck_split_ost(struct lfsck_ost_work *ow)
+{
+	struct lfsck_table *big;
+	__u64 mds_start = 0, ost_start = 0, mds_end, ost_end, pos, key;
+	int rc;
+
+	if (ow->ost_db == NULL)
+		return (lfsck_add_chunk(ow, 0, lfsck_table_count(ow->mds_ostdb),
+					0, 0));
+
+	big = lfsck_table_count(ow->mds_ostdb) > lfsck_table_count(ow->ost_db) ?
+		ow->mds_ostdb : ow->ost_db;
+	for (pos = LFSCK_CHUNK_RECS; pos < lfsck_table_count(big);
+	     pos += LFSCK_CHUNK_RECS) {
+		key = lfsck_table_key(big, pos);
+		lfsck_table_find(ow->mds_ostdb, key, &mds_end);
+		lfsck_table_find(ow->ost_db, key, &ost_end);
+		/* many references to one object can span a whole chunk */
+		if (mds_end == mds_start && ost_end == ost_start)
+			continue;
+		rc = lfsck_add_chunk(ow, mds_start, mds_end,
+				     ost_start, ost_end);
+		if (rc)
+			return (rc);
+		mds_start = mds_end;
+		ost_start = ost_end;
+	}
+	return (lfsck_add_chunk(ow, mds_start, lfsck_table_count(ow->mds_ostdb),
+				ost_start, lfsck_table_count(ow->ost_db)));
+}
+
+/* Largest OSTs first, so that they are not left until the end */
+static int lfsck_ost_size_cmp(const void *a, const void *b)
+{
+	const struct lfsck_ost_work *oa = a, *ob = b;
+
+	if (oa->size != ob->size)
+		return (oa->size > ob->size ? -1 : 1);
+	return ((int)oa->ost_idx - (int)ob->ost_idx);
+}
+
+/* Log the results of an OST once all of its chunks have been checked */
+void lfsck_report_ost(struct lfsck_ost_work *ow)
+{
+	__u32 ost_idx = ow->ost_idx;
+
+	if (ow->error[0] == 0) {
+		log_write("%s: ost_idx %d: pass1 OK (%lu files total)\n",
+			  progname, ost_idx, ow->count[0]);
+	} else {
+		log_write("%s: ost_idx %d: pass1 ERROR: %d duplicate "
+			  "entries found (fixed in pass4) (%lu files total)\n",
+			  progname, ost_idx, ow->error[0], ow->count[0]);
+	}
+
+	if (ow->error[1] == 0) {
+		log_write("lfsck: ost_idx %d: pass2 OK (%lu objects)\n",
+			  ost_idx, ow->count[1]);
+	} else {
+		log_write("lfsck: ost_idx %d: pass2 ERROR: %d dangling inodes "
+			  "found (%lu files total)\n", ost_idx, ow->error[1],
+			  ow->count[1]);
+	}
+
+	if (ow->error[2] == 0) {
+		log_write("lfsck: ost_idx %d: pass3 OK (%lu files total)\n",
+			  ost_idx, ow->count[2]);
+	} else {
+		log_write("lfsck: ost_idx %d: pass3 %s: %4gMB of orphan "
+			  "data (%lu of %lu files total)\n", ost_idx,
+			  (lfsck_save | lfsck_delete) ? "FIXED" : "ERROR",
+			  (double)ow->bytes / (1024 * 1024), ow->error[2],
+			  ow->count[2]);
+	}
+}
+
+/* Run checks 1 2 and 3 on one chunk of an OST */
+int run_test(struct lfsck_chunk *ch, struct lfsck_thread_info *tinfo)
+{
+	struct lfsck_ost_work *ow = ch->ow;
+	struct lfsck_stats *st = &tinfo->stats;
+	__u32 ost_idx = ow->ost_idx;
+	int first, last, rc = 0;
+	double start, now;
+
+	st->chunks++;
+	pthread_mutex_lock(&work_lock);
+	first = !ow->started;
+	ow->started = 1;
+	pthread_mutex_unlock(&work_lock);
+
+	if (ow->ost_db == NULL) {
+		rc = lfsck_list_affected_files(st, ow->mds_ostdb,
+					       tinfo->mds_direntdb, ost_idx);
+		goto out;
+	}
+
+	if (first) {
+		log_write("%s: ost_idx %d: pass1: check for duplicate "
+			  "objects\n", progname, ost_idx);
+		log_write("lfsck: ost_idx %d: pass2: check for missing inode "
+			  "objects\n", ost_idx);
+		log_write("lfsck: ost_idx %d: pass3: check for orphan "
+			  "objects\n", ost_idx);
+		VERBOSE(1, "[%u] uuid %s\n", ost_idx, ow->ost_hdr.ost_uuid.uuid);
+		VERBOSE(1, "[%u] last_id "LPU64"\n", ost_idx, ow->last_id);
+	}
+
+	start = lfsck_time();
+	rc = lfsck_run_pass1(ch, tinfo);
+	now = lfsck_time();
+	st->pass_time[0] += now - start;
+	st->objects[0] += ch->mds_end - ch->mds_start;
 	if (rc != 0) {
 		log_write("error in running pass1\n");
 		goto out;
 	}
 
-	rc = lfsck_run_pass2(ost_idx, mds_hdr, mds_ostdb, ost_db, mds_direntdb,
-			     mds_sizeinfodb);
+	start = now;
+	rc = lfsck_run_pass2(ch, tinfo);
+	now = lfsck_time();
+	st->pass_time[1] += now - start;
+	st->objects[1] += ch->mds_end - ch->mds_start;
 	if (rc != 0) {
 		log_write("error in running pass2\n");
 		goto out;
 	}
 
-	last_id = (ost_hdr->ost_flags & E2F_OPT_READONLY ||
-		   mds_hdr->mds_flags & E2F_OPT_READONLY) ?
-			mds_hdr->mds_max_ost_id[ost_idx] : ost_hdr->ost_last_id;
-
-	rc = lfsck_run_pass3(ost_idx, mds_ostdb, ost_db, ost_hdr->ost_uuid,
-			     last_id);
+	start = now;
+	rc = lfsck_run_pass3(ch, tinfo);
+	st->pass_time[2] += lfsck_time() - start;
+	st->objects[2] += ch->ost_end - ch->ost_start;
 	if (rc != 0) {
 		log_write("error in running pass3\n");
 		goto out;
 	}
-	rc = 0;
 
 out:
-	if (ost_hdr)
-		free(ost_hdr);
-	if (mds_ostdb)
-		mds_ostdb->close(mds_ostdb, 0);
-	if (ost_db)
-		ost_db->close(ost_db, 0);
+	pthread_mutex_lock(&work_lock);
+	if (rc)
+		ow->status = rc;
+	last = --ow->chunks_left == 0;
+	lfsck_chunks_done++;
+	lfsck_objects_done += ch->mds_end - ch->mds_start +
+			      ch->ost_end - ch->ost_start;
+	now = lfsck_time();
+	if (now - lfsck_last_progress >= LFSCK_PROGRESS_INTERVAL) {
+		lfsck_last_progress = now;
+		log_write("%s: %d of %d chunks checked, %lu objects, "
+			  "%.0f objects/s\n", progname, lfsck_chunks_done,
+			  lfsck_num_chunks, lfsck_objects_done,
+			  lfsck_objects_done / (now - lfsck_start_time));
+	}
+	pthread_mutex_unlock(&work_lock);
+
+	if (last && ow->ost_db != NULL && ow->status == 0)
+		lfsck_report_ost(ow);
 
 	return(rc);
 }
@@ -1465,14 +1893,17 @@ void llapi_cancel_osc_locks(const char *mnt_path)
 /* Duplicate an object that is referenced by multiple files and point one
  * of the files to use the duplicated object */
 int lfsck_fix_duplicate(__u64 mds_fid, __u32 mds_generation,
-			__u32 ost_idx, __u64 ost_objid, DB *mds_direntdb)
+			__u32 ost_idx, __u64 ost_objid,
+			struct lfsck_table *mds_direntdb)
 {
 	char path_tmp[PATH_MAX] = { 0 }, path[PATH_MAX] = { 0 };
 	char tmp[PATH_MAX * 2 + 10] = { 0 };
 	const char *base;
+	double start;
 	int rc;
 
-	if (lfsck_get_path(mds_fid, mds_direntdb, path, sizeof(path))) {
+	if (lfsck_lookup_path(&lfsck_main_stats, mds_fid, mds_direntdb,
+			      path, sizeof(path))) {
 		log_write("%s: [%u]: failed to locate FID "LPU64
 			  " duplicate objid "LPU64"\n", progname,
 			  ost_idx, mds_fid, ost_objid);
@@ -1534,7 +1965,9 @@ int lfsck_fix_duplicate(__u64 mds_fid, __u32 mds_generation,
 		fixed++;
 	}
 	sync();
+	start = lfsck_time();
 	llapi_cancel_osc_locks(mnt_path);
+	lfsck_main_stats.lock_time += lfsck_time() - start;
 out:
 	VERBOSE(2, "unlink %s\n", path_tmp);
 	unlink(path_tmp);
@@ -1546,9 +1979,10 @@ out:
  * Check for files found that reference the same ost objects
  * (found in pass1) and repair now if necessary
  */
-int lfsck_run_pass4(DB *mds_direntdb)
+int lfsck_run_pass4(struct lfsck_table *mds_direntdb)
 {
 	char tmp[PATH_MAX + 512];
+	double start;
 	int i, j;
 
 	log_write("lfsck: pass4: check for duplicate object references\n");
@@ -1561,6 +1995,7 @@ int lfsck_run_pass4(DB *mds_direntdb)
 		if (lfsck_duplicates[i].mds_fid == 0)
 			continue;
 
+		start = lfsck_time();
 		if (lfsck_fix_duplicate(lfsck_duplicates[i].mds_fid,
 					lfsck_duplicates[i].mds_generation,
 					lfsck_duplicates[i].ost_idx,
@@ -1568,6 +2003,8 @@ int lfsck_run_pass4(DB *mds_direntdb)
 					mds_direntdb)) {
 			fix_failed++;
 		}
+		lfsck_main_stats.fixes++;
+		lfsck_main_stats.fix_time += lfsck_time() - start;
 
 		/* don't duplicate a file multiple times even if it has
 		 * multiple shared objects */
@@ -1592,35 +2029,28 @@ int lfsck_run_pass4(DB *mds_direntdb)
  * This is a placeholder to check for filesize correctness no fixup is in
  * place right now since file size is still obtained from osts
  */
-int lfsck_run_pass5(DB *mds_direntdb, DB *mds_sizeinfodb)
+int lfsck_run_pass5(struct lfsck_table *mds_direntdb,
+		    struct lfsck_table *mds_sizeinfodb)
 {
 	int rc = 0;
 #ifdef CHECK_SIZE
 	struct lfsck_mds_szinfo mds_szinfo1;
 	char path[PATH_MAX];
 	struct stat64 statbuf;
-	DBT key,data;
-	DBC *dbcp;
+	__u64 i;
 
 	log_write("lfsck: pass5: file size correctness\n");
 
-	if ((rc = mds_sizeinfodb->cursor(mds_sizeinfodb, NULL, &dbcp, 0)) != 0){
-		log_write("%s: error acquiring cursor for database: %s\n",
-			  progname, db_strerror(rc));
-		rc = -EINVAL;
-		goto out;
-	}
-	memset(&key, 0, sizeof(key));
-	memset(&data, 0, sizeof(data));
-	data.data = &mds_szinfo1;
-	data.size = data.ulen = sizeof(mds_szinfo1);
-	data.flags = DB_DBT_USERMEM;
-	while ((rc = dbcp->c_get(dbcp, &key, &data, DB_NEXT)) == 0) {
+	for (i = 0; i < lfsck_table_count(mds_sizeinfodb); i++) {
+		memcpy(&mds_szinfo1, lfsck_table_rec(mds_sizeinfodb, i),
+		       sizeof(mds_szinfo1));
 		letocpu_mds_szinfo(&mds_szinfo1);
 
-		if (mds_szinfo1.mds_size != mds_szinfo1.mds_calc_size) {
-			if (lfsck_get_path(mds_szinfo1.mds_fid, mds_direntdb,
-					   path, sizeof(path))) {
+		if (mds_szinfo1.mds_size != mds_szinfo1.mds_calc_size &&
+		    lfsck_fid_changed(mds_szinfo1.mds_fid)) {
+			if (lfsck_lookup_path(&lfsck_main_stats,
+					      mds_szinfo1.mds_fid, mds_direntdb,
+					      path, sizeof(path))) {
 				log_write("%s: failed to get path and update "
 					  "size for fid "LPU64"\n",
 					  mds_szinfo1.mds_fid);
@@ -1645,16 +2075,7 @@ int lfsck_run_pass5(DB *mds_direntdb, DB *mds_sizeinfodb)
 			}
 		}
 	}
-	if (rc != DB_NOTFOUND) {
-		log_write("%s: error getting next element in db: %s\n",
-			  progname, db_strerror(rc));
-		rc = -EINVAL;
-		goto out;
-	}
-	rc = 0;
 	log_write("%s: pass5 finished\n", progname);
-out:
-	dbcp->c_close(dbcp);
 #endif
 	return rc;
 }
@@ -1688,7 +2109,8 @@ int get_response()
 void *lfsck_start_thread(void *arg)
 {
 	struct lfsck_thread_info *tinfo = (struct lfsck_thread_info *)arg;
-	int i,rc;
+	struct lfsck_chunk *ch;
+	int rc;
 
 	tinfo->status = 0;
 	pthread_mutex_lock(&init_mutex);
@@ -1699,36 +2121,121 @@ void *lfsck_start_thread(void *arg)
 
 	if (!all_started)
 		pthread_exit(NULL);
-	for (i = tinfo->start_ost_idx; i < tinfo->end_ost_idx; i++) {
-		rc = run_test(i, tinfo->mds_hdr, tinfo->mds_direntdb,
-			      tinfo->mds_sizeinfodb);
+
+	/* take the next chunk from the queue until it is empty */
+	while (1) {
+		pthread_mutex_lock(&work_lock);
+		if (lfsck_next_chunk == lfsck_num_chunks) {
+			pthread_mutex_unlock(&work_lock);
+			break;
+		}
+		ch = &lfsck_chunks[lfsck_next_chunk++];
+		pthread_mutex_unlock(&work_lock);
+
+		rc = run_test(ch, tinfo);
 		if (rc) {
-			log_write("lfsck: ost_idx %d: error running check\n",i);
+			log_write("lfsck: ost_idx %d: error running check\n",
+				  ch->ow->ost_idx);
 			tinfo->status = rc;
 		}
 	}
 	pthread_exit(NULL);
 }
 
+static void lfsck_write_stats(FILE *f, const char *name,
+			      struct lfsck_stats *st)
+{
+	int i;
+
+	fprintf(f, "%s_chunks %lu\n", name, st->chunks);
+	for (i = 0; i < 3; i++)
+		fprintf(f, "%s_pass%d_objects %lu\n", name, i + 1,
+			st->objects[i]);
+	fprintf(f, "%s_lookups %lu\n", name, st->lookups);
+	fprintf(f, "%s_fixes %lu\n", name, st->fixes);
+	for (i = 0; i < 5; i++)
+		fprintf(f, "%s_pass%d_seconds %.6f\n", name, i + 1,
+			st->pass_time[i]);
+	fprintf(f, "%s_lookup_seconds %.6f\n", name, st->lookup_time);
+	fprintf(f, "%s_fix_seconds %.6f\n", name, st->fix_time);
+	fprintf(f, "%s_lock_seconds %.6f\n", name, st->lock_time);
+}
+
+/*
+ * Summarize what each thread did, to find the slow OSTs and to see
+ * whether more threads would help: as a table in the log, and as
+ * "name value" lines in the --stats file for scripts.
+ */
+void lfsck_report_stats(struct lfsck_thread_info *tinfo, int count)
+{
+	struct lfsck_stats *st;
+	char name[32];
+	FILE *f;
+	int i;
+
+	log_write("%s: thread chunks   pass1   pass2   pass3 lookups   fixes"
+		  "  pass1 s  pass2 s  pass3 s lookup s    fix s\n", progname);
+	for (i = 0; i < count; i++) {
+		st = &tinfo[i].stats;
+		log_write("%s: %6d %6lu %7lu %7lu %7lu %7lu %7lu %8.1f %8.1f "
+			  "%8.1f %8.1f %8.1f\n", progname, i, st->chunks,
+			  st->objects[0], st->objects[1], st->objects[2],
+			  st->lookups, st->fixes, st->pass_time[0],
+			  st->pass_time[1], st->pass_time[2],
+			  st->lookup_time, st->fix_time);
+	}
+	st = &lfsck_main_stats;
+	log_write("%s: pass4 %.1fs: %lu duplicates fixed in %.1fs, %.1fs "
+		  "cancelling locks; pass5 %.1fs: %lu lookups in %.1fs\n",
+		  progname, st->pass_time[3], st->fixes, st->fix_time,
+		  st->lock_time, st->pass_time[4], st->lookups,
+		  st->lookup_time);
+
+	if (stats_file == NULL)
+		return;
+	if (strcmp(stats_file, "-") == 0)
+		f = stdout;
+	else if ((f = fopen(stats_file, "w")) == NULL) {
+		log_write("%s: error opening %s: %s\n", progname, stats_file,
+			  strerror(errno));
+		return;
+	}
+	fprintf(f, "threads %d\n", count);
+	fprintf(f, "chunks %d\n", lfsck_num_chunks);
+	fprintf(f, "seconds %.6f\n", lfsck_time() - lfsck_start_time);
+	for (i = 0; i < count; i++) {
+		sprintf(name, "thread%d", i);
+		lfsck_write_stats(f, name, &tinfo[i].stats);
+	}
+	lfsck_write_stats(f, "main", &lfsck_main_stats);
+	if (f == stdout)
+		fflush(f);
+	else
+		fclose(f);
+}
+
 /* Start threads and run filesystem checks and repair */
 int lfsck_run_checks()
 {
 	struct lfsck_mds_hdr *mds_hdr = NULL;
 	struct lfsck_thread_info *tinfo = NULL;
+	struct lfsck_ost_work *ost_work = NULL;
+	struct lfsck_ost_hdr *ost_hdrs = NULL;
 	pthread_t *threads = NULL;
 	int rc, i;
-	DB *mds_direntdb = NULL;
-	DB *mds_hdrdb = NULL;
-	DB *mds_sizeinfodb = NULL;
-	DBT key, data;
-	int num_osts;
+	struct lfsck_table *mds_direntdb = NULL;
+	struct lfsck_table *mds_sizeinfodb = NULL;
+	char fname[PATH_MAX];
+	int num_osts = 0;
+	double start;
+
+	for (i = 0; i < LFSCK_SIZE_LOCKS; i++)
+		pthread_mutex_init(&size_locks[i], NULL);
+
+	rc = lfsck_unpack_dbs();
+	if (rc != 0)
+		return (rc);
 
-	rc = lfsck_opendb(mds_file, MDS_HDR, &mds_hdrdb, 0, 0, 0);
-	if (rc != 0) {
-		log_write("%s: error opening mds_hdr in %s: rc %d\n",
-			  mds_file, rc);
-		return(-EINVAL);
-	}
 	mds_hdr = malloc(sizeof(*mds_hdr));
 	if (mds_hdr == NULL) {
 		log_write("%s: out of memory allocating DB header (%u)\n",
@@ -1736,34 +2243,54 @@ int lfsck_run_checks()
 		rc = -ENOMEM;
 		goto out;
 	}
-	memset(&key, 0, sizeof(key));
-	memset(&data, 0, sizeof(data));
 	mds_hdr->mds_magic = MDS_MAGIC;
-	key.data = &mds_hdr->mds_magic;
-	key.size = sizeof(mds_hdr->mds_magic);
-	data.data = mds_hdr;
-	data.size = sizeof(*mds_hdr);
-	data.ulen = sizeof(*mds_hdr);
-	data.flags = DB_DBT_USERMEM;
-	rc = mds_hdrdb->get(mds_hdrdb, NULL, &key, &data, 0);
+	rc = lfsck_read_hdr(mds_file, MDS_HDR, mds_hdr, sizeof(*mds_hdr));
 	if (rc != 0) {
 		log_write("%s: error getting mds_hdr info %s: %s\n",
 			  progname, mds_file, db_strerror(rc));
 		goto out;
 	}
 	letocpu_mds_hdr(mds_hdr);
+	if (!(mds_hdr->mds_flags & LFSCK_FL_TABLES)) {
+		log_write("%s: %s was written by an older e2fsck, please "
+			  "regenerate it\n", progname, mds_file);
+		rc = -EINVAL;
+		goto out;
+	}
 
-	rc = lfsck_opendb(mds_file, MDS_DIRINFO, &mds_direntdb, 0, 0, 0);
+	lfsck_tablefile(fname, mds_file, MDS_DIRINFO);
+	rc = lfsck_table_open(fname, sizeof(struct lfsck_mds_dirent),
+			      LFSCK_TABLE_RANDOM, &mds_direntdb);
 	if (rc != 0) {
-		log_write("%s: error opening dirinfo db %s\n",
-			  progname, mds_file);
+		log_write("%s: error opening dirinfo table %s: %s\n",
+			  progname, fname, strerror(rc));
 		goto out;
 	}
 
-	rc = lfsck_opendb(mds_file, MDS_SIZEINFO, &mds_sizeinfodb, 0, 0, 0);
+	if (lfsck_incremental && !(mds_hdr->mds_flags & LFSCK_FL_DELTA)) {
+		log_write("%s: no earlier e2fsck run to compare %s with, "
+			  "doing a full check\n", progname, mds_file);
+	} else if (lfsck_incremental) {
+		lfsck_tablefile(fname, mds_file, MDS_CHANGED);
+		rc = lfsck_table_open(fname, sizeof(struct lfsck_mds_change),
+				      LFSCK_TABLE_RANDOM, &lfsck_changes);
+		if (rc != 0) {
+			log_write("%s: error opening changes table %s: %s\n",
+				  progname, fname, strerror(rc));
+			goto out;
+		}
+		VERBOSE(1, "%s: "LPU64" files changed since the last run\n",
+			progname, lfsck_table_count(lfsck_changes));
+	}
+
+	/* only written when e2fsck was built with CHECK_SIZE */
+	lfsck_tablefile(fname, mds_file, MDS_SIZEINFO);
+	rc = lfsck_table_open(fname, sizeof(struct lfsck_mds_szinfo),
+			      LFSCK_TABLE_RDWR | LFSCK_TABLE_RANDOM |
+			      LFSCK_TABLE_EMPTY_OK, &mds_sizeinfodb);
 	if (rc != 0) {
-		log_write("%s: error opening sizeinfo db %s\n",
-			  progname, mds_file);
+		log_write("%s: error opening sizeinfo table %s: %s\n",
+			  progname, fname, strerror(rc));
 		goto out;
 	}
 
@@ -1783,8 +2310,43 @@ int lfsck_run_checks()
 	} else {
 		num_osts = mds_hdr->mds_num_osts;
 	}
-	if (num_threads > num_osts)
-		num_threads = num_osts;
+
+	ost_hdrs = calloc(num_ost_files, sizeof(*ost_hdrs));
+	ost_work = calloc(num_osts, sizeof(*ost_work));
+	if ((ost_hdrs == NULL && num_ost_files) ||
+	    (ost_work == NULL && num_osts)) {
+		log_write("%s: out of memory for OST info\n", progname);
+		rc = -ENOMEM;
+		goto out;
+	}
+	rc = lfsck_read_ost_hdrs(ost_hdrs);
+	if (rc != 0)
+		goto out;
+
+	for (i = 0; i < num_osts; i++) {
+		ost_work[i].ost_idx = i;
+		rc = lfsck_prepare_ost(&ost_work[i], mds_hdr, ost_hdrs);
+		if (rc) {
+			log_write("lfsck: ost_idx %d: error running check\n",i);
+			ost_work[i].status = rc;
+		}
+	}
+	qsort(ost_work, num_osts, sizeof(*ost_work), lfsck_ost_size_cmp);
+	for (i = 0; i < num_osts; i++) {
+		if (ost_work[i].status)
+			continue;
+		rc = lfsck_split_ost(&ost_work[i]);
+		if (rc) {
+			log_write("%s: out of memory for OST chunks\n",
+				  progname);
+			goto out;
+		}
+	}
+	VERBOSE(1, "%s: checking %d OSTs in %d chunks\n", progname, num_osts,
+		lfsck_num_chunks);
+
+	if (num_threads > lfsck_num_chunks)
+		num_threads = lfsck_num_chunks;
 
 	tinfo = calloc(num_threads, sizeof(*tinfo));
 	if (tinfo == NULL) {
@@ -1800,22 +2362,15 @@ int lfsck_run_checks()
 	}
 
 	all_started = 0;
+	lfsck_next_chunk = 0;
+	lfsck_chunks_done = 0;
+	lfsck_objects_done = 0;
+	lfsck_start_time = lfsck_last_progress = lfsck_time();
 	for (i = 0; i < num_threads; i++) {
-		__u32 end_ost_idx;
-		__u32 chunk;
-
-		chunk = num_osts / num_threads;
-		if (num_osts % num_threads)
-			chunk++;
 		tinfo[i].mds_hdr = mds_hdr;
 		tinfo[i].mds_direntdb = mds_direntdb;
 		tinfo[i].mds_sizeinfodb = mds_sizeinfodb;
 		tinfo[i].status = 0;
-		tinfo[i].start_ost_idx = (chunk) * i;
-		end_ost_idx = (chunk) * (i + 1);
-		end_ost_idx = end_ost_idx > num_osts ?
-			      num_osts : end_ost_idx;
-		tinfo[i].end_ost_idx = end_ost_idx;
 		rc = pthread_create(&threads[i], NULL, lfsck_start_thread,
 				    &tinfo[i]);
 		if (rc) {
@@ -1843,25 +2398,60 @@ int lfsck_run_checks()
 		}
 	}
 
+	rc = lfsck_merge_duplicates(tinfo, num_threads);
+	if (rc != 0) {
+		log_write("%s: out of memory for duplicate objects\n",
+			  progname);
+		goto out;
+	}
+
+	start = lfsck_time();
 	rc = lfsck_run_pass4(mds_direntdb);
+	lfsck_main_stats.pass_time[3] = lfsck_time() - start;
 	if (rc != 0)
 		goto out;
 
+	start = lfsck_time();
 	rc = lfsck_run_pass5(mds_direntdb, mds_sizeinfodb);
+	lfsck_main_stats.pass_time[4] = lfsck_time() - start;
+
+	lfsck_report_stats(tinfo, num_threads);
 
 out:
 	if (threads)
 		free(threads);
-	if (tinfo)
+	if (tinfo) {
+		for (i = 0; i < num_threads; i++)
+			if (tinfo[i].dups)
+				free(tinfo[i].dups);
 		free(tinfo);
+	}
+	if (lfsck_chunks) {
+		free(lfsck_chunks);
+		lfsck_chunks = NULL;
+		lfsck_num_chunks = 0;
+	}
+	if (ost_work) {
+		for (i = 0; i < num_osts; i++) {
+			if (ost_work[i].mds_ostdb)
+				lfsck_table_close(ost_work[i].mds_ostdb);
+			if (ost_work[i].ost_db)
+				lfsck_table_close(ost_work[i].ost_db);
+		}
+		free(ost_work);
+	}
+	if (ost_hdrs)
+		free(ost_hdrs);
 	if (mds_hdr)
 		free(mds_hdr);
 	if (mds_direntdb)
-		mds_direntdb->close(mds_direntdb, 0);
-	if (mds_hdrdb)
-		mds_hdrdb->close(mds_hdrdb, 0);
+		lfsck_table_close(mds_direntdb);
 	if (mds_sizeinfodb)
-		mds_sizeinfodb->close(mds_sizeinfodb, 0);
+		lfsck_table_close(mds_sizeinfodb);
+	if (lfsck_changes) {
+		lfsck_table_close(lfsck_changes);
+		lfsck_changes = NULL;
+	}
 
 	return(rc);
 }
@@ -1941,6 +2531,12 @@ int main(int argc, char *argv[])
 
 	log_open();
 
+	if (lfsck_path_cache_init()) {
+		log_write("%s: failed to allocate path cache\n", progname);
+		log_close(-1);
+		exit(8);
+	}
+
 	if ((lfsck_save || lfsck_delete) && create_lostandfound() != 0) {
 		log_write("%s: failed to create lost+found directory\n",
 			  progname);
@@ -1964,6 +2560,7 @@ int main(int argc, char *argv[])
 	}
 	if (lfsck_duplicates)
 		free(lfsck_duplicates);
+	lfsck_path_cache_free();
 
 	log_close(0);
 	if (fix_failed) {
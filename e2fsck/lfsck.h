@@ -13,6 +13,9 @@
 #endif
 
 #include <db.h>
+#include <stddef.h>
+#include "lfsck_table.h"
+#include "lfsck_pack.h"
 
 #ifndef LPU64
 #if (__WORDSIZE == 32) || defined(__x86_64__)
@@ -52,12 +55,28 @@
 #define MDS_DIRINFO   "mds_dirinfo"
 #define MDS_SIZEINFO  "mds_sizeinfo"
 #define MDS_OSTDB     "mds_ostdb"
+#define MDS_INODES    "mds_inodes"
+#define MDS_INODES_PREV "mds_inodes.prev"	/* only while comparing */
+#define MDS_CHANGED   "mds_changed"
 #define OST_HDR       "osthdr"
 #define OST_OSTDB     "ost_db"
+#define OST_INODB     "ost_inodb"	/* only while scanning objects */
 
 #define MDS_MAGIC     0xDBABCD01
 #define OST_MAGIC     0xDB123402
 
+/*
+ * Only the headers are kept in the Berkeley DB files.  The records are
+ * in sorted lfsck tables next to them, e.g. mdsdb.mds_ostdb.3, and this
+ * is flagged in mds_flags/ost_flags so older databases are refused.
+ */
+#define LFSCK_FL_TABLES 0x00010000
+/*
+ * The MDS database also lists the inodes which changed since the previous
+ * run with the same --mdsdb, so lfsck --incremental can limit its work.
+ */
+#define LFSCK_FL_DELTA  0x00020000
+
 #define OBD_COMPAT_OST          0x00000002 /* this is an OST */
 #define OBD_COMPAT_MDT          0x00000004 /* this is an MDT */
 
@@ -143,6 +162,23 @@ struct lfsck_mds_objent {
 	__u32 mds_ostoffset;
 };
 
+/* Enough of each inode with a LOV EA to tell whether it has changed */
+struct lfsck_mds_inode {
+	__u64 mi_ino;
+	__u32 mi_generation;
+	__u32 mi_ctime;
+};
+
+#define LFSCK_CHG_NEW		0x0001
+#define LFSCK_CHG_MODIFIED	0x0002
+#define LFSCK_CHG_REMOVED	0x0004
+
+struct lfsck_mds_change {
+	__u64 mc_ino;
+	__u32 mc_flags;
+	__u32 mc_unused;
+};
+
 struct lfsck_ost_objent {
 	__u64 ost_objid;
 	__u64 ost_group;
@@ -152,7 +188,7 @@ struct lfsck_ost_objent {
 };
 
 struct lfsck_ofile_ctx {
-	DB *dbp;
+	struct lfsck_table_writer *writer;
 	__u64 max_id;
 	int have_max_id;
 };
@@ -160,7 +196,8 @@ struct lfsck_ofile_ctx {
 struct lfsck_outdb_info {
 	__u32 ost_count;
 	int have_ost_count;
-	DB *mds_sizeinfo_dbp;
+	struct lfsck_table_writer *mds_sizeinfo;
+	struct lfsck_table_writer *mds_inodes;
 	struct lfsck_ofile_ctx *ofile_ctx;
 };
 
@@ -176,6 +213,9 @@ extern int e2fsck_lfsck_remove_pending(e2fsck_t ctx, char *block_buf);
 extern int lfsck_create_dbenv(const char *progname);
 extern int lfsck_opendb(const char *fname, const char *dbname, DB **dbpp,
 			int allow_dup, int keydata_size, int num_files);
+extern void lfsck_tablefile(char *buf, const char *dbfile, const char *table);
+extern int lfsck_read_hdr(const char *dbfile, const char *dbname,
+			  void *hdr, size_t size);
 extern void cputole_mds_hdr(struct lfsck_mds_hdr *mds_hdr);
 extern void letocpu_mds_hdr(struct lfsck_mds_hdr *mds_hdr);
 extern void cputole_ost_hdr(struct lfsck_ost_hdr *ost_hdr);
@@ -188,6 +228,10 @@ extern void cputole_mds_objent(struct lfsck_mds_objent *mds_objent);
 extern void letocpu_mds_objent(struct lfsck_mds_objent *mds_objent);
 extern void cputole_ost_objent(struct lfsck_ost_objent *ost_objent);
 extern void letocpu_ost_objent(struct lfsck_ost_objent *ost_objent);
+extern void cputole_mds_inode(struct lfsck_mds_inode *mds_inode);
+extern void letocpu_mds_inode(struct lfsck_mds_inode *mds_inode);
+extern void cputole_mds_change(struct lfsck_mds_change *mds_change);
+extern void letocpu_mds_change(struct lfsck_mds_change *mds_change);
 extern void letocpu_lov_user_md(struct lov_user_md *lmm);
 
 #define MDS_START_DIRENT_TABLE sizeof(struct lfsck_mds_hdr)
@@ -220,8 +264,8 @@ sizeof(struct lfsck_mds_hdr) + (sizeof(struct lfsck_mds_dirent) * numfiles) +\
 
 #else /* !ENABLE_LFSCK */
 #define e2fsck_lfsck_found_ea(ctx, ino, inode, entry, value) (0)
-#define e2fsck_lfsck_flush_ea(ctx) (0)
-#define e2fsck_lfsck_cleanupdb(ctx) (0)
+#define e2fsck_lfsck_flush_ea(ctx) do { } while (0)
+#define e2fsck_lfsck_cleanupdb(ctx) do { } while (0)
 #define e2fsck_lfsck_remove_pending(ctx, block_buf) (0)
 #endif /* ENABLE_LFSCK */
 
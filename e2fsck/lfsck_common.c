@@ -178,6 +178,53 @@ int lfsck_opendb(const char *fname, const char *dbname, DB **dbpp,
 	return (0);
 }
 
+/*
+ * Name of the file holding the records of table in the database dbfile.
+ * buf must have room for PATH_MAX bytes.
+ */
+void lfsck_tablefile(char *buf, const char *dbfile, const char *table)
+{
+	snprintf(buf, PATH_MAX, "%s.%s", dbfile, table);
+}
+
+/*
+ * Read the header of dbfile, which is either a Berkeley DB file holding
+ * it in dbname or a pack.  The header is keyed by the magic in its first
+ * __u64, which the caller must set, and is returned in disk byte order.
+ */
+int lfsck_read_hdr(const char *dbfile, const char *dbname,
+		   void *hdr, size_t size)
+{
+	DB *dbp = NULL;
+	DBT key, data;
+	__u64 magic;
+	int rc;
+
+	if (lfsck_pack_is_pack(dbfile)) {
+		memcpy(&magic, hdr, sizeof(magic));
+		rc = lfsck_pack_read_blob(dbfile, dbname, hdr, size);
+		if (rc == 0 && ext2fs_le64_to_cpu(*(__u64 *)hdr) != magic)
+			rc = EINVAL;
+		return (rc);
+	}
+
+	rc = lfsck_opendb(dbfile, dbname, &dbp, 0, 0, 0);
+	if (rc != 0)
+		return (rc);
+
+	memset(&key, 0, sizeof(key));
+	memset(&data, 0, sizeof(data));
+	key.data = hdr;
+	key.size = sizeof(__u64);
+	data.data = hdr;
+	data.size = size;
+	data.ulen = size;
+	data.flags = DB_DBT_USERMEM;
+	rc = dbp->get(dbp, NULL, &key, &data, 0);
+	dbp->close(dbp, 0);
+	return (rc);
+}
+
 void cputole_mds_hdr(struct lfsck_mds_hdr *mds_hdr)
 {
 	int i, num_osts = mds_hdr->mds_num_osts;
@@ -299,6 +346,32 @@ void letocpu_ost_objent(struct lfsck_ost_objent *ost_objent)
 	ost_objent->ost_bytes = ext2fs_le64_to_cpu(ost_objent->ost_bytes);
 }
 
+void cputole_mds_inode(struct lfsck_mds_inode *mds_inode)
+{
+	mds_inode->mi_ino = ext2fs_cpu_to_le64(mds_inode->mi_ino);
+	mds_inode->mi_generation = ext2fs_cpu_to_le32(mds_inode->mi_generation);
+	mds_inode->mi_ctime = ext2fs_cpu_to_le32(mds_inode->mi_ctime);
+}
+
+void letocpu_mds_inode(struct lfsck_mds_inode *mds_inode)
+{
+	mds_inode->mi_ino = ext2fs_le64_to_cpu(mds_inode->mi_ino);
+	mds_inode->mi_generation = ext2fs_le32_to_cpu(mds_inode->mi_generation);
+	mds_inode->mi_ctime = ext2fs_le32_to_cpu(mds_inode->mi_ctime);
+}
+
+void cputole_mds_change(struct lfsck_mds_change *mds_change)
+{
+	mds_change->mc_ino = ext2fs_cpu_to_le64(mds_change->mc_ino);
+	mds_change->mc_flags = ext2fs_cpu_to_le32(mds_change->mc_flags);
+}
+
+void letocpu_mds_change(struct lfsck_mds_change *mds_change)
+{
+	mds_change->mc_ino = ext2fs_le64_to_cpu(mds_change->mc_ino);
+	mds_change->mc_flags = ext2fs_le32_to_cpu(mds_change->mc_flags);
+}
+
 void letocpu_lov_user_md(struct lov_user_md *lmm)
 {
 	struct lov_user_ost_data_v1 *loi;
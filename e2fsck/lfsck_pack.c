@@ -0,0 +1,808 @@
+/*
+ * lfsck_pack.c --- compact interchange format for the lfsck databases
+ *
+ * The mdsdb has to be copied to every OSS before the OSTs are checked,
+ * and every ostdb copied back to the node running lfsck.  The Berkeley
+ * DB header files tie all of these nodes to the same BDB version, and
+ * the tables are copied at their full record size even though they are
+ * sorted and mostly made up of small or repeated values.  A pack puts
+ * the header and tables of a database into one delta-encoded stream,
+ * which lfsck unpacks next to the pack file.  See lfsck_pack.h for the
+ * layout.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include "e2fsck.h"
+#include "lfsck_table.h"
+#include "lfsck_pack.h"
+
+/* Longest encoding of a __u32 word */
+#define LFSCK_PACK_VARINT_MAX	5
+
+struct lfsck_pack {
+	FILE		*pk_file;
+	char		*pk_name;
+	__u64		pk_sects;
+	__u64		pk_bytes;
+};
+
+static __u32 pack_zigzag(__u32 d)
+{
+	return (d << 1) ^ (0U - (d >> 31));
+}
+
+static __u32 pack_unzigzag(__u32 z)
+{
+	return (z >> 1) ^ (0U - (z & 1));
+}
+
+static int pack_write(struct lfsck_pack *pk, const void *buf, size_t len)
+{
+	if (fwrite(buf, 1, len, pk->pk_file) != len)
+		return errno ? errno : EIO;
+	pk->pk_bytes += len;
+	return 0;
+}
+
+static int pack_write_sect(struct lfsck_pack *pk, int type, const char *name,
+			   unsigned int recsize, unsigned int keyoff,
+			   __u64 count)
+{
+	struct lfsck_pack_sect sect;
+	size_t namelen = strlen(name);
+	int rc;
+
+	if (namelen > 255)
+		return ENAMETOOLONG;
+	memset(&sect, 0, sizeof(sect));
+	sect.ls_type = type;
+	sect.ls_namelen = namelen;
+	sect.ls_recsize = ext2fs_cpu_to_le32(recsize);
+	sect.ls_keyoff = ext2fs_cpu_to_le32(keyoff);
+	sect.ls_count = ext2fs_cpu_to_le64(count);
+	rc = pack_write(pk, &sect, sizeof(sect));
+	if (rc == 0)
+		rc = pack_write(pk, name, namelen);
+	if (rc == 0 && type != LFSCK_PACK_END)
+		pk->pk_sects++;
+	return rc;
+}
+
+/* Encode and write nrecs consecutive records, in blocks */
+static int pack_write_recs(struct lfsck_pack *pk, const char *recs,
+			   __u64 nrecs, unsigned int recsize)
+{
+	struct lfsck_pack_block blk;
+	unsigned int nwords = recsize / sizeof(__u32);
+	unsigned char *buf, *p;
+	__u32 *prev, w, d;
+	__u64 i, r, n;
+	unsigned int j;
+	int rc = 0;
+
+	n = nrecs < LFSCK_PACK_BLOCK ? nrecs : LFSCK_PACK_BLOCK;
+	buf = malloc(n * nwords * LFSCK_PACK_VARINT_MAX + 1);
+	prev = malloc(nwords * sizeof(*prev));
+	if (buf == NULL || prev == NULL) {
+		rc = ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < nrecs && rc == 0; i += n) {
+		n = nrecs - i < LFSCK_PACK_BLOCK ? nrecs - i : LFSCK_PACK_BLOCK;
+		memset(prev, 0, nwords * sizeof(*prev));
+		p = buf;
+		for (r = i; r < i + n; r++) {
+			const char *rec = recs + r * recsize;
+
+			for (j = 0; j < nwords; j++) {
+				memcpy(&w, rec + j * sizeof(w), sizeof(w));
+				w = ext2fs_le32_to_cpu(w);
+				d = w - prev[j];
+				prev[j] = w;
+				w = pack_zigzag(d);
+				while (w >= 0x80) {
+					*p++ = (w & 0x7f) | 0x80;
+					w >>= 7;
+				}
+				*p++ = w;
+			}
+		}
+		blk.lb_nrecs = ext2fs_cpu_to_le32(n);
+		blk.lb_len = ext2fs_cpu_to_le32(p - buf);
+		blk.lb_crc = ext2fs_cpu_to_le32(crc32_be(~0U, buf, p - buf));
+		blk.lb_unused = 0;
+		rc = pack_write(pk, &blk, sizeof(blk));
+		if (rc == 0)
+			rc = pack_write(pk, buf, p - buf);
+	}
+out:
+	free(buf);
+	free(prev);
+	return rc;
+}
+
+int lfsck_pack_create(const char *name, struct lfsck_pack **ret)
+{
+	struct lfsck_pack_hdr hdr;
+	struct lfsck_pack *pk;
+	int rc;
+
+	pk = calloc(1, sizeof(*pk));
+	if (pk == NULL)
+		return ENOMEM;
+	pk->pk_name = strdup(name);
+	if (pk->pk_name == NULL) {
+		free(pk);
+		return ENOMEM;
+	}
+	pk->pk_file = fopen(name, "w");
+	if (pk->pk_file == NULL) {
+		rc = errno;
+		free(pk->pk_name);
+		free(pk);
+		return rc;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.lp_magic = ext2fs_cpu_to_le32(LFSCK_PACK_MAGIC);
+	hdr.lp_version = ext2fs_cpu_to_le32(LFSCK_PACK_VERSION);
+	rc = pack_write(pk, &hdr, sizeof(hdr));
+	if (rc) {
+		lfsck_pack_abort(pk);
+		return rc;
+	}
+	*ret = pk;
+	return 0;
+}
+
+/* Add a header, which must already be in disk byte order */
+int lfsck_pack_add_blob(struct lfsck_pack *pk, const char *name,
+			const void *buf, size_t size)
+{
+	int rc;
+
+	if (size == 0 || size % sizeof(__u32) || size > UINT_MAX)
+		return EINVAL;
+	rc = pack_write_sect(pk, LFSCK_PACK_BLOB, name, size, 0, 1);
+	if (rc == 0)
+		rc = pack_write_recs(pk, buf, 1, size);
+	return rc;
+}
+
+/*
+ * Add the finished table in fname.  A missing table is added as an empty
+ * one, so that unpacking replaces any older copy of it.
+ */
+int lfsck_pack_add_table(struct lfsck_pack *pk, const char *name,
+			 const char *fname, unsigned int recsize)
+{
+	struct lfsck_table *t;
+	int rc;
+
+	if (recsize == 0 || recsize % sizeof(__u32))
+		return EINVAL;
+	rc = lfsck_table_open(fname, recsize, LFSCK_TABLE_EMPTY_OK, &t);
+	if (rc)
+		return rc;
+	rc = pack_write_sect(pk, LFSCK_PACK_TABLE, name, recsize,
+			     t->lt_keyoff, lfsck_table_count(t));
+	if (rc == 0 && lfsck_table_count(t))
+		rc = pack_write_recs(pk, lfsck_table_rec(t, 0),
+				     lfsck_table_count(t), recsize);
+	lfsck_table_close(t);
+	return rc;
+}
+
+int lfsck_pack_finish(struct lfsck_pack *pk, __u64 *bytes)
+{
+	int rc;
+
+	rc = pack_write_sect(pk, LFSCK_PACK_END, "", 0, 0, pk->pk_sects);
+	if (rc == 0 && fflush(pk->pk_file))
+		rc = errno ? errno : EIO;
+	if (rc == 0 && fsync(fileno(pk->pk_file)))
+		rc = errno;
+	if (rc) {
+		lfsck_pack_abort(pk);
+		return rc;
+	}
+	if (fclose(pk->pk_file)) {
+		rc = errno ? errno : EIO;
+		unlink(pk->pk_name);
+	}
+	if (bytes)
+		*bytes = pk->pk_bytes;
+	free(pk->pk_name);
+	free(pk);
+	return rc;
+}
+
+void lfsck_pack_abort(struct lfsck_pack *pk)
+{
+	if (pk == NULL)
+		return;
+	fclose(pk->pk_file);
+	unlink(pk->pk_name);
+	free(pk->pk_name);
+	free(pk);
+}
+
+static int pack_read(FILE *f, void *buf, size_t len)
+{
+	if (fread(buf, 1, len, f) != len)
+		return ferror(f) ? (errno ? errno : EIO) : EINVAL;
+	return 0;
+}
+
+static int pack_open(const char *name, FILE **ret)
+{
+	struct lfsck_pack_hdr hdr;
+	FILE *f;
+	int rc;
+
+	f = fopen(name, "r");
+	if (f == NULL)
+		return errno;
+	rc = pack_read(f, &hdr, sizeof(hdr));
+	if (rc == 0 &&
+	    (ext2fs_le32_to_cpu(hdr.lp_magic) != LFSCK_PACK_MAGIC ||
+	     ext2fs_le32_to_cpu(hdr.lp_version) != LFSCK_PACK_VERSION))
+		rc = EINVAL;
+	if (rc) {
+		fclose(f);
+		return rc;
+	}
+	*ret = f;
+	return 0;
+}
+
+/* Read the next section header, and its name into name[256] */
+static int pack_next_sect(FILE *f, struct lfsck_pack_sect *sect, char *name)
+{
+	int rc;
+
+	rc = pack_read(f, sect, sizeof(*sect));
+	if (rc == 0)
+		rc = pack_read(f, name, sect->ls_namelen);
+	if (rc)
+		return rc;
+	name[sect->ls_namelen] = '\0';
+	sect->ls_recsize = ext2fs_le32_to_cpu(sect->ls_recsize);
+	sect->ls_keyoff = ext2fs_le32_to_cpu(sect->ls_keyoff);
+	sect->ls_count = ext2fs_le64_to_cpu(sect->ls_count);
+
+	switch (sect->ls_type) {
+	case LFSCK_PACK_END:
+		return 0;
+	case LFSCK_PACK_BLOB:
+		if (sect->ls_count != 1)
+			return EINVAL;
+		break;
+	case LFSCK_PACK_TABLE:
+		if (sect->ls_keyoff + sizeof(__u64) > sect->ls_recsize)
+			return EINVAL;
+		break;
+	default:
+		return EINVAL;
+	}
+	if (sect->ls_recsize == 0 || sect->ls_recsize % sizeof(__u32))
+		return EINVAL;
+	return 0;
+}
+
+/*
+ * Decode the records of a section, calling func on each of them in
+ * disk byte order, or just skip them if func is NULL.
+ */
+static int pack_read_recs(FILE *f, struct lfsck_pack_sect *sect,
+			  int (*func)(void *rec, void *priv), void *priv)
+{
+	struct lfsck_pack_block blk;
+	unsigned int nwords = sect->ls_recsize / sizeof(__u32);
+	unsigned char *buf = NULL, *p, *end;
+	size_t buflen = 0, maxlen;
+	__u32 *prev, *rec, w;
+	__u64 left = sect->ls_count;
+	unsigned int j, n, shift;
+	int rc = 0;
+
+	prev = malloc(nwords * sizeof(*prev));
+	rec = malloc(nwords * sizeof(*rec));
+	if (prev == NULL || rec == NULL) {
+		rc = ENOMEM;
+		goto out;
+	}
+
+	while (left && rc == 0) {
+		rc = pack_read(f, &blk, sizeof(blk));
+		if (rc)
+			break;
+		blk.lb_nrecs = ext2fs_le32_to_cpu(blk.lb_nrecs);
+		blk.lb_len = ext2fs_le32_to_cpu(blk.lb_len);
+		maxlen = (size_t)blk.lb_nrecs * nwords * LFSCK_PACK_VARINT_MAX;
+		if (blk.lb_nrecs == 0 || blk.lb_nrecs > LFSCK_PACK_BLOCK ||
+		    blk.lb_nrecs > left || blk.lb_len > maxlen) {
+			rc = EINVAL;
+			break;
+		}
+		if (blk.lb_len > buflen) {
+			free(buf);
+			buflen = maxlen;
+			buf = malloc(buflen);
+			if (buf == NULL) {
+				rc = ENOMEM;
+				break;
+			}
+		}
+		rc = pack_read(f, buf, blk.lb_len);
+		if (rc)
+			break;
+		if (crc32_be(~0U, buf, blk.lb_len) !=
+		    ext2fs_le32_to_cpu(blk.lb_crc)) {
+			rc = EINVAL;
+			break;
+		}
+		left -= blk.lb_nrecs;
+		if (func == NULL)
+			continue;
+
+		memset(prev, 0, nwords * sizeof(*prev));
+		p = buf;
+		end = buf + blk.lb_len;
+		for (n = 0; n < blk.lb_nrecs && rc == 0; n++) {
+			for (j = 0; j < nwords; j++) {
+				w = 0;
+				shift = 0;
+				do {
+					if (p == end || shift > 28) {
+						rc = EINVAL;
+						goto out;
+					}
+					w |= (__u32)(*p & 0x7f) << shift;
+					shift += 7;
+				} while (*p++ & 0x80);
+				prev[j] += pack_unzigzag(w);
+				rec[j] = ext2fs_cpu_to_le32(prev[j]);
+			}
+			rc = func(rec, priv);
+		}
+		if (rc == 0 && p != end)
+			rc = EINVAL;
+	}
+out:
+	free(buf);
+	free(prev);
+	free(rec);
+	return rc;
+}
+
+/* Return 1 if name is a pack rather than a Berkeley DB file */
+int lfsck_pack_is_pack(const char *name)
+{
+	FILE *f;
+
+	if (pack_open(name, &f))
+		return 0;
+	fclose(f);
+	return 1;
+}
+
+struct pack_blob {
+	void	*pb_buf;
+	size_t	pb_size;
+};
+
+static int pack_copy_blob(void *rec, void *priv)
+{
+	struct pack_blob *pb = priv;
+
+	memcpy(pb->pb_buf, rec, pb->pb_size);
+	return 0;
+}
+
+/* Read the header stored as blob, returned in disk byte order */
+int lfsck_pack_read_blob(const char *name, const char *blob, void *buf,
+			 size_t size)
+{
+	struct lfsck_pack_sect sect;
+	struct pack_blob pb;
+	char sname[256];
+	FILE *f;
+	int rc;
+
+	rc = pack_open(name, &f);
+	if (rc)
+		return rc;
+	while ((rc = pack_next_sect(f, &sect, sname)) == 0) {
+		if (sect.ls_type == LFSCK_PACK_END) {
+			rc = ENOENT;
+			break;
+		}
+		if (sect.ls_type == LFSCK_PACK_BLOB &&
+		    strcmp(sname, blob) == 0) {
+			if (sect.ls_recsize != size) {
+				rc = EINVAL;
+				break;
+			}
+			pb.pb_buf = buf;
+			pb.pb_size = size;
+			rc = pack_read_recs(f, &sect, pack_copy_blob, &pb);
+			break;
+		}
+		rc = pack_read_recs(f, &sect, NULL, NULL);
+		if (rc)
+			break;
+	}
+	fclose(f);
+	return rc;
+}
+
+static int pack_add_rec(void *rec, void *priv)
+{
+	return lfsck_table_add(priv, rec);
+}
+
+/* Tables of a pack being extracted, kept until the whole pack is read */
+struct pack_names {
+	char		**pn_names;
+	unsigned int	pn_count;
+	unsigned int	pn_max;
+};
+
+static int pack_names_add(struct pack_names *pn, const char *name)
+{
+	char **names;
+
+	if (pn->pn_count == pn->pn_max) {
+		pn->pn_max = pn->pn_max ? pn->pn_max * 2 : 64;
+		names = realloc(pn->pn_names,
+				pn->pn_max * sizeof(*pn->pn_names));
+		if (names == NULL)
+			return ENOMEM;
+		pn->pn_names = names;
+	}
+	pn->pn_names[pn->pn_count] = strdup(name);
+	if (pn->pn_names[pn->pn_count] == NULL)
+		return ENOMEM;
+	pn->pn_count++;
+	return 0;
+}
+
+static int pack_names_find(struct pack_names *pn, const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < pn->pn_count; i++)
+		if (strcmp(pn->pn_names[i], name) == 0)
+			return 1;
+	return 0;
+}
+
+static void pack_names_free(struct pack_names *pn)
+{
+	unsigned int i;
+
+	for (i = 0; i < pn->pn_count; i++)
+		free(pn->pn_names[i]);
+	free(pn->pn_names);
+}
+
+/* Name of the file a table is written to before the pack is verified */
+static void pack_unpack_name(char *buf, const char *dbfile, const char *table)
+{
+	snprintf(buf, PATH_MAX, "%s.%s.unpack", dbfile, table);
+}
+
+/*
+ * Remove the tables of dbfile named stale.N which are not in the pack,
+ * left from an older database with more of them.
+ */
+static int pack_remove_stale(const char *dbfile, const char *stale,
+			     struct pack_names *pn)
+{
+	char dir[PATH_MAX], fname[PATH_MAX], prefix[PATH_MAX];
+	const char *base, *p;
+	struct dirent *de;
+	size_t len;
+	DIR *d;
+	int rc = 0;
+
+	base = strrchr(dbfile, '/');
+	if (base == NULL) {
+		strcpy(dir, ".");
+		base = dbfile;
+	} else {
+		snprintf(dir, PATH_MAX, "%.*s", (int)(base - dbfile + 1),
+			 dbfile);
+		base++;
+	}
+	len = snprintf(prefix, PATH_MAX, "%s.%s.", base, stale);
+
+	d = opendir(dir);
+	if (d == NULL)
+		return errno;
+	while ((de = readdir(d)) != NULL) {
+		if (strncmp(de->d_name, prefix, len) != 0)
+			continue;
+		for (p = de->d_name + len; *p >= '0' && *p <= '9'; p++)
+			;
+		if (p == de->d_name + len || *p != '\0' ||
+		    pack_names_find(pn, de->d_name + strlen(base) + 1))
+			continue;
+		snprintf(fname, PATH_MAX, "%s/%s", dir, de->d_name);
+		if (unlink(fname) && errno != ENOENT) {
+			rc = errno;
+			break;
+		}
+	}
+	closedir(d);
+	return rc;
+}
+
+/*
+ * Write each table in the pack to its own table file named after
+ * dbfile, as the tables of dbfile itself would be.  The tables are only
+ * moved into place once the whole pack has been read and verified, so
+ * that a bad pack leaves the tables of an earlier one as they were.
+ * Tables named stale.N which the pack does not hold are then removed,
+ * if stale is not NULL.
+ */
+int lfsck_pack_extract(const char *name, const char *dbfile,
+		       const char *stale)
+{
+	struct lfsck_table_writer *tw;
+	struct lfsck_pack_sect sect;
+	struct pack_names pn;
+	char sname[256];
+	char fname[PATH_MAX], tmpname[PATH_MAX];
+	__u64 sects = 0;
+	unsigned int i;
+	FILE *f;
+	int rc;
+
+	memset(&pn, 0, sizeof(pn));
+	rc = pack_open(name, &f);
+	if (rc)
+		return rc;
+	while ((rc = pack_next_sect(f, &sect, sname)) == 0) {
+		if (sect.ls_type == LFSCK_PACK_END) {
+			if (sect.ls_count != sects)
+				rc = EINVAL;
+			break;
+		}
+		sects++;
+		if (sect.ls_type != LFSCK_PACK_TABLE ||
+		    pack_names_find(&pn, sname)) {
+			rc = pack_read_recs(f, &sect, NULL, NULL);
+			if (rc)
+				break;
+			continue;
+		}
+
+		rc = pack_names_add(&pn, sname);
+		if (rc)
+			break;
+		pack_unpack_name(tmpname, dbfile, sname);
+		rc = lfsck_table_create(tmpname, sect.ls_recsize,
+					sect.ls_keyoff, LFSCK_TABLE_MEM, &tw);
+		if (rc)
+			break;
+		rc = pack_read_recs(f, &sect, pack_add_rec, tw);
+		if (rc) {
+			lfsck_table_abort(tw);
+			break;
+		}
+		rc = lfsck_table_finish(tw);
+		if (rc)
+			break;
+	}
+	fclose(f);
+
+	for (i = 0; i < pn.pn_count; i++) {
+		pack_unpack_name(tmpname, dbfile, pn.pn_names[i]);
+		snprintf(fname, PATH_MAX, "%s.%s", dbfile, pn.pn_names[i]);
+		if (rc == 0 && rename(tmpname, fname) != 0)
+			rc = errno;
+		if (rc)
+			unlink(tmpname);
+	}
+	if (rc == 0 && stale != NULL)
+		rc = pack_remove_stale(dbfile, stale, &pn);
+	pack_names_free(&pn);
+	return rc;
+}
+
+#ifdef TEST_PROGRAM
+struct test_rec {
+	__u64	objid;
+	__u64	group;
+	__u64	size;
+	__u32	flag;
+	__u32	unused;
+};
+
+static int compare_tables(const char *a, const char *b, __u64 nrecs)
+{
+	struct lfsck_table *ta, *tb;
+	int rc;
+
+	rc = lfsck_table_open(a, sizeof(struct test_rec),
+			      LFSCK_TABLE_EMPTY_OK, &ta);
+	if (rc)
+		return rc;
+	rc = lfsck_table_open(b, sizeof(struct test_rec), 0, &tb);
+	if (rc) {
+		lfsck_table_close(ta);
+		return rc;
+	}
+	if (lfsck_table_count(ta) != nrecs || lfsck_table_count(tb) != nrecs ||
+	    ta->lt_keyoff != tb->lt_keyoff ||
+	    (nrecs && memcmp(lfsck_table_rec(ta, 0), lfsck_table_rec(tb, 0),
+			     nrecs * sizeof(struct test_rec))))
+		rc = EINVAL;
+	lfsck_table_close(ta);
+	lfsck_table_close(tb);
+	return rc;
+}
+
+int main(int argc, char **argv)
+{
+	const char *name = "tst_lfsck_pack.db";
+	const char *pack = "tst_lfsck_pack.lpk";
+	struct lfsck_table_writer *tw;
+	struct lfsck_pack *pk;
+	struct test_rec rec;
+	char hdr[1024], hdr2[1024];
+	char fname[PATH_MAX], fname2[PATH_MAX];
+	__u64 i, nrecs = 200000, bytes;
+	FILE *f;
+	int rc;
+
+	srandom(1234);
+
+	/* a table of mostly ascending objects, as an OST database holds */
+	snprintf(fname, PATH_MAX, "%s.objs", name);
+	rc = lfsck_table_create(fname, sizeof(rec),
+				offsetof(struct test_rec, objid), 0, &tw);
+	for (i = 0; i < nrecs && rc == 0; i++) {
+		rec.objid = ext2fs_cpu_to_le64(i * 3 + random() % 3 +
+					       0xfffffff0ULL);
+		rec.group = 0;
+		rec.size = ext2fs_cpu_to_le64(random() % 3 ? 1048576 :
+					      random());
+		rec.flag = ext2fs_cpu_to_le32(i % 50 == 0);
+		rec.unused = 0;
+		rc = lfsck_table_add(tw, &rec);
+	}
+	if (rc == 0)
+		rc = lfsck_table_finish(tw);
+	else
+		lfsck_table_abort(tw);
+
+	memset(hdr, 0, sizeof(hdr));
+	strcpy(hdr + 100, "ost-uuid");
+	hdr[0] = 0x02;
+
+	if (rc == 0)
+		rc = lfsck_pack_create(pack, &pk);
+	if (rc == 0) {
+		rc = lfsck_pack_add_blob(pk, "hdr", hdr, sizeof(hdr));
+		if (rc == 0)
+			rc = lfsck_pack_add_table(pk, "objs", fname,
+						  sizeof(rec));
+		snprintf(fname, PATH_MAX, "%s.missing", name);
+		if (rc == 0)
+			rc = lfsck_pack_add_table(pk, "missing", fname,
+						  sizeof(rec));
+		if (rc == 0)
+			rc = lfsck_pack_finish(pk, &bytes);
+		else
+			lfsck_pack_abort(pk);
+	}
+	if (rc) {
+		printf("lfsck_pack: writing pack failed: %s\n", strerror(rc));
+		exit(1);
+	}
+	if (bytes * 2 > nrecs * sizeof(rec)) {
+		printf("lfsck_pack: %llu byte pack for %llu bytes of records\n",
+		       (unsigned long long)bytes,
+		       (unsigned long long)(nrecs * sizeof(rec)));
+		exit(1);
+	}
+
+	snprintf(fname, PATH_MAX, "%s.objs", name);
+	if (!lfsck_pack_is_pack(pack) || lfsck_pack_is_pack(fname)) {
+		printf("lfsck_pack: pack not recognised\n");
+		exit(1);
+	}
+	rc = lfsck_pack_read_blob(pack, "hdr", hdr2, sizeof(hdr2));
+	if (rc || memcmp(hdr, hdr2, sizeof(hdr)) ||
+	    lfsck_pack_read_blob(pack, "nohdr", hdr2, sizeof(hdr2)) != ENOENT) {
+		printf("lfsck_pack: header not read back\n");
+		exit(1);
+	}
+
+	/* left from an older pack, which had more of these tables */
+	snprintf(fname2, PATH_MAX, "%s.ostdb.3", pack);
+	f = fopen(fname2, "w");
+	if (f == NULL || fclose(f)) {
+		printf("lfsck_pack: can't create %s\n", fname2);
+		exit(1);
+	}
+
+	rc = lfsck_pack_extract(pack, pack, "ostdb");
+	if (rc == 0 && access(fname2, F_OK) == 0)
+		rc = EEXIST;
+	snprintf(fname2, PATH_MAX, "%s.objs", pack);
+	if (rc == 0)
+		rc = compare_tables(fname, fname2, nrecs);
+	snprintf(fname, PATH_MAX, "%s.missing", name);
+	snprintf(fname2, PATH_MAX, "%s.missing", pack);
+	if (rc == 0)
+		rc = compare_tables(fname, fname2, 0);
+	if (rc) {
+		printf("lfsck_pack: tables not unpacked: %s\n", strerror(rc));
+		exit(1);
+	}
+
+	/*
+	 * A corrupted block and a truncated pack must both be refused,
+	 * without unpacking any table again.
+	 */
+	unlink(fname2);
+	f = fopen(pack, "r+");
+	if (f == NULL || fseek(f, bytes / 2, SEEK_SET) ||
+	    fputc(0x55, f) == EOF || fclose(f)) {
+		printf("lfsck_pack: can't corrupt %s\n", pack);
+		exit(1);
+	}
+	if (lfsck_pack_extract(pack, pack, "ostdb") != EINVAL) {
+		printf("lfsck_pack: corrupted pack not detected\n");
+		exit(1);
+	}
+	if (truncate(pack, bytes - 10) ||
+	    lfsck_pack_extract(pack, pack, "ostdb") != EINVAL) {
+		printf("lfsck_pack: truncated pack not detected\n");
+		exit(1);
+	}
+
+	snprintf(fname, PATH_MAX, "%s.objs", name);
+	snprintf(fname2, PATH_MAX, "%s.objs", pack);
+	rc = compare_tables(fname, fname2, nrecs);
+	snprintf(fname2, PATH_MAX, "%s.missing", pack);
+	if (rc == 0 && access(fname2, F_OK) == 0)
+		rc = EEXIST;
+	snprintf(fname2, PATH_MAX, "%s.missing.unpack", pack);
+	if (rc == 0 && access(fname2, F_OK) == 0)
+		rc = EEXIST;
+	if (rc) {
+		printf("lfsck_pack: bad pack changed the tables: %s\n",
+		       strerror(rc));
+		exit(1);
+	}
+
+	snprintf(fname, PATH_MAX, "%s.objs", name);
+	unlink(fname);
+	snprintf(fname, PATH_MAX, "%s.objs", pack);
+	unlink(fname);
+	snprintf(fname, PATH_MAX, "%s.missing", pack);
+	unlink(fname);
+	unlink(pack);
+
+	printf("lfsck_pack: all tests passed\n");
+	exit(0);
+}
+#endif /* TEST_PROGRAM */
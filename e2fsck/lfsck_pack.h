@@ -0,0 +1,80 @@
+/*
+ * lfsck_pack.h --- compact interchange format for the lfsck databases
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+#ifndef LFSCK_PACK_H
+#define LFSCK_PACK_H
+
+#include <sys/types.h>
+#include "ext2fs/ext2_types.h"
+
+/*
+ * A pack holds the header and tables of one MDS or OST database in a
+ * single file which can be copied between nodes and read without
+ * Berkeley DB.  It is a stream of sections, each holding either a blob
+ * (a database header) or the records of a table in key order, and
+ * ending with an end section giving the number of sections before it.
+ *
+ * Records are stored in blocks of up to LFSCK_PACK_BLOCK records.  Each
+ * record is taken as a sequence of little-endian __u32 words, and every
+ * word is written as the zigzag varint of its difference from the same
+ * word of the previous record in the block.  Since tables are sorted on
+ * their key, and most other fields repeat or are zero, nearly all words
+ * fit in a single byte.  Every block carries a crc32 of its payload.
+ * All header fields are little-endian.
+ */
+#define LFSCK_PACK_MAGIC	0x4C504B31	/* "LPK1" */
+#define LFSCK_PACK_VERSION	1
+
+#define LFSCK_PACK_BLOCK	4096	/* records per block */
+
+struct lfsck_pack_hdr {
+	__u32	lp_magic;
+	__u32	lp_version;
+	__u32	lp_flags;
+	__u32	lp_unused;
+};
+
+/* Section types */
+#define LFSCK_PACK_BLOB		'B'
+#define LFSCK_PACK_TABLE	'T'
+#define LFSCK_PACK_END		'E'
+
+struct lfsck_pack_sect {
+	__u8	ls_type;
+	__u8	ls_namelen;	/* length of the name following */
+	__u16	ls_unused;
+	__u32	ls_recsize;	/* size of each record in bytes */
+	__u32	ls_keyoff;	/* offset of the __u64 table key */
+	__u32	ls_unused2;
+	__u64	ls_count;	/* records, or sections for LFSCK_PACK_END */
+};
+
+struct lfsck_pack_block {
+	__u32	lb_nrecs;
+	__u32	lb_len;		/* bytes of encoded records following */
+	__u32	lb_crc;
+	__u32	lb_unused;
+};
+
+struct lfsck_pack;
+
+extern int lfsck_pack_create(const char *name, struct lfsck_pack **ret);
+extern int lfsck_pack_add_blob(struct lfsck_pack *pk, const char *name,
+			       const void *buf, size_t size);
+extern int lfsck_pack_add_table(struct lfsck_pack *pk, const char *name,
+				const char *fname, unsigned int recsize);
+extern int lfsck_pack_finish(struct lfsck_pack *pk, __u64 *bytes);
+extern void lfsck_pack_abort(struct lfsck_pack *pk);
+
+extern int lfsck_pack_is_pack(const char *name);
+extern int lfsck_pack_read_blob(const char *name, const char *blob,
+				void *buf, size_t size);
+extern int lfsck_pack_extract(const char *name, const char *dbfile,
+			      const char *stale);
+
+#endif /* LFSCK_PACK_H */
@@ -0,0 +1,953 @@
+/*
+ * lfsck_table.c --- sorted record tables used for the lfsck databases
+ *
+ * The MDS and OST tables gathered by e2fsck pass 6 used to be written
+ * into Berkeley DB hashes, one put per record, and lfsck then did a
+ * random get for every object it checked.  Once the tables are larger
+ * than the DB cache nearly every operation is a disk seek.  Instead,
+ * records are now appended to an in-memory run which is sorted and
+ * spilled to disk when it gets too big, and the runs are merged into
+ * one sorted file when the table is finished.  See lfsck_table.h for
+ * the layout.
+ *
+ * Runs are sorted and written by a background thread shared by all of
+ * the tables, while new records go into a second buffer, so that e2fsck
+ * pass1 does not stop to do table I/O unless the disk falls behind.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+
+#include "ext2fs/ext2_fs.h"
+#include "ext2fs/ext2fs.h"
+#include "lfsck_table.h"
+
+#define LFSCK_TABLE_STRIDE	256		/* records per index entry */
+#define LFSCK_TABLE_MIN_RECS	1024		/* smallest run buffer */
+#define LFSCK_TABLE_MAX_RUNS	64		/* runs merged at once */
+#define LFSCK_TABLE_IOBUF	(256 * 1024)	/* stdio buffer per file */
+
+struct lfsck_table_writer {
+	char		*tw_name;
+	unsigned int	tw_recsize;
+	unsigned int	tw_keyoff;
+	char		*tw_buf;	/* unsorted records of the next run */
+	size_t		tw_nrecs;
+	size_t		tw_maxrecs;	/* records that fit in tw_buf */
+	size_t		tw_limit;	/* records allowed in each buffer */
+	int		tw_runs[LFSCK_TABLE_MAX_RUNS];
+	int		tw_nruns;	/* spilled runs, oldest first */
+	int		tw_runseq;	/* suffix of the next run file */
+	__u64		tw_count;
+	/* owned by the spill thread while tw_spilling is set */
+	char		*tw_spillbuf;	/* run being written in background */
+	size_t		tw_spillrecs;
+	size_t		tw_spillmax;	/* records that fit in tw_spillbuf */
+	int		tw_spilling;
+	int		tw_spillrc;	/* error from the last background run */
+	struct lfsck_table_writer *tw_next;	/* on the spill queue */
+};
+
+static pthread_mutex_t spill_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t spill_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t spill_done = PTHREAD_COND_INITIALIZER;
+static struct lfsck_table_writer *spill_head, *spill_tail;
+static int spill_started;	/* 1 if running, -1 if it can't be started */
+
+struct sort_ent {
+	__u64		se_key;
+	size_t		se_idx;
+};
+
+struct run_cursor {
+	FILE		*rc_file;
+	char		*rc_rec;
+	__u64		rc_key;
+	int		rc_run;		/* position in tw_runs, for ties */
+};
+
+struct table_out {
+	FILE		*to_file;
+	__u64		to_count;
+	int		to_indexed;	/* collect the sparse index */
+	__u64		*to_index;
+	__u64		to_nindex;
+	__u64		to_maxindex;
+};
+
+static __u64 rec_key(const char *rec, unsigned int keyoff)
+{
+	__u64 key;
+
+	memcpy(&key, rec + keyoff, sizeof(key));
+	return ext2fs_le64_to_cpu(key);
+}
+
+static void run_name(struct lfsck_table_writer *tw, int run, char *name)
+{
+	snprintf(name, PATH_MAX, "%s.run%d", tw->tw_name, run);
+}
+
+static int sort_ent_cmp(const void *a, const void *b)
+{
+	const struct sort_ent *sa = a, *sb = b;
+
+	if (sa->se_key != sb->se_key)
+		return sa->se_key < sb->se_key ? -1 : 1;
+	/* keep records with equal keys in the order they were added */
+	if (sa->se_idx != sb->se_idx)
+		return sa->se_idx < sb->se_idx ? -1 : 1;
+	return 0;
+}
+
+static int table_out_rec(struct lfsck_table_writer *tw, struct table_out *out,
+			 const char *rec, __u64 key)
+{
+	if (out->to_indexed && (out->to_count % LFSCK_TABLE_STRIDE) == 0) {
+		if (out->to_nindex == out->to_maxindex) {
+			__u64 n = out->to_maxindex ? out->to_maxindex * 2 :
+				  1024;
+			__u64 *index;
+
+			index = realloc(out->to_index, n * sizeof(*index));
+			if (index == NULL)
+				return ENOMEM;
+			out->to_index = index;
+			out->to_maxindex = n;
+		}
+		out->to_index[out->to_nindex++] = ext2fs_cpu_to_le64(key);
+	}
+	if (fwrite(rec, tw->tw_recsize, 1, out->to_file) != 1)
+		return EIO;
+	out->to_count++;
+	return 0;
+}
+
+/* Sort nrecs records in buf and write them out in order */
+static int write_sorted(struct lfsck_table_writer *tw, struct table_out *out,
+			const char *buf, size_t nrecs)
+{
+	struct sort_ent *ents;
+	size_t i;
+	int rc = 0;
+
+	if (nrecs == 0)
+		return 0;
+
+	ents = malloc(nrecs * sizeof(*ents));
+	if (ents == NULL)
+		return ENOMEM;
+
+	for (i = 0; i < nrecs; i++) {
+		ents[i].se_key = rec_key(buf + i * tw->tw_recsize,
+					 tw->tw_keyoff);
+		ents[i].se_idx = i;
+	}
+	qsort(ents, nrecs, sizeof(*ents), sort_ent_cmp);
+
+	for (i = 0; i < nrecs; i++) {
+		rc = table_out_rec(tw, out,
+				   buf + ents[i].se_idx * tw->tw_recsize,
+				   ents[i].se_key);
+		if (rc)
+			break;
+	}
+	free(ents);
+	return rc;
+}
+
+static int run_next(struct lfsck_table_writer *tw, struct run_cursor *c)
+{
+	if (fread(c->rc_rec, tw->tw_recsize, 1, c->rc_file) != 1) {
+		if (ferror(c->rc_file))
+			return EIO;
+		fclose(c->rc_file);
+		c->rc_file = NULL;
+		return 0;
+	}
+	c->rc_key = rec_key(c->rc_rec, tw->tw_keyoff);
+	return 0;
+}
+
+static int run_before(struct run_cursor *a, struct run_cursor *b)
+{
+	if (a->rc_key != b->rc_key)
+		return a->rc_key < b->rc_key;
+	return a->rc_run < b->rc_run;
+}
+
+static void heap_down(struct run_cursor **heap, int n, int i)
+{
+	struct run_cursor *c = heap[i];
+	int child;
+
+	while ((child = 2 * i + 1) < n) {
+		if (child + 1 < n && run_before(heap[child + 1], heap[child]))
+			child++;
+		if (!run_before(heap[child], c))
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = c;
+}
+
+/*
+ * Merge all of the spilled runs into out, and remove the run files once
+ * they have been written out.
+ */
+static int merge_runs(struct lfsck_table_writer *tw, struct table_out *out)
+{
+	struct run_cursor *cur = NULL, **heap = NULL;
+	char name[PATH_MAX];
+	char *recs = NULL;
+	int i, n = 0, rc = 0;
+
+	cur = calloc(tw->tw_nruns, sizeof(*cur));
+	heap = calloc(tw->tw_nruns, sizeof(*heap));
+	recs = malloc((size_t)tw->tw_nruns * tw->tw_recsize);
+	if (cur == NULL || heap == NULL || recs == NULL) {
+		rc = ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < tw->tw_nruns; i++) {
+		run_name(tw, tw->tw_runs[i], name);
+		cur[i].rc_file = fopen(name, "r");
+		if (cur[i].rc_file == NULL) {
+			rc = errno;
+			goto out;
+		}
+		setvbuf(cur[i].rc_file, NULL, _IOFBF, LFSCK_TABLE_IOBUF);
+		cur[i].rc_rec = recs + i * tw->tw_recsize;
+		cur[i].rc_run = i;
+		rc = run_next(tw, &cur[i]);
+		if (rc)
+			goto out;
+		if (cur[i].rc_file != NULL)
+			heap[n++] = &cur[i];
+	}
+	for (i = n / 2 - 1; i >= 0; i--)
+		heap_down(heap, n, i);
+
+	while (n > 0) {
+		struct run_cursor *c = heap[0];
+
+		rc = table_out_rec(tw, out, c->rc_rec, c->rc_key);
+		if (rc)
+			goto out;
+		rc = run_next(tw, c);
+		if (rc)
+			goto out;
+		if (c->rc_file == NULL)
+			heap[0] = heap[--n];
+		if (n > 0)
+			heap_down(heap, n, 0);
+	}
+
+	for (i = 0; i < tw->tw_nruns; i++) {
+		run_name(tw, tw->tw_runs[i], name);
+		unlink(name);
+	}
+	tw->tw_nruns = 0;
+out:
+	if (cur) {
+		for (i = 0; i < tw->tw_nruns; i++)
+			if (cur[i].rc_file)
+				fclose(cur[i].rc_file);
+	}
+	free(recs);
+	free(heap);
+	free(cur);
+	return rc;
+}
+
+static int close_out(struct table_out *out, int rc)
+{
+	if (fflush(out->to_file) != 0 && rc == 0)
+		rc = errno;
+	if (fclose(out->to_file) != 0 && rc == 0)
+		rc = errno;
+	out->to_file = NULL;
+	return rc;
+}
+
+/* Write nrecs records from buf to a new run file */
+static int spill_run(struct lfsck_table_writer *tw, const char *buf,
+		     size_t nrecs)
+{
+	struct table_out out;
+	char name[PATH_MAX];
+	int run, rc;
+
+	if (nrecs == 0)
+		return 0;
+
+	/*
+	 * Fold the existing runs into one before adding another, so the
+	 * final merge never needs more than LFSCK_TABLE_MAX_RUNS files.
+	 */
+	if (tw->tw_nruns == LFSCK_TABLE_MAX_RUNS) {
+		memset(&out, 0, sizeof(out));
+		run = tw->tw_runseq++;
+		run_name(tw, run, name);
+		out.to_file = fopen(name, "w");
+		if (out.to_file == NULL)
+			return errno;
+		setvbuf(out.to_file, NULL, _IOFBF, LFSCK_TABLE_IOBUF);
+		rc = close_out(&out, merge_runs(tw, &out));
+		if (rc) {
+			unlink(name);
+			return rc;
+		}
+		tw->tw_runs[tw->tw_nruns++] = run;
+	}
+
+	memset(&out, 0, sizeof(out));
+	run = tw->tw_runseq++;
+	run_name(tw, run, name);
+	out.to_file = fopen(name, "w");
+	if (out.to_file == NULL)
+		return errno;
+	setvbuf(out.to_file, NULL, _IOFBF, LFSCK_TABLE_IOBUF);
+	rc = close_out(&out, write_sorted(tw, &out, buf, nrecs));
+	if (rc) {
+		unlink(name);
+		return rc;
+	}
+	tw->tw_runs[tw->tw_nruns++] = run;
+	return 0;
+}
+
+static void *spill_thread(void *arg)
+{
+	struct lfsck_table_writer *tw;
+	int rc;
+
+	pthread_mutex_lock(&spill_lock);
+	while (1) {
+		while (spill_head == NULL)
+			pthread_cond_wait(&spill_cond, &spill_lock);
+		tw = spill_head;
+		spill_head = tw->tw_next;
+		if (spill_head == NULL)
+			spill_tail = NULL;
+		pthread_mutex_unlock(&spill_lock);
+
+		rc = spill_run(tw, tw->tw_spillbuf, tw->tw_spillrecs);
+
+		pthread_mutex_lock(&spill_lock);
+		tw->tw_spillrc = rc;
+		tw->tw_spilling = 0;
+		pthread_cond_broadcast(&spill_done);
+	}
+	return NULL;
+}
+
+/* Wait for the background run of tw, if any, and return its error */
+static int spill_wait(struct lfsck_table_writer *tw)
+{
+	int rc;
+
+	pthread_mutex_lock(&spill_lock);
+	while (tw->tw_spilling)
+		pthread_cond_wait(&spill_done, &spill_lock);
+	rc = tw->tw_spillrc;
+	tw->tw_spillrc = 0;
+	pthread_mutex_unlock(&spill_lock);
+	return rc;
+}
+
+/*
+ * Start a new run from the records in memory.  They are handed to the
+ * spill thread and tw_buf is swapped for the buffer of its previous run,
+ * or written out here if there is no thread or no memory for a second
+ * buffer.
+ */
+static int spill_start(struct lfsck_table_writer *tw)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	char *buf;
+	size_t max;
+	int rc;
+
+	rc = spill_wait(tw);
+	if (rc)
+		return rc;
+
+	pthread_mutex_lock(&spill_lock);
+	if (spill_started == 0) {
+		spill_started = -1;
+		if (pthread_attr_init(&attr) == 0) {
+			pthread_attr_setdetachstate(&attr,
+						    PTHREAD_CREATE_DETACHED);
+			if (pthread_create(&thread, &attr, spill_thread,
+					   NULL) == 0)
+				spill_started = 1;
+			pthread_attr_destroy(&attr);
+		}
+	}
+	pthread_mutex_unlock(&spill_lock);
+
+	if (spill_started < 0)
+		goto sync;
+	if (tw->tw_spillbuf == NULL) {
+		tw->tw_spillbuf = malloc(tw->tw_maxrecs * tw->tw_recsize);
+		if (tw->tw_spillbuf == NULL)
+			goto sync;
+		tw->tw_spillmax = tw->tw_maxrecs;
+	}
+
+	buf = tw->tw_spillbuf;
+	max = tw->tw_spillmax;
+	tw->tw_spillbuf = tw->tw_buf;
+	tw->tw_spillmax = tw->tw_maxrecs;
+	tw->tw_spillrecs = tw->tw_nrecs;
+	tw->tw_buf = buf;
+	tw->tw_maxrecs = max;
+	tw->tw_nrecs = 0;
+
+	pthread_mutex_lock(&spill_lock);
+	tw->tw_spilling = 1;
+	tw->tw_next = NULL;
+	if (spill_tail)
+		spill_tail->tw_next = tw;
+	else
+		spill_head = tw;
+	spill_tail = tw;
+	pthread_cond_signal(&spill_cond);
+	pthread_mutex_unlock(&spill_lock);
+	return 0;
+
+sync:
+	rc = spill_run(tw, tw->tw_buf, tw->tw_nrecs);
+	if (rc == 0)
+		tw->tw_nrecs = 0;
+	return rc;
+}
+
+/*
+ * Start a new table in the file name, holding records of recsize bytes
+ * sorted by the __u64 at keyoff.  At most about mem bytes are used to
+ * collect records before they are spilled to a run file next to name.
+ */
+int lfsck_table_create(const char *name, unsigned int recsize,
+		       unsigned int keyoff, size_t mem,
+		       struct lfsck_table_writer **ret)
+{
+	struct lfsck_table_writer *tw;
+
+	if (recsize == 0 || keyoff + sizeof(__u64) > recsize)
+		return EINVAL;
+
+	tw = calloc(1, sizeof(*tw));
+	if (tw == NULL)
+		return ENOMEM;
+	tw->tw_name = strdup(name);
+	if (tw->tw_name == NULL) {
+		free(tw);
+		return ENOMEM;
+	}
+	tw->tw_recsize = recsize;
+	tw->tw_keyoff = keyoff;
+	/* one buffer being filled and one being written out */
+	tw->tw_limit = mem / 2 / (recsize + sizeof(struct sort_ent));
+	if (tw->tw_limit < LFSCK_TABLE_MIN_RECS)
+		tw->tw_limit = LFSCK_TABLE_MIN_RECS;
+
+	*ret = tw;
+	return 0;
+}
+
+/* Add a record, already in little-endian order, to the table */
+int lfsck_table_add(struct lfsck_table_writer *tw, const void *rec)
+{
+	int rc;
+
+	if (tw->tw_nrecs == tw->tw_maxrecs) {
+		char *buf = NULL;
+		size_t n;
+
+		if (tw->tw_maxrecs < tw->tw_limit) {
+			n = tw->tw_maxrecs ? tw->tw_maxrecs * 2 :
+			    LFSCK_TABLE_MIN_RECS;
+			if (n > tw->tw_limit)
+				n = tw->tw_limit;
+			buf = realloc(tw->tw_buf, n * tw->tw_recsize);
+			if (buf != NULL) {
+				tw->tw_buf = buf;
+				tw->tw_maxrecs = n;
+			}
+		}
+		/* out of room, or memory: start a new run instead */
+		if (buf == NULL) {
+			if (tw->tw_nrecs == 0)
+				return ENOMEM;
+			rc = spill_start(tw);
+			if (rc)
+				return rc;
+		}
+	}
+
+	memcpy(tw->tw_buf + tw->tw_nrecs * tw->tw_recsize, rec,
+	       tw->tw_recsize);
+	tw->tw_nrecs++;
+	tw->tw_count++;
+	return 0;
+}
+
+__u64 lfsck_table_added(struct lfsck_table_writer *tw)
+{
+	return tw->tw_count;
+}
+
+static void free_writer(struct lfsck_table_writer *tw)
+{
+	char name[PATH_MAX];
+	int i;
+
+	spill_wait(tw);
+	for (i = 0; i < tw->tw_nruns; i++) {
+		run_name(tw, tw->tw_runs[i], name);
+		unlink(name);
+	}
+	free(tw->tw_spillbuf);
+	free(tw->tw_buf);
+	free(tw->tw_name);
+	free(tw);
+}
+
+/*
+ * Merge everything added so far into the table file, replacing any old
+ * file of the same name only once the new one is complete.  The writer
+ * is freed whether or not this succeeds.
+ */
+int lfsck_table_finish(struct lfsck_table_writer *tw)
+{
+	struct lfsck_table_hdr hdr;
+	struct table_out out;
+	char tmpname[PATH_MAX];
+	__u64 i;
+	int rc;
+
+	memset(&out, 0, sizeof(out));
+	out.to_indexed = 1;
+	rc = spill_wait(tw);
+	if (rc)
+		goto out_free;
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", tw->tw_name);
+	out.to_file = fopen(tmpname, "w");
+	if (out.to_file == NULL) {
+		rc = errno;
+		goto out_free;
+	}
+	setvbuf(out.to_file, NULL, _IOFBF, LFSCK_TABLE_IOBUF);
+
+	memset(&hdr, 0, sizeof(hdr));
+	if (fwrite(&hdr, sizeof(hdr), 1, out.to_file) != 1) {
+		rc = EIO;
+		goto out_close;
+	}
+
+	if (tw->tw_nruns == 0) {
+		rc = write_sorted(tw, &out, tw->tw_buf, tw->tw_nrecs);
+	} else {
+		rc = spill_run(tw, tw->tw_buf, tw->tw_nrecs);
+		if (rc == 0)
+			rc = merge_runs(tw, &out);
+	}
+	if (rc)
+		goto out_close;
+
+	if (out.to_nindex &&
+	    fwrite(out.to_index, sizeof(*out.to_index), out.to_nindex,
+		   out.to_file) != out.to_nindex) {
+		rc = EIO;
+		goto out_close;
+	}
+
+	hdr.lh_magic = ext2fs_cpu_to_le32(LFSCK_TABLE_MAGIC);
+	hdr.lh_version = ext2fs_cpu_to_le32(LFSCK_TABLE_VERSION);
+	hdr.lh_recsize = ext2fs_cpu_to_le32(tw->tw_recsize);
+	hdr.lh_keyoff = ext2fs_cpu_to_le32(tw->tw_keyoff);
+	hdr.lh_count = ext2fs_cpu_to_le64(out.to_count);
+	hdr.lh_stride = ext2fs_cpu_to_le32(LFSCK_TABLE_STRIDE);
+	i = sizeof(hdr) + out.to_count * tw->tw_recsize;
+	hdr.lh_index = ext2fs_cpu_to_le64(i);
+	hdr.lh_nindex = ext2fs_cpu_to_le64(out.to_nindex);
+	if (fseek(out.to_file, 0, SEEK_SET) != 0 ||
+	    fwrite(&hdr, sizeof(hdr), 1, out.to_file) != 1)
+		rc = EIO;
+
+out_close:
+	rc = close_out(&out, rc);
+	if (rc == 0 && rename(tmpname, tw->tw_name) != 0)
+		rc = errno;
+	if (rc)
+		unlink(tmpname);
+out_free:
+	free(out.to_index);
+	free_writer(tw);
+	return rc;
+}
+
+/* Throw away a table that is no longer wanted, and its run files */
+void lfsck_table_abort(struct lfsck_table_writer *tw)
+{
+	if (tw)
+		free_writer(tw);
+}
+
+static __u64 index_key(struct lfsck_table *t, __u64 i)
+{
+	__u64 key;
+
+	memcpy(&key, t->lt_index + i, sizeof(key));
+	return ext2fs_le64_to_cpu(key);
+}
+
+/*
+ * Map a finished table.  recsize is the record size the caller expects,
+ * so that tables from an incompatible e2fsck are refused.
+ */
+int lfsck_table_open(const char *name, unsigned int recsize, int flags,
+		     struct lfsck_table **ret)
+{
+	struct lfsck_table_hdr hdr;
+	struct lfsck_table *t;
+	struct stat st;
+	int fd, prot = PROT_READ;
+	int rc = 0;
+
+	t = calloc(1, sizeof(*t));
+	if (t == NULL)
+		return ENOMEM;
+	t->lt_recsize = recsize;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		rc = errno;
+		if (rc == ENOENT && (flags & LFSCK_TABLE_EMPTY_OK)) {
+			*ret = t;
+			return 0;
+		}
+		free(t);
+		return rc;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		rc = errno;
+		goto out_err;
+	}
+	if (st.st_size < (off_t)sizeof(hdr) ||
+	    (off_t)(size_t)st.st_size != st.st_size) {
+		rc = EINVAL;
+		goto out_err;
+	}
+	t->lt_maplen = st.st_size;
+	if (flags & LFSCK_TABLE_RDWR)
+		prot |= PROT_WRITE;
+	t->lt_map = mmap(NULL, t->lt_maplen, prot, MAP_PRIVATE, fd, 0);
+	if (t->lt_map == MAP_FAILED) {
+		t->lt_map = NULL;
+		rc = errno;
+		goto out_err;
+	}
+
+	memcpy(&hdr, t->lt_map, sizeof(hdr));
+	t->lt_count = ext2fs_le64_to_cpu(hdr.lh_count);
+	t->lt_nindex = ext2fs_le64_to_cpu(hdr.lh_nindex);
+	t->lt_keyoff = ext2fs_le32_to_cpu(hdr.lh_keyoff);
+	t->lt_stride = ext2fs_le32_to_cpu(hdr.lh_stride);
+	if (ext2fs_le32_to_cpu(hdr.lh_magic) != LFSCK_TABLE_MAGIC ||
+	    ext2fs_le32_to_cpu(hdr.lh_version) != LFSCK_TABLE_VERSION ||
+	    ext2fs_le32_to_cpu(hdr.lh_recsize) != recsize ||
+	    t->lt_keyoff + sizeof(__u64) > recsize || t->lt_stride == 0 ||
+	    t->lt_count > (t->lt_maplen - sizeof(hdr)) / recsize ||
+	    ext2fs_le64_to_cpu(hdr.lh_index) !=
+	    sizeof(hdr) + t->lt_count * recsize ||
+	    t->lt_nindex != (t->lt_count + t->lt_stride - 1) / t->lt_stride ||
+	    t->lt_nindex > (t->lt_maplen - sizeof(hdr) -
+			    t->lt_count * recsize) / sizeof(__u64)) {
+		rc = EINVAL;
+		goto out_err;
+	}
+	t->lt_recs = t->lt_map + sizeof(hdr);
+	t->lt_index = (__u64 *)(t->lt_map + ext2fs_le64_to_cpu(hdr.lh_index));
+
+#ifdef MADV_SEQUENTIAL
+	madvise(t->lt_map, t->lt_maplen, (flags & LFSCK_TABLE_RANDOM) ?
+		MADV_RANDOM : MADV_SEQUENTIAL);
+#endif
+	close(fd);
+	*ret = t;
+	return 0;
+
+out_err:
+	if (t->lt_map)
+		munmap(t->lt_map, t->lt_maplen);
+	close(fd);
+	free(t);
+	return rc;
+}
+
+void lfsck_table_close(struct lfsck_table *t)
+{
+	if (t == NULL)
+		return;
+	if (t->lt_map)
+		munmap(t->lt_map, t->lt_maplen);
+	free(t);
+}
+
+__u64 lfsck_table_key(struct lfsck_table *t, __u64 i)
+{
+	return rec_key(t->lt_recs + i * t->lt_recsize, t->lt_keyoff);
+}
+
+/*
+ * Find the first record with the given key.  Returns 0 if there is one,
+ * or ENOENT if not.  Either way, *idx (if given) is set to the position
+ * of the first record with a key that is not smaller, which may be the
+ * end of the table.
+ */
+int lfsck_table_find(struct lfsck_table *t, __u64 key, __u64 *idx)
+{
+	__u64 lo, hi, mid;
+
+	/* The first index entry that is not below key bounds the search */
+	lo = 0;
+	hi = t->lt_nindex;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (index_key(t, mid) < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	hi = lo * t->lt_stride;
+	if (hi > t->lt_count)
+		hi = t->lt_count;
+	lo = lo ? (lo - 1) * t->lt_stride : 0;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (lfsck_table_key(t, mid) < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (idx)
+		*idx = lo;
+	if (lo < t->lt_count && lfsck_table_key(t, lo) == key)
+		return 0;
+	return ENOENT;
+}
+
+/*
+ * Return the position of the first record in [from, end) with a key that
+ * is not smaller than key, or end.  This is for walking two tables side
+ * by side: the next record is checked first, so matching tables cost one
+ * compare per record, and the steps then double, so a long stretch that
+ * is missing from the other table is skipped in logarithmic time.
+ */
+__u64 lfsck_table_seek(struct lfsck_table *t, __u64 key, __u64 from,
+		       __u64 end)
+{
+	__u64 lo, hi, mid, step;
+
+	if (from >= end || lfsck_table_key(t, from) >= key)
+		return from;
+
+	/* key(lo) < key <= key(hi), taking key(end) as infinite */
+	lo = from;
+	for (step = 1; lo + step < end &&
+	     lfsck_table_key(t, lo + step) < key; step <<= 1)
+		lo += step;
+	hi = lo + step < end ? lo + step : end;
+
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (lfsck_table_key(t, mid) < key)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return hi;
+}
+
+#ifdef TEST_PROGRAM
+struct test_rec {
+	__u64	seq;
+	__u64	key;
+};
+
+/* Verify a finished table against the number of records for each key */
+static int verify_table(const char *name, __u64 nrecs, __u64 nkeys,
+			__u64 *counts)
+{
+	struct lfsck_table *t;
+	struct test_rec *r, *prev = NULL;
+	__u64 i, k, idx, pos = 0, seen = 0;
+	int rc;
+
+	rc = lfsck_table_open(name, sizeof(*r), 0, &t);
+	if (rc)
+		return rc;
+	if (lfsck_table_count(t) != nrecs) {
+		printf("%s: %llu records, expected %llu\n", name,
+		       (unsigned long long)lfsck_table_count(t),
+		       (unsigned long long)nrecs);
+		rc = EINVAL;
+		goto out_close;
+	}
+	for (i = 0; i < nrecs; i++) {
+		r = lfsck_table_rec(t, i);
+		if (prev && (ext2fs_le64_to_cpu(prev->key) >
+			     ext2fs_le64_to_cpu(r->key) ||
+			     (prev->key == r->key &&
+			      ext2fs_le64_to_cpu(prev->seq) >
+			      ext2fs_le64_to_cpu(r->seq)))) {
+			printf("%s: record %llu out of order\n", name,
+			       (unsigned long long)i);
+			rc = EINVAL;
+			goto out_close;
+		}
+		prev = r;
+	}
+	/* key nkeys is never added, so a lookup past the end is tested */
+	for (k = 0; k <= nkeys; k++) {
+		rc = lfsck_table_find(t, k, &idx);
+		if ((rc == 0) != (counts[k] != 0) || idx != seen ||
+		    (rc != 0 && rc != ENOENT)) {
+			printf("%s: lookup of key %llu returned %d at %llu, "
+			       "expected %llu\n", name, (unsigned long long)k,
+			       rc, (unsigned long long)idx,
+			       (unsigned long long)seen);
+			rc = EINVAL;
+			goto out_close;
+		}
+		/* walk forward from the last position, and from the start */
+		pos = lfsck_table_seek(t, k, pos, nrecs);
+		idx = lfsck_table_seek(t, k, 0, nrecs);
+		if (pos != seen || idx != seen ||
+		    lfsck_table_seek(t, k, 0, seen / 2) != seen / 2) {
+			printf("%s: seek to key %llu returned %llu/%llu, "
+			       "expected %llu\n", name, (unsigned long long)k,
+			       (unsigned long long)pos, (unsigned long long)idx,
+			       (unsigned long long)seen);
+			rc = EINVAL;
+			goto out_close;
+		}
+		seen += counts[k];
+	}
+	rc = 0;
+out_close:
+	lfsck_table_close(t);
+	return rc;
+}
+
+/*
+ * Add nrecs records with random keys to each of ntables tables at once,
+ * as pass1 does for the OSTs, so their runs are spilled concurrently.
+ */
+static int check_tables(const char *name, int ntables, __u64 nrecs,
+			__u64 nkeys, size_t mem)
+{
+	struct lfsck_table_writer *tw[4];
+	struct test_rec rec;
+	char names[4][PATH_MAX];
+	__u64 *counts, i, k;
+	int n, rc = 0;
+
+	counts = calloc(ntables * (nkeys + 1), sizeof(*counts));
+	if (counts == NULL)
+		return ENOMEM;
+
+	for (n = 0; n < ntables; n++) {
+		sprintf(names[n], "%s.%d", name, n);
+		tw[n] = NULL;
+		if (rc == 0)
+			rc = lfsck_table_create(names[n], sizeof(rec),
+						sizeof(__u64), mem, &tw[n]);
+	}
+	for (i = 0; i < nrecs && rc == 0; i++) {
+		for (n = 0; n < ntables && rc == 0; n++) {
+			k = random() % nkeys;
+			counts[n * (nkeys + 1) + k]++;
+			rec.seq = ext2fs_cpu_to_le64(i);
+			rec.key = ext2fs_cpu_to_le64(k);
+			rc = lfsck_table_add(tw[n], &rec);
+		}
+	}
+	for (n = 0; n < ntables; n++) {
+		if (rc)
+			lfsck_table_abort(tw[n]);
+		else
+			rc = lfsck_table_finish(tw[n]);
+		tw[n] = NULL;
+	}
+	for (n = 0; n < ntables && rc == 0; n++)
+		rc = verify_table(names[n], nrecs, nkeys,
+				  counts + n * (nkeys + 1));
+
+	for (n = 0; n < ntables; n++)
+		unlink(names[n]);
+	free(counts);
+	return rc;
+}
+
+int main(int argc, char **argv)
+{
+	const char *name = "tst_lfsck_table.tbl";
+	struct lfsck_table *t;
+	int rc;
+
+	srandom(1234);
+
+	/* everything fits in memory */
+	rc = check_tables(name, 1, 100000, 5000, LFSCK_TABLE_MEM);
+	/* many small runs, with intermediate merges */
+	if (rc == 0)
+		rc = check_tables(name, 1, 300000, 100000, 0);
+	/* runs of several tables written in the background together */
+	if (rc == 0)
+		rc = check_tables(name, 4, 50000, 20000, 0);
+	/* empty table, and a single partial index stride */
+	if (rc == 0)
+		rc = check_tables(name, 1, 0, 1, 0);
+	if (rc == 0)
+		rc = check_tables(name, 1, 100, 7, 0);
+	if (rc) {
+		printf("lfsck_table: test failed: %s\n", strerror(rc));
+		exit(1);
+	}
+
+	rc = lfsck_table_open(name, sizeof(struct test_rec),
+			      LFSCK_TABLE_EMPTY_OK, &t);
+	if (rc || lfsck_table_count(t) != 0 ||
+	    lfsck_table_find(t, 0, NULL) != ENOENT) {
+		printf("lfsck_table: missing table not treated as empty\n");
+		exit(1);
+	}
+	lfsck_table_close(t);
+
+	printf("lfsck_table: all tests passed\n");
+	exit(0);
+}
+#endif /* TEST_PROGRAM */
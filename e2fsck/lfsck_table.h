@@ -0,0 +1,87 @@
+/*
+ * lfsck_table.h --- sorted record tables used for the lfsck databases
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+#ifndef LFSCK_TABLE_H
+#define LFSCK_TABLE_H
+
+#include <sys/types.h>
+#include "ext2fs/ext2_types.h"
+
+/*
+ * A table is a file of fixed-size records sorted by a little-endian
+ * __u64 key stored at a fixed offset in each record, followed by a
+ * sparse index holding the key of every lt_stride'th record.  Records
+ * with equal keys are kept in the order they were added.
+ *
+ * Tables are written by appending records in any order: they are
+ * collected in memory, sorted and spilled to temporary run files when
+ * the memory limit is reached, and the runs are merged into the final
+ * table by lfsck_table_finish().  Readers mmap the finished table, so
+ * a lookup only touches the index and a single stride of records, and
+ * two tables with the same key can be joined with one sequential pass
+ * over each.
+ */
+#define LFSCK_TABLE_MAGIC	0x4C544231	/* "LTB1" */
+#define LFSCK_TABLE_VERSION	1
+
+struct lfsck_table_hdr {
+	__u32	lh_magic;
+	__u32	lh_version;
+	__u32	lh_recsize;	/* size of each record in bytes */
+	__u32	lh_keyoff;	/* offset of the __u64 key in a record */
+	__u64	lh_count;	/* number of records */
+	__u32	lh_stride;	/* records per sparse index entry */
+	__u32	lh_unused;
+	__u64	lh_index;	/* byte offset of the sparse index */
+	__u64	lh_nindex;	/* number of index entries */
+};
+
+struct lfsck_table {
+	int		lt_fd;
+	char		*lt_map;
+	size_t		lt_maplen;
+	char		*lt_recs;
+	__u64		*lt_index;
+	__u64		lt_count;
+	__u64		lt_nindex;
+	unsigned int	lt_recsize;
+	unsigned int	lt_keyoff;
+	unsigned int	lt_stride;
+};
+
+struct lfsck_table_writer;
+
+/* Flags for lfsck_table_open() */
+#define LFSCK_TABLE_RDWR	0x0001	/* private, writable mapping */
+#define LFSCK_TABLE_RANDOM	0x0002	/* mostly random lookups */
+#define LFSCK_TABLE_EMPTY_OK	0x0004	/* missing file is an empty table */
+
+/* Default memory used to collect each run before it is spilled */
+#define LFSCK_TABLE_MEM		(64 * 1024 * 1024)
+
+#define lfsck_table_count(t)	((t)->lt_count)
+#define lfsck_table_rec(t, i)	\
+	((void *)((t)->lt_recs + (size_t)(i) * (t)->lt_recsize))
+
+extern int lfsck_table_create(const char *name, unsigned int recsize,
+			      unsigned int keyoff, size_t mem,
+			      struct lfsck_table_writer **ret);
+extern int lfsck_table_add(struct lfsck_table_writer *tw, const void *rec);
+extern int lfsck_table_finish(struct lfsck_table_writer *tw);
+extern void lfsck_table_abort(struct lfsck_table_writer *tw);
+extern __u64 lfsck_table_added(struct lfsck_table_writer *tw);
+
+extern int lfsck_table_open(const char *name, unsigned int recsize,
+			    int flags, struct lfsck_table **ret);
+extern void lfsck_table_close(struct lfsck_table *t);
+extern __u64 lfsck_table_key(struct lfsck_table *t, __u64 i);
+extern int lfsck_table_find(struct lfsck_table *t, __u64 key, __u64 *idx);
+extern __u64 lfsck_table_seek(struct lfsck_table *t, __u64 key, __u64 from,
+			      __u64 end);
+
+#endif /* LFSCK_TABLE_H */
@@ -461,8 +461,8 @@ static void check_ea_in_inode(e2fsck_t ctx, struct problem_context *pctx)
 			goto fix;
 		}
 
-		e2fsck_lfsck_found_ea(ctx, pctx->ino, inode, entry,
-				      start + entry->e_value_offs);
+		(void) e2fsck_lfsck_found_ea(ctx, pctx->ino, inode, entry,
+					     start + entry->e_value_offs);
 
 		/* If EA value is stored in external inode then it does not
 		 * consume space here */
@@ -32,23 +32,10 @@
 #include <errno.h>
 #endif
 
-#ifdef HAVE_INTTYPES_H
-#include <inttypes.h>
-#endif
-
-#ifndef HAVE_INTPTR_T
-typedef long intptr_t;
-#endif
-
-/* Needed for architectures where sizeof(int) != sizeof(void *) */
-#define INT_TO_VOIDPTR(val)  ((void *)(intptr_t)(val))
-#define VOIDPTR_TO_INT(ptr)  ((int)(intptr_t)(ptr))
-
 #include <et/com_err.h>
 #include "e2fsck.h"
 
 #include "problem.h"
-#include "dict.h"
 
 /* Define an extension to the ext2 library's block count information */
 #define BLOCK_COUNT_EXTATTR	(-5)
@@ -98,18 +85,120 @@ static void pass1d(e2fsck_t ctx, char *block_buf);
 static int dup_inode_count = 0;
 static int dup_inode_founddir = 0;
 
-static dict_t blk_dict, ino_dict;
+/*
+ * The multiply-claimed blocks and the inodes claiming them are kept in
+ * open-addressing hash tables keyed by block and inode number.  The
+ * records and list elements are carved out of an arena, so that a
+ * badly cross-linked filesystem doesn't cost several mallocs for each
+ * duplicate, and everything can be released at once when we're done.
+ */
+struct dup_hash {
+	__u32		size;		/* Always a power of two */
+	__u32		count;
+	int		shift;
+	__u32		*keys;	/* Zero marks an empty slot */
+	void		**vals;
+};
+
+#define DUP_ARENA_SIZE	65536
+
+struct dup_arena {
+	struct dup_arena	*next;
+	unsigned int		used;
+};
+
+static struct dup_hash blk_hash, ino_hash;
+static struct dup_arena *dup_arena;
 
 static ext2fs_inode_bitmap inode_dup_map;
 
-static int dict_int_cmp(const void *a, const void *b)
+/*
+ * Allocate zeroed memory from the arena
+ */
+static void *dup_alloc(e2fsck_t ctx, unsigned int size)
+{
+	struct dup_arena	*a = dup_arena;
+	void			*ret;
+
+	size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	if (!a || a->used + size > DUP_ARENA_SIZE) {
+		a = e2fsck_allocate_memory(ctx, sizeof(struct dup_arena) +
+					   DUP_ARENA_SIZE,
+					   "duplicate block arena");
+		a->next = dup_arena;
+		dup_arena = a;
+	}
+	ret = (char *) (a + 1) + a->used;
+	a->used += size;
+	return ret;
+}
+
+static void dup_hash_init(e2fsck_t ctx, struct dup_hash *h, int shift)
+{
+	h->shift = shift;
+	h->size = 1 << shift;
+	h->count = 0;
+	h->keys = e2fsck_allocate_memory(ctx, h->size * sizeof(__u32),
+					 "duplicate hash keys");
+	h->vals = e2fsck_allocate_memory(ctx, h->size * sizeof(void *),
+					 "duplicate hash values");
+}
+
+static void dup_hash_free(struct dup_hash *h)
+{
+	ext2fs_free_mem(&h->keys);
+	ext2fs_free_mem(&h->vals);
+	h->size = h->count = 0;
+}
+
+static __u32 dup_hash_slot(struct dup_hash *h, __u32 key)
+{
+	__u32	i;
+
+	i = (key * 0x9E3779B1U) >> (32 - h->shift);
+	while (h->keys[i] && h->keys[i] != key)
+		i = (i + 1) & (h->size - 1);
+	return i;
+}
+
+static void *dup_hash_lookup(struct dup_hash *h, __u32 key)
+{
+	__u32	i = dup_hash_slot(h, key);
+
+	return h->keys[i] ? h->vals[i] : 0;
+}
+
+static void dup_hash_insert(e2fsck_t ctx, struct dup_hash *h,
+			    __u32 key, void *val)
 {
-	intptr_t	ia, ib;
+	struct dup_hash	old = *h;
+	__u32		i, j;
+
+	if ((h->count + 1) * 4 > h->size * 3) {
+		dup_hash_init(ctx, h, h->shift + 1);
+		for (i = 0; i < old.size; i++) {
+			if (!old.keys[i])
+				continue;
+			j = dup_hash_slot(h, old.keys[i]);
+			h->keys[j] = old.keys[i];
+			h->vals[j] = old.vals[i];
+		}
+		h->count = old.count;
+		dup_hash_free(&old);
+	}
+	i = dup_hash_slot(h, key);
+	if (!h->keys[i])
+		h->count++;
+	h->keys[i] = key;
+	h->vals[i] = val;
+}
 
-	ia = (intptr_t)a;
-	ib = (intptr_t)b;
+static int ino_cmp(const void *a, const void *b)
+{
+	const ext2_ino_t *ia = (const ext2_ino_t *) a;
+	const ext2_ino_t *ib = (const ext2_ino_t *) b;
 
-	return (ia-ib);
+	return (*ia > *ib) - (*ia < *ib);
 }
 
 /*
@@ -118,35 +207,29 @@ static int dict_int_cmp(const void *a, const void *b)
 static void add_dupe(e2fsck_t ctx, ext2_ino_t ino, blk_t blk,
 		     struct ext2_inode *inode)
 {
-	dnode_t	*n;
 	struct dup_block	*db;
 	struct dup_inode	*di;
 	struct block_el		*blk_el;
 	struct inode_el 	*ino_el;
 
-	n = dict_lookup(&blk_dict, INT_TO_VOIDPTR(blk));
-	if (n)
-		db = (struct dup_block *) dnode_get(n);
-	else {
-		db = (struct dup_block *) e2fsck_allocate_memory(ctx,
-			 sizeof(struct dup_block), "duplicate block header");
+	db = (struct dup_block *) dup_hash_lookup(&blk_hash, blk);
+	if (!db) {
+		db = (struct dup_block *) dup_alloc(ctx,
+						    sizeof(struct dup_block));
 		db->num_bad = 0;
 		db->inode_list = 0;
-		dict_alloc_insert(&blk_dict, INT_TO_VOIDPTR(blk), db);
+		dup_hash_insert(ctx, &blk_hash, blk, db);
 	}
-	ino_el = (struct inode_el *) e2fsck_allocate_memory(ctx,
-			 sizeof(struct inode_el), "inode element");
+	ino_el = (struct inode_el *) dup_alloc(ctx, sizeof(struct inode_el));
 	ino_el->inode = ino;
 	ino_el->next = db->inode_list;
 	db->inode_list = ino_el;
 	db->num_bad++;
 
-	n = dict_lookup(&ino_dict, INT_TO_VOIDPTR(ino));
-	if (n)
-		di = (struct dup_inode *) dnode_get(n);
-	else {
-		di = (struct dup_inode *) e2fsck_allocate_memory(ctx,
-			 sizeof(struct dup_inode), "duplicate inode header");
+	di = (struct dup_inode *) dup_hash_lookup(&ino_hash, ino);
+	if (!di) {
+		di = (struct dup_inode *) dup_alloc(ctx,
+						    sizeof(struct dup_inode));
 		if (ino == EXT2_ROOT_INO) {
 			di->dir = EXT2_ROOT_INO;
 			dup_inode_founddir++;
@@ -156,10 +239,9 @@ static void add_dupe(e2fsck_t ctx, ext2_ino_t ino, blk_t blk,
 		di->num_dupblocks = 0;
 		di->block_list = 0;
 		di->inode = *inode;
-		dict_alloc_insert(&ino_dict, INT_TO_VOIDPTR(ino), di);
+		dup_hash_insert(ctx, &ino_hash, ino, di);
 	}
-	blk_el = (struct block_el *) e2fsck_allocate_memory(ctx,
-			 sizeof(struct block_el), "block element");
+	blk_el = (struct block_el *) dup_alloc(ctx, sizeof(struct block_el));
 	blk_el->block = blk;
 	blk_el->next = di->block_list;
 	di->block_list = blk_el;
@@ -167,39 +249,19 @@ static void add_dupe(e2fsck_t ctx, ext2_ino_t ino, blk_t blk,
 }
 
 /*
- * Free a duplicate inode record
- */
-static void inode_dnode_free(dnode_t *node,
-			     void *context EXT2FS_ATTR((unused)))
-{
-	struct dup_inode	*di;
-	struct block_el		*p, *next;
-
-	di = (struct dup_inode *) dnode_get(node);
-	for (p = di->block_list; p; p = next) {
-		next = p->next;
-		free(p);
-	}
-	free(di);
-	free(node);
-}
-
-/*
- * Free a duplicate block record
+ * Free the duplicate block and inode records
  */
-static void block_dnode_free(dnode_t *node,
-			     void *context EXT2FS_ATTR((unused)))
+static void free_dupes(void)
 {
-	struct dup_block	*db;
-	struct inode_el		*p, *next;
+	struct dup_arena	*a, *next;
 
-	db = (struct dup_block *) dnode_get(node);
-	for (p = db->inode_list; p; p = next) {
-		next = p->next;
-		free(p);
+	for (a = dup_arena; a; a = next) {
+		next = a->next;
+		ext2fs_free_mem(&a);
 	}
-	free(db);
-	free(node);
+	dup_arena = 0;
+	dup_hash_free(&blk_hash);
+	dup_hash_free(&ino_hash);
 }
 
 
@@ -224,10 +286,8 @@ void e2fsck_pass1_dupblocks(e2fsck_t ctx, char *block_buf)
 		return;
 	}
 
-	dict_init(&ino_dict, DICTCOUNT_T_MAX, dict_int_cmp);
-	dict_init(&blk_dict, DICTCOUNT_T_MAX, dict_int_cmp);
-	dict_set_allocator(&ino_dict, NULL, inode_dnode_free, NULL);
-	dict_set_allocator(&blk_dict, NULL, block_dnode_free, NULL);
+	dup_hash_init(ctx, &ino_hash, 10);
+	dup_hash_init(ctx, &blk_hash, 10);
 
 	init_resource_track(&rtrack, ctx->fs->io);
 	pass1b(ctx, block_buf);
@@ -245,8 +305,7 @@ void e2fsck_pass1_dupblocks(e2fsck_t ctx, char *block_buf)
 	 * Time to free all of the accumulated data structures that we
 	 * don't need anymore.
 	 */
-	dict_free_nodes(&ino_dict);
-	dict_free_nodes(&blk_dict);
+	free_dupes();
 	ext2fs_free_inode_bitmap(inode_dup_map);
 }
 
@@ -264,7 +323,9 @@ struct process_block_struct {
 static void pass1b(e2fsck_t ctx, char *block_buf)
 {
 	ext2_filsys fs = ctx->fs;
-	ext2_ino_t ino;
+	ext2_ino_t ino = 0, last = 0;
+	ext2_ino_t ipg = fs->super->s_inodes_per_group;
+	dgrp_t group;
 	struct ext2_inode inode;
 	ext2_inode_scan	scan;
 	struct process_block_struct pb;
@@ -303,6 +364,34 @@ static void pass1b(e2fsck_t ctx, char *block_buf)
 		}
 		if (!ino)
 			break;
+		/*
+		 * Only the inodes found in use by pass 1 can claim
+		 * blocks, so skip over whole groups of the inode table
+		 * which don't have any.  (Group 0 always has to be
+		 * scanned, since it holds the bad blocks inode.)
+		 */
+		if (ino > last) {
+			group = (ino - 1) / ipg;
+			while (group && group < fs->group_desc_count &&
+			       ext2fs_test_inode_bitmap_range(
+					ctx->inode_used_map,
+					group * ipg + 1, ipg))
+				group++;
+			if (group >= fs->group_desc_count)
+				break;
+			last = (group + 1) * ipg;
+			if (ino <= group * ipg) {
+				pctx.errcode = ext2fs_inode_scan_goto_blockgroup(
+					scan, group);
+				if (pctx.errcode) {
+					fix_problem(ctx, PR_1B_ISCAN_ERROR,
+						    &pctx);
+					ctx->flags |= E2F_FLAG_ABORT;
+					return;
+				}
+				continue;
+			}
+		}
 		pctx.ino = ctx->stashed_ino = ino;
 		if ((ino != EXT2_BAD_INO) &&
 		    !ext2fs_test_inode_bitmap(ctx->inode_used_map, ino))
@@ -384,7 +473,6 @@ static int search_dirent_proc(ext2_ino_t dir, int entry,
 {
 	struct search_dir_struct *sd;
 	struct dup_inode	*p;
-	dnode_t			*n;
 
 	sd = (struct search_dir_struct *) priv_data;
 
@@ -396,10 +484,9 @@ static int search_dirent_proc(ext2_ino_t dir, int entry,
 	    !ext2fs_test_inode_bitmap(inode_dup_map, dirent->inode))
 		return 0;
 
-	n = dict_lookup(&ino_dict, INT_TO_VOIDPTR(dirent->inode));
-	if (!n)
+	p = (struct dup_inode *) dup_hash_lookup(&ino_hash, dirent->inode);
+	if (!p)
 		return 0;
-	p = (struct dup_inode *) dnode_get(n);
 	if (!p->dir) {
 		p->dir = dir;
 		sd->count--;
@@ -436,13 +523,12 @@ static void pass1d(e2fsck_t ctx, char *block_buf)
 	ext2_filsys fs = ctx->fs;
 	struct dup_inode	*p, *t;
 	struct dup_block	*q;
-	ext2_ino_t		*shared, ino;
+	ext2_ino_t		*shared, *dup_inodes, ino;
 	int	shared_len;
-	int	i;
+	int	i, n, num_inodes;
 	int	file_ok;
 	int	meta_data = 0;
 	struct problem_context pctx;
-	dnode_t	*n, *m;
 	struct block_el	*s;
 	struct inode_el *r;
 
@@ -452,16 +538,30 @@ static void pass1d(e2fsck_t ctx, char *block_buf)
 		fix_problem(ctx, PR_1D_PASS_HEADER, &pctx);
 	e2fsck_read_bitmaps(ctx);
 
-	pctx.num = dup_inode_count; /* dict_count(&ino_dict); */
+	pctx.num = dup_inode_count; /* ino_hash.count */
 	fix_problem(ctx, PR_1D_NUM_DUP_INODES, &pctx);
 	shared = (ext2_ino_t *) e2fsck_allocate_memory(ctx,
-				sizeof(ext2_ino_t) * dict_count(&ino_dict),
+				sizeof(ext2_ino_t) * ino_hash.count,
 				"Shared inode list");
-	for (n = dict_first(&ino_dict); n; n = dict_next(&ino_dict, n)) {
-		p = (struct dup_inode *) dnode_get(n);
+
+	/*
+	 * Handle the inodes in order, which is how the user will
+	 * expect to see them.
+	 */
+	dup_inodes = (ext2_ino_t *) e2fsck_allocate_memory(ctx,
+				sizeof(ext2_ino_t) * ino_hash.count,
+				"Duplicate inode list");
+	num_inodes = 0;
+	for (i = 0; i < (int) ino_hash.size; i++)
+		if (ino_hash.keys[i])
+			dup_inodes[num_inodes++] = ino_hash.keys[i];
+	qsort(dup_inodes, num_inodes, sizeof(ext2_ino_t), ino_cmp);
+
+	for (n = 0; n < num_inodes; n++) {
+		ino = dup_inodes[n];
+		p = (struct dup_inode *) dup_hash_lookup(&ino_hash, ino);
 		shared_len = 0;
 		file_ok = 1;
-		ino = (ext2_ino_t)VOIDPTR_TO_INT(dnode_getkey(n));
 		if (ino == EXT2_BAD_INO || ino == EXT2_RESIZE_INO)
 			continue;
 
@@ -472,10 +572,10 @@ static void pass1d(e2fsck_t ctx, char *block_buf)
 		 * get the list of inodes, and merge them together.
 		 */
 		for (s = p->block_list; s; s = s->next) {
-			m = dict_lookup(&blk_dict, INT_TO_VOIDPTR(s->block));
-			if (!m)
+			q = (struct dup_block *) dup_hash_lookup(&blk_hash,
+								 s->block);
+			if (!q)
 				continue; /* Should never happen... */
-			q = (struct dup_block *) dnode_get(m);
 			if (q->num_bad > 1)
 				file_ok = 0;
 			if (q->num_bad == 1 && (ctx->clone == E2F_CLONE_ZERO ||
@@ -520,10 +620,10 @@ static void pass1d(e2fsck_t ctx, char *block_buf)
 			fix_problem(ctx, PR_1D_SHARE_METADATA, &pctx);
 
 		for (i = 0; i < shared_len; i++) {
-			m = dict_lookup(&ino_dict, INT_TO_VOIDPTR(shared[i]));
-			if (!m)
+			t = (struct dup_inode *) dup_hash_lookup(&ino_hash,
+								 shared[i]);
+			if (!t)
 				continue; /* should never happen */
-			t = (struct dup_inode *) dnode_get(m);
 			/*
 			 * Report the inode that we are sharing with
 			 */
@@ -562,6 +662,7 @@ delete:
 			ext2fs_unmark_valid(fs);
 	}
 	ext2fs_free_mem(&shared);
+	ext2fs_free_mem(&dup_inodes);
 }
 
 /*
@@ -586,7 +687,6 @@ static int delete_file_block(ext2_filsys fs,
 {
 	struct process_block_struct *pb;
 	struct dup_block *p;
-	dnode_t	*n;
 	e2fsck_t ctx;
 
 	pb = (struct process_block_struct *) priv_data;
@@ -596,11 +696,10 @@ static int delete_file_block(ext2_filsys fs,
 		return 0;
 
 	if (ext2fs_test_block_bitmap(ctx->block_dup_map, *block_nr)) {
-		n = dict_lookup(&blk_dict, INT_TO_VOIDPTR(*block_nr));
-		if (n) {
-			p = (struct dup_block *) dnode_get(n);
+		p = (struct dup_block *) dup_hash_lookup(&blk_hash, *block_nr);
+		if (p)
 			decrement_badcount(ctx, *block_nr, p);
-		} else
+		else
 			com_err("delete_file_block", 0,
 			    _("internal error: can't find dup_blk for %u\n"),
 				*block_nr);
@@ -685,7 +784,6 @@ static int clone_file_block(ext2_filsys fs,
 	blk_t	new_block;
 	errcode_t	retval;
 	struct clone_struct *cs = (struct clone_struct *) priv_data;
-	dnode_t *n;
 	e2fsck_t ctx;
 
 	ctx = cs->ctx;
@@ -694,9 +792,8 @@ static int clone_file_block(ext2_filsys fs,
 		return 0;
 
 	if (ext2fs_test_block_bitmap(ctx->block_dup_map, *block_nr)) {
-		n = dict_lookup(&blk_dict, INT_TO_VOIDPTR(*block_nr));
-		if (n) {
-			p = (struct dup_block *) dnode_get(n);
+		p = (struct dup_block *) dup_hash_lookup(&blk_hash, *block_nr);
+		if (p) {
 			retval = ext2fs_new_block(fs, 0, ctx->block_found_map,
 						  &new_block);
 			if (retval) {
@@ -758,7 +855,6 @@ static int clone_file(e2fsck_t ctx, ext2_ino_t ino,
 	struct clone_struct cs;
 	struct problem_context	pctx;
 	blk_t		blk;
-	dnode_t		*n;
 	struct inode_el	*ino_el;
 	struct dup_block	*db;
 	struct dup_inode	*di;
@@ -803,20 +899,20 @@ static int clone_file(e2fsck_t ctx, ext2_ino_t ino,
 		 * which refered to that EA block, and modify
 		 * them to point to the new EA block.
 		 */
-		n = dict_lookup(&blk_dict, INT_TO_VOIDPTR(blk));
-		if (!n) {
+		db = (struct dup_block *) dup_hash_lookup(&blk_hash, blk);
+		if (!db) {
 			com_err("clone_file", 0,
 				_("internal error: couldn't lookup EA "
 				  "block record for %u"), blk);
 			retval = 0; /* OK to stumble on... */
 			goto errout;
 		}
-		db = (struct dup_block *) dnode_get(n);
 		for (ino_el = db->inode_list; ino_el; ino_el = ino_el->next) {
 			if (ino_el->inode == ino)
 				continue;
-			n = dict_lookup(&ino_dict, INT_TO_VOIDPTR(ino_el->inode));
-			if (!n) {
+			di = (struct dup_inode *)
+				dup_hash_lookup(&ino_hash, ino_el->inode);
+			if (!di) {
 				com_err("clone_file", 0,
 					_("internal error: couldn't lookup EA "
 					  "inode record for %u"),
@@ -824,7 +920,6 @@ static int clone_file(e2fsck_t ctx, ext2_ino_t ino,
 				retval = 0; /* OK to stumble on... */
 				goto errout;
 			}
-			di = (struct dup_inode *) dnode_get(n);
 			if (di->inode.i_file_acl == blk) {
 				di->inode.i_file_acl = dp->inode.i_file_acl;
 				e2fsck_write_inode(ctx, ino_el->inode,
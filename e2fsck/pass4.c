@@ -101,18 +101,52 @@ static int disconnect_inode(e2fsck_t ctx, ext2_ino_t i,
 }
 
 
+/*
+ * This routine is called when the number of references to an inode
+ * found in pass 2 doesn't match its link count.
+ */
+static void fix_link_count(e2fsck_t ctx, ext2_ino_t i,
+			   struct ext2_inode *inode, int isdir,
+			   __u16 link_count, __u16 link_counted)
+{
+	struct problem_context	pctx;
+
+	clear_problem_context(&pctx);
+	e2fsck_read_inode(ctx, i, inode, "pass4");
+	pctx.ino = i;
+	pctx.inode = inode;
+	if ((link_count != inode->i_links_count) && !isdir &&
+	    (inode->i_links_count <= EXT2_LINK_MAX)) {
+		pctx.num = link_count;
+		fix_problem(ctx, PR_4_INCONSISTENT_COUNT, &pctx);
+	}
+	pctx.num = link_counted;
+	/* i_link_count was previously exceeded, but no longer
+	 * is, fix this but don't consider it an error */
+	if ((isdir && link_counted > 1 &&
+	     (inode->i_flags & EXT2_INDEX_FL) &&
+	     link_count == 1 && !(ctx->options & E2F_OPT_NO)) ||
+	    fix_problem(ctx, PR_4_BAD_REF_COUNT, &pctx)) {
+		inode->i_links_count = link_counted;
+		e2fsck_write_inode(ctx, i, inode, "pass4");
+	}
+}
+
 void e2fsck_pass4(e2fsck_t ctx)
 {
 	ext2_filsys fs = ctx->fs;
-	ext2_ino_t	i;
+	ext2_ino_t	i, start;
 	struct ext2_inode	*inode;
 #ifdef RESOURCE_TRACK
 	struct resource_track	rtrack;
 #endif
 	struct problem_context	pctx;
+	struct ext2_icount_diff	*diffs;
 	__u16	link_count, link_counted;
 	char	*buf = 0;
 	int	group, maxgroup;
+	unsigned int	d, num, ipg;
+	errcode_t	retval;
 
 	init_resource_track(&rtrack, ctx->fs->io);
 
@@ -125,7 +159,6 @@ void e2fsck_pass4(e2fsck_t ctx)
 	if (!(ctx->options & E2F_OPT_PREEN))
 		fix_problem(ctx, PR_4_PASS_HEADER, &pctx);
 
-	group = 0;
 	maxgroup = fs->group_desc_count;
 	if (ctx->progress)
 		if ((ctx->progress)(ctx, 4, 0, maxgroup))
@@ -133,66 +166,72 @@ void e2fsck_pass4(e2fsck_t ctx)
 
 	inode = e2fsck_allocate_memory(ctx, EXT2_INODE_SIZE(fs->super),
 				       "scratch inode");
+	ipg = fs->super->s_inodes_per_group;
+	diffs = e2fsck_allocate_memory(ctx, ipg * sizeof(*diffs),
+				       "inode count differences");
 
-	/* Protect loop from wrap-around if s_inodes_count maxed */
-	for (i=1; i <= fs->super->s_inodes_count && i > 0; i++) {
-		int isdir = ext2fs_test_inode_bitmap(ctx->inode_dir_map, i);
-
+	/*
+	 * Only the in-use inodes whose reference count doesn't match
+	 * the link count, or which aren't referenced at all, need to
+	 * be looked at; find those a group at a time.
+	 */
+	for (group = 0; group < maxgroup; group++) {
 		if (ctx->flags & E2F_FLAG_SIGNAL_MASK)
 			goto errout;
-		if ((i % fs->super->s_inodes_per_group) == 0) {
-			group++;
-			if (ctx->progress)
-				if ((ctx->progress)(ctx, 4, group, maxgroup))
-					goto errout;
+		start = group * ipg + 1;
+		retval = ext2fs_icount_compare_range(ctx->inode_link_info,
+						     ctx->inode_count,
+						     ctx->inode_used_map,
+						     start, ipg, diffs, &num);
+		if (retval) {
+			/* Fall back to checking every inode in the group */
+			for (num = 0; num < ipg; num++)
+				diffs[num].ino = start + num;
 		}
-		if (i == EXT2_BAD_INO ||
-		    (i > EXT2_ROOT_INO && i < EXT2_FIRST_INODE(fs->super)))
-			continue;
-		if (!(ext2fs_test_inode_bitmap(ctx->inode_used_map, i)) ||
-		    (ctx->inode_imagic_map &&
-		     ext2fs_test_inode_bitmap(ctx->inode_imagic_map, i)) ||
-		    (ctx->inode_bb_map &&
-		     ext2fs_test_inode_bitmap(ctx->inode_bb_map, i)))
-			continue;
-		ext2fs_icount_fetch(ctx->inode_link_info, i, &link_count);
-		ext2fs_icount_fetch(ctx->inode_count, i, &link_counted);
-		if (link_counted == 0) {
-			if (!buf)
-				buf = e2fsck_allocate_memory(ctx,
-				     fs->blocksize, "bad_inode buffer");
-			if (e2fsck_process_bad_inode(ctx, 0, i, buf))
+		for (d = 0; d < num; d++) {
+			int isdir;
+
+			i = diffs[d].ino;
+			if (i == EXT2_BAD_INO ||
+			    (i > EXT2_ROOT_INO &&
+			     i < EXT2_FIRST_INODE(fs->super)))
 				continue;
-			if (disconnect_inode(ctx, i, inode))
+			if (!(ext2fs_test_inode_bitmap(ctx->inode_used_map,
+						       i)) ||
+			    (ctx->inode_imagic_map &&
+			     ext2fs_test_inode_bitmap(ctx->inode_imagic_map,
+						      i)) ||
+			    (ctx->inode_bb_map &&
+			     ext2fs_test_inode_bitmap(ctx->inode_bb_map, i)))
 				continue;
+			isdir = ext2fs_test_inode_bitmap(ctx->inode_dir_map,
+							 i);
 			ext2fs_icount_fetch(ctx->inode_link_info, i,
 					    &link_count);
 			ext2fs_icount_fetch(ctx->inode_count, i,
 					    &link_counted);
-		}
-		if (isdir && (link_counted > EXT2_LINK_MAX))
-			link_counted = 1;
-		if (link_counted != link_count) {
-			e2fsck_read_inode(ctx, i, inode, "pass4");
-			pctx.ino = i;
-			pctx.inode = inode;
-			if ((link_count != inode->i_links_count) && !isdir &&
-			    (inode->i_links_count <= EXT2_LINK_MAX)) {
-				pctx.num = link_count;
-				fix_problem(ctx,
-					    PR_4_INCONSISTENT_COUNT, &pctx);
-			}
-			pctx.num = link_counted;
-			/* i_link_count was previously exceeded, but no longer
-			 * is, fix this but don't consider it an error */
-			if ((isdir && link_counted > 1 &&
-			     (inode->i_flags & EXT2_INDEX_FL) &&
-			     link_count == 1 && !(ctx->options & E2F_OPT_NO)) ||
-			    fix_problem(ctx, PR_4_BAD_REF_COUNT, &pctx)) {
-				inode->i_links_count = link_counted;
-				e2fsck_write_inode(ctx, i, inode, "pass4");
+			if (link_counted == 0) {
+				if (!buf)
+					buf = e2fsck_allocate_memory(ctx,
+					     fs->blocksize, "bad_inode buffer");
+				if (e2fsck_process_bad_inode(ctx, 0, i, buf))
+					continue;
+				if (disconnect_inode(ctx, i, inode))
+					continue;
+				ext2fs_icount_fetch(ctx->inode_link_info, i,
+						    &link_count);
+				ext2fs_icount_fetch(ctx->inode_count, i,
+						    &link_counted);
 			}
+			if (isdir && (link_counted > EXT2_LINK_MAX))
+				link_counted = 1;
+			if (link_counted != link_count)
+				fix_link_count(ctx, i, inode, isdir,
+					       link_count, link_counted);
 		}
+		if (ctx->progress)
+			if ((ctx->progress)(ctx, 4, group + 1, maxgroup))
+				goto errout;
 	}
 	ext2fs_free_icount(ctx->inode_link_info); ctx->inode_link_info = 0;
 	ext2fs_free_icount(ctx->inode_count); ctx->inode_count = 0;
@@ -207,6 +246,7 @@ errout:
 	if (buf)
 		ext2fs_free_mem(&buf);
 
+	ext2fs_free_mem(&diffs);
 	ext2fs_free_mem(&inode);
 	print_resource_track(ctx, _("Pass 4"), &rtrack, ctx->fs->io);
 }
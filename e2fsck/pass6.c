@@ -37,9 +37,12 @@ do { if (ctx->options & E2F_OPT_VERBOSE) printf(fmt, ##args); } while (0)
 #define DEBUG(ctx, fmt, args...) \
 do { if (ctx->options & E2F_OPT_DEBUG) printf(fmt, ##args); } while (0)
 
+/* Memory shared by the per-OST object tables while pass1 runs */
+#define LFSCK_OSTDB_MEM (256 * 1024 * 1024)
+
 struct lfsck_mds_ctx {
 	e2fsck_t	ctx;
-	DB		*outdb;
+	struct lfsck_table_writer *outdb;
 	ext2_ino_t	dot;
 	ext2_ino_t	dotdot;
 	int		numfiles;
@@ -47,40 +50,192 @@ struct lfsck_mds_ctx {
 
 struct lfsck_ost_ctx {
 	e2fsck_t	ctx;
-	DB		*outdb;
+	struct lfsck_table_writer *outdb;
+	struct lfsck_table_writer *inodb;	/* objects by inode number */
+	ext2_dblist	dblist;			/* blocks of the d* dirs */
 	ext2_ino_t	dirinode;
 	int		numfiles;
 	int		status;
 	__u64		max_objid;
 };
 
+/* An object found in the d* directories, before its inode is read */
+struct lfsck_ost_inoent {
+	__u64		oi_ino;
+	__u64		oi_objid;
+};
+
+/* Inode table blocks read at once while looking up the objects */
+#define LFSCK_SCAN_BLOCKS 512
+
+/* Throw away any tables that have not been finished yet */
 int e2fsck_lfsck_cleanupdb(e2fsck_t ctx)
 {
 	int i;
-	int rc = 0;
-	DB *dbp;
 
 	if (ctx->lfsck_oinfo == NULL) {
 		return (0);
 	}
 
 	for (i = 0; i < ctx->lfsck_oinfo->ost_count; i++) {
-		if (ctx->lfsck_oinfo->ofile_ctx[i].dbp != NULL) {
-			dbp = ctx->lfsck_oinfo->ofile_ctx[i].dbp;
-			rc += dbp->close(dbp, 0);
-			ctx->lfsck_oinfo->ofile_ctx[i].dbp = NULL;
+		if (ctx->lfsck_oinfo->ofile_ctx[i].writer != NULL) {
+			lfsck_table_abort(ctx->lfsck_oinfo->ofile_ctx[i].writer);
+			ctx->lfsck_oinfo->ofile_ctx[i].writer = NULL;
 		}
 	}
-	if (ctx->lfsck_oinfo->mds_sizeinfo_dbp != NULL) {
-		dbp = ctx->lfsck_oinfo->mds_sizeinfo_dbp;
-		rc += dbp->close(dbp, 0);
-		ctx->lfsck_oinfo->mds_sizeinfo_dbp = NULL;
+	if (ctx->lfsck_oinfo->mds_sizeinfo != NULL) {
+		lfsck_table_abort(ctx->lfsck_oinfo->mds_sizeinfo);
+		ctx->lfsck_oinfo->mds_sizeinfo = NULL;
+	}
+	if (ctx->lfsck_oinfo->mds_inodes != NULL) {
+		lfsck_table_abort(ctx->lfsck_oinfo->mds_inodes);
+		ctx->lfsck_oinfo->mds_inodes = NULL;
 	}
 	if (ctx->lfsck_oinfo->ofile_ctx)
-		ext2fs_free_mem(ctx->lfsck_oinfo->ofile_ctx);
+		ext2fs_free_mem(&ctx->lfsck_oinfo->ofile_ctx);
 	ext2fs_free_mem(&ctx->lfsck_oinfo);
 
-	return(rc);
+	return(0);
+}
+
+static int lfsck_create_table(const char *dbfile, const char *table,
+			      unsigned int recsize, unsigned int keyoff,
+			      size_t mem, struct lfsck_table_writer **tw)
+{
+	char fname[PATH_MAX];
+	int rc;
+
+	lfsck_tablefile(fname, dbfile, table);
+	rc = lfsck_table_create(fname, recsize, keyoff, mem, tw);
+	if (rc)
+		fprintf(stderr, "Failure to create table %s: %s\n", fname,
+			strerror(rc));
+	return rc;
+}
+
+/* Sort and write out the table, which is freed whether or not it works */
+static int lfsck_finish_table(e2fsck_t ctx, const char *dbfile,
+			      const char *table, struct lfsck_table_writer **tw)
+{
+	char fname[PATH_MAX];
+	__u64 count = lfsck_table_added(*tw);
+	int rc;
+
+	lfsck_tablefile(fname, dbfile, table);
+	rc = lfsck_table_finish(*tw);
+	*tw = NULL;
+	if (rc)
+		fprintf(stderr, "Failure to write table %s: %s\n", fname,
+			strerror(rc));
+	else
+		VERBOSE(ctx, "%s: "LPU64" records\n", fname, count);
+	return rc;
+}
+
+/*
+ * Remove the tables left by an earlier run, so that lfsck does not pick
+ * up stale records for an OST that no longer has any objects referenced.
+ * The inode list is kept aside to find out what changed since that run.
+ */
+static int lfsck_remove_tables(const char *dbfile)
+{
+	char fname[PATH_MAX];
+	char prevname[PATH_MAX];
+	char table[256];
+	int i;
+
+	lfsck_tablefile(fname, dbfile, MDS_INODES);
+	lfsck_tablefile(prevname, dbfile, MDS_INODES_PREV);
+	if (rename(fname, prevname) && errno != ENOENT) {
+		fprintf(stderr, "Failure to rename old table %s: %s\n",
+			fname, strerror(errno));
+		return errno;
+	}
+
+	for (i = -3; i < LOV_MAX_OSTS; i++) {
+		if (i == -3)
+			strcpy(table, MDS_CHANGED);
+		else if (i == -2)
+			strcpy(table, MDS_DIRINFO);
+		else if (i == -1)
+			strcpy(table, MDS_SIZEINFO);
+		else
+			sprintf(table, "%s.%d", MDS_OSTDB, i);
+		lfsck_tablefile(fname, dbfile, table);
+		if (unlink(fname) && errno != ENOENT) {
+			fprintf(stderr, "Failure to remove old table %s: %s\n",
+				fname, strerror(errno));
+			return errno;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Write the header and tables of a database into the pack given with
+ * -E lfsck_export, which can be copied to the other nodes in place of
+ * the database.  hdr must already be in disk byte order.
+ */
+static int lfsck_export_db(e2fsck_t ctx, const char *dbfile,
+			   const char *hdrname, const void *hdr, size_t size,
+			   int num_osts)
+{
+	struct lfsck_pack *pk = NULL;
+	char fname[PATH_MAX];
+	char table[256];
+	unsigned int recsize;
+	__u64 bytes;
+	int i, rc;
+
+	rc = lfsck_pack_create(ctx->lfsck_export, &pk);
+	if (rc == 0)
+		rc = lfsck_pack_add_blob(pk, hdrname, hdr, size);
+	for (i = -3; i < num_osts && rc == 0; i++) {
+		if (ctx->lustre_devtype & LUSTRE_OST) {
+			if (i > -3)
+				break;
+			strcpy(table, OST_OSTDB);
+			recsize = sizeof(struct lfsck_ost_objent);
+		} else if (i == -3) {
+			strcpy(table, MDS_DIRINFO);
+			recsize = sizeof(struct lfsck_mds_dirent);
+		} else if (i == -2) {
+			strcpy(table, MDS_SIZEINFO);
+			recsize = sizeof(struct lfsck_mds_szinfo);
+		} else if (i == -1) {
+			strcpy(table, MDS_CHANGED);
+			recsize = sizeof(struct lfsck_mds_change);
+		} else {
+			sprintf(table, "%s.%d", MDS_OSTDB, i);
+			recsize = sizeof(struct lfsck_mds_objent);
+		}
+		lfsck_tablefile(fname, dbfile, table);
+		rc = lfsck_pack_add_table(pk, table, fname, recsize);
+	}
+	if (rc) {
+		fprintf(stderr, "Failure to export %s to %s: %s\n", dbfile,
+			ctx->lfsck_export, strerror(rc));
+		lfsck_pack_abort(pk);
+		return rc;
+	}
+
+	rc = lfsck_pack_finish(pk, &bytes);
+	if (rc)
+		fprintf(stderr, "Failure to write %s: %s\n",
+			ctx->lfsck_export, strerror(rc));
+	else
+		VERBOSE(ctx, "%s: exported "LPU64" bytes\n",
+			ctx->lfsck_export, bytes);
+	return rc;
+}
+
+/* Share the pass1 table memory between the OSTs we know about */
+static size_t lfsck_ostdb_mem(struct lfsck_outdb_info *oinfo)
+{
+	size_t mem;
+
+	mem = LFSCK_OSTDB_MEM / (oinfo->ost_count > 16 ? oinfo->ost_count : 16);
+	return mem < 1024 * 1024 ? 1024 * 1024 : mem;
 }
 
 /* What is the last object id for the OST on the MDS */
@@ -176,7 +331,7 @@ static int lfsck_write_mds_hdrinfo(e2fsck_t ctx, struct lfsck_outdb_info *outdb)
 
 	memset(&mds_hdr, 0, sizeof(mds_hdr));
 	mds_hdr.mds_magic = MDS_MAGIC;
-	mds_hdr.mds_flags = ctx->options & E2F_OPT_READONLY;
+	mds_hdr.mds_flags = (ctx->options & E2F_OPT_READONLY) | LFSCK_FL_TABLES;
 	mds_hdr.mds_max_files = fs->super->s_inodes_count -
 			    fs->super->s_free_inodes_count;
 	VERBOSE(ctx, "MDS: max_files = "LPU64"\n", mds_hdr.mds_max_files);
@@ -214,17 +369,12 @@ out:
 }
 
 static int e2fsck_lfsck_save_ea(e2fsck_t ctx, ext2_ino_t ino, __u32 generation,
-				struct lov_user_md *lmm)
+				__u32 ctime, struct lov_user_md *lmm)
 {
-	ext2_filsys fs = ctx->fs;
 	struct lfsck_mds_szinfo szinfo;
+	struct lfsck_mds_inode mds_inode;
 	struct lov_user_ost_data_v1 *loi;
-	__u64 mds_fid;
 	int rc, i;
-	DBT key, data;
-	DB *dbp;
-	__u32 numfiles = fs->super->s_inodes_count -
-			 fs->super->s_free_inodes_count;
 
 	if (!ctx->lfsck_oinfo) {
 		/* remove old db file */
@@ -237,6 +387,11 @@ static int e2fsck_lfsck_save_ea(e2fsck_t ctx, ext2_ino_t ino, __u32 generation,
 				return rc;
 			}
 		}
+		rc = lfsck_remove_tables(ctx->lustre_mdsdb);
+		if (rc) {
+			ctx->flags |= E2F_FLAG_ABORT;
+			return rc;
+		}
 
 		rc = ext2fs_get_mem(sizeof(struct lfsck_outdb_info),
 				    &ctx->lfsck_oinfo);
@@ -255,11 +410,12 @@ static int e2fsck_lfsck_save_ea(e2fsck_t ctx, ext2_ino_t ino, __u32 generation,
 		}
 		memset(ctx->lfsck_oinfo->ofile_ctx, 0,
 		       sizeof(struct lfsck_ofile_ctx) * LOV_MAX_OSTS);
-		if (lfsck_opendb(ctx->lustre_mdsdb, MDS_SIZEINFO,
-				 &ctx->lfsck_oinfo->mds_sizeinfo_dbp, 0,
-				 sizeof(mds_fid) + sizeof(szinfo), numfiles)) {
-			fprintf(stderr, "Failed to open db file %s\n",
-				MDS_SIZEINFO);
+		if (lfsck_create_table(ctx->lustre_mdsdb, MDS_SIZEINFO,
+				       sizeof(szinfo),
+				       offsetof(struct lfsck_mds_szinfo,
+						mds_fid),
+				       LFSCK_TABLE_MEM,
+				       &ctx->lfsck_oinfo->mds_sizeinfo)) {
 			ctx->flags |= E2F_FLAG_ABORT;
 			return (EIO);
 		}
@@ -269,11 +425,35 @@ static int e2fsck_lfsck_save_ea(e2fsck_t ctx, ext2_ino_t ino, __u32 generation,
 			lfsck_write_mds_hdrinfo(ctx, ctx->lfsck_oinfo);
 		}
 	}
+	if (ctx->lfsck_oinfo->mds_inodes == NULL &&
+	    lfsck_create_table(ctx->lustre_mdsdb, MDS_INODES,
+			       sizeof(mds_inode),
+			       offsetof(struct lfsck_mds_inode, mi_ino),
+			       LFSCK_TABLE_MEM, &ctx->lfsck_oinfo->mds_inodes)) {
+		e2fsck_lfsck_cleanupdb(ctx);
+		ctx->flags |= E2F_FLAG_ABORT;
+		return (EIO);
+	}
+	memset(&mds_inode, 0, sizeof(mds_inode));
+	mds_inode.mi_ino = ino;
+	mds_inode.mi_generation = generation;
+	mds_inode.mi_ctime = ctime;
+	cputole_mds_inode(&mds_inode);
+	rc = lfsck_table_add(ctx->lfsck_oinfo->mds_inodes, &mds_inode);
+	if (rc) {
+		fprintf(stderr, "Failure to add ino %u to table: %s\n",
+			ino, strerror(rc));
+		e2fsck_lfsck_cleanupdb(ctx);
+		ctx->flags |= E2F_FLAG_ABORT;
+		return (EIO);
+	}
+
 	if (lmm->lmm_magic == LOV_USER_MAGIC_V3)
 		loi = ((struct lov_user_md_v3 *)lmm)->lmm_objects;
 	else /* if (lmm->lmm_magic == LOV_USER_MAGIC_V1) */
 		loi = lmm->lmm_objects;
 
+	memset(&szinfo, 0, sizeof(szinfo));
 	szinfo.mds_fid = ino;
 	/* XXX: We don't save the layout type here.  This doesn't matter for
 	 *      now, we don't really need the pool information for lfsck, but
@@ -285,20 +465,12 @@ static int e2fsck_lfsck_save_ea(e2fsck_t ctx, ext2_ino_t ino, __u32 generation,
 	szinfo.mds_size = 0; /* XXX */
 	szinfo.mds_calc_size = 0;
 	szinfo.mds_stripe_pattern = lmm->lmm_pattern;
-	memset(&key, 0, sizeof(key));
-	memset(&data, 0, sizeof(data));
-	mds_fid = szinfo.mds_fid;
-	key.data = &mds_fid;
-	assert(sizeof(szinfo.mds_fid) == sizeof(mds_fid));
-	key.size = sizeof(mds_fid);
 	cputole_mds_szinfo(&szinfo);
-	data.data = &szinfo;
-	data.size = sizeof(szinfo);
-	dbp = ctx->lfsck_oinfo->mds_sizeinfo_dbp;
 #ifdef CHECK_SIZE
-	if ((rc = dbp->put(dbp, NULL, &key, &data, 0)) != 0) {
-		dbp->err(ctx->lfsck_oinfo->mds_sizeinfo_dbp, rc,
-			 "db->put failed\n");
+	rc = lfsck_table_add(ctx->lfsck_oinfo->mds_sizeinfo, &szinfo);
+	if (rc) {
+		fprintf(stderr, "Failure to add size info for ino %u: %s\n",
+			ino, strerror(rc));
 		e2fsck_lfsck_cleanupdb(ctx);
 		ctx->flags |= E2F_FLAG_ABORT;
 		return (EIO);
@@ -326,14 +498,16 @@ static int e2fsck_lfsck_save_ea(e2fsck_t ctx, ext2_ino_t ino, __u32 generation,
 			ctx->lfsck_oinfo->ost_count = ost_idx + 1;
 		}
 
-		if (ofile_ctx->dbp == NULL) {
+		if (ofile_ctx->writer == NULL) {
 			char dbname[256];
 			memset(dbname, 0, 256);
 			sprintf(dbname, "%s.%d", MDS_OSTDB, ost_idx);
-			rc = lfsck_opendb(ctx->lustre_mdsdb, dbname,
-					  &ofile_ctx->dbp, 1,
-					  sizeof(objid) + sizeof(mds_ent),
-					  numfiles);
+			rc = lfsck_create_table(ctx->lustre_mdsdb, dbname,
+					sizeof(mds_ent),
+					offsetof(struct lfsck_mds_objent,
+						 mds_objid),
+					lfsck_ostdb_mem(ctx->lfsck_oinfo),
+					&ofile_ctx->writer);
 			if (rc) {
 				e2fsck_lfsck_cleanupdb(ctx);
 				ctx->flags |= E2F_FLAG_ABORT;
@@ -350,23 +524,19 @@ static int e2fsck_lfsck_save_ea(e2fsck_t ctx, ext2_ino_t ino, __u32 generation,
 			}
 			ofile_ctx->max_id = objid;
 		}
+		memset(&mds_ent, 0, sizeof(mds_ent));
 		mds_ent.mds_fid = ino;
 		mds_ent.mds_generation = generation;
 		mds_ent.mds_flag = 0;
 		mds_ent.mds_objid = objid;
 		mds_ent.mds_ostidx = ost_idx;
 		mds_ent.mds_ostoffset = i;
-		memset(&key, 0, sizeof(key));
-		memset(&data, 0, sizeof(data));
-		key.data = &objid;
-		assert(sizeof(objid) == sizeof(mds_ent.mds_objid));
-		key.size = sizeof(objid);
 		cputole_mds_objent(&mds_ent);
-		data.data = &mds_ent;
-		data.size = sizeof(mds_ent);
-		dbp = ofile_ctx->dbp;
-		if ((rc = dbp->put(dbp, NULL, &key, &data, 0)) != 0) {
-			dbp->err(dbp, rc, "db->put failed\n");
+		rc = lfsck_table_add(ofile_ctx->writer, &mds_ent);
+		if (rc) {
+			fprintf(stderr, "Failure to add object %u:"LPU64
+				" of ino %u: %s\n", ost_idx, objid, ino,
+				strerror(rc));
 			e2fsck_lfsck_cleanupdb(ctx);
 			ctx->flags |= E2F_FLAG_ABORT;
 			/* XXX - Free lctx memory */
@@ -419,17 +589,19 @@ int e2fsck_lfsck_found_ea(e2fsck_t ctx, ext2_ino_t ino,
 			return -EINVAL;
 		}
 
-		return e2fsck_lfsck_save_ea(ctx, ino, inode->i_generation, lmm);
+		return e2fsck_lfsck_save_ea(ctx, ino, inode->i_generation,
+					    inode->i_ctime, lmm);
 	}
 
 	return 0;
 }
 
-/* make sure that the mds data is on file */
+/* make sure that the mds data is on file, by sorting out the tables */
 int e2fsck_lfsck_flush_ea(e2fsck_t ctx)
 {
+	struct lfsck_ofile_ctx *ofile_ctx;
+	char dbname[256];
 	int i, rc = 0;
-	DB *dbp;
 
 	if ((ctx->lustre_devtype & LUSTRE_TYPE) != LUSTRE_MDS)
 		return (0);
@@ -441,16 +613,23 @@ int e2fsck_lfsck_flush_ea(e2fsck_t ctx)
 		if (ctx->lfsck_oinfo->ofile_ctx == NULL)
 			break;
 
-		if (ctx->lfsck_oinfo->ofile_ctx[i].dbp != NULL) {
-			dbp = ctx->lfsck_oinfo->ofile_ctx[i].dbp;
-			rc += dbp->close(dbp, 0);
-			ctx->lfsck_oinfo->ofile_ctx[i].dbp = NULL;
+		ofile_ctx = &ctx->lfsck_oinfo->ofile_ctx[i];
+		if (ofile_ctx->writer != NULL) {
+			sprintf(dbname, "%s.%d", MDS_OSTDB, i);
+			if (lfsck_finish_table(ctx, ctx->lustre_mdsdb, dbname,
+					       &ofile_ctx->writer))
+				rc++;
 		}
 	}
-	if (ctx->lfsck_oinfo->mds_sizeinfo_dbp != NULL) {
-		dbp = ctx->lfsck_oinfo->mds_sizeinfo_dbp;
-		rc += dbp->close(dbp, 0);
-		ctx->lfsck_oinfo->mds_sizeinfo_dbp = NULL;
+	if (ctx->lfsck_oinfo->mds_sizeinfo != NULL) {
+		if (lfsck_finish_table(ctx, ctx->lustre_mdsdb, MDS_SIZEINFO,
+				       &ctx->lfsck_oinfo->mds_sizeinfo))
+			rc++;
+	}
+	if (ctx->lfsck_oinfo->mds_inodes != NULL) {
+		if (lfsck_finish_table(ctx, ctx->lustre_mdsdb, MDS_INODES,
+				       &ctx->lfsck_oinfo->mds_inodes))
+			rc++;
 	}
 
 	if (rc)
@@ -459,6 +638,108 @@ int e2fsck_lfsck_flush_ea(e2fsck_t ctx)
 	return(rc);
 }
 
+/*
+ * Compare the inodes with a LOV EA against those found by the previous
+ * run, and list the ones which are new, were changed or went away.  An
+ * inode whose generation changed was deleted and reused for a new file.
+ */
+static int lfsck_write_changes(e2fsck_t ctx, int *have_delta)
+{
+	struct lfsck_table *prev = NULL, *cur = NULL;
+	struct lfsck_table_writer *outdb = NULL;
+	struct lfsck_mds_inode prev_inode, cur_inode;
+	struct lfsck_mds_change change;
+	char fname[PATH_MAX];
+	unsigned long num_new = 0, num_modified = 0, num_removed = 0;
+	__u64 i = 0, j = 0;
+	int rc;
+
+	*have_delta = 0;
+	lfsck_tablefile(fname, ctx->lustre_mdsdb, MDS_INODES_PREV);
+	rc = lfsck_table_open(fname, sizeof(prev_inode), 0, &prev);
+	if (rc == ENOENT) {
+		VERBOSE(ctx, "MDS: no earlier run to compare with\n");
+		return (0);
+	}
+	if (rc == 0) {
+		lfsck_tablefile(fname, ctx->lustre_mdsdb, MDS_INODES);
+		rc = lfsck_table_open(fname, sizeof(cur_inode),
+				      LFSCK_TABLE_EMPTY_OK, &cur);
+	}
+	if (rc) {
+		fprintf(stderr, "Failure to open table %s: %s\n", fname,
+			strerror(rc));
+		goto out;
+	}
+
+	rc = lfsck_create_table(ctx->lustre_mdsdb, MDS_CHANGED,
+				sizeof(change),
+				offsetof(struct lfsck_mds_change, mc_ino),
+				LFSCK_TABLE_MEM, &outdb);
+	if (rc)
+		goto out;
+
+	while (i < lfsck_table_count(prev) || j < lfsck_table_count(cur)) {
+		memset(&change, 0, sizeof(change));
+		if (j == lfsck_table_count(cur) ||
+		    (i < lfsck_table_count(prev) &&
+		     lfsck_table_key(prev, i) < lfsck_table_key(cur, j))) {
+			change.mc_ino = lfsck_table_key(prev, i++);
+			change.mc_flags = LFSCK_CHG_REMOVED;
+			num_removed++;
+		} else if (i == lfsck_table_count(prev) ||
+			   lfsck_table_key(cur, j) < lfsck_table_key(prev, i)) {
+			change.mc_ino = lfsck_table_key(cur, j++);
+			change.mc_flags = LFSCK_CHG_NEW;
+			num_new++;
+		} else {
+			memcpy(&prev_inode, lfsck_table_rec(prev, i++),
+			       sizeof(prev_inode));
+			letocpu_mds_inode(&prev_inode);
+			memcpy(&cur_inode, lfsck_table_rec(cur, j++),
+			       sizeof(cur_inode));
+			letocpu_mds_inode(&cur_inode);
+			change.mc_ino = cur_inode.mi_ino;
+			if (cur_inode.mi_generation !=
+			    prev_inode.mi_generation) {
+				change.mc_flags = LFSCK_CHG_REMOVED |
+						  LFSCK_CHG_NEW;
+				num_new++;
+			} else if (cur_inode.mi_ctime != prev_inode.mi_ctime) {
+				change.mc_flags = LFSCK_CHG_MODIFIED;
+				num_modified++;
+			} else {
+				continue;
+			}
+		}
+		cputole_mds_change(&change);
+		rc = lfsck_table_add(outdb, &change);
+		if (rc) {
+			fprintf(stderr, "Failure to add change to table: %s\n",
+				strerror(rc));
+			goto out;
+		}
+	}
+
+	rc = lfsck_finish_table(ctx, ctx->lustre_mdsdb, MDS_CHANGED, &outdb);
+	if (rc)
+		goto out;
+	VERBOSE(ctx, "MDS: %lu new, %lu modified, %lu removed files\n",
+		num_new, num_modified, num_removed);
+	*have_delta = 1;
+
+	lfsck_tablefile(fname, ctx->lustre_mdsdb, MDS_INODES_PREV);
+	unlink(fname);
+out:
+	if (outdb)
+		lfsck_table_abort(outdb);
+	if (cur)
+		lfsck_table_close(cur);
+	if (prev)
+		lfsck_table_close(prev);
+	return (rc);
+}
+
 /* From debugfs.c for file removal */
 static int lfsck_release_blocks_proc(ext2_filsys fs, blk_t *blocknr,
 			       int blockcnt, void *private)
@@ -523,63 +804,138 @@ static int lfsck_rm_file(e2fsck_t ctx, ext2_ino_t dir, char *name)
 	return(0);
 }
 
-/* called for each ost object - save the object id and size */
+/*
+ * Note the inode and object id of each object.  The inodes are read later
+ * in inode number order, rather than in the hash order of the names.
+ */
 static int lfsck_list_objs(ext2_ino_t dir, int entry,
 			   struct ext2_dir_entry *dirent, int offset,
 			   int blocksize, char *buf, void *priv_data)
 {
 	struct lfsck_ost_ctx *lctx = priv_data;
-	struct lfsck_ost_objent objent;
-	struct ext2_inode inode;
-	DBT key, data;
-	DB *dbp;
+	struct lfsck_ost_inoent inoent;
 	char name[32]; /* same as filter_fid2dentry() */
-	__u64  objid;
+	int rc;
 
-	if (!ext2fs_check_directory(lctx->ctx->fs, dirent->inode)) {
+	if (entry == DIRENT_DOT_FILE || entry == DIRENT_DOT_DOT_FILE)
 		return (0);
-	}
+
 	memset(name, 0, 32);
 	strncpy(name, dirent->name, dirent->name_len & 0xFF);
-	objid = STRTOUL(name, NULL, 10);
-	if (objid == STRTOUL_MAX) {
+	/* a bad name is only an error if this isn't a subdirectory */
+	inoent.oi_ino = ext2fs_cpu_to_le64(dirent->inode);
+	inoent.oi_objid = ext2fs_cpu_to_le64(STRTOUL(name, NULL, 10));
+	rc = lfsck_table_add(lctx->inodb, &inoent);
+	if (rc) {
+		fprintf(stderr, "Failure to add object %s to table: %s\n",
+			name, strerror(rc));
 		lctx->status = 1;
 		lctx->ctx->flags |= E2F_FLAG_ABORT;
 		return(DIRENT_ABORT);
 	}
+	return (0);
+}
 
-	if (ext2fs_read_inode(lctx->ctx->fs, dirent->inode, &inode)) {
-		lctx->status = 1;
-		lctx->ctx->flags |= E2F_FLAG_ABORT;
-		return(DIRENT_ABORT);
+/* Read an object inode from the scan if it hasn't been passed already */
+static errcode_t lfsck_scan_inode(ext2_filsys fs, ext2_inode_scan scan,
+				  ext2_ino_t ino, ext2_ino_t *scan_ino,
+				  struct ext2_inode *inode)
+{
+	dgrp_t group = (ino - 1) / EXT2_INODES_PER_GROUP(fs->super);
+	errcode_t retval = 0;
+
+	if (scan != NULL && (*scan_ino == 0 || *scan_ino >= ino ||
+	    (*scan_ino - 1) / EXT2_INODES_PER_GROUP(fs->super) != group)) {
+		retval = ext2fs_inode_scan_goto_blockgroup(scan, group);
+		*scan_ino = 0;
 	}
+	while (scan != NULL && retval == 0 && *scan_ino < ino) {
+		retval = ext2fs_get_next_inode(scan, scan_ino, inode);
+		if (*scan_ino == 0)
+			break;
+	}
+	if (scan != NULL && retval == 0 && *scan_ino == ino)
+		return (0);
 
-	objent.ost_objid = objid;
-	objent.ost_flag = 0;
-	if (LINUX_S_ISREG(inode.i_mode))
-		objent.ost_size = EXT2_I_SIZE(&inode);
-	else
-		objent.ost_size = inode.i_size;
-	objent.ost_bytes = (__u64)inode.i_blocks * 512;
+	/* unused or bad inode table blocks, just read this one inode */
+	*scan_ino = 0;
+	return (ext2fs_read_inode(fs, ino, inode));
+}
 
-	memset(&key, 0, sizeof(key));
-	memset(&data, 0, sizeof(data));
-	key.data = &objid;
-	key.size = sizeof(objid);
-	cputole_ost_objent(&objent);
-	data.data = &objent;
-	data.size = sizeof(objent);
-	dbp = lctx->outdb;
-	if (dbp->put(dbp, NULL, &key, &data, 0) != 0) {
-		fprintf(stderr, "Failure to put data into db\n");
-		lctx->ctx->flags |= E2F_FLAG_ABORT;
-		return(DIRENT_ABORT);
+/* Read the inodes of the objects found in order, and save the data */
+static int lfsck_scan_objs(e2fsck_t ctx, struct lfsck_ost_ctx *lctx)
+{
+	ext2_filsys fs = ctx->fs;
+	struct lfsck_table *inotbl = NULL;
+	struct lfsck_ost_inoent inoent;
+	struct lfsck_ost_objent objent;
+	struct ext2_inode inode;
+	ext2_inode_scan scan = NULL;
+	ext2_ino_t ino, last_ino = 0, scan_ino = 0;
+	char fname[PATH_MAX];
+	__u64 i, objid;
+	int rc;
+
+	lfsck_tablefile(fname, ctx->lustre_ostdb, OST_INODB);
+	rc = lfsck_finish_table(ctx, ctx->lustre_ostdb, OST_INODB,
+				&lctx->inodb);
+	if (rc == 0)
+		rc = lfsck_table_open(fname, sizeof(inoent), 0, &inotbl);
+	if (rc) {
+		fprintf(stderr, "Failure to read object table %s: %s\n",
+			fname, strerror(rc));
+		goto out;
 	}
-	if (objid > lctx->max_objid)
-		lctx->max_objid = objid;
 
-	lctx->numfiles ++;
-	return (0);
+	if (ext2fs_open_inode_scan(fs, LFSCK_SCAN_BLOCKS, &scan))
+		scan = NULL;
+
+	for (i = 0; i < lfsck_table_count(inotbl); i++) {
+		memcpy(&inoent, lfsck_table_rec(inotbl, i), sizeof(inoent));
+		ino = ext2fs_le64_to_cpu(inoent.oi_ino);
+		objid = ext2fs_le64_to_cpu(inoent.oi_objid);
+
+		if (ino != last_ino &&
+		    lfsck_scan_inode(fs, scan, ino, &scan_ino, &inode)) {
+			rc = EIO;
+			goto out;
+		}
+		last_ino = ino;
+		if (LINUX_S_ISDIR(inode.i_mode))
+			continue;
+		if (objid == STRTOUL_MAX) {
+			rc = EINVAL;
+			goto out;
+		}
+
+		memset(&objent, 0, sizeof(objent));
+		objent.ost_objid = objid;
+		objent.ost_flag = 0;
+		if (LINUX_S_ISREG(inode.i_mode))
+			objent.ost_size = EXT2_I_SIZE(&inode);
+		else
+			objent.ost_size = inode.i_size;
+		objent.ost_bytes = (__u64)inode.i_blocks * 512;
+
+		cputole_ost_objent(&objent);
+		rc = lfsck_table_add(lctx->outdb, &objent);
+		if (rc) {
+			fprintf(stderr, "Failure to add object "LPU64
+				" to table: %s\n", objid, strerror(rc));
+			goto out;
+		}
+		if (objid > lctx->max_objid)
+			lctx->max_objid = objid;
+
+		lctx->numfiles ++;
+	}
+out:
+	if (scan)
+		ext2fs_close_inode_scan(scan);
+	if (inotbl)
+		lfsck_table_close(inotbl);
+	unlink(fname);
+	return (rc);
 }
 
 /* For each file on the mds save the fid and the containing directory */
@@ -591,14 +947,12 @@ static int lfsck_mds_dirs(ext2_ino_t dir, int entry,
 	struct lfsck_mds_ctx  *lctx = priv_data;
 	struct lfsck_mds_ctx lctx2;
 	struct lfsck_mds_dirent mds_dirent;
-	DBT key, data;
-	DB *dbp = lctx->outdb;
-	__u64 mds_fid;
 	int rc = 0;
 
 	if (dirent->inode == lctx->dot || dirent->inode == lctx->dotdot)
 		return (0);
 
+	memset(&mds_dirent, 0, sizeof(mds_dirent));
 	if (dirent2->file_type == EXT2_FT_DIR ||
 	    dirent2->file_type == EXT2_FT_REG_FILE)
 		mds_dirent.mds_filetype = dirent2->file_type;
@@ -606,28 +960,17 @@ static int lfsck_mds_dirs(ext2_ino_t dir, int entry,
 		return (0);
 
 	lctx->numfiles++;
-	memset(&key, 0, sizeof(key));
-	memset(&data, 0, sizeof(data));
 	mds_dirent.mds_fid = dirent->inode;
 	mds_dirent.mds_dirfid = lctx->dot;
-	mds_fid = mds_dirent.mds_fid;
-	assert(sizeof(mds_dirent.mds_fid) == sizeof(mds_fid));
-	key.data = &mds_fid;
-	key.size = sizeof(mds_fid);
 
 	cputole_mds_dirent(&mds_dirent);
 
-	data.data = &mds_dirent;
-	data.size = sizeof(mds_dirent);
-	if ((rc = dbp->put(dbp, NULL, &key, &data, 0)) != 0) {
-		if (rc != DB_KEYEXIST) {
-			fprintf(stderr,
-				"error adding MDS inode %.*s (inum %u): %s\n",
-				dirent->name_len & 0xFF, dirent->name, dirent->inode,
-				db_strerror(rc));
-			lctx->ctx->flags |= E2F_FLAG_ABORT;
-			return (DIRENT_ABORT);
-		}
+	if ((rc = lfsck_table_add(lctx->outdb, &mds_dirent)) != 0) {
+		fprintf(stderr, "error adding MDS inode %.*s (inum %u): %s\n",
+			dirent->name_len & 0xFF, dirent->name, dirent->inode,
+			strerror(rc));
+		lctx->ctx->flags |= E2F_FLAG_ABORT;
+		return (DIRENT_ABORT);
 	}
 	if (dirent2->file_type == EXT2_FT_DIR) {
 		lctx2 = *lctx;
@@ -642,7 +985,24 @@ static int lfsck_mds_dirs(ext2_ino_t dir, int entry,
 	return(0);
 }
 
-/* For each directory get the objects and save the data */
+static int lfsck_add_dir_block(ext2_filsys fs, blk_t *blocknr,
+			       e2_blkcnt_t blockcnt, blk_t ref_block,
+			       int ref_offset, void *priv_data)
+{
+	struct lfsck_ost_ctx *lctx = priv_data;
+
+	if (ext2fs_add_dir_block(lctx->dblist, lctx->dirinode, *blocknr,
+				 blockcnt)) {
+		lctx->status = 1;
+		return (BLOCK_ABORT);
+	}
+	return (0);
+}
+
+/*
+ * For each d* directory note its blocks, so that all of them can be read
+ * in disk order rather than one directory after another.
+ */
 static int lfsck_iterate_obj_dirs(ext2_ino_t dir, int entry,
 				  struct ext2_dir_entry *dirent, int offset,
 				  int blocksize, char *buf, void *priv_data)
@@ -656,8 +1016,11 @@ static int lfsck_iterate_obj_dirs(ext2_ino_t dir, int entry,
 	if (*dirent->name != 'd')
 		return (0);
 
-	ext2fs_dir_iterate2(lctx->ctx->fs, dirent->inode, 0, NULL,
-			    lfsck_list_objs, priv_data);
+	lctx->dirinode = dirent->inode;
+	if (ext2fs_block_iterate2(lctx->ctx->fs, dirent->inode,
+				  BLOCK_FLAG_READ_ONLY | BLOCK_FLAG_DATA_ONLY,
+				  NULL, lfsck_add_dir_block, lctx))
+		lctx->status = 1;
 	if (lctx->status != 0)
 		return (DIRENT_ABORT);
 
@@ -1075,9 +1438,7 @@ void e2fsck_pass6_ost(e2fsck_t ctx)
 	struct lfsck_ost_ctx lctx;
 	struct lfsck_ost_hdr ost_hdr;
 	struct lfsck_mds_hdr mds_hdr;
-	struct lfsck_ost_objent objent;
-	DB *outdb = NULL;
-	DB *mds_hdrdb = NULL;
+	struct lfsck_table_writer *outdb = NULL;
 	DB *osthdr = NULL;
 	DBT key, data;
 	ext2_ino_t dir;
@@ -1085,6 +1446,7 @@ void e2fsck_pass6_ost(e2fsck_t ctx)
 	int i, rc;
 	char *block_buf = NULL;
 
+	memset(&lctx, 0, sizeof(lctx));
 	if (unlink(ctx->lustre_ostdb)) {
 		if (errno != ENOENT) {
 			fprintf(stderr, "Failure to remove old db file %s\n",
@@ -1093,38 +1455,25 @@ void e2fsck_pass6_ost(e2fsck_t ctx)
 			return;
 		}
 	}
+	if (lfsck_remove_tables(ctx->lustre_ostdb)) {
+		ctx->flags |= E2F_FLAG_ABORT;
+		return;
+	}
 
 	block_buf = e2fsck_allocate_memory(ctx, fs->blocksize * 3,
 					   "block iterate buffer");
 
-	rc = lfsck_opendb(ctx->lustre_mdsdb, MDS_HDR, &mds_hdrdb, 0, 0, 0);
-	if (rc != 0) {
-		fprintf(stderr, "failure to open database %s: %s\n",
-			MDS_HDR, db_strerror(rc));
-		ctx->flags |= E2F_FLAG_ABORT;
-		goto out;
-	}
-
-	memset(&key, 0, sizeof(key));
-	memset(&data, 0, sizeof(data));
+	/* the mdsdb may also be a pack exported by the MDS e2fsck */
 	mds_hdr.mds_magic = MDS_MAGIC;
-	key.data = &mds_hdr.mds_magic;
-	key.size = sizeof(mds_hdr.mds_magic);
-	data.data = &mds_hdr;
-	data.size = sizeof(mds_hdr);
-	data.ulen = sizeof(mds_hdr);
-	data.flags = DB_DBT_USERMEM;
-	rc = mds_hdrdb->get(mds_hdrdb, NULL, &key, &data, 0);
+	rc = lfsck_read_hdr(ctx->lustre_mdsdb, MDS_HDR, &mds_hdr,
+			    sizeof(mds_hdr));
 	if (rc) {
 		fprintf(stderr,"error getting mds_hdr ("LPU64":%u) in %s: %s\n",
-			mds_hdr.mds_magic, (int)sizeof(mds_hdr.mds_magic),
+			(__u64)MDS_MAGIC, (int)sizeof(mds_hdr.mds_magic),
 			ctx->lustre_mdsdb, db_strerror(rc));
 		ctx->flags |= E2F_FLAG_ABORT;
 		goto out;
 	}
-
-	assert(data.size == sizeof(mds_hdr));
-	memcpy(&mds_hdr, data.data, sizeof(mds_hdr));
 	letocpu_mds_hdr(&mds_hdr);
 
 	rc = lfsck_opendb(ctx->lustre_ostdb, OST_HDR, &osthdr, 0, 0, 0);
@@ -1135,13 +1484,10 @@ void e2fsck_pass6_ost(e2fsck_t ctx)
 		goto out;
 	}
 
-	rc = lfsck_opendb(ctx->lustre_ostdb, OST_OSTDB, &outdb, 0,
-			  sizeof(objent.ost_objid) + sizeof(objent),
-			  fs->super->s_inodes_count -
-			  fs->super->s_free_inodes_count);
-	if (rc != 0) {
-		fprintf(stderr, "error getting ost_hdr in %s: %s\n",
-			ctx->lustre_ostdb, db_strerror(rc));
+	if (lfsck_create_table(ctx->lustre_ostdb, OST_OSTDB,
+			       sizeof(struct lfsck_ost_objent),
+			       offsetof(struct lfsck_ost_objent, ost_objid),
+			       LFSCK_TABLE_MEM, &outdb)) {
 		ctx->flags |= E2F_FLAG_ABORT;
 		goto out;
 	}
@@ -1180,19 +1526,35 @@ void e2fsck_pass6_ost(e2fsck_t ctx)
 	 */
 	lctx.ctx = ctx;
 	lctx.outdb = outdb;
-	lctx.status = 0;
-	lctx.numfiles = 0;
-	lctx.max_objid = 0;
-	lctx.status = ext2fs_dir_iterate2(fs, dir, 0, block_buf,
-					  lfsck_iterate_obj_dirs, &lctx);
-	if (lctx.status) {
+	if (ext2fs_init_dblist(fs, &lctx.dblist) ||
+	    lfsck_create_table(ctx->lustre_ostdb, OST_INODB,
+			       sizeof(struct lfsck_ost_inoent),
+			       offsetof(struct lfsck_ost_inoent, oi_ino),
+			       LFSCK_TABLE_MEM, &lctx.inodb)) {
+		ctx->flags |= E2F_FLAG_ABORT;
+		goto out;
+	}
+	rc = ext2fs_dir_iterate2(fs, dir, 0, block_buf,
+				 lfsck_iterate_obj_dirs, &lctx);
+	if (rc == 0 && lctx.status == 0)
+		rc = ext2fs_dblist_dir_iterate(lctx.dblist, 0, block_buf,
+					       lfsck_list_objs, &lctx);
+	if (rc == 0 && lctx.status == 0)
+		rc = lfsck_scan_objs(ctx, &lctx);
+	if (rc || lctx.status) {
 		fprintf(stderr, "Failure in iterating object dirs\n");
 		ctx->flags |= E2F_FLAG_ABORT;
-		return;
+		goto out;
+	}
+
+	if (lfsck_finish_table(ctx, ctx->lustre_ostdb, OST_OSTDB, &outdb)) {
+		ctx->flags |= E2F_FLAG_ABORT;
+		goto out;
 	}
 
 	ost_hdr.ost_magic = OST_MAGIC;
-	ost_hdr.ost_flags = ctx->options & E2F_OPT_READONLY;
+	ost_hdr.ost_flags = (ctx->options & E2F_OPT_READONLY) |
+			    LFSCK_FL_TABLES;
 	ost_hdr.ost_num_files = lctx.numfiles;
 	VERBOSE(ctx, "OST: num files = %u\n", lctx.numfiles);
 
@@ -1241,11 +1603,18 @@ void e2fsck_pass6_ost(e2fsck_t ctx)
 		goto out;
 	}
 
+	if (ctx->lfsck_export &&
+	    lfsck_export_db(ctx, ctx->lustre_ostdb, OST_HDR, &ost_hdr,
+			    sizeof(ost_hdr), 0))
+		ctx->flags |= E2F_FLAG_ABORT;
+
 out:
-	if (mds_hdrdb)
-		mds_hdrdb->close(mds_hdrdb, 0);
+	if (lctx.dblist)
+		ext2fs_free_dblist(lctx.dblist);
+	if (lctx.inodb)
+		lfsck_table_abort(lctx.inodb);
 	if (outdb)
-		outdb->close(outdb, 0);
+		lfsck_table_abort(outdb);
 	if (osthdr)
 		osthdr->close(osthdr, 0);
 	if (block_buf)
@@ -1297,12 +1666,12 @@ void e2fsck_pass6_mds(e2fsck_t ctx)
 	ext2_filsys fs = ctx->fs;
 	struct problem_context pctx;
 	struct lfsck_mds_ctx lctx;
-	struct lfsck_mds_dirent mds_dirent;
 	struct lfsck_mds_hdr mds_hdr;
+	struct lfsck_table_writer *outdb = NULL;
 	DBT key, data;
-	DB *outdb = NULL, *dbhdr = NULL;
+	DB *dbhdr = NULL;
 	__u32 compat, rocompat, incompat, index;
-	int rc, i;
+	int rc, i, have_delta;
 
 	clear_problem_context(&pctx);
 
@@ -1318,6 +1687,10 @@ void e2fsck_pass6_mds(e2fsck_t ctx)
 				goto out;
 			}
 		}
+		if (lfsck_remove_tables(ctx->lustre_mdsdb)) {
+			ctx->flags |= E2F_FLAG_ABORT;
+			goto out;
+		}
 		rc = ext2fs_get_mem(sizeof(struct lfsck_outdb_info),
 				    &ctx->lfsck_oinfo);
 		if (rc) {
@@ -1342,11 +1715,10 @@ void e2fsck_pass6_mds(e2fsck_t ctx)
 		 lfsck_write_mds_hdrinfo(ctx, ctx->lfsck_oinfo);
 	}
 
-	if (lfsck_opendb(ctx->lustre_mdsdb, MDS_DIRINFO, &outdb, 1,
-			 sizeof(mds_dirent.mds_fid) + sizeof(mds_dirent),
-			 fs->super->s_inodes_count -
-			 fs->super->s_free_inodes_count)) {
-		fprintf(stderr, "failure to open database %s\n", MDS_DIRINFO);
+	if (lfsck_create_table(ctx->lustre_mdsdb, MDS_DIRINFO,
+			       sizeof(struct lfsck_mds_dirent),
+			       offsetof(struct lfsck_mds_dirent, mds_fid),
+			       LFSCK_TABLE_MEM, &outdb)) {
 		ctx->flags |= E2F_FLAG_ABORT;
 		goto out;
 	}
@@ -1362,6 +1734,15 @@ void e2fsck_pass6_mds(e2fsck_t ctx)
 		ctx->flags |= E2F_FLAG_ABORT;
 		goto out;
 	}
+	if (lfsck_finish_table(ctx, ctx->lustre_mdsdb, MDS_DIRINFO, &outdb)) {
+		ctx->flags |= E2F_FLAG_ABORT;
+		goto out;
+	}
+
+	if (lfsck_write_changes(ctx, &have_delta)) {
+		ctx->flags |= E2F_FLAG_ABORT;
+		goto out;
+	}
 
 	/* read in e2fsck_lfsck_save_ea() already if we opened read/write */
 	if (ctx->lfsck_oinfo->ost_count == 0)
@@ -1369,7 +1750,9 @@ void e2fsck_pass6_mds(e2fsck_t ctx)
 
 	memset(&mds_hdr, 0, sizeof(mds_hdr));
 	mds_hdr.mds_magic = MDS_MAGIC;
-	mds_hdr.mds_flags = ctx->options & E2F_OPT_READONLY;
+	mds_hdr.mds_flags = (ctx->options & E2F_OPT_READONLY) | LFSCK_FL_TABLES;
+	if (have_delta)
+		mds_hdr.mds_flags |= LFSCK_FL_DELTA;
 	mds_hdr.mds_max_files = fs->super->s_inodes_count -
 			    fs->super->s_free_inodes_count;
 	VERBOSE(ctx, "MDS: max_files = "LPU64"\n", mds_hdr.mds_max_files);
@@ -1431,11 +1814,16 @@ void e2fsck_pass6_mds(e2fsck_t ctx)
 		ctx->flags |= E2F_FLAG_ABORT;
 		goto out;
 	}
+
+	if (ctx->lfsck_export &&
+	    lfsck_export_db(ctx, ctx->lustre_mdsdb, MDS_HDR, &mds_hdr,
+			    sizeof(mds_hdr), ctx->lfsck_oinfo->ost_count))
+		ctx->flags |= E2F_FLAG_ABORT;
 out:
 	if (dbhdr)
 		dbhdr->close(dbhdr, 0);
 	if (outdb)
-		outdb->close(outdb, 0);
+		lfsck_table_abort(outdb);
 }
 
 /* If lfsck checking requested then gather the data */
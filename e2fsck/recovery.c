@@ -37,7 +37,9 @@ struct recovery_info
 	int		nr_revoke_hits;
 };
 
+#ifdef __KERNEL__
 enum passtype {PASS_SCAN, PASS_REVOKE, PASS_REPLAY};
+#endif
 static int do_one_pass(journal_t *journal,
 				struct recovery_info *info, enum passtype pass);
 static int scan_revoke_records(journal_t *, struct buffer_head *,
@@ -123,6 +125,47 @@ failed:
 
 #endif /* __KERNEL__ */
 
+#ifndef __KERNEL__
+/*
+ * Time each pass and keep what it found, for e2fsck -t.
+ */
+static int timed_pass(journal_t *journal,
+		      struct recovery_info *info, enum passtype pass)
+{
+	struct recovery_stats	*stats = journal->j_dev->k_stats;
+	struct timeval		start, end;
+	int			err;
+
+	if (!stats)
+		return do_one_pass(journal, info, pass);
+
+	gettimeofday(&start, 0);
+	err = do_one_pass(journal, info, pass);
+	gettimeofday(&end, 0);
+	stats->pass_time[pass] += (end.tv_sec - start.tv_sec) +
+		(double) (end.tv_usec - start.tv_usec) / 1000000;
+	return err;
+}
+
+static void save_recovery_stats(journal_t *journal,
+				struct recovery_info *info)
+{
+	struct recovery_stats	*stats = journal->j_dev->k_stats;
+
+	if (!stats)
+		return;
+	stats->start_transaction = info->start_transaction;
+	stats->end_transaction = info->end_transaction;
+	stats->nr_replays = info->nr_replays;
+	stats->nr_revokes = info->nr_revokes;
+	stats->nr_revoke_hits = info->nr_revoke_hits;
+	journal_get_revoke_stats(journal, &stats->revoke);
+}
+#else
+#define timed_pass(journal, info, pass)	do_one_pass(journal, info, pass)
+#define save_recovery_stats(journal, info) do { } while (0)
+#endif /* __KERNEL__ */
+
 
 /*
  * Read a block from the journal
@@ -245,11 +288,12 @@ int journal_recover(journal_t *journal)
 		return 0;
 	}
 
-	err = do_one_pass(journal, &info, PASS_SCAN);
+	err = timed_pass(journal, &info, PASS_SCAN);
 	if (!err)
-		err = do_one_pass(journal, &info, PASS_REVOKE);
+		err = timed_pass(journal, &info, PASS_REVOKE);
 	if (!err)
-		err = do_one_pass(journal, &info, PASS_REPLAY);
+		err = timed_pass(journal, &info, PASS_REPLAY);
+	save_recovery_stats(journal, &info);
 
 	jbd_debug(1, "JBD: recovery, exit status %d, "
 		  "recovered transactions %u to %u\n",
@@ -18,19 +18,51 @@
 #undef ENABLE_NLS
 #endif
 #include "e2fsck.h"
+#include "dict.h"
 
+/*
+ * The allocated ranges are kept as disjoint, coalesced [start, end)
+ * intervals in a red-black tree keyed by their start address.  Since
+ * no two intervals overlap, ordering them by start also orders them by
+ * end, so an overlap check only has to look at the two neighbours of
+ * the new range.  This keeps region_allocate() at O(log n) no matter
+ * how many ranges are tracked, where the old sorted list was O(n).
+ */
 struct region_el {
+	dnode_t		node;
 	region_addr_t	start;
 	region_addr_t	end;
-	struct region_el *next;
 };
 
 struct region_struct {
 	region_addr_t	min;
 	region_addr_t	max;
-	struct region_el *allocated;
+	dict_t		allocated;
 };
 
+static int region_cmp(const void *a, const void *b)
+{
+	const struct region_el *ra = a, *rb = b;
+
+	if (ra->start < rb->start)
+		return -1;
+	return ra->start > rb->start;
+}
+
+static dnode_t *region_el_alloc(void *context EXT2FS_ATTR((unused)))
+{
+	struct region_el	*r;
+
+	r = malloc(sizeof(struct region_el));
+	return r ? &r->node : NULL;
+}
+
+static void region_el_free(dnode_t *node,
+			   void *context EXT2FS_ATTR((unused)))
+{
+	free(dnode_get(node));
+}
+
 region_t region_create(region_addr_t min, region_addr_t max)
 {
 	region_t	region;
@@ -41,25 +73,24 @@ region_t region_create(region_addr_t min, region_addr_t max)
 	memset(region, 0, sizeof(struct region_struct));
 	region->min = min;
 	region->max = max;
+	dict_init(&region->allocated, DICTCOUNT_T_MAX, region_cmp);
+	dict_set_allocator(&region->allocated, region_el_alloc,
+			   region_el_free, NULL);
 	return region;
 }
 
 void region_free(region_t region)
 {
-	struct region_el	*r, *next;
-
-	for (r = region->allocated; r; r = next) {
-		next = r->next;
-		free(r);
-	}
+	dict_free_nodes(&region->allocated);
 	memset(region, 0, sizeof(struct region_struct));
 	free(region);
 }
 
 int region_allocate(region_t region, region_addr_t start, int n)
 {
-	struct region_el	*r, *new_region, *prev, *next;
-	region_addr_t end;
+	struct region_el	key, *prev = NULL, *next = NULL, *new_region;
+	dnode_t			*dn;
+	region_addr_t		end;
 
 	end = start+n;
 	if ((start < region->min) || (end > region->max))
@@ -68,56 +99,59 @@ int region_allocate(region_t region, region_addr_t start, int n)
 		return 1;
 
 	/*
-	 * Search through the linked list.  If we find that it
-	 * conflicts witih something that's already allocated, return
-	 * 1; if we can find an existing region which we can grow, do
-	 * so.  Otherwise, stop when we find the appropriate place
-	 * insert a new region element into the linked list.
+	 * Find the last interval starting at or before start, and the
+	 * first one starting after it.  The new range conflicts with
+	 * what's already allocated iff it overlaps either of them.
 	 */
-	for (r = region->allocated, prev=NULL; r; prev = r, r = r->next) {
-		if (((start >= r->start) && (start < r->end)) ||
-		    ((end > r->start) && (end <= r->end)) ||
-		    ((start <= r->start) && (end >= r->end)))
-			return 1;
-		if (end == r->start) {
-			r->start = start;
-			return 0;
-		}
-		if (start == r->end) {
-			if ((next = r->next)) {
-				if (end > next->start)
-					return 1;
-				if (end == next->start) {
-					r->end = next->end;
-					r->next = next->next;
-					free(next);
-					return 0;
-				}
-			}
-			r->end = end;
-			return 0;
-		}
-		if (start < r->start)
-			break;
-	}
+	key.start = start;
+	dn = dict_upper_bound(&region->allocated, &key);
+	if (dn) {
+		prev = dnode_get(dn);
+		dn = dict_next(&region->allocated, dn);
+	} else
+		dn = dict_first(&region->allocated);
+	if (dn)
+		next = dnode_get(dn);
+
+	if (prev && start < prev->end)
+		return 1;
+	if (next && end > next->start)
+		return 1;
+
 	/*
-	 * Insert a new region element structure into the linked list
+	 * Grow an adjacent interval if we can, merging prev and next
+	 * if the new range exactly fills the gap between them.
+	 * Lowering next->start in place is safe since it stays above
+	 * prev->end, so the tree order is unchanged.
 	 */
-	new_region = malloc(sizeof(struct region_el));
-	if (!new_region)
+	if (prev && start == prev->end) {
+		if (next && end == next->start) {
+			prev->end = next->end;
+			dict_delete(&region->allocated, &next->node);
+			region_el_free(&next->node, NULL);
+		} else
+			prev->end = end;
+		return 0;
+	}
+	if (next && end == next->start) {
+		next->start = start;
+		return 0;
+	}
+
+	dn = region_el_alloc(NULL);
+	if (!dn)
 		return -1;
+	new_region = (struct region_el *) dn;
 	new_region->start = start;
-	new_region->end = start + n;
-	new_region->next = r;
-	if (prev)
-		prev->next = new_region;
-	else
-		region->allocated = new_region;
+	new_region->end = end;
+	dnode_init(dn, new_region);
+	dict_insert(&region->allocated, dn, new_region);
 	return 0;
 }
 
 #ifdef TEST_PROGRAM
 #include <stdio.h>
+#include <time.h>
 
 #define BCODE_END	0
 #define BCODE_CREATE	1
@@ -156,11 +190,14 @@ int bcode_program[] = {
 void region_print(region_t region, FILE *f)
 {
 	struct region_el	*r;
+	dnode_t			*n;
 	int	i = 0;
 
 	fprintf(f, "Printing region (min=%d. max=%d)\n\t", region->min,
 		region->max);
-	for (r = region->allocated; r; r = r->next) {
+	for (n = dict_first(&region->allocated); n;
+	     n = dict_next(&region->allocated, n)) {
+		r = dnode_get(n);
 		fprintf(f, "(%d, %d)  ", r->start, r->end);
 		if (++i >= 8)
 			fprintf(f, "\n\t");
@@ -168,12 +205,64 @@ void region_print(region_t region, FILE *f)
 	fprintf(f, "\n");
 }
 
+/*
+ * Allocate every even slot of a large region in a scrambled order, then
+ * every odd slot, so that the second half of the run coalesces
+ * everything back into a single interval.  Reports the elapsed time,
+ * which should grow as n log n.
+ */
+static int region_benchmark(unsigned int count)
+{
+	region_t	r;
+	clock_t		t;
+	unsigned int	i, slot, step;
+	int		ret;
+
+	if (count == 0)
+		return 1;
+	r = region_create(0, 2 * count);
+	if (!r) {
+		fprintf(stderr, "Couldn't create region.\n");
+		return 1;
+	}
+	/* Any odd step is coprime with a power of two; make count one */
+	for (step = 1; step < count; step <<= 1)
+		;
+	t = clock();
+	for (slot = 0; slot < 2; slot++) {
+		for (i = 0; i < step; i++) {
+			unsigned int x = (i * 2654435761U) & (step - 1);
+
+			if (x >= count)
+				continue;
+			ret = region_allocate(r, 2 * x + slot, 1);
+			if (ret) {
+				fprintf(stderr, "Region_allocate(%u, 1) "
+					"returns %d\n", 2 * x + slot, ret);
+				return 1;
+			}
+		}
+	}
+	t = clock() - t;
+	if (dict_count(&r->allocated) != 1 ||
+	    region_allocate(r, count, 1) != 1) {
+		fprintf(stderr, "Region did not coalesce\n");
+		return 1;
+	}
+	printf("Allocated %u ranges in %.3f seconds\n", 2 * count,
+	       (double) t / CLOCKS_PER_SEC);
+	region_free(r);
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
 	region_t	r;
 	int		pc = 0, ret;
 	region_addr_t	start, end, len;
 
+	if (argc == 3 && !strcmp(argv[1], "-b"))
+		exit(region_benchmark(strtoul(argv[2], NULL, 0)));
 
 	while (1) {
 		switch (bcode_program[pc++]) {
@@ -94,8 +94,26 @@ struct jbd_revoke_table_s
 	int		  hash_size;
 	int		  hash_shift;
 	struct list_head *hash_table;
+
+	/* Records in the table; it is doubled when the chains get long */
+	int		  hash_count;
+
+	/* Bloom filter of the revoked block numbers, so that lookups of
+	 * blocks which were never revoked can skip the chain walk.
+	 * Records are never removed during recovery, so it stays valid
+	 * until the table is cleared.  Must be a power of two. */
+	unsigned int	  bloom_bits;
+	unsigned char	 *bloom;
+
+	/* Statistics, kept across journal_clear_revoke() */
+	unsigned long	  records;
+	unsigned long	  lookups;
+	unsigned long	  filtered;
 };
 
+#define REVOKE_BLOOM_RATIO	32	/* filter bits per hash bucket */
+#define REVOKE_MAX_CHAIN	2	/* average chain length before resize */
+
 
 #ifdef __KERNEL__
 static void write_one_revoke_record(journal_t *, transaction_t *,
@@ -117,6 +135,81 @@ static inline int hash(journal_t *journal, unsigned long block)
 		(block << (hash_shift - 12))) & (table->hash_size - 1);
 }
 
+static inline unsigned int bloom_mix(unsigned int h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+static void bloom_add(struct jbd_revoke_table_s *table, unsigned long block)
+{
+	unsigned int h1 = bloom_mix(block), h2 = bloom_mix(h1);
+	unsigned int mask = table->bloom_bits - 1;
+
+	table->bloom[(h1 & mask) >> 3] |= 1 << (h1 & 7);
+	table->bloom[(h2 & mask) >> 3] |= 1 << (h2 & 7);
+}
+
+static int bloom_test(struct jbd_revoke_table_s *table, unsigned long block)
+{
+	unsigned int h1 = bloom_mix(block), h2 = bloom_mix(h1);
+	unsigned int mask = table->bloom_bits - 1;
+
+	return (table->bloom[(h1 & mask) >> 3] & (1 << (h1 & 7))) &&
+		(table->bloom[(h2 & mask) >> 3] & (1 << (h2 & 7)));
+}
+
+/*
+ * Double the hash table, and rebuild the Bloom filter at twice the
+ * size along with it.  If we run out of memory we just carry on with
+ * the table we have; the chains only get longer.
+ */
+static void resize_revoke_table(journal_t *journal)
+{
+	struct jbd_revoke_table_s *table = journal->j_revoke;
+	struct list_head *old_table, *new_table, *hash_list;
+	struct jbd_revoke_record_s *record;
+	unsigned char *bloom;
+	int i, old_size = table->hash_size;
+
+	new_table = kmalloc(2 * old_size * sizeof(struct list_head),
+			    GFP_KERNEL);
+	if (!new_table)
+		return;
+	bloom = kmalloc(2 * table->bloom_bits / 8, GFP_KERNEL);
+	if (!bloom) {
+		kfree(new_table);
+		return;
+	}
+	for (i = 0; i < 2 * old_size; i++)
+		INIT_LIST_HEAD(&new_table[i]);
+	memset(bloom, 0, 2 * table->bloom_bits / 8);
+
+	old_table = table->hash_table;
+	table->hash_table = new_table;
+	table->hash_size = 2 * old_size;
+	table->hash_shift++;
+	kfree(table->bloom);
+	table->bloom = bloom;
+	table->bloom_bits *= 2;
+
+	for (i = 0; i < old_size; i++) {
+		hash_list = &old_table[i];
+		while (!list_empty(hash_list)) {
+			record = (struct jbd_revoke_record_s *) hash_list->next;
+			list_del(&record->hash);
+			list_add(&record->hash, &table->hash_table[
+					 hash(journal, record->blocknr)]);
+			bloom_add(table, record->blocknr);
+		}
+	}
+	kfree(old_table);
+}
+
 static int insert_revoke_hash(journal_t *journal, unsigned long blocknr,
 			      tid_t seq)
 {
@@ -134,6 +227,11 @@ repeat:
 	record->blocknr = blocknr;
 	hash_list = &journal->j_revoke->hash_table[hash(journal, blocknr)];
 	list_add(&record->hash, hash_list);
+	bloom_add(journal->j_revoke, blocknr);
+	journal->j_revoke->records++;
+	if (++journal->j_revoke->hash_count >
+	    REVOKE_MAX_CHAIN * journal->j_revoke->hash_size)
+		resize_revoke_table(journal);
 	return 0;
 
 oom:
@@ -226,6 +324,21 @@ int journal_init_revoke(journal_t *journal, int hash_size)
 		return -ENOMEM;
 	}
 
+	journal->j_revoke->bloom_bits = hash_size * REVOKE_BLOOM_RATIO;
+	journal->j_revoke->bloom =
+		kmalloc(journal->j_revoke->bloom_bits / 8, GFP_KERNEL);
+	if (!journal->j_revoke->bloom) {
+		kfree(journal->j_revoke->hash_table);
+		kmem_cache_free(revoke_table_cache, journal->j_revoke);
+		journal->j_revoke = NULL;
+		return -ENOMEM;
+	}
+	memset(journal->j_revoke->bloom, 0, journal->j_revoke->bloom_bits / 8);
+	journal->j_revoke->hash_count = 0;
+	journal->j_revoke->records = 0;
+	journal->j_revoke->lookups = 0;
+	journal->j_revoke->filtered = 0;
+
 	for (tmp = 0; tmp < hash_size; tmp++)
 		INIT_LIST_HEAD(&journal->j_revoke->hash_table[tmp]);
 
@@ -250,6 +363,7 @@ void journal_destroy_revoke(journal_t *journal)
 	}
 
 	kfree(table->hash_table);
+	kfree(table->bloom);
 	kmem_cache_free(revoke_table_cache, table);
 	journal->j_revoke = NULL;
 }
@@ -580,9 +694,10 @@ int journal_set_revoke(journal_t *journal,
 		       unsigned long blocknr,
 		       tid_t sequence)
 {
-	struct jbd_revoke_record_s *record;
+	struct jbd_revoke_record_s *record = NULL;
 
-	record = find_revoke_record(journal, blocknr);
+	if (bloom_test(journal->j_revoke, blocknr))
+		record = find_revoke_record(journal, blocknr);
 	if (record) {
 		/* If we have multiple occurences, only record the
 		 * latest sequence number in the hashed record */
@@ -606,6 +721,11 @@ int journal_test_revoke(journal_t *journal,
 {
 	struct jbd_revoke_record_s *record;
 
+	journal->j_revoke->lookups++;
+	if (!bloom_test(journal->j_revoke, blocknr)) {
+		journal->j_revoke->filtered++;
+		return 0;
+	}
 	record = find_revoke_record(journal, blocknr);
 	if (!record)
 		return 0;
@@ -614,6 +734,16 @@ int journal_test_revoke(journal_t *journal,
 	return 1;
 }
 
+void journal_get_revoke_stats(journal_t *journal, struct revoke_stats *stats)
+{
+	struct jbd_revoke_table_s *revoke = journal->j_revoke;
+
+	stats->records = revoke->records;
+	stats->hash_size = revoke->hash_size;
+	stats->lookups = revoke->lookups;
+	stats->filtered = revoke->filtered;
+}
+
 /*
  * Finally, once recovery is over, we need to clear the revoke table so
  * that it can be reused by the running filesystem.
@@ -636,5 +766,7 @@ void journal_clear_revoke(journal_t *journal)
 			kmem_cache_free(revoke_record_cache, record);
 		}
 	}
+	revoke->hash_count = 0;
+	memset(revoke->bloom, 0, revoke->bloom_bits / 8);
 }
 
@@ -723,6 +723,22 @@ static void parse_extended_opts(e2fsck_t ctx, const char *opts)
 				continue;
 			}
 			ctx->options |= E2F_OPT_JOURNAL_ONLY;
+		/* -E journal_stats=<file> */
+		} else if (strcmp(token, "journal_stats") == 0) {
+			if (!arg) {
+				extended_usage++;
+				continue;
+			}
+			ctx->journal_stats_file = string_copy(ctx, arg, 0);
+#ifdef ENABLE_LFSCK
+		/* -E lfsck_export=<file> */
+		} else if (strcmp(token, "lfsck_export") == 0) {
+			if (!arg) {
+				extended_usage++;
+				continue;
+			}
+			ctx->lfsck_export = string_copy(ctx, arg, 0);
+#endif
 		} else {
 			fprintf(stderr, _("Unknown extended option: %s\n"),
 				token);
@@ -739,6 +755,10 @@ static void parse_extended_opts(e2fsck_t ctx, const char *opts)
 		fputs(("\tea_ver=<ea_version (1 or 2)>\n"), stderr);
 		fputs(("\tfragcheck\n"), stderr);
 		fputs(("\tjournal_only\n"), stderr);
+		fputs(("\tjournal_stats=<file>\n"), stderr);
+#ifdef ENABLE_LFSCK
+		fputs(("\tlfsck_export=<file>\n"), stderr);
+#endif
 		fputs(("\tshared=<preserve|lost+found|delete>\n"), stderr);
 		fputs(("\tclone=<dup|zero>\n"), stderr);
 		fputs(("\texpand_extra_isize\n"), stderr);
@@ -1043,6 +1063,13 @@ static errcode_t PRS(int argc, char *argv[], e2fsck_t *ret_ctx)
 			usage(ctx);
 		}
 	}
+#ifdef ENABLE_LFSCK
+	if (ctx->lfsck_export && !ctx->lustre_devtype) {
+		com_err(ctx->program_name, 0,
+			_("must specify --mdsdb or --ostdb with lfsck_export"));
+		usage(ctx);
+	}
+#endif
 	if (show_version_only)
 		return 0;
 	if (optind != argc - 1)
@@ -1761,6 +1788,9 @@ no_journal:
 				_("while resetting context"));
 			fatal_error(ctx, 0);
 		}
+		/* pass1 will record the lfsck information again */
+		if (ctx->lfsck_oinfo)
+			e2fsck_lfsck_cleanupdb(ctx);
 		ext2fs_close(fs);
 		goto restart;
 	}
@@ -4,9 +4,12 @@
 #include <stdio.h>
 #include <time.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <ext2fs/ext2fs.h>
 #include <sys/stat.h>
 
+#include "e2scan.h"
+
 #if defined(HAVE_SQLITE3) && defined(HAVE_SQLITE3_H)
 
 #include <sqlite3.h>
@@ -18,7 +21,6 @@ extern struct {
 	int nr;
 	union {
 		struct {
-			int fd;
 			int nr_commands;
 		} db;
 		struct {
@@ -32,14 +34,56 @@ extern struct {
 	};
 } scan_data;
 
-int block_iterate_cb(ext2_filsys fs, blk_t  *block_nr,
-		     e2_blkcnt_t blockcnt,
-		     blk_t ref_block EXT2FS_ATTR((unused)),
-		     int ref_offset EXT2FS_ATTR((unused)),
-		     void *priv_data);
-
-
-static long count = 10000;
+/*
+ * Records are inserted by a writer thread, so that the scan does not
+ * wait for sqlite.  The scan fills batches of binary records in a ring
+ * and only takes the lock when a batch is full; the writer binds them
+ * to prepared statements and commits every DB_TRANSACTION records.
+ * Records are produced by one thread at a time: the inode scan thread
+ * of the first group, then the main thread once all scan threads are
+ * joined.
+ */
+#define DB_BATCH	1024		/* records handed over at once */
+#define DB_RING		16		/* batches in the ring */
+#define DB_TRANSACTION	(1 << 20)	/* records per transaction */
+
+#define DB_DIRS		0
+#define DB_FILES	1
+
+struct db_record {
+	__u8		table;
+	__u8		namelen;
+	ext2_ino_t	ino;
+	__u32		generation;
+	ext2_ino_t	parent;
+	__u32		size;
+	__u32		mtime;
+	__u32		ctime;
+	__u32		dtime;
+	char		name[EXT2_NAME_LEN];
+};
+
+struct db_batch {
+	int			nr;
+	struct db_record	rec[DB_BATCH];
+};
+
+static struct {
+	pthread_t	thread;
+	pthread_mutex_t	lock;
+	pthread_cond_t	filled;		/* signalled when head moves */
+	pthread_cond_t	written;	/* signalled when tail moves */
+	struct db_batch	*batches;
+	unsigned long	head;		/* batches filled */
+	unsigned long	tail;		/* batches written */
+	int		done;
+	const char	*name;
+	long		nr;		/* records inserted */
+} dbw = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.filled = PTHREAD_COND_INITIALIZER,
+	.written = PTHREAD_COND_INITIALIZER,
+};
 
 static void exec_one_sql_noreturn(sqlite3 *db, char *sqls)
 {
@@ -66,6 +110,25 @@ static void create_sql_table(sqlite3 *db, const char *table_name,
 	free(sqls);
 }
 
+static sqlite3_stmt *prepare_insert(sqlite3 *db, const char *table_name)
+{
+	sqlite3_stmt *stmt;
+	char *sqls;
+
+	if (asprintf(&sqls, "insert into %s values (?,?,?,?,?,?,?,?)",
+		     table_name) < 0) {
+		perror("asprintf failed");
+		exit(1);
+	}
+	if (sqlite3_prepare_v2(db, sqls, -1, &stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "SQL error: %s;\nrequest: %s",
+			sqlite3_errmsg(db), sqls);
+		exit(1);
+	}
+	free(sqls);
+	return stmt;
+}
+
 static void begin_one_transaction(sqlite3 *db)
 {
 	exec_one_sql_noreturn(db, "BEGIN;");
@@ -76,125 +139,167 @@ static void commit_one_transaction(sqlite3 *db)
 	exec_one_sql_noreturn(db, "COMMIT;");
 }
 
-static void batch_one_transaction(sqlite3 *db)
+static void insert_record(sqlite3 *db, sqlite3_stmt *stmt,
+			  struct db_record *rec)
 {
-	static long num = 0;
-
-	num ++;
-	if (num % count == 0) {
-		commit_one_transaction(db);
-		begin_one_transaction(db);
+	sqlite3_bind_int64(stmt, 1, rec->ino);
+	sqlite3_bind_int64(stmt, 2, rec->generation);
+	sqlite3_bind_int64(stmt, 3, rec->parent);
+	sqlite3_bind_text(stmt, 4, rec->name, rec->namelen, SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 5, rec->size);
+	sqlite3_bind_int64(stmt, 6, rec->mtime);
+	sqlite3_bind_int64(stmt, 7, rec->ctime);
+	sqlite3_bind_int64(stmt, 8, rec->dtime);
+	if (sqlite3_step(stmt) != SQLITE_DONE) {
+		fprintf(stderr, "SQL error: %s; inserting %u\n",
+			sqlite3_errmsg(db), rec->ino);
+		exit(1);
 	}
-	/* else do nothing */
+	sqlite3_reset(stmt);
 }
 
 #define COLUMNS "ino, generation, parent, name, size, mtime, ctime, dtime"
 
-static void create_full_db(const char *name, int fd)
+static void *create_full_db(void *arg)
 {
 	sqlite3 *db;
-	int rd;
-	int nr;
-	char sqls[512];
+	sqlite3_stmt *stmt[2];
+	struct db_batch *batch;
+	int i;
 
-	if (sqlite3_open(name, &db) != SQLITE_OK) {
-		fprintf(stderr, "failed to sqlite3_open: %s\n", name);
+	if (sqlite3_open(dbw.name, &db) != SQLITE_OK) {
+		fprintf(stderr, "failed to sqlite3_open: %s\n", dbw.name);
 		sqlite3_close(db);
 		exit(1);
 	}
+	/* the database is useless if e2scan does not complete anyway */
+	exec_one_sql_noreturn(db, "PRAGMA synchronous = OFF;");
+	exec_one_sql_noreturn(db, "PRAGMA journal_mode = MEMORY;");
 	create_sql_table(db, "dirs", COLUMNS);
 	create_sql_table(db, "files", COLUMNS);
+	stmt[DB_DIRS] = prepare_insert(db, "dirs");
+	stmt[DB_FILES] = prepare_insert(db, "files");
 
 	begin_one_transaction(db);
 
-	nr = 0;
 	while (1) {
-		rd = read(fd, sqls, 512);
-		if (rd == -1) {
-			perror("read failed\n");
-			exit(1);
-		}
-		if (rd != 512)
+		pthread_mutex_lock(&dbw.lock);
+		while (dbw.tail == dbw.head && !dbw.done)
+			pthread_cond_wait(&dbw.filled, &dbw.lock);
+		if (dbw.tail == dbw.head) {
+			pthread_mutex_unlock(&dbw.lock);
 			break;
-		nr ++;
-		exec_one_sql_noreturn(db, sqls);
-		batch_one_transaction(db);
+		}
+		batch = &dbw.batches[dbw.tail % DB_RING];
+		pthread_mutex_unlock(&dbw.lock);
+
+		for (i = 0; i < batch->nr; i++) {
+			insert_record(db, stmt[batch->rec[i].table],
+				      &batch->rec[i]);
+			if (++dbw.nr % DB_TRANSACTION == 0) {
+				commit_one_transaction(db);
+				begin_one_transaction(db);
+			}
+		}
+
+		pthread_mutex_lock(&dbw.lock);
+		dbw.tail++;
+		pthread_cond_signal(&dbw.written);
+		pthread_mutex_unlock(&dbw.lock);
 	}
 	commit_one_transaction(db);
-	printf("database is created, %d records are inserted\n", nr);
+	sqlite3_finalize(stmt[DB_DIRS]);
+	sqlite3_finalize(stmt[DB_FILES]);
 	sqlite3_close(db);
+	return NULL;
 }
 
-/* write sql command to pipe */
-#define PIPECMDLEN 512
-static void write_sql_command(int fd, const char *sqls)
+/* hand the current batch over to the writer, wait for a free one */
+static void push_batch(void)
 {
-	char buf[PIPECMDLEN];
+	pthread_mutex_lock(&dbw.lock);
+	dbw.head++;
+	pthread_cond_signal(&dbw.filled);
+	while (dbw.head - dbw.tail == DB_RING)
+		pthread_cond_wait(&dbw.written, &dbw.lock);
+	pthread_mutex_unlock(&dbw.lock);
+	dbw.batches[dbw.head % DB_RING].nr = 0;
+}
 
-	if (strlen(sqls) + 1 > PIPECMDLEN) {
-		fprintf(stderr, "too long command");
-		exit(1);
-	}
-	strcpy(buf, sqls);
-	if (write(fd, buf, PIPECMDLEN) != PIPECMDLEN) {
-		perror("failed to write to pipe");
-		exit(1);
-	}
+static void add_record(int table, ext2_ino_t ino, ext2_ino_t parent,
+		       const char *name, int namelen,
+		       struct ext2_inode *inode)
+{
+	struct db_batch *batch;
+	struct db_record *rec;
+
+	batch = &dbw.batches[dbw.head % DB_RING];
+	rec = &batch->rec[batch->nr];
+	rec->table = table;
+	rec->namelen = namelen;
+	rec->ino = ino;
+	rec->generation = inode->i_generation;
+	rec->parent = parent;
+	rec->size = inode->i_size;
+	rec->mtime = inode->i_mtime;
+	rec->ctime = inode->i_ctime;
+	rec->dtime = inode->i_dtime;
+	memcpy(rec->name, name, namelen);
 	scan_data.db.nr_commands ++;
+
+	if (++batch->nr == DB_BATCH)
+		push_batch();
 }
 
-pid_t fork_db_creation(const char *database)
+void start_db_creation(const char *database)
 {
-	int p[2];
 	struct stat st;
-	pid_t pid;
+	int rc;
 
 	if (stat(database, &st) == 0) {
 		fprintf(stderr, "%s exists. remove it first\n", database);
 		exit(1);
 	}
-	if (pipe(p) == -1) {
-		fprintf(stderr, "failed to pipe");
-		exit(1);
-	}
 
-	pid = fork();
-	if (pid == (pid_t)-1) {
-		fprintf(stderr, "failed to fork");
+	dbw.name = database;
+	dbw.batches = calloc(DB_RING, sizeof(*dbw.batches));
+	if (dbw.batches == NULL) {
+		fprintf(stderr, "malloc failed\n");
 		exit(1);
 	}
-	if (pid == (pid_t)0) {
-		/* child, read data written by parent and write to
-		 * database */
-		close(p[1]);
-		create_full_db(database, p[0]);
-		close(p[0]);
-		exit(0);
+	rc = pthread_create(&dbw.thread, NULL, create_full_db, NULL);
+	if (rc) {
+		fprintf(stderr, "failed to create database writer: %s\n",
+			strerror(rc));
+		exit(1);
 	}
-
-	/* parent, read inodes and write them to pipe */
-	close(p[0]);
-	scan_data.db.fd = p[1];
-	return pid;
 }
 
-void database_iscan_action(ext2_ino_t ino, struct ext2_inode *inode,
-			   int fd, char *buf)
+void finish_db_creation(void)
 {
-	char *sqls;
+	if (dbw.batches[dbw.head % DB_RING].nr != 0) {
+		pthread_mutex_lock(&dbw.lock);
+		dbw.head++;
+		pthread_mutex_unlock(&dbw.lock);
+	}
+	pthread_mutex_lock(&dbw.lock);
+	dbw.done = 1;
+	pthread_cond_signal(&dbw.filled);
+	pthread_mutex_unlock(&dbw.lock);
+	pthread_join(dbw.thread, NULL);
+	free(dbw.batches);
+	fprintf(stderr, "database is created, %ld records are inserted\n",
+		dbw.nr);
+}
 
+void database_iscan_action(ext2_filsys scanfs, ext2_ino_t ino,
+			   struct ext2_inode *inode, char *buf)
+{
 	if (LINUX_S_ISDIR(inode->i_mode)) {
-		if (ino == EXT2_ROOT_INO) {
-			sqls = sqlite3_mprintf("%s (%u,%u,%u,'%q',%u,%u,%u,%u)",
-					       "insert into dirs values",
-					       ino, inode->i_generation, ino, "/",
-					       inode->i_size, inode->i_mtime,
-					       inode->i_ctime, inode->i_dtime);
-			write_sql_command(fd, sqls);
-			sqlite3_free(sqls);
-		}
+		if (ino == EXT2_ROOT_INO)
+			add_record(DB_DIRS, ino, ino, "/", 1, inode);
 
-		if (ext2fs_block_iterate2(fs, ino, 0, buf,
+		if (ext2fs_block_iterate2(scanfs, ino, 0, buf,
 					  block_iterate_cb, &ino)) {
 			fprintf(stderr, "ext2fs_block_iterate2 failed\n");
 			exit(1);
@@ -207,13 +312,10 @@ void database_iscan_action(ext2_ino_t ino, struct ext2_inode *inode,
  * directory entry
  */
 int database_dblist_iterate_cb(ext2_ino_t dir, struct ext2_dir_entry *dirent,
-			       int namelen, int fd)
+			       int namelen)
 {
 	struct ext2_inode inode;
-	char *table;
-	char *sqls;
 	errcode_t retval;
-	char str[256];
 
 	if (!ext2fs_fast_test_inode_bitmap(fs->inode_map, dirent->inode))
 		/* entry of deleted file? can that ever happen */
@@ -225,39 +327,32 @@ int database_dblist_iterate_cb(ext2_ino_t dir, struct ext2_dir_entry *dirent,
 		exit(1);
 	}
 
-	if (LINUX_S_ISDIR(inode.i_mode))
-		table = "dirs";
-	else
-		table = "files";
-
-	sprintf(str, "%.*s", namelen, dirent->name);
-	sqls = sqlite3_mprintf("%s %s %s (%u,%u,%u,'%q',%u,%u,%u,%u)",
-			       "insert into", table, "values",
-			       dirent->inode, inode.i_generation, dir,
-			       str,
-			       inode.i_size, inode.i_mtime,
-			       inode.i_ctime, inode.i_dtime);
-	write_sql_command(fd, sqls);
-	sqlite3_free(sqls);
+	add_record(LINUX_S_ISDIR(inode.i_mode) ? DB_DIRS : DB_FILES,
+		   dirent->inode, dir, dirent->name, namelen, &inode);
 
 	return 0;
 }
 
 #else
 
-pid_t fork_db_creation(const char *database)
+void start_db_creation(const char *database)
 {
-	return 0;
+	return;
+}
+
+void finish_db_creation(void)
+{
+	return;
 }
 
-void database_iscan_action(ext2_ino_t ino, struct ext2_inode *inode,
-			   int fd, char *buf)
+void database_iscan_action(ext2_filsys scanfs, ext2_ino_t ino,
+			   struct ext2_inode *inode, char *buf)
 {
 	return;
 }
 
 int database_dblist_iterate_cb(ext2_ino_t dir, struct ext2_dir_entry *dirent,
-			       int namelen, int fd)
+			       int namelen)
 {
 	return 0;
 }
@@ -7,16 +7,24 @@
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <ext2fs/ext2fs.h>
 #include <string.h>
 #include <limits.h>
-#include <sys/wait.h>
 #include <sys/errno.h>
+#include <pthread.h>
+
+#include "e2scan.h"
 
 ext2_filsys fs;
 const char *database = "e2scan.db";
 int readahead_groups = 1; /* by default readahead one group inode table */
-FILE *outfile;
+int nr_threads = 1;
+int inode_buffer_blocks = 0;
+const char *state_file;
+int prune_dirs;
+int output_format = OUTPUT_LINES;
+int outfd = STDOUT_FILENO;
 
 void usage(char *prog)
 {
@@ -29,16 +37,28 @@ void usage(char *prog)
 #endif
 		"\t-l: list recently changed files\n"
 		"Options:\n"
+		"\t-0: terminate names with NUL instead of newline\n"
 		"\t-a groups: readahead 'groups' inode tables (default %d)\n"
 		"\t-b blocks: buffer 'blocks' inode table blocks\n"
+		"\t-B: output binary records with inode, parent, size, "
+							"times and path\n"
 		"\t-C chdir: list files relative to 'chdir' in filesystem\n"
 		"\t-d database: output database filename (default %s)\n"
 		"\t-D: list not only files, but directories as well\n"
+		"\t-F filter: only list files matching 'filter', like "
+							"'size>1G && ost=3'\n"
+		"\t-j threads: scan inode tables with 'threads' threads "
+							"(default %d)\n"
 		"\t-n filename: list files newer than 'filename'\n"
 		"\t-N date: list files newer than 'date' (default 1 day, "
 							 "0 for all files)\n"
-		"\t-o outfile: output file list to 'outfile'\n",
-		prog, readahead_groups, database);
+		"\t-o outfile: output file list to 'outfile'\n"
+		"\t-p: first read only directories on the way to "
+							"listed files\n"
+		"\t-s statefile: read only directories changed since the "
+							"run which\n"
+		"\t\twrote 'statefile', and list files newer than it\n",
+		prog, readahead_groups, database, nr_threads);
 	exit(1);
 }
 
@@ -51,7 +71,6 @@ struct {
 	int nr;
 	union {
 		struct {
-			int fd;
 			int nr_commands;
 		} db;
 		struct {
@@ -67,22 +86,38 @@ struct {
 	};
 } scan_data = { .mode = SM_FILELIST, };
 
-/* db.c */
-pid_t fork_db_creation(const char *database);
-void database_iscan_action(ext2_ino_t ino,
-			   struct ext2_inode *inode, int fd, char *buf);
-int database_dblist_iterate_cb(ext2_ino_t dir, struct ext2_dir_entry *dirent,
-			       int namelen, int fd);
-
-/* filelist.c */
-void filelist_iscan_action(ext2_ino_t ino,
-			   struct ext2_inode *inode, char *buf);
-int filelist_dblist_iterate_cb(ext2_ino_t dirino,
-			       struct ext2_dir_entry *dirent,
-			       int namelen);
-int create_root_dentries(char *root);
-void report_root(void);
-
+/*
+ * The inode tables are split into ranges of groups, each scanned by its
+ * own thread.  libext2fs is not thread safe, so every thread but the
+ * first opens the device again to get its own io channel and dblist.
+ * Nothing shared is changed until all of them are done: the inodes to
+ * drop from inode_map and the directories to create dentries for are
+ * kept per thread, and merged with the dblists before the directory
+ * blocks are read.
+ */
+struct scan_dir {
+	ext2_ino_t	ino;
+	int		flags;
+	__u32		generation;	/* for the state file */
+	__u32		mtime;
+	__u32		ctime;
+};
+
+struct scan_thread {
+	pthread_t	thread;
+	ext2_filsys	fs;
+	dgrp_t		group;		/* first group of the range */
+	dgrp_t		end;		/* group after the range */
+	int		nr;		/* inodes scanned */
+	ext2_ino_t	nr_files;
+	ext2_ino_t	nr_dirs;
+	unsigned char	*unmark;	/* bitmap of inodes to unmark */
+	struct scan_dir	*dirs;
+	ext2_ino_t	nr_dirents;
+	ext2_ino_t	max_dirents;
+	struct prune_hints *hints;	/* with -p */
+	struct output_attrs *attrs;	/* with -B */
+};
 
 static void get_timestamps(const char *filename)
 {
@@ -120,43 +155,51 @@ int block_iterate_cb(ext2_filsys fs, blk_t  *block_nr,
 	return ret;
 }
 
+/* readahead inode tables of ra_group and the following groups of a range */
+static void readahead_groups_itable(struct scan_thread *st, dgrp_t ra_group)
+{
+	int ra_size;
+
+	if (ra_group >= st->end)
+		return;
+
+	if (ra_group + readahead_groups > st->end)
+		ra_size = st->end - ra_group;
+	else
+		ra_size = readahead_groups;
+
+	ra_size *= st->fs->inode_blocks_per_group;
+	io_channel_readahead(st->fs->io,
+			     st->fs->group_desc[ra_group].bg_inode_table,
+			     ra_size);
+}
+
 /*
  * done_group callback for inode scan.
- * When i-th group of inodes is scanned over, readahead for i+2-th
- * group is issued. Inode table readahead for two first groups is
- * issued before scan begin.
+ * When i-th group of inodes of a thread's range is scanned over,
+ * readahead for i+2-th group is issued. Inode table readahead for two
+ * first groups is issued before scan begin. Each thread reads ahead
+ * only within its own range, on its own io channel.
  */
 errcode_t done_group_callback(ext2_filsys fs, ext2_inode_scan scan,
 			      dgrp_t group, void *vp)
 {
-	dgrp_t ra_group;
-	unsigned long ra_start;
-	int ra_size;
+	struct scan_thread *st = vp;
 
 	if (readahead_groups <= 0)
 		return 0;
 
-	if (((group + 1) % readahead_groups) != 0)
-		return 0;
-
-	ra_group = group + 1 + readahead_groups;
-	if (ra_group >= fs->group_desc_count)
+	if (((group + 1 - st->group) % readahead_groups) != 0)
 		return 0;
 
-	ra_start = fs->group_desc[ra_group].bg_inode_table;
-	if (ra_group + readahead_groups > fs->group_desc_count)
-		ra_size = fs->group_desc_count - ra_group;
-	else
-		ra_size = readahead_groups;
-
-	ra_size *= fs->inode_blocks_per_group;
-	io_channel_readahead(fs->io, ra_start, ra_size);
+	readahead_groups_itable(st, group + 1 + readahead_groups);
 	return 0;
 }
 
 #define DEFAULT_CHUNK_SIZE 16
 __u32 chunk_size; /* in blocks */
 int nr_chunks;
+static __u32 prev_chunk;
 
 struct chunk {
 	__u32 start;
@@ -190,12 +233,11 @@ static int count_chunks(ext2_filsys fs, struct ext2_db_entry *db_info,
 			void *priv_data)
 {
 	__u32 cur;
-	static __u32 prev = (__u32)-1;
 
 	cur = db_info->blk / chunk_size;
-	if (cur != prev) {
+	if (cur != prev_chunk) {
 		nr_chunks ++;
-		prev = cur;
+		prev_chunk = cur;
 	}
 	return 0;
 }
@@ -207,7 +249,15 @@ static void make_chunk_list(ext2_dblist dblist)
 	if (chunk_size == 0)
 		return;
 
+	nr_chunks = 0;
+	prev_chunk = (__u32)-1;
+	cur_chunk = NULL;
 	ext2fs_dblist_iterate(dblist, count_chunks, NULL);
+	if (nr_chunks == 0) {
+		/* every directory was skipped */
+		chunk_size = 0;
+		return;
+	}
 	chunks = malloc(sizeof(struct chunk) * nr_chunks);
 	if (chunks == NULL) {
 		fprintf(stderr, "malloc failed\n");
@@ -292,25 +342,219 @@ static int dblist_iterate_cb(ext2_ino_t dirino, int entry,
 	}
 
 	if (scan_data.mode == SM_DATABASE)
-		return database_dblist_iterate_cb(dirino, dirent, namelen,
-						  scan_data.db.fd);
+		return database_dblist_iterate_cb(dirino, dirent, namelen);
 
+	if (state_file) {
+		/* all directories are read to the end for the state */
+		state_add_entry(dirino, dirent->inode, dirent->name, namelen);
+		return filelist_dblist_iterate_cb(dirino, dirent, namelen) &
+			~DIRENT_ABORT;
+	}
 	return filelist_dblist_iterate_cb(dirino, dirent, namelen);
 }
 
+static void add_scan_dir(struct scan_thread *st, ext2_ino_t ino, int flags,
+			 struct ext2_inode *inode)
+{
+	struct scan_dir *dirs;
+
+	if (st->nr_dirents == st->max_dirents) {
+		st->max_dirents = st->max_dirents ? st->max_dirents * 2 : 1024;
+		dirs = realloc(st->dirs, st->max_dirents * sizeof(*dirs));
+		if (dirs == NULL) {
+			fprintf(stderr, "malloc failed\n");
+			exit(1);
+		}
+		st->dirs = dirs;
+	}
+	st->dirs[st->nr_dirents].ino = ino;
+	st->dirs[st->nr_dirents].flags = flags;
+	st->dirs[st->nr_dirents].generation = inode->i_generation;
+	st->dirs[st->nr_dirents].mtime = inode->i_mtime;
+	st->dirs[st->nr_dirents].ctime = inode->i_ctime;
+	st->nr_dirents ++;
+}
+
+/* scan inode tables of a range of groups */
+static void *scan_groups(void *arg)
+{
+	struct scan_thread *st = arg;
+	ext2_inode_scan scan;
+	struct ext2_inode *inode;
+	ext2_ino_t ino, first, last;
+	errcode_t retval;
+	char *block_buf;
+	int flags, inode_size;
+
+	first = st->group * fs->super->s_inodes_per_group + 1;
+	last = st->end * fs->super->s_inodes_per_group;
+
+	retval = ext2fs_open_inode_scan(st->fs, inode_buffer_blocks, &scan);
+	if (retval == 0 && st->group != 0)
+		retval = ext2fs_inode_scan_goto_blockgroup(scan, st->group);
+	if (retval) {
+		com_err("ext2fs_open_inode_scan", retval,
+			"opening inode scan of group %u\n", st->group);
+		exit(1);
+	}
+	ext2fs_set_inode_callback(scan, done_group_callback, st);
+
+	block_buf = (char *)malloc(st->fs->blocksize * 3);
+	if (block_buf == NULL) {
+		fprintf(stderr, "failed to allocate memory for block_buf\n");
+		exit(1);
+	}
+	memset(block_buf, 0, st->fs->blocksize * 3);
+
+	/* the whole inode, filters may look at the EAs in it */
+	inode_size = EXT2_INODE_SIZE(st->fs->super);
+	inode = malloc(inode_size);
+	if (inode == NULL) {
+		fprintf(stderr, "failed to allocate memory for inode\n");
+		exit(1);
+	}
+
+	if (readahead_groups > 0) {
+		readahead_groups_itable(st, st->group);
+		readahead_groups_itable(st, st->group + readahead_groups);
+	}
+	while (ext2fs_get_next_inode_full(scan, &ino, inode, inode_size) == 0) {
+		if (ino == 0 || ino > last)
+			break;
+
+		st->nr ++;
+		if (ext2fs_fast_test_inode_bitmap(fs->inode_map, ino) == 0)
+			/* deleted - always skip for now */
+			continue;
+		switch (scan_data.mode) {
+		case SM_DATABASE:
+			database_iscan_action(st->fs, ino, inode, block_buf);
+			break;
+
+		case SM_FILELIST:
+			flags = filelist_iscan_action(st->fs, ino, inode,
+						      block_buf);
+			if (flags & ISCAN_UNMARK)
+				ext2fs_fast_set_bit(ino - first, st->unmark);
+			if ((flags & ISCAN_FIND) && (flags & ISCAN_DIR))
+				st->nr_dirs ++;
+			else if (flags & ISCAN_FIND)
+				st->nr_files ++;
+			if (flags & ISCAN_DIR)
+				add_scan_dir(st, ino, flags, inode);
+			if (st->hints)
+				prune_iscan(st->hints, st->fs, ino, inode,
+					    block_buf, flags);
+			if (st->attrs && (flags & ISCAN_FIND))
+				output_iscan(st->attrs, ino, inode);
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	ext2fs_close_inode_scan(scan);
+	free(inode);
+	free(block_buf);
+	return NULL;
+}
+
+/* callback for ext2fs_dblist_iterate */
+static int merge_dblist(ext2_filsys scanfs, struct ext2_db_entry *db_info,
+			void *priv_data)
+{
+	if (ext2fs_add_dir_block(fs->dblist, db_info->ino, db_info->blk,
+				 db_info->blockcnt)) {
+		fprintf(stderr, "failed to add directory block\n");
+		exit(1);
+	}
+	return 0;
+}
+
+/* apply results of a scan thread once all of them are done */
+static void merge_scan_thread(struct scan_thread *st)
+{
+	ext2_ino_t i, first, count;
+	struct scan_dir *d;
+
+	scan_data.nr += st->nr;
+	if (scan_data.mode == SM_FILELIST) {
+		scan_data.fl.nr_files += st->nr_files;
+		scan_data.fl.nr_dirs += st->nr_dirs;
+
+		first = st->group * fs->super->s_inodes_per_group + 1;
+		count = (st->end - st->group) * fs->super->s_inodes_per_group;
+		for (i = 0; i < count; i++) {
+			if ((i & 7) == 0 && st->unmark[i >> 3] == 0) {
+				i += 7;
+				continue;
+			}
+			if (ext2fs_test_bit(i, st->unmark))
+				ext2fs_fast_unmark_inode_bitmap(fs->inode_map,
+								first + i);
+		}
+		for (i = 0; i < st->nr_dirents; i++) {
+			d = &st->dirs[i];
+			filelist_add_dir(d->ino,
+					 (d->flags & ISCAN_LISTED) ? 1 : 0);
+			if (state_file)
+				state_add_dir(d->ino, d->generation, d->mtime,
+					      d->ctime,
+					      (d->flags & ISCAN_SKIPPED) ? 1 : 0);
+		}
+		if (st->hints)
+			prune_merge(st->hints);
+		if (st->attrs)
+			output_merge(st->attrs);
+	}
+
+	if (st->fs != fs) {
+		ext2fs_dblist_iterate(st->fs->dblist, merge_dblist, NULL);
+		ext2fs_close(st->fs);
+	}
+	free(st->unmark);
+	free(st->dirs);
+}
+
+/*
+ * we have a list of directory leaf blocks, blocks are sorted, but can be
+ * not very sequential. If such blocks are close to each other, read
+ * throughput can be improved if blocks are read not sequentially, but
+ * all at once in a big chunk. Create list of those chunks, it will be
+ * then used to issue readahead
+ */
+static void read_dir_blocks(ext2_dblist dblist, char *block_buf)
+{
+	errcode_t retval;
+
+	make_chunk_list(dblist);
+
+	retval = ext2fs_dblist_dir_iterate(dblist,
+					   DIRENT_FLAG_INCLUDE_EMPTY,
+					   block_buf,
+					   dblist_iterate_cb, NULL);
+	if (retval) {
+		com_err("ext2fs_dblist_dir_iterate", retval,
+			"dir iterating dblist\n");
+		exit(1);
+	}
+	if (chunk_size)
+		free(chunks);
+}
+
 int main(int argc, char **argv)
 {
 	char *root = "/";
-	int inode_buffer_blocks = 0;
+	char *filter = NULL;
 	errcode_t retval;
 	char *block_buf;
-	ext2_inode_scan scan;
-	struct ext2_inode inode;
-	ext2_ino_t ino;
+	struct scan_thread *threads, *st;
 	dgrp_t nr;
-	time_t t;
-	int c;
-	pid_t pid;
+	time_t t, scan_start;
+	int c, i, timestamps_given = 0;
+	ext2_ino_t nr_skipped = 0, nr_pending;
+	ext2_dblist rest = NULL;
 
 	/*
 	 * by default find for files which are modified less than one
@@ -318,7 +562,6 @@ int main(int argc, char **argv)
 	 */
 	scan_data.fl.mtimestamp = time(NULL) - 60 * 60 * 24;
 	scan_data.fl.ctimestamp = scan_data.fl.mtimestamp;
-	outfile = stdout;
 
 	opterr = 0;
 #if defined(HAVE_SQLITE3) && defined(HAVE_SQLITE3_H)
@@ -326,10 +569,13 @@ int main(int argc, char **argv)
 #else
 #define OPTF ""
 #endif
-	while ((c = getopt(argc, argv, "a:b:C:d:D"OPTF"hln:N:o:")) != EOF) {
+	while ((c = getopt(argc, argv, "0a:b:BC:d:D"OPTF"F:hj:ln:N:o:ps:")) != EOF) {
 		char *end;
 
 		switch (c) {
+		case '0':
+			output_format = OUTPUT_NUL;
+			break;
 		case 'a':
 			if (optarg == NULL)
 				usage(argv[0]);
@@ -348,6 +594,9 @@ int main(int argc, char **argv)
 				usage(argv[0]);
 			}
 			break;
+		case 'B':
+			output_format = OUTPUT_RECORDS;
+			break;
 		case 'C':
 			root = optarg;
 			break;
@@ -357,6 +606,9 @@ int main(int argc, char **argv)
 		case 'D':
 			scan_data.fl.with_dirs = 1;
 			break;
+		case 'F':
+			filter = optarg;
+			break;
 		case 'f':
 #if !defined(HAVE_SQLITE3) || !defined(HAVE_SQLITE3_H)
 			fprintf(stderr,
@@ -366,11 +618,20 @@ int main(int argc, char **argv)
 #endif
 			scan_data.mode = SM_DATABASE;
 			break;
+		case 'j':
+			nr_threads = strtoul(optarg, &end, 0);
+			if (*end || nr_threads < 1) {
+				fprintf(stderr, "%s: bad -j argument '%s'\n",
+					argv[0], optarg);
+				usage(argv[0]);
+			}
+			break;
 		case 'l':
 			scan_data.mode = SM_FILELIST;
 			break;
 		case 'n':
 			get_timestamps(optarg);
+			timestamps_given = 1;
 			break;
 		case 'N': {
 			const char *fmts[] = {"%c", /*date/time current locale*/
@@ -409,16 +670,24 @@ int main(int argc, char **argv)
 			}
 			scan_data.fl.mtimestamp = mktime(tm);
 			scan_data.fl.ctimestamp = scan_data.fl.mtimestamp;
+			timestamps_given = 1;
 			break;
 			}
 		case 'o':
-			outfile = fopen(optarg, "w");
-			if (outfile == NULL) {
+			outfd = open(optarg, O_WRONLY | O_CREAT | O_TRUNC,
+				     0666);
+			if (outfd < 0) {
 				fprintf(stderr, "%s: can't open '%s': %s\n",
 					argv[0], optarg, strerror(errno));
 				usage(argv[0]);
 			}
 			break;
+		case 'p':
+			prune_dirs = 1;
+			break;
+		case 's':
+			state_file = optarg;
+			break;
 		default:
 			fprintf(stderr, "%s: unknown option '-%c'\n",
 				argv[0], optopt);
@@ -430,13 +699,31 @@ int main(int argc, char **argv)
 	if (scan_data.mode == SM_NONE || argv[optind] == NULL)
 		usage(argv[0]);
 
+	if (state_file && scan_data.mode != SM_FILELIST) {
+		fprintf(stderr, "%s: -s is only supported with -l\n", argv[0]);
+		usage(argv[0]);
+	}
+	if (output_format != OUTPUT_LINES && scan_data.mode != SM_FILELIST) {
+		fprintf(stderr, "%s: -0 and -B are only supported with -l\n",
+			argv[0]);
+		usage(argv[0]);
+	}
+	if (prune_dirs && (scan_data.mode != SM_FILELIST || state_file)) {
+		fprintf(stderr, "%s: -p is only supported with -l, "
+			"and not with -s\n", argv[0]);
+		usage(argv[0]);
+	}
+	if (filter) {
+		if (scan_data.mode != SM_FILELIST) {
+			fprintf(stderr, "%s: -F is only supported with -l\n",
+				argv[0]);
+			usage(argv[0]);
+		}
+		filter_compile(filter);
+	}
 
-	fprintf(stderr, "generating list of files with\n"
-		"\tmtime newer than %s"
-		"\tctime newer than %s",
-		ctime(&scan_data.fl.mtimestamp),
-		ctime(&scan_data.fl.ctimestamp));
-
+	/* anything changed from now on is newer than the next state */
+	scan_start = time(NULL);
 	retval = ext2fs_open(argv[optind], EXT2_FLAG_SOFTSUPP_FEATURES,
 			     0, 0, unix_io_manager, &fs);
 	if (retval != 0) {
@@ -444,6 +731,17 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
+	if (state_file && state_load(state_file, &t) && !timestamps_given) {
+		scan_data.fl.mtimestamp = t;
+		scan_data.fl.ctimestamp = t;
+	}
+
+	fprintf(stderr, "generating list of files with\n"
+		"\tmtime newer than %s"
+		"\tctime newer than %s",
+		ctime(&scan_data.fl.mtimestamp),
+		ctime(&scan_data.fl.ctimestamp));
+
 	t = time(NULL);
 
 	for (nr = 0; nr < fs->group_desc_count; nr ++)
@@ -461,15 +759,6 @@ int main(int argc, char **argv)
 	if (inode_buffer_blocks == 0)
 		inode_buffer_blocks = fs->inode_blocks_per_group;
 
-	retval = ext2fs_open_inode_scan(fs, inode_buffer_blocks, &scan);
-	if (retval) {
-		com_err("ext2fs_open_inode_scan", retval,
-			"opening inode scan on %s\n", argv[optind]);
-		fprintf(stderr, "failed to open inode scan\n");
-		exit(1);
-	}
-	ext2fs_set_inode_callback(scan, done_group_callback, NULL);
-
 	retval = ext2fs_init_dblist(fs, NULL);
 	if (retval) {
 		com_err("ext2fs_init_dblist", retval,
@@ -487,10 +776,11 @@ int main(int argc, char **argv)
 
 	switch (scan_data.mode) {
 	case SM_DATABASE:
-		pid = fork_db_creation(database);
+		start_db_creation(database);
 		break;
 
 	case SM_FILELIST:
+		output_open(outfd, output_format);
 		c = create_root_dentries(root);
 		if (c == ENOENT && strncmp(root, "/ROOT", 5) != 0) {
 			/* Try again with prepending "/ROOT" */
@@ -523,34 +813,73 @@ int main(int argc, char **argv)
 		break;
 	}
 
+	if (nr_threads > fs->group_desc_count)
+		nr_threads = fs->group_desc_count;
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (threads == NULL) {
+		fprintf(stderr, "%s: failed to allocate memory for threads\n",
+			argv[0]);
+		exit(1);
+	}
+	for (i = 0; i < nr_threads; i++) {
+		st = &threads[i];
+		st->group = (__u64)fs->group_desc_count * i / nr_threads;
+		st->end = (__u64)fs->group_desc_count * (i + 1) / nr_threads;
+		if (i == 0) {
+			st->fs = fs;
+		} else {
+			retval = ext2fs_open(argv[optind],
+					     EXT2_FLAG_SOFTSUPP_FEATURES, 0, 0,
+					     unix_io_manager, &st->fs);
+			if (retval == 0)
+				retval = ext2fs_init_dblist(st->fs, NULL);
+			if (retval) {
+				com_err("ext2fs_open", retval,
+					"opening %s for thread %d\n",
+					argv[optind], i);
+				exit(1);
+			}
+		}
+		if (scan_data.mode == SM_FILELIST) {
+			st->unmark = calloc((st->end - st->group) *
+					    fs->super->s_inodes_per_group / 8 + 1,
+					    1);
+			if (st->unmark == NULL) {
+				fprintf(stderr, "%s: failed to allocate memory "
+					"for thread %d\n", argv[0], i);
+				exit(1);
+			}
+		}
+		if (prune_dirs)
+			st->hints = prune_thread_init();
+		if (output_format == OUTPUT_RECORDS)
+			st->attrs = output_thread_init();
+	}
+
 	t = time(NULL);
 	fprintf(stderr, "scanning inode tables .. ");
 	scan_data.nr = 0;
 
-	done_group_callback(fs, scan, -readahead_groups * 2, NULL);
-	done_group_callback(fs, scan, -readahead_groups, NULL);
-	while (ext2fs_get_next_inode(scan, &ino, &inode) == 0) {
-		if (ino == 0)
-			break;
-
-		scan_data.nr ++;
-		if (ext2fs_fast_test_inode_bitmap(fs->inode_map, ino) == 0)
-			/* deleted - always skip for now */
-			continue;
-		switch (scan_data.mode) {
-		case SM_DATABASE:
-			database_iscan_action(ino, &inode, scan_data.db.fd,
-					      block_buf);
-			break;
-
-		case SM_FILELIST:
-			filelist_iscan_action(ino, &inode, block_buf);
-			break;
-
-		default:
-			break;
+	if (nr_threads == 1) {
+		scan_groups(&threads[0]);
+	} else {
+		for (i = 0; i < nr_threads; i++) {
+			c = pthread_create(&threads[i].thread, NULL,
+					   scan_groups, &threads[i]);
+			if (c) {
+				fprintf(stderr, "%s: failed to create thread: "
+					"%s\n", argv[0], strerror(c));
+				exit(1);
+			}
 		}
+		for (i = 0; i < nr_threads; i++)
+			pthread_join(threads[i].thread, NULL);
 	}
+	for (i = 0; i < nr_threads; i++)
+		merge_scan_thread(&threads[i]);
+	free(threads);
+	if (state_file)
+		nr_skipped = state_schedule_dirs(block_buf);
 
 	switch (scan_data.mode) {
 	case SM_DATABASE:
@@ -564,12 +893,18 @@ int main(int argc, char **argv)
 			"%d dirs to find\n",
 			scan_data.nr, time(NULL) - t, scan_data.fl.nr_files,
 			scan_data.fl.nr_dirs);
-		if (scan_data.fl.nr_files == 0 && scan_data.fl.nr_dirs == 0) {
-			ext2fs_close_inode_scan(scan);
+		if (state_file)
+			fprintf(stderr, "\t%u directories unchanged, "
+				"not read\n", nr_skipped);
+		if (scan_data.fl.nr_files == 0 && scan_data.fl.nr_dirs == 0 &&
+		    state_file == NULL) {
+			output_flush();
 			ext2fs_close(fs);
 			free(block_buf);
 			return 0;
 		}
+		if (prune_dirs)
+			rest = prune_schedule(fs);
 		break;
 
 	default:
@@ -582,57 +917,55 @@ int main(int argc, char **argv)
 
 	/* root directory does not have name, handle it separately */
 	report_root();
-	/*
-	 * we have a list of directory leaf blocks, blocks are sorted,
-	 * but can be not very sequential. If such blocks are close to
-	 * each other, read throughput can be improved if blocks are
-	 * read not sequentially, but all at once in a big
-	 * chunk. Create list of those chunks, it will be then used to
-	 * issue readahead
-	 */
-	make_chunk_list(fs->dblist);
+	if (state_file)
+		state_replay();
 
 	scan_data.nr = 0;
-	retval = ext2fs_dblist_dir_iterate(fs->dblist,
-					   DIRENT_FLAG_INCLUDE_EMPTY,
-					   block_buf,
-					   dblist_iterate_cb, NULL);
-	if (retval) {
-		com_err("ext2fs_dblist_dir_iterate", retval,
-			"dir iterating dblist\n");
-		exit(1);
+	read_dir_blocks(fs->dblist, block_buf);
+	if (rest != NULL) {
+		/* a hint was stale or missing, read the other directories */
+		nr_pending = prune_pending(fs);
+		if (nr_pending) {
+			fprintf(stderr, "done\n\t%u names not found, "
+				"scanning other directory blocks (%u).. ",
+				nr_pending, ext2fs_dblist_count(rest));
+			read_dir_blocks(rest, block_buf);
+		}
+		ext2fs_free_dblist(rest);
+	}
+	if (state_file) {
+		/* the state did not know all directories of a listed file */
+		nr_pending = state_pending(block_buf);
+		if (nr_pending) {
+			fprintf(stderr, "done\n\t%u names not found, "
+				"scanning unchanged directory blocks (%u).. ",
+				nr_pending, ext2fs_dblist_count(fs->dblist));
+			read_dir_blocks(fs->dblist, block_buf);
+		}
 	}
-	if (chunk_size)
-		free(chunks);
 
 	switch (scan_data.mode) {
 	case SM_DATABASE:
-	{
-		int status;
-
 		fprintf(stderr,
 			"done\n\t%d blocks, %ld seconds, "
 			"%d records sent to database\n",
 			scan_data.nr, time(NULL) - t, scan_data.db.nr_commands);
-		close(scan_data.db.fd);
-		waitpid(pid, &status, 0);
-		if (WIFEXITED(status))
-			fprintf(stderr, "database creation exited with %d\n",
-				WEXITSTATUS(status));
+		finish_db_creation();
 		break;
-	}
 
 	case SM_FILELIST:
+		output_flush();
 		fprintf(stderr,
 			"done\n\t%d blocks, %ld seconds, %d files reported\n",
 			scan_data.nr, time(NULL) - t, scan_data.fl.nr_reported);
+		if (state_file && state_save(state_file, scan_start))
+			exit(1);
 		break;
 
 	default:
 		break;
 	}
 
-	ext2fs_close_inode_scan(scan);
 	ext2fs_close(fs);
 	free(block_buf);
 
@@ -0,0 +1,94 @@
+#ifndef E2SCAN_H
+#define E2SCAN_H
+
+#include <ext2fs/ext2fs.h>
+
+/* e2scan.c */
+int block_iterate_cb(ext2_filsys fs, blk_t  *block_nr,
+		     e2_blkcnt_t blockcnt,
+		     blk_t ref_block EXT2FS_ATTR((unused)),
+		     int ref_offset EXT2FS_ATTR((unused)),
+		     void *priv_data);
+
+/* db.c */
+void start_db_creation(const char *database);
+void finish_db_creation(void);
+void database_iscan_action(ext2_filsys scanfs, ext2_ino_t ino,
+			   struct ext2_inode *inode, char *buf);
+int database_dblist_iterate_cb(ext2_ino_t dir, struct ext2_dir_entry *dirent,
+			       int namelen);
+
+/*
+ * filelist.c
+ *
+ * The inode scan may run on several threads, so filelist_iscan_action()
+ * only reports what is to be done with an inode.  The results are
+ * applied by the main thread once every thread is done.
+ */
+#define ISCAN_UNMARK	0x01	/* not interesting, clear in inode_map */
+#define ISCAN_DIR	0x02	/* directory, needs a dentry */
+#define ISCAN_LISTED	0x04	/* changed since the timestamps */
+#define ISCAN_FIND	0x08	/* name is to be found and reported */
+#define ISCAN_SKIPPED	0x10	/* directory unchanged, blocks not read */
+
+int filelist_iscan_action(ext2_filsys scanfs, ext2_ino_t ino,
+			  struct ext2_inode *inode, char *buf);
+void filelist_add_dir(ext2_ino_t ino, int listed);
+int filelist_dirent(ext2_ino_t dirino, ext2_ino_t ino, const char *name,
+		    int namelen, int is_dirname);
+int filelist_dblist_iterate_cb(ext2_ino_t dirino,
+			       struct ext2_dir_entry *dirent,
+			       int namelen);
+char *name_arena_copy(const char *name, int namelen);
+int filelist_dir_connected(ext2_ino_t ino);
+int create_root_dentries(char *root);
+void report_root(void);
+
+/* ea.c */
+void *inode_ea_get(ext2_filsys scanfs, struct ext2_inode *inode, char *buf,
+		   int index, const char *name, __u32 *size);
+
+/* filter.c */
+void filter_compile(const char *expr);
+int filter_match(ext2_filsys scanfs, struct ext2_inode *inode, char *buf);
+
+/* output.c */
+#define OUTPUT_LINES	0	/* one name per line */
+#define OUTPUT_NUL	1	/* names terminated by NUL, -0 */
+#define OUTPUT_RECORDS	2	/* binary records, -B */
+
+struct output_attrs;
+
+void output_open(int fd, int format);
+void output_flush(void);
+void output_name(ext2_ino_t parent, ext2_ino_t ino, const char *dir,
+		 int dirlen, const char *name, int namelen);
+struct output_attrs *output_thread_init(void);
+void output_iscan(struct output_attrs *attrs, ext2_ino_t ino,
+		  struct ext2_inode *inode);
+void output_merge(struct output_attrs *attrs);
+
+/* prune.c */
+struct prune_hints;
+
+struct prune_hints *prune_thread_init(void);
+void prune_iscan(struct prune_hints *hints, ext2_filsys scanfs,
+		 ext2_ino_t ino, struct ext2_inode *inode, char *buf,
+		 int flags);
+void prune_merge(struct prune_hints *hints);
+ext2_dblist prune_schedule(ext2_filsys fs);
+ext2_ino_t prune_pending(ext2_filsys fs);
+
+/* state.c */
+int state_load(const char *name, time_t *time);
+int state_dir_unchanged(ext2_ino_t ino, struct ext2_inode *inode);
+void state_add_dir(ext2_ino_t ino, __u32 generation, __u32 mtime,
+		   __u32 ctime, int skipped);
+ext2_ino_t state_schedule_dirs(char *block_buf);
+ext2_ino_t state_pending(char *block_buf);
+void state_replay(void);
+void state_add_entry(ext2_ino_t dirino, ext2_ino_t ino, const char *name,
+		     int namelen);
+int state_save(const char *name, time_t time);
+
+#endif /* E2SCAN_H */
@@ -0,0 +1,75 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <string.h>
+#include <ext2fs/ext2fs.h>
+#include <ext2fs/ext2_ext_attr.h>
+
+#include "e2scan.h"
+
+/*
+ * Find the value of an EA among the entries from entry to end.  The
+ * entries come straight from disk, so an entry whose name or value runs
+ * past end ends the search.
+ */
+static void *find_ea(struct ext2_ext_attr_entry *entry, char *end,
+		     char *values, int index, const char *name, __u32 *size)
+{
+	size_t room = end - values;
+	int len = strlen(name);
+
+	while ((char *)entry + sizeof(*entry) <= end &&
+	       !EXT2_EXT_IS_LAST_ENTRY(entry)) {
+		if ((char *)entry + sizeof(*entry) + entry->e_name_len > end)
+			break;
+		if (entry->e_name_index == index && entry->e_name_len == len &&
+		    !memcmp(EXT2_EXT_ATTR_NAME(entry), name, len)) {
+			if (entry->e_value_inum != 0 ||
+			    entry->e_value_offs > room ||
+			    entry->e_value_size > room - entry->e_value_offs)
+				break;
+			*size = entry->e_value_size;
+			return values + entry->e_value_offs;
+		}
+		entry = EXT2_EXT_ATTR_NEXT(entry);
+	}
+	return NULL;
+}
+
+/*
+ * Look up an EA of an inode returned by the inode scan, first in the
+ * inode body, then in the EA block, which is read into buf.  Called from
+ * the inode scan threads, each with its own scanfs and buf.
+ */
+void *inode_ea_get(ext2_filsys scanfs, struct ext2_inode *inode, char *buf,
+		   int index, const char *name, __u32 *size)
+{
+	struct ext2_inode_large *large = (struct ext2_inode_large *)inode;
+	struct ext2_ext_attr_header *header;
+	int inode_size = EXT2_INODE_SIZE(scanfs->super);
+	__u32 *magic;
+	void *value;
+
+	if (inode_size > EXT2_GOOD_OLD_INODE_SIZE &&
+	    EXT2_GOOD_OLD_INODE_SIZE + large->i_extra_isize + sizeof(__u32) <=
+	    inode_size) {
+		magic = IHDR(large);
+		if (*magic == EXT2_EXT_ATTR_MAGIC) {
+			value = find_ea(ENTRY(magic + 1),
+					(char *)inode + inode_size,
+					(char *)(magic + 1), index, name, size);
+			if (value != NULL)
+				return value;
+		}
+	}
+	if (inode->i_file_acl == 0 ||
+	    ext2fs_read_ext_attr(scanfs, inode->i_file_acl, buf))
+		return NULL;
+	header = BHDR(buf);
+	if (header->h_magic != EXT2_EXT_ATTR_MAGIC &&
+	    header->h_magic != EXT2_EXT_ATTR_MAGIC_v1)
+		return NULL;
+	return find_ea(ENTRY(header + 1), buf + scanfs->blocksize, buf,
+		       index, name, size);
+}
@@ -7,18 +7,17 @@
 #include <time.h>
 #include <unistd.h>
 #include <sys/errno.h>
-#include <search.h>
 #include <ext2fs/ext2fs.h>
 
+#include "e2scan.h"
+
 /* e2scan.c */
 extern ext2_filsys fs;
-extern FILE *outfile;
 extern struct {
 	int mode;
 	int nr;
 	union {
 		struct {
-			int fd;
 			int nr_commands;
 		} db;
 		struct {
@@ -36,13 +35,6 @@ extern struct {
 
 ext2_ino_t visible_root_ino;
 
-int block_iterate_cb(ext2_filsys fs, blk_t  *block_nr,
-		     e2_blkcnt_t blockcnt,
-		     blk_t ref_block EXT2FS_ATTR((unused)),
-		     int ref_offset EXT2FS_ATTR((unused)),
-		     void *priv_data);
-
-
 /*
 create root dentry
     root->connected_to_root = 1
@@ -77,12 +69,25 @@ for each directory block:
                 attach filename to directory
 */
 
+/*
+ * Dentries are kept in chunks of DENTRY_CHUNK entries which are never
+ * moved, so pointers to them stay valid while the table grows.  Links
+ * between dentries are 32-bit indices into the chunks, index 0 standing
+ * for none.  Dentries are found by inode number through an open
+ * addressing hash of indices with linear probing.  Names are copied
+ * into a name arena and are never freed individually.
+ */
+#define DENTRY_CHUNK_BITS	16
+#define DENTRY_CHUNK		(1U << DENTRY_CHUNK_BITS)
+#define NAME_ARENA_CHUNK	(1024 * 1024)
+
 struct e2scan_dentry {
-	ext2_ino_t ino;
-	struct e2scan_dentry *d_parent;
 	char *name;
-	struct e2scan_dentry *d_child; /* pointer to first of subdirs */
-	struct e2scan_dentry *d_next; /* pointer to next directory */
+	ext2_ino_t ino;
+	__u32 d_index;	/* index of this dentry */
+	__u32 d_parent;	/* index of parent directory */
+	__u32 d_child;	/* index of first of subdirs */
+	__u32 d_next;	/* index of next directory */
 	unsigned connected_to_root:1;
 	unsigned is_file:1;
 	unsigned is_dir:1;
@@ -90,55 +95,217 @@ struct e2scan_dentry {
 	unsigned is_printed:1;
 };
 
-static void *dentry_tree = NULL;
+static struct e2scan_dentry **dentry_chunks;
+static __u32 nr_dentry_chunks;
+static __u32 next_dentry = 1;	/* first never used index */
+static __u32 free_dentries;	/* list of released dentries, by d_next */
+
+static __u32 *dentry_hash;
+static unsigned int dentry_hash_bits;
+static __u32 dentry_hash_count;
 
-static int compare_ino(const void *a, const void *b)
+static char *name_arena;
+static size_t name_arena_left;
+
+/*
+ * Path of the directory names were last reported in, "./a/b", as names
+ * are mostly found one directory after another.  Directories are never
+ * released, and do not move once connected to the root.
+ */
+static __u32 path_dir;
+static char *path_buf;
+static int path_len, path_max;
+
+static void *xmalloc(size_t size)
 {
-	const struct e2scan_dentry *d1;
-	const struct e2scan_dentry *d2;
-
-	d1 = a;
-	d2 = b;
-	if (d1->ino > d2->ino)
-		return 1;
-	if (d1->ino < d2->ino)
-		return -1;
-	return 0;
+	void *p;
+
+	p = malloc(size);
+	if (p == NULL) {
+		fprintf(stderr, "malloc failed");
+		exit(1);
+	}
+	return p;
 }
 
-static struct e2scan_dentry *find_dentry(ext2_ino_t ino)
+static inline struct e2scan_dentry *dentry_at(__u32 index)
+{
+	if (index == 0)
+		return NULL;
+	return &dentry_chunks[index >> DENTRY_CHUNK_BITS]
+		[index & (DENTRY_CHUNK - 1)];
+}
+
+static struct e2scan_dentry *alloc_dentry(ext2_ino_t ino)
 {
-	struct e2scan_dentry tmp, **pdentry;
+	struct e2scan_dentry *dentry;
+	__u32 index;
 
-	tmp.ino = ino;
-	pdentry = tfind(&tmp, &dentry_tree, compare_ino);
-	return (pdentry == NULL) ? NULL : *pdentry;
+	if (free_dentries) {
+		index = free_dentries;
+		free_dentries = dentry_at(index)->d_next;
+	} else {
+		index = next_dentry;
+		if ((index >> DENTRY_CHUNK_BITS) == nr_dentry_chunks) {
+			if (nr_dentry_chunks == (~0U >> DENTRY_CHUNK_BITS)) {
+				fprintf(stderr, "too many dentries\n");
+				exit(1);
+			}
+			dentry_chunks = realloc(dentry_chunks,
+						(nr_dentry_chunks + 1) *
+						sizeof(*dentry_chunks));
+			if (dentry_chunks == NULL) {
+				fprintf(stderr, "malloc failed");
+				exit(1);
+			}
+			dentry_chunks[nr_dentry_chunks++] =
+				xmalloc(DENTRY_CHUNK * sizeof(**dentry_chunks));
+		}
+		next_dentry++;
+	}
+	dentry = dentry_at(index);
+	memset(dentry, 0, sizeof(*dentry));
+	dentry->ino = ino;
+	dentry->d_index = index;
+	return dentry;
 }
 
-static struct e2scan_dentry *find_or_create_dentry(ext2_ino_t ino, int *created)
+static inline __u32 dentry_hash_slot(ext2_ino_t ino)
+{
+	return ((__u32)ino * 2654435761U) >> (32 - dentry_hash_bits);
+}
+
+static void dentry_hash_insert(struct e2scan_dentry *dentry)
+{
+	__u32 mask = (1U << dentry_hash_bits) - 1;
+	__u32 slot;
+
+	slot = dentry_hash_slot(dentry->ino);
+	while (dentry_hash[slot])
+		slot = (slot + 1) & mask;
+	dentry_hash[slot] = dentry->d_index;
+	dentry_hash_count++;
+}
+
+/* keep the hash at most three quarters full */
+static void dentry_hash_grow(void)
 {
-	struct e2scan_dentry **dentry, *new;
+	__u32 *old = dentry_hash;
+	__u32 i, old_size;
+
+	if (dentry_hash &&
+	    (dentry_hash_count + 1) * 4 <= (3U << dentry_hash_bits))
+		return;
 
-	new = calloc(1, sizeof(struct e2scan_dentry));
-	if (new == NULL) {
+	old_size = old ? 1U << dentry_hash_bits : 0;
+	dentry_hash_bits = old ? dentry_hash_bits + 1 : 16;
+	if (dentry_hash_bits > 31) {
+		fprintf(stderr, "too many dentries\n");
+		exit(1);
+	}
+	dentry_hash = calloc(1U << dentry_hash_bits, sizeof(*dentry_hash));
+	if (dentry_hash == NULL) {
 		fprintf(stderr, "malloc failed");
 		exit(1);
 	}
-	new->ino = ino;
+	dentry_hash_count = 0;
+	for (i = 0; i < old_size; i++)
+		if (old[i])
+			dentry_hash_insert(dentry_at(old[i]));
+	free(old);
+}
 
-	dentry = tsearch(new, &dentry_tree, compare_ino);
-	if (dentry == NULL) {
-		fprintf(stderr, "tsearch failed");
-		exit(1);
+static __u32 dentry_hash_find(ext2_ino_t ino)
+{
+	__u32 mask = (1U << dentry_hash_bits) - 1;
+	__u32 slot;
+
+	if (dentry_hash == NULL)
+		return ~0U;
+	slot = dentry_hash_slot(ino);
+	while (dentry_hash[slot]) {
+		if (dentry_at(dentry_hash[slot])->ino == ino)
+			return slot;
+		slot = (slot + 1) & mask;
 	}
-	if (*dentry != new) {
+	return ~0U;
+}
+
+static struct e2scan_dentry *find_dentry(ext2_ino_t ino)
+{
+	__u32 slot;
+
+	slot = dentry_hash_find(ino);
+	return (slot == ~0U) ? NULL : dentry_at(dentry_hash[slot]);
+}
+
+static struct e2scan_dentry *find_or_create_dentry(ext2_ino_t ino, int *created)
+{
+	struct e2scan_dentry *dentry;
+
+	dentry = find_dentry(ino);
+	if (dentry != NULL) {
 		*created = 0;
-		free(new);
-	} else {
-		*created = 1;
+		return dentry;
 	}
+	dentry_hash_grow();
+	dentry = alloc_dentry(ino);
+	dentry_hash_insert(dentry);
+	*created = 1;
+
+	return dentry;
+}
+
+/*
+ * Remove the dentry from the hash, moving back the entries of the probe
+ * sequence following it so that no tombstones are needed, and put it on
+ * the free list.  Its name stays in the arena.
+ */
+static void release_dentry(struct e2scan_dentry *dentry)
+{
+	__u32 mask = (1U << dentry_hash_bits) - 1;
+	__u32 hole, slot, home;
+
+	hole = dentry_hash_find(dentry->ino);
+	assert(hole != ~0U);
+	dentry_hash[hole] = 0;
+	dentry_hash_count--;
+
+	slot = hole;
+	while (1) {
+		slot = (slot + 1) & mask;
+		if (dentry_hash[slot] == 0)
+			break;
+		home = dentry_hash_slot(dentry_at(dentry_hash[slot])->ino);
+		/* move the entry if the hole lies between home and slot */
+		if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+			dentry_hash[hole] = dentry_hash[slot];
+			dentry_hash[slot] = 0;
+			hole = slot;
+		}
+	}
+
+	dentry->name = NULL;
+	dentry->d_next = free_dentries;
+	free_dentries = dentry->d_index;
+}
+
+char *name_arena_copy(const char *name, int namelen)
+{
+	char *p;
 
-	return *dentry;
+	if (name_arena_left < (size_t)namelen + 1) {
+		name_arena_left = NAME_ARENA_CHUNK;
+		if (name_arena_left < (size_t)namelen + 1)
+			name_arena_left = namelen + 1;
+		name_arena = xmalloc(name_arena_left);
+	}
+	p = name_arena;
+	memcpy(p, name, namelen);
+	p[namelen] = '\0';
+	name_arena += namelen + 1;
+	name_arena_left -= namelen + 1;
+	return p;
 }
 
 static int is_file_interesting(ext2_ino_t ino)
@@ -150,8 +317,8 @@ static void link_to_parent(struct e2scan_dentry *parent,
 			   struct e2scan_dentry *child)
 {
 	child->d_next = parent->d_child;
-	parent->d_child = child;
-	child->d_parent = parent;
+	parent->d_child = child->d_index;
+	child->d_parent = parent->d_index;
 }
 
 static void dentry_attach_name(struct e2scan_dentry *dentry, int namelen,
@@ -164,7 +331,7 @@ static void dentry_attach_name(struct e2scan_dentry *dentry, int namelen,
 			dentry->name, namelen, name);
 		exit(1);
 	}
-	asprintf(&dentry->name, "%.*s", namelen, name);
+	dentry->name = name_arena_copy(name, namelen);
 }
 
 /*
@@ -219,81 +386,79 @@ int create_root_dentries(char *root)
 	return 0;
 }
 
-static inline void output_dot(void)
-{
-	fprintf(outfile, ".");
-}
-
-static inline void output_dot_newline(void)
-{
-	fprintf(outfile, ".\n");
-}
-
-static inline void output_dir_name(const char *dirname)
-{
-	fprintf(outfile, "/%s", dirname);
-}
-
-static inline void output_file_name(const char *filename, int len)
-{
-	fprintf(outfile, "/%.*s\n", len, filename);
-}
-
-static int up_path(struct e2scan_dentry *dentry)
-{
-	int len;
-
-	len = 0;
-	while (dentry->ino != visible_root_ino) {
-		if (dentry->ino == EXT2_ROOT_INO)
-			return -1;
-		dentry = dentry->d_parent;
-		len ++;
-	}
-	return len;
-}
-
-static void revert_dir_name(int path_length, struct e2scan_dentry *dentry)
+/* the path of dentry, or NULL if it is not under the visible root */
+static const char *dir_path(struct e2scan_dentry *dentry, int *len)
 {
-	if (path_length > 0) {
-		path_length --;
-		revert_dir_name(path_length, dentry->d_parent);
-		output_dir_name(dentry->name);
+	struct e2scan_dentry *d;
+	char *p;
+	int n;
+
+	if (dentry->d_index != path_dir) {
+		path_dir = dentry->d_index;
+		n = 1;
+		for (d = dentry; d->ino != visible_root_ino;
+		     d = dentry_at(d->d_parent)) {
+			if (d->ino == EXT2_ROOT_INO) {
+				n = -1;
+				break;
+			}
+			n += strlen(d->name) + 1;
+		}
+		path_len = n;
+		if (n < 0)
+			return NULL;
+		if (n > path_max) {
+			path_max = n * 2;
+			free(path_buf);
+			path_buf = xmalloc(path_max);
+		}
+		/* fill in the names from the end */
+		p = path_buf + n;
+		for (d = dentry; d->ino != visible_root_ino;
+		     d = dentry_at(d->d_parent)) {
+			n = strlen(d->name);
+			p -= n;
+			memcpy(p, d->name, n);
+			*--p = '/';
+		}
+		path_buf[0] = '.';
 	}
-	return;
+	if (path_len < 0)
+		return NULL;
+	*len = path_len;
+	return path_buf;
 }
 
 static void report_file_name(struct e2scan_dentry *dentry, ext2_ino_t ino,
 			     const char *name, int namelen)
 {
-	int path_up_length;
+	const char *path;
+	int len;
 
 	ext2fs_fast_unmark_inode_bitmap(fs->inode_map, ino);
 
 	if (ino == visible_root_ino) {
 		/* visible root is to be reported */
-		output_dot_newline();
+		output_name(dentry->ino, ino, ".", 1, NULL, 0);
 		scan_data.fl.nr_reported ++;
 		return;
 	}
 
-	path_up_length = up_path(dentry);
-	if (path_up_length == -1)
+	path = dir_path(dentry, &len);
+	if (path == NULL)
 		/* file is not in visible root */
 		return;
 
-	output_dot();
-	revert_dir_name(path_up_length, dentry);
 	/* the file is under visible root */
 	scan_data.fl.nr_reported ++;
-	output_file_name(name, namelen);
+	output_name(dentry->ino, ino, path, len, name, namelen);
 }
 
 void report_root(void)
 {
 	if (EXT2_ROOT_INO == visible_root_ino &&
 	    is_file_interesting(EXT2_ROOT_INO)) {
-		output_dot_newline();
+		output_name(0, EXT2_ROOT_INO, ".", 1, NULL, 0);
 		scan_data.fl.nr_reported ++;
 	}
 }
@@ -307,7 +472,7 @@ static struct e2scan_dentry *connect_subtree_to_root(struct e2scan_dentry *dir,
 	dir->connected_to_root = 1;
 	dir->not_in_root = not_in_root;
 
-	subdir = dir->d_child;
+	subdir = dentry_at(dir->d_child);
 	prev = NULL;
 	while (subdir) {
 		if (subdir->is_file) {
@@ -320,12 +485,8 @@ static struct e2scan_dentry *connect_subtree_to_root(struct e2scan_dentry *dir,
 			else
 				prev->d_next = subdir->d_next;
 
-			p = tdelete(subdir, &dentry_tree, compare_ino);
-			assert(p != NULL);
-
-			free(subdir->name);
-			p = subdir->d_next;
-			free(subdir);
+			p = dentry_at(subdir->d_next);
+			release_dentry(subdir);
 			subdir = p;
 			continue;
 		}
@@ -337,76 +498,95 @@ static struct e2scan_dentry *connect_subtree_to_root(struct e2scan_dentry *dir,
 		}
 		connect_subtree_to_root(subdir, not_in_root);
 		prev = subdir;
-		subdir = subdir->d_next;
+		subdir = dentry_at(subdir->d_next);
 	}
 	return NULL;
 }
 
-void filelist_iscan_action(ext2_ino_t ino,
-			   struct ext2_inode *inode, char *buf)
+/* whether names of everything below the directory are known to be found */
+int filelist_dir_connected(ext2_ino_t ino)
 {
-	int created;
 	struct e2scan_dentry *dentry;
+
+	dentry = find_dentry(ino);
+	return dentry != NULL && dentry->connected_to_root;
+}
+
+/*
+ * Called from the inode scan threads: the directory blocks are added to
+ * the dblist of scanfs, everything else is left to the caller.
+ */
+int filelist_iscan_action(ext2_filsys scanfs, ext2_ino_t ino,
+			  struct ext2_inode *inode, char *buf)
+{
 	int to_be_listed;
+	int ret = 0;
 
 	if (!LINUX_S_ISDIR(inode->i_mode) &&
-	    (inode->i_flags & EXT2_NODUMP_FL)) {
+	    (inode->i_flags & EXT2_NODUMP_FL))
 		/* skip files which are not to be backuped */
-		ext2fs_fast_unmark_inode_bitmap(fs->inode_map, ino);
-		return;
-	}
+		return ISCAN_UNMARK;
 
 	to_be_listed = (inode->i_ctime < scan_data.fl.ctimestamp &&
 			inode->i_mtime < scan_data.fl.mtimestamp) ? 0 : 1;
+	if (to_be_listed && !filter_match(scanfs, inode, buf))
+		to_be_listed = 0;
 	if (LINUX_S_ISDIR(inode->i_mode)) {
-		dentry = find_or_create_dentry(ino, &created);
-
-		if (ext2fs_block_iterate2(fs, ino, 0, buf,
-					  block_iterate_cb, &ino)) {
+		if (state_dir_unchanged(ino, inode))
+			ret |= ISCAN_SKIPPED;
+		else if (ext2fs_block_iterate2(scanfs, ino, 0, buf,
+					       block_iterate_cb, &ino)) {
 			fprintf(stderr, "ext2fs_block_iterate2 failed\n");
 			exit(1);
 		}
-		dentry->is_dir = to_be_listed;
+		ret |= ISCAN_DIR;
+		if (to_be_listed)
+			ret |= ISCAN_LISTED;
 	}
 	if (!to_be_listed)
 		/* too old files are not interesting */
-		ext2fs_fast_unmark_inode_bitmap(fs->inode_map, ino);
+		ret |= ISCAN_UNMARK;
 	else {
 		/* files and directories to find names of */
-		if (LINUX_S_ISDIR(inode->i_mode)) {
-			if (scan_data.fl.with_dirs)
-				scan_data.fl.nr_dirs++;
-			else
-				ext2fs_fast_unmark_inode_bitmap(fs->inode_map,
-								ino);
-		} else
-			scan_data.fl.nr_files++;
+		if (LINUX_S_ISDIR(inode->i_mode) && !scan_data.fl.with_dirs)
+			ret |= ISCAN_UNMARK;
+		else
+			ret |= ISCAN_FIND;
 	}
+	return ret;
 }
 
-int filelist_dblist_iterate_cb(ext2_ino_t dirino,
-			       struct ext2_dir_entry *dirent,
-			       int namelen)
+void filelist_add_dir(ext2_ino_t ino, int listed)
+{
+	struct e2scan_dentry *dentry;
+	int created;
+
+	dentry = find_or_create_dentry(ino, &created);
+	dentry->is_dir = listed;
+}
+
+/*
+ * Called for each name found in a directory, whether read from disk or
+ * taken from the state of a previous run.
+ */
+int filelist_dirent(ext2_ino_t dirino, ext2_ino_t ino, const char *name,
+		    int namelen, int is_dirname)
 {
 	struct e2scan_dentry *dir, *subdir;
 	int created;
 	int ret;
-	struct ext2_dir_entry_2 *dirent2;
-	int is_dirname;
 
 	dir = find_dentry(dirino);
 	assert(dir != NULL);
 
-	dirent2 = (struct ext2_dir_entry_2 *)dirent;
-	is_dirname = (dirent2->file_type == EXT2_FT_DIR) ? 1 : 0;
 	if (is_dirname) {
-		subdir = find_dentry(dirent->inode);
+		subdir = find_dentry(ino);
 		if (subdir == NULL)
 			/* new name is encountered, skip it */
 			return 0;
 
-		if (subdir->d_parent == NULL) {
-			dentry_attach_name(subdir, namelen, dirent->name);
+		if (subdir->d_parent == 0) {
+			dentry_attach_name(subdir, namelen, name);
 			link_to_parent(dir, subdir);
 
 			if (dir->connected_to_root)
@@ -418,19 +598,17 @@ int filelist_dblist_iterate_cb(ext2_ino_t dirino,
 							dir->not_in_root);
 		}
 	}
-	if (is_file_interesting(dirent->inode)) {
+	if (is_file_interesting(ino)) {
 		if (dir->connected_to_root) {
 			if (is_dirname && subdir->is_printed == 0) {
-				report_file_name(dir, dirent->inode,
-						 dirent->name, namelen);
+				report_file_name(dir, ino, name, namelen);
 				subdir->is_printed = 1;
 			} else
-				report_file_name(dir, dirent->inode,
-						 dirent->name, namelen);
+				report_file_name(dir, ino, name, namelen);
 		} else {
-			subdir = find_or_create_dentry(dirent->inode, &created);
+			subdir = find_or_create_dentry(ino, &created);
 			if (created) {
-				dentry_attach_name(subdir,namelen,dirent->name);
+				dentry_attach_name(subdir, namelen, name);
 
 				link_to_parent(dir, subdir);
 				subdir->is_file = 1;
@@ -453,3 +631,14 @@ int filelist_dblist_iterate_cb(ext2_ino_t dirino,
 		ret |= DIRENT_ABORT;
 	return ret;
 }
+
+int filelist_dblist_iterate_cb(ext2_ino_t dirino,
+			       struct ext2_dir_entry *dirent,
+			       int namelen)
+{
+	struct ext2_dir_entry_2 *dirent2;
+
+	dirent2 = (struct ext2_dir_entry_2 *)dirent;
+	return filelist_dirent(dirino, dirent->inode, dirent->name, namelen,
+			       dirent2->file_type == EXT2_FT_DIR);
+}
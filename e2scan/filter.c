@@ -0,0 +1,375 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <ext2fs/ext2fs.h>
+#include <ext2fs/ext2_ext_attr.h>
+
+#include "e2scan.h"
+
+/*
+ * Filter expressions given with -F are compiled to a short program which
+ * the inode scan threads run on every inode, so that only the matching
+ * inodes are left for the directory walk to find names for.
+ *
+ *	expr := and { "||" and }
+ *	and  := not { "&&" not }
+ *	not  := "!" not | "(" expr ")" | field op value
+ *
+ * The result of the last comparison is kept in an accumulator, and "&&"
+ * and "||" are conditional jumps over the right hand side, so the LOV EA
+ * is only looked up when a comparison on it is actually reached.
+ */
+
+/* on-disk layout of the Lustre LOV EA, as in lustre_idl.h */
+#define LOV_MAGIC_V1	0x0BD10BD0
+#define LOV_MAGIC_V3	0x0BD30BD0
+#define LOV_EA_NAME	"lov"
+
+struct lov_mds_md_v1 {
+	__u32	lmm_magic;
+	__u32	lmm_pattern;
+	__u64	lmm_object_id;
+	__u64	lmm_object_seq;
+	__u32	lmm_stripe_size;
+	__u16	lmm_stripe_count;
+	__u16	lmm_layout_gen;
+};
+
+struct lov_ost_data_v1 {
+	__u64	l_object_id;
+	__u64	l_object_seq;
+	__u32	l_ost_gen;
+	__u32	l_ost_idx;
+};
+
+#define LOV_POOL_NAME_LEN	16	/* follows the v3 header */
+
+enum { FF_SIZE, FF_UID, FF_GID, FF_TYPE, FF_LINKS, FF_STRIPES, FF_OST };
+enum { FC_EQ, FC_NE, FC_LT, FC_LE, FC_GT, FC_GE };
+enum { FO_CMP, FO_NOT, FO_JF, FO_JT };
+
+static const struct {
+	const char	*name;
+	int		field;
+} filter_fields[] = {
+	{ "size",	FF_SIZE },
+	{ "uid",	FF_UID },
+	{ "gid",	FF_GID },
+	{ "type",	FF_TYPE },
+	{ "links",	FF_LINKS },
+	{ "stripes",	FF_STRIPES },
+	{ "ost",	FF_OST },
+	{ NULL, 0 }
+};
+
+static const struct {
+	const char	*name;
+	int		cmp;
+} filter_cmps[] = {	/* longest first */
+	{ "==", FC_EQ }, { "!=", FC_NE }, { "<=", FC_LE }, { ">=", FC_GE },
+	{ "=", FC_EQ }, { "<", FC_LT }, { ">", FC_GT },
+	{ NULL, 0 }
+};
+
+static const struct {
+	char	c;
+	__u16	mode;
+} filter_types[] = {
+	{ 'f', LINUX_S_IFREG }, { 'd', LINUX_S_IFDIR }, { 'l', LINUX_S_IFLNK },
+	{ 'b', LINUX_S_IFBLK }, { 'c', LINUX_S_IFCHR }, { 'p', LINUX_S_IFIFO },
+	{ 's', LINUX_S_IFSOCK },
+	{ 0, 0 }
+};
+
+struct filter_insn {
+	unsigned char	opcode;
+	unsigned char	field;
+	unsigned char	cmp;
+	int		target;		/* of jumps */
+	__u64		value;
+};
+
+static struct filter_insn *prog;
+static int prog_len, prog_max;
+
+static const char *filter_expr, *pos;
+
+/* the LOV EA of the inode being matched, looked up on first use */
+struct filter_lov {
+	int			loaded;
+	int			stripes;
+	struct lov_ost_data_v1	*objects;
+};
+
+static void filter_error(const char *msg)
+{
+	fprintf(stderr, "bad filter '%s' at offset %d: %s\n",
+		filter_expr, (int)(pos - filter_expr), msg);
+	exit(1);
+}
+
+static int emit(int opcode)
+{
+	struct filter_insn *p;
+
+	if (prog_len == prog_max) {
+		prog_max = prog_max ? prog_max * 2 : 16;
+		p = realloc(prog, prog_max * sizeof(*prog));
+		if (p == NULL) {
+			fprintf(stderr, "malloc failed\n");
+			exit(1);
+		}
+		prog = p;
+	}
+	memset(&prog[prog_len], 0, sizeof(*prog));
+	prog[prog_len].opcode = opcode;
+	return prog_len++;
+}
+
+static int match(const char *token)
+{
+	while (isspace(*pos))
+		pos++;
+	if (strncmp(pos, token, strlen(token)))
+		return 0;
+	pos += strlen(token);
+	return 1;
+}
+
+static void parse_cmp(void)
+{
+	const char *word;
+	char *end;
+	int i, len, insn;
+
+	while (isspace(*pos))
+		pos++;
+	word = pos;
+	while (isalpha(*pos))
+		pos++;
+	len = pos - word;
+	for (i = 0; filter_fields[i].name; i++)
+		if (strlen(filter_fields[i].name) == len &&
+		    !strncmp(filter_fields[i].name, word, len))
+			break;
+	if (filter_fields[i].name == NULL) {
+		pos = word;
+		filter_error("expected size, uid, gid, type, links, "
+			     "stripes or ost");
+	}
+	insn = emit(FO_CMP);
+	prog[insn].field = filter_fields[i].field;
+
+	for (i = 0; filter_cmps[i].name; i++)
+		if (match(filter_cmps[i].name))
+			break;
+	if (filter_cmps[i].name == NULL)
+		filter_error("expected a comparison");
+	prog[insn].cmp = filter_cmps[i].cmp;
+	if ((prog[insn].field == FF_TYPE || prog[insn].field == FF_OST) &&
+	    prog[insn].cmp != FC_EQ && prog[insn].cmp != FC_NE)
+		filter_error("only = and != apply to type and ost");
+
+	while (isspace(*pos))
+		pos++;
+	if (prog[insn].field == FF_TYPE) {
+		for (i = 0; filter_types[i].c; i++)
+			if (*pos == filter_types[i].c)
+				break;
+		if (filter_types[i].c == 0 || isalnum(pos[1]))
+			filter_error("expected one of f, d, l, b, c, p, s");
+		prog[insn].value = filter_types[i].mode;
+		pos++;
+		return;
+	}
+
+	if (!isdigit(*pos))
+		filter_error("expected a number");
+	prog[insn].value = strtoull(pos, &end, 0);
+	pos = end;
+	switch (*pos) {
+	case 'T': case 't':
+		prog[insn].value <<= 10;
+	case 'G': case 'g':
+		prog[insn].value <<= 10;
+	case 'M': case 'm':
+		prog[insn].value <<= 10;
+	case 'K': case 'k':
+		prog[insn].value <<= 10;
+		pos++;
+	}
+}
+
+static void parse_or(void);
+
+static void parse_not(void)
+{
+	if (match("!")) {
+		parse_not();
+		emit(FO_NOT);
+	} else if (match("(")) {
+		parse_or();
+		if (!match(")"))
+			filter_error("expected )");
+	} else {
+		parse_cmp();
+	}
+}
+
+/*
+ * A jump taken leaves the accumulator as it is, which is then also the
+ * value of the whole chain: false for "&&", true for "||".
+ */
+static void parse_and(void)
+{
+	int jump;
+
+	parse_not();
+	while (match("&&")) {
+		jump = emit(FO_JF);
+		parse_not();
+		prog[jump].target = prog_len;
+	}
+}
+
+static void parse_or(void)
+{
+	int jump;
+
+	parse_and();
+	while (match("||")) {
+		jump = emit(FO_JT);
+		parse_and();
+		prog[jump].target = prog_len;
+	}
+}
+
+void filter_compile(const char *expr)
+{
+	filter_expr = pos = expr;
+	parse_or();
+	while (isspace(*pos))
+		pos++;
+	if (*pos)
+		filter_error("unexpected characters");
+}
+
+/* the LOV EA is either in the inode, or in its EA block read into buf */
+static void load_lov(ext2_filsys scanfs, struct ext2_inode *inode, char *buf,
+		     struct filter_lov *lov)
+{
+	struct lov_mds_md_v1 *lmm;
+	__u32 size, hdr_size;
+
+	lov->loaded = 1;
+	lmm = inode_ea_get(scanfs, inode, buf, EXT2_ATTR_INDEX_TRUSTED,
+			   LOV_EA_NAME, &size);
+	if (lmm == NULL || size < sizeof(*lmm))
+		return;
+
+	if (ext2fs_le32_to_cpu(lmm->lmm_magic) == LOV_MAGIC_V1)
+		hdr_size = sizeof(*lmm);
+	else if (ext2fs_le32_to_cpu(lmm->lmm_magic) == LOV_MAGIC_V3)
+		hdr_size = sizeof(*lmm) + LOV_POOL_NAME_LEN;
+	else
+		return;
+	lov->stripes = ext2fs_le16_to_cpu(lmm->lmm_stripe_count);
+	if (hdr_size + lov->stripes * sizeof(*lov->objects) > size) {
+		lov->stripes = 0;
+		return;
+	}
+	lov->objects = (struct lov_ost_data_v1 *)((char *)lmm + hdr_size);
+}
+
+static int compare(__u64 a, int cmp, __u64 b)
+{
+	switch (cmp) {
+	case FC_EQ:	return a == b;
+	case FC_NE:	return a != b;
+	case FC_LT:	return a < b;
+	case FC_LE:	return a <= b;
+	case FC_GT:	return a > b;
+	default:	return a >= b;
+	}
+}
+
+static int eval_cmp(ext2_filsys scanfs, struct ext2_inode *inode, char *buf,
+		    struct filter_insn *insn, struct filter_lov *lov)
+{
+	__u64 v;
+	int i;
+
+	switch (insn->field) {
+	case FF_SIZE:
+		v = inode->i_size;
+		if (LINUX_S_ISREG(inode->i_mode))
+			v |= (__u64)inode->i_size_high << 32;
+		break;
+	case FF_UID:
+		v = inode_uid(*inode);
+		break;
+	case FF_GID:
+		v = inode_gid(*inode);
+		break;
+	case FF_TYPE:
+		v = inode->i_mode & LINUX_S_IFMT;
+		break;
+	case FF_LINKS:
+		v = inode->i_links_count;
+		break;
+	case FF_STRIPES:
+		if (!lov->loaded)
+			load_lov(scanfs, inode, buf, lov);
+		v = lov->stripes;
+		break;
+	case FF_OST:
+		if (!lov->loaded)
+			load_lov(scanfs, inode, buf, lov);
+		for (i = 0; i < lov->stripes; i++)
+			if (ext2fs_le32_to_cpu(lov->objects[i].l_ost_idx) ==
+			    insn->value)
+				break;
+		/* "ost=N" is true if any of the objects is on OST N */
+		v = (i < lov->stripes) ? insn->value : ~insn->value;
+		break;
+	default:
+		return 0;
+	}
+	return compare(v, insn->cmp, insn->value);
+}
+
+/*
+ * Called from the inode scan threads.  buf is a block buffer of the
+ * calling thread, which is used to read the EA block.
+ */
+int filter_match(ext2_filsys scanfs, struct ext2_inode *inode, char *buf)
+{
+	struct filter_lov lov;
+	int pc, acc = 1;
+
+	lov.loaded = 0;
+	lov.stripes = 0;
+	for (pc = 0; pc < prog_len; pc++) {
+		switch (prog[pc].opcode) {
+		case FO_CMP:
+			acc = eval_cmp(scanfs, inode, buf, &prog[pc], &lov);
+			break;
+		case FO_NOT:
+			acc = !acc;
+			break;
+		case FO_JF:
+			if (!acc)
+				pc = prog[pc].target - 1;
+			break;
+		case FO_JT:
+			if (acc)
+				pc = prog[pc].target - 1;
+			break;
+		}
+	}
+	return acc;
+}
@@ -0,0 +1,261 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <ext2fs/ext2fs.h>
+
+#include "e2scan.h"
+
+/*
+ * Names are written into one large buffer which is handed to write(2)
+ * when full, so that the output is a few big writes to the descriptor
+ * rather than a stdio call per path component.  A record which does not
+ * fit is written together with the buffer by a single writev(2), without
+ * being copied.
+ *
+ * With -B every name is written as a binary record instead of a line:
+ *
+ *	struct e2scan_record, little endian
+ *	path, not terminated, er_reclen - sizeof(struct e2scan_record) bytes
+ *
+ * after a stream header of E2SCAN_RECORD_MAGIC and E2SCAN_RECORD_VERSION.
+ * The size and times of the inodes are kept while the inode tables are
+ * scanned, as only the inode number is known when the name is found.
+ */
+#define OUTPUT_BUFSIZE		(1024 * 1024)
+
+#define E2SCAN_RECORD_MAGIC	0x52533245	/* "E2SR" once little endian */
+#define E2SCAN_RECORD_VERSION	1
+
+struct e2scan_record {
+	__u32	er_reclen;	/* with the path */
+	__u32	er_ino;
+	__u32	er_parent;	/* directory the name was found in */
+	__u32	er_atime;
+	__u64	er_size;
+	__u32	er_mtime;
+	__u32	er_ctime;
+};
+
+struct output_attr {
+	ext2_ino_t	ino;
+	__u32		atime;
+	__u32		mtime;
+	__u32		ctime;
+	__u64		size;
+};
+
+/* collected by each inode scan thread, then merged */
+struct output_attrs {
+	struct output_attr	*attrs;
+	ext2_ino_t		nr;
+	ext2_ino_t		max;
+};
+
+static int output_fd = -1;
+static int output_format;
+static char *output_buf;
+static size_t output_used;
+
+/* sorted by inode number, as the threads scan ascending ranges */
+static struct output_attrs all;
+
+static void write_iov(struct iovec *iov, int cnt)
+{
+	ssize_t done;
+
+	while (cnt > 0) {
+		done = writev(output_fd, iov, cnt);
+		if (done < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "failed to write output: %s\n",
+				strerror(errno));
+			exit(1);
+		}
+		/* skip what was written, resume a partly written vector */
+		while (cnt > 0 && (size_t)done >= iov->iov_len) {
+			done -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + done;
+			iov->iov_len -= done;
+		}
+	}
+}
+
+void output_open(int fd, int format)
+{
+	__u32 header[2];
+
+	output_fd = fd;
+	output_format = format;
+	output_buf = malloc(OUTPUT_BUFSIZE);
+	if (output_buf == NULL) {
+		fprintf(stderr, "failed to allocate memory for output\n");
+		exit(1);
+	}
+	output_used = 0;
+	if (format == OUTPUT_RECORDS) {
+		header[0] = ext2fs_cpu_to_le32(E2SCAN_RECORD_MAGIC);
+		header[1] = ext2fs_cpu_to_le32(E2SCAN_RECORD_VERSION);
+		memcpy(output_buf, header, sizeof(header));
+		output_used = sizeof(header);
+	}
+}
+
+void output_flush(void)
+{
+	struct iovec iov;
+
+	if (output_used == 0)
+		return;
+	iov.iov_base = output_buf;
+	iov.iov_len = output_used;
+	write_iov(&iov, 1);
+	output_used = 0;
+}
+
+/* iov[0] is left free for the buffer */
+static void output_iov(struct iovec *iov, int cnt)
+{
+	size_t len = 0;
+	int i;
+
+	for (i = 1; i < cnt; i++)
+		len += iov[i].iov_len;
+	if (output_used + len > OUTPUT_BUFSIZE) {
+		iov[0].iov_base = output_buf;
+		iov[0].iov_len = output_used;
+		write_iov(iov, cnt);
+		output_used = 0;
+		return;
+	}
+	for (i = 1; i < cnt; i++) {
+		memcpy(output_buf + output_used, iov[i].iov_base,
+		       iov[i].iov_len);
+		output_used += iov[i].iov_len;
+	}
+}
+
+static int attr_compare(const void *a, const void *b)
+{
+	const struct output_attr *aa = a, *ab = b;
+
+	if (aa->ino == ab->ino)
+		return 0;
+	return aa->ino < ab->ino ? -1 : 1;
+}
+
+/*
+ * Write the name of ino found in directory parent: dir, followed by "/"
+ * and name unless name is NULL.
+ */
+void output_name(ext2_ino_t parent, ext2_ino_t ino, const char *dir,
+		 int dirlen, const char *name, int namelen)
+{
+	struct iovec iov[5];
+	struct e2scan_record rec;
+	struct output_attr key, *attr;
+	int cnt = 1;
+
+	if (output_format == OUTPUT_RECORDS) {
+		memset(&rec, 0, sizeof(rec));
+		key.ino = ino;
+		attr = bsearch(&key, all.attrs, all.nr, sizeof(*all.attrs),
+			       attr_compare);
+		if (attr != NULL) {
+			rec.er_atime = ext2fs_cpu_to_le32(attr->atime);
+			rec.er_mtime = ext2fs_cpu_to_le32(attr->mtime);
+			rec.er_ctime = ext2fs_cpu_to_le32(attr->ctime);
+			rec.er_size = ext2fs_cpu_to_le64(attr->size);
+		}
+		rec.er_reclen = ext2fs_cpu_to_le32(sizeof(rec) + dirlen +
+						   (name ? namelen + 1 : 0));
+		rec.er_ino = ext2fs_cpu_to_le32(ino);
+		rec.er_parent = ext2fs_cpu_to_le32(parent);
+		iov[cnt].iov_base = &rec;
+		iov[cnt++].iov_len = sizeof(rec);
+	}
+	iov[cnt].iov_base = (char *)dir;
+	iov[cnt++].iov_len = dirlen;
+	if (name != NULL) {
+		iov[cnt].iov_base = "/";
+		iov[cnt++].iov_len = 1;
+		iov[cnt].iov_base = (char *)name;
+		iov[cnt++].iov_len = namelen;
+	}
+	if (output_format == OUTPUT_LINES) {
+		iov[cnt].iov_base = "\n";
+		iov[cnt++].iov_len = 1;
+	} else if (output_format == OUTPUT_NUL) {
+		iov[cnt].iov_base = "";
+		iov[cnt++].iov_len = 1;
+	}
+	output_iov(iov, cnt);
+}
+
+struct output_attrs *output_thread_init(void)
+{
+	struct output_attrs *attrs;
+
+	attrs = calloc(1, sizeof(*attrs));
+	if (attrs == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	return attrs;
+}
+
+/* called from the inode scan threads for the inodes to be listed */
+void output_iscan(struct output_attrs *attrs, ext2_ino_t ino,
+		  struct ext2_inode *inode)
+{
+	struct output_attr *a;
+
+	if (attrs->nr == attrs->max) {
+		attrs->max = attrs->max ? attrs->max * 2 : 1024;
+		a = realloc(attrs->attrs, attrs->max * sizeof(*a));
+		if (a == NULL) {
+			fprintf(stderr, "malloc failed\n");
+			exit(1);
+		}
+		attrs->attrs = a;
+	}
+	a = &attrs->attrs[attrs->nr++];
+	a->ino = ino;
+	a->atime = inode->i_atime;
+	a->mtime = inode->i_mtime;
+	a->ctime = inode->i_ctime;
+	a->size = inode->i_size;
+	if (LINUX_S_ISREG(inode->i_mode))
+		a->size |= (__u64)inode->i_size_high << 32;
+}
+
+/* called by the main thread for the scan threads in order of groups */
+void output_merge(struct output_attrs *attrs)
+{
+	struct output_attr *a;
+
+	if (all.nr + attrs->nr > all.max) {
+		all.max = all.nr + attrs->nr;
+		a = realloc(all.attrs, all.max * sizeof(*a));
+		if (a == NULL) {
+			fprintf(stderr, "malloc failed\n");
+			exit(1);
+		}
+		all.attrs = a;
+	}
+	memcpy(all.attrs + all.nr, attrs->attrs,
+	       attrs->nr * sizeof(*attrs->attrs));
+	all.nr += attrs->nr;
+	free(attrs->attrs);
+	free(attrs);
+}
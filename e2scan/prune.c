@@ -0,0 +1,378 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ext2fs/ext2fs.h>
+#include <ext2fs/ext2_ext_attr.h>
+
+#include "e2scan.h"
+
+/*
+ * With -p the directory blocks are read in two passes.  While the inode
+ * tables are scanned, every directory records its own FID and the FID of
+ * its parent, and every inode to be listed the FID of its parent.  Lustre
+ * keeps these in the LMA and link EAs.  The first pass then reads only
+ * the directories on the way from the parents of the listed inodes up to
+ * the visible root.  If some names are still not found, because a hint was
+ * stale or missing, the second pass reads all the other directories, so
+ * the output is the same as without -p.
+ *
+ * Without any hints, as on plain ext2/3/4, there is nothing to prune by
+ * and all directories are read in one pass.
+ */
+
+/* on-disk layout of the Lustre LMA and link EAs, as in lustre_idl.h */
+#define LMA_EA_NAME		"lma"
+#define LINK_EA_NAME		"link"
+#define LINK_EA_MAGIC		0x11EAF1DFUL
+
+struct lu_fid {
+	__u64	f_seq;
+	__u32	f_oid;
+	__u32	f_ver;
+};
+
+struct lustre_mdt_attrs {	/* little endian */
+	__u32		lma_compat;
+	__u32		lma_incompat;
+	struct lu_fid	lma_self_fid;
+};
+
+struct link_ea_header {
+	__u32	leh_magic;
+	__u32	leh_reccount;
+	__u64	leh_len;
+	__u32	padding1;
+	__u32	padding2;
+};
+
+#define LINK_EA_ENTRY_FID	2	/* big endian, after the record length */
+#define LINK_EA_ENTRY_SIZE	(LINK_EA_ENTRY_FID + 16)
+
+struct prune_dir {
+	struct lu_fid	fid;
+	struct lu_fid	parent;		/* zero if not known */
+	ext2_ino_t	ino;
+};
+
+struct prune_match {
+	struct lu_fid	parent;
+	ext2_ino_t	ino;
+};
+
+/* collected by each inode scan thread, then merged */
+struct prune_hints {
+	struct prune_dir	*dirs;
+	ext2_ino_t		nr_dirs;
+	ext2_ino_t		max_dirs;
+	struct prune_match	*matches;
+	ext2_ino_t		nr_matches;
+	ext2_ino_t		max_matches;
+	ext2_ino_t		nr_unhinted;	/* matches without a parent */
+};
+
+static struct prune_hints all;
+
+static void *grow(void *p, ext2_ino_t *max, size_t size)
+{
+	*max = *max ? *max * 2 : 1024;
+	p = realloc(p, *max * size);
+	if (p == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	return p;
+}
+
+static inline int fid_is_zero(const struct lu_fid *fid)
+{
+	return fid->f_seq == 0 && fid->f_oid == 0 && fid->f_ver == 0;
+}
+
+static __u64 get_be64(const unsigned char *p)
+{
+	__u64 v = 0;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+static __u64 get_le64(const unsigned char *p)
+{
+	__u64 v = 0;
+	int i;
+
+	for (i = 7; i >= 0; i--)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+/*
+ * The FID of a directory from its LMA.  Directories created before the
+ * filesystem was used by Lustre 2 have none, and are known by their IGIF,
+ * the FID made of inode number and generation.
+ */
+static void self_fid(ext2_filsys scanfs, ext2_ino_t ino,
+		     struct ext2_inode *inode, char *buf, struct lu_fid *fid)
+{
+	struct lustre_mdt_attrs *lma;
+	__u32 size;
+
+	lma = inode_ea_get(scanfs, inode, buf, EXT2_ATTR_INDEX_TRUSTED,
+			   LMA_EA_NAME, &size);
+	if (lma != NULL && size >= sizeof(*lma)) {
+		fid->f_seq = get_le64((unsigned char *)&lma->lma_self_fid);
+		fid->f_oid = ext2fs_le32_to_cpu(lma->lma_self_fid.f_oid);
+		fid->f_ver = ext2fs_le32_to_cpu(lma->lma_self_fid.f_ver);
+		if (!fid_is_zero(fid))
+			return;
+	}
+	fid->f_seq = ino;
+	fid->f_oid = inode->i_generation;
+	fid->f_ver = 0;
+}
+
+/* the FID of the parent of the first name in the link EA */
+static int parent_fid(ext2_filsys scanfs, struct ext2_inode *inode,
+		      char *buf, struct lu_fid *fid)
+{
+	struct link_ea_header *leh;
+	unsigned char *entry;
+	__u32 size, magic;
+
+	leh = inode_ea_get(scanfs, inode, buf, EXT2_ATTR_INDEX_TRUSTED,
+			   LINK_EA_NAME, &size);
+	if (leh == NULL || size < sizeof(*leh) + LINK_EA_ENTRY_SIZE)
+		return 0;
+	magic = leh->leh_magic;
+	if (magic != LINK_EA_MAGIC && ext2fs_swab32(magic) != LINK_EA_MAGIC)
+		return 0;
+	if (leh->leh_reccount == 0)
+		return 0;
+
+	entry = (unsigned char *)(leh + 1);
+	fid->f_seq = get_be64(entry + LINK_EA_ENTRY_FID);
+	fid->f_oid = ext2fs_be32_to_cpu(*(__u32 *)(entry +
+						   LINK_EA_ENTRY_FID + 8));
+	fid->f_ver = ext2fs_be32_to_cpu(*(__u32 *)(entry +
+						   LINK_EA_ENTRY_FID + 12));
+	return !fid_is_zero(fid);
+}
+
+struct prune_hints *prune_thread_init(void)
+{
+	struct prune_hints *hints;
+
+	hints = calloc(1, sizeof(*hints));
+	if (hints == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	return hints;
+}
+
+/* called from the inode scan threads for directories and listed inodes */
+void prune_iscan(struct prune_hints *hints, ext2_filsys scanfs,
+		 ext2_ino_t ino, struct ext2_inode *inode, char *buf,
+		 int flags)
+{
+	struct lu_fid parent;
+	struct prune_dir *d;
+	struct prune_match *m;
+	int found;
+
+	if (!(flags & (ISCAN_DIR | ISCAN_FIND)))
+		return;
+
+	found = parent_fid(scanfs, inode, buf, &parent);
+	if (flags & ISCAN_DIR) {
+		if (hints->nr_dirs == hints->max_dirs)
+			hints->dirs = grow(hints->dirs, &hints->max_dirs,
+					   sizeof(*hints->dirs));
+		d = &hints->dirs[hints->nr_dirs++];
+		d->ino = ino;
+		self_fid(scanfs, ino, inode, buf, &d->fid);
+		if (found)
+			d->parent = parent;
+		else
+			memset(&d->parent, 0, sizeof(d->parent));
+	}
+	/* reserved inodes have no names, the root is reported apart */
+	if ((flags & ISCAN_FIND) && ino >= EXT2_FIRST_INO(scanfs->super)) {
+		if (!found) {
+			memset(&parent, 0, sizeof(parent));
+			hints->nr_unhinted++;
+		}
+		if (hints->nr_matches == hints->max_matches)
+			hints->matches = grow(hints->matches,
+					      &hints->max_matches,
+					      sizeof(*hints->matches));
+		m = &hints->matches[hints->nr_matches++];
+		m->ino = ino;
+		m->parent = parent;
+	}
+}
+
+/* called by the main thread once all scan threads are done */
+void prune_merge(struct prune_hints *hints)
+{
+	while (all.nr_dirs + hints->nr_dirs > all.max_dirs)
+		all.dirs = grow(all.dirs, &all.max_dirs, sizeof(*all.dirs));
+	memcpy(all.dirs + all.nr_dirs, hints->dirs,
+	       hints->nr_dirs * sizeof(*hints->dirs));
+	all.nr_dirs += hints->nr_dirs;
+
+	while (all.nr_matches + hints->nr_matches > all.max_matches)
+		all.matches = grow(all.matches, &all.max_matches,
+				   sizeof(*all.matches));
+	memcpy(all.matches + all.nr_matches, hints->matches,
+	       hints->nr_matches * sizeof(*hints->matches));
+	all.nr_matches += hints->nr_matches;
+	all.nr_unhinted += hints->nr_unhinted;
+
+	free(hints->dirs);
+	free(hints->matches);
+	free(hints);
+}
+
+static int fid_compare(const void *a, const void *b)
+{
+	const struct lu_fid *fa = a, *fb = b;
+
+	if (fa->f_seq != fb->f_seq)
+		return fa->f_seq < fb->f_seq ? -1 : 1;
+	if (fa->f_oid != fb->f_oid)
+		return fa->f_oid < fb->f_oid ? -1 : 1;
+	if (fa->f_ver != fb->f_ver)
+		return fa->f_ver < fb->f_ver ? -1 : 1;
+	return 0;
+}
+
+/* the FID is the first member of struct prune_dir */
+static struct prune_dir *find_dir(const struct lu_fid *fid)
+{
+	return bsearch(fid, all.dirs, all.nr_dirs, sizeof(*all.dirs),
+		       fid_compare);
+}
+
+struct split_dblist {
+	ext2fs_inode_bitmap	read_dirs;
+	ext2_dblist		first;
+	ext2_dblist		rest;
+	ext2_ino_t		nr_first;
+};
+
+/* callback for ext2fs_dblist_iterate */
+static int split_dblist_cb(ext2_filsys fs, struct ext2_db_entry *db_info,
+			   void *priv_data)
+{
+	struct split_dblist *split = priv_data;
+	ext2_dblist dblist;
+
+	if (ext2fs_fast_test_inode_bitmap(split->read_dirs, db_info->ino)) {
+		dblist = split->first;
+		split->nr_first++;
+	} else {
+		dblist = split->rest;
+	}
+	if (ext2fs_add_dir_block(dblist, db_info->ino, db_info->blk,
+				 db_info->blockcnt)) {
+		fprintf(stderr, "failed to add directory block\n");
+		exit(1);
+	}
+	return 0;
+}
+
+/*
+ * Leave in fs->dblist only the blocks of the directories on the way from
+ * the parents of the listed inodes up to a directory connected to the
+ * visible root, and return the blocks of the other directories for the
+ * second pass.  Returns NULL if all directories are to be read at once.
+ */
+ext2_dblist prune_schedule(ext2_filsys fs)
+{
+	struct split_dblist split;
+	struct prune_dir *d;
+	ext2_dblist rest = NULL;
+	struct lu_fid *fid;
+	ext2_ino_t i, nr_read = 0;
+	errcode_t retval;
+
+	if (all.nr_unhinted == all.nr_matches) {
+		fprintf(stderr, "\tno parent hints, reading all directories\n");
+		free(all.matches);
+		all.matches = NULL;
+		all.nr_matches = 0;
+		goto out;
+	}
+
+	retval = ext2fs_allocate_inode_bitmap(fs, "directories to read",
+					      &split.read_dirs);
+	if (retval) {
+		com_err("ext2fs_allocate_inode_bitmap", retval,
+			"allocating directory bitmap\n");
+		exit(1);
+	}
+	qsort(all.dirs, all.nr_dirs, sizeof(*all.dirs), fid_compare);
+	for (i = 0; i < all.nr_matches; i++) {
+		fid = &all.matches[i].parent;
+		while ((d = find_dir(fid)) != NULL) {
+			if (ext2fs_fast_test_inode_bitmap(split.read_dirs,
+							  d->ino))
+				break;
+			ext2fs_fast_mark_inode_bitmap(split.read_dirs, d->ino);
+			nr_read++;
+			/* names above it are known already */
+			if (filelist_dir_connected(d->ino) ||
+			    fid_is_zero(&d->parent))
+				break;
+			fid = &d->parent;
+		}
+	}
+
+	split.nr_first = 0;
+	retval = ext2fs_init_dblist(fs, &split.first);
+	if (retval == 0)
+		retval = ext2fs_init_dblist(fs, &split.rest);
+	if (retval) {
+		com_err("ext2fs_init_dblist", retval,
+			"initializing dblist\n");
+		exit(1);
+	}
+	ext2fs_dblist_iterate(fs->dblist, split_dblist_cb, &split);
+	fprintf(stderr, "\t%u of %u directories (%u of %u blocks) "
+		"to read first, %u inodes without parent hint\n", nr_read,
+		all.nr_dirs, split.nr_first, ext2fs_dblist_count(fs->dblist),
+		all.nr_unhinted);
+	ext2fs_free_dblist(fs->dblist);
+	fs->dblist = split.first;
+	ext2fs_free_inode_bitmap(split.read_dirs);
+	rest = split.rest;
+
+out:
+	free(all.dirs);
+	all.dirs = NULL;
+	all.nr_dirs = 0;
+	return rest;
+}
+
+/*
+ * Number of inodes whose names were not found by the first pass: names
+ * found are cleared in inode_map, whether under the visible root or not.
+ */
+ext2_ino_t prune_pending(ext2_filsys fs)
+{
+	ext2_ino_t i, pending = 0;
+
+	for (i = 0; i < all.nr_matches; i++)
+		if (ext2fs_fast_test_inode_bitmap(fs->inode_map,
+						  all.matches[i].ino))
+			pending++;
+	free(all.matches);
+	memset(&all, 0, sizeof(all));
+	return pending;
+}
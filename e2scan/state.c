@@ -0,0 +1,541 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/errno.h>
+#include <ext2fs/ext2fs.h>
+
+#include "e2scan.h"
+
+/* e2scan.c */
+extern ext2_filsys fs;
+
+/*
+ * The state file lets a later run skip the directory blocks which can
+ * not have changed.  It keeps every directory with its generation, times,
+ * parent and name, and every directory each other inode was found in, as
+ * a hard linked file has to be looked for in all of them.  A directory whose generation, mtime and ctime are as
+ * recorded, with the ctime older than the start of the recorded run, has
+ * the same entries as it had then.  Its blocks are only read if it holds
+ * a file to be listed; its subdirectories are named from the state.
+ *
+ * Records are sorted by inode number and written as varints of the
+ * difference from the previous record, so the file stays small.  It is
+ * in host byte order, as it is only meant to be read by the next run on
+ * the same node.
+ */
+#define E2SCAN_STATE_MAGIC	0x45325353	/* "E2SS" */
+#define E2SCAN_STATE_VERSION	2
+
+struct state_hdr {
+	__u32	sh_magic;
+	__u32	sh_version;
+	__u8	sh_uuid[16];
+	__u32	sh_inodes_count;
+	__u32	sh_unused;
+	__u64	sh_time;	/* when the run started */
+	__u64	sh_nr_dirs;
+	__u64	sh_nr_files;
+};
+
+struct state_dir {
+	ext2_ino_t	ino;
+	ext2_ino_t	parent;		/* 0 if not found in any directory */
+	__u32		generation;
+	__u32		mtime;
+	__u32		ctime;
+	__u32		namelen;
+	char		*name;
+};
+
+struct state_file {
+	ext2_ino_t	ino;
+	ext2_ino_t	parent;
+};
+
+struct state {
+	struct state_dir	*dirs;
+	__u64			nr_dirs;
+	__u64			max_dirs;
+	struct state_file	*files;
+	__u64			nr_files;
+	__u64			max_files;
+	time_t			time;
+};
+
+static struct state old_state, new_state;
+static int old_state_loaded;
+
+/* unchanged directories whose blocks are not read in this run */
+static ext2fs_inode_bitmap skipped_dirs;
+
+static void put_varint(FILE *f, __u64 v)
+{
+	while (v >= 0x80) {
+		putc_unlocked((v & 0x7f) | 0x80, f);
+		v >>= 7;
+	}
+	putc_unlocked(v, f);
+}
+
+static int get_varint(FILE *f, __u64 *v)
+{
+	int c, shift = 0;
+
+	*v = 0;
+	do {
+		c = getc_unlocked(f);
+		if (c == EOF || shift > 63)
+			return -1;
+		*v |= (__u64)(c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+	return 0;
+}
+
+static struct state_dir *find_dir(struct state *s, ext2_ino_t ino)
+{
+	__u64 lo = 0, hi = s->nr_dirs, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (s->dirs[mid].ino < ino)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < s->nr_dirs && s->dirs[lo].ino == ino)
+		return &s->dirs[lo];
+	return NULL;
+}
+
+static void add_file(struct state *s, ext2_ino_t ino, ext2_ino_t parent)
+{
+	struct state_file *files;
+
+	if (s->nr_files == s->max_files) {
+		s->max_files = s->max_files ? s->max_files * 2 : 65536;
+		files = realloc(s->files, s->max_files * sizeof(*files));
+		if (files == NULL) {
+			fprintf(stderr, "malloc failed\n");
+			exit(1);
+		}
+		s->files = files;
+	}
+	s->files[s->nr_files].ino = ino;
+	s->files[s->nr_files].parent = parent;
+	s->nr_files++;
+}
+
+static int read_state(FILE *f, struct state_hdr *hdr)
+{
+	struct state_dir *d;
+	struct state_file *sf;
+	__u64 i, v, delta, ino, parent, prev, val[5];
+	char buf[EXT2_NAME_LEN];
+	__u32 magic;
+	int j;
+
+	if (hdr->sh_nr_dirs > hdr->sh_inodes_count ||
+	    hdr->sh_nr_files > hdr->sh_inodes_count)
+		return -1;
+	old_state.dirs = calloc(hdr->sh_nr_dirs + 1, sizeof(*d));
+	old_state.files = calloc(hdr->sh_nr_files + 1, sizeof(*sf));
+	if (old_state.dirs == NULL || old_state.files == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+
+	ino = 0;
+	for (i = 0; i < hdr->sh_nr_dirs; i++) {
+		d = &old_state.dirs[i];
+		if (get_varint(f, &v))
+			return -1;
+		/* parent, generation, mtime, ctime, namelen */
+		for (j = 0; j < 5; j++)
+			if (get_varint(f, &val[j]) || val[j] > ~0U)
+				return -1;
+		ino += v;
+		if (v == 0 || ino > hdr->sh_inodes_count ||
+		    val[0] > hdr->sh_inodes_count || val[4] > EXT2_NAME_LEN)
+			return -1;
+		if (fread(buf, 1, val[4], f) != val[4])
+			return -1;
+		d->ino = ino;
+		d->parent = val[0];
+		d->generation = val[1];
+		d->mtime = val[2];
+		d->ctime = val[3];
+		d->namelen = val[4];
+		if (d->parent)
+			d->name = name_arena_copy(buf, d->namelen);
+	}
+	old_state.nr_dirs = hdr->sh_nr_dirs;
+
+	ino = 0;
+	parent = 0;
+	for (i = 0; i < hdr->sh_nr_files; i++) {
+		sf = &old_state.files[i];
+		if (get_varint(f, &v) || (v == 0 && i == 0))
+			return -1;
+		ino += v;
+		if (get_varint(f, &delta))
+			return -1;
+		/* zigzag encoded difference from the previous parent */
+		prev = parent;
+		parent += (delta >> 1) ^ -(delta & 1);
+		parent &= 0xffffffff;
+		/* the parents of an inode are sorted */
+		if (ino > hdr->sh_inodes_count || parent == 0 ||
+		    parent > hdr->sh_inodes_count || (v == 0 && parent <= prev))
+			return -1;
+		sf->ino = ino;
+		sf->parent = parent;
+	}
+	old_state.nr_files = hdr->sh_nr_files;
+
+	if (fread(&magic, sizeof(magic), 1, f) != 1 ||
+	    magic != E2SCAN_STATE_MAGIC)
+		return -1;
+	return 0;
+}
+
+/*
+ * Read the state saved by a previous run on this filesystem.  Any
+ * problem with it only means that this run reads every directory.
+ * Returns 1 and the start time of the previous run if it was loaded.
+ */
+int state_load(const char *name, time_t *time)
+{
+	struct state_hdr hdr;
+	errcode_t retval;
+	FILE *f;
+
+	retval = ext2fs_allocate_inode_bitmap(fs, "skipped directories",
+					      &skipped_dirs);
+	if (retval) {
+		com_err("ext2fs_allocate_inode_bitmap", retval,
+			"allocating skipped directory bitmap\n");
+		exit(1);
+	}
+
+	f = fopen(name, "r");
+	if (f == NULL) {
+		if (errno != ENOENT)
+			fprintf(stderr, "can't open state '%s': %s\n",
+				name, strerror(errno));
+		fprintf(stderr, "no previous state, reading all directories\n");
+		return 0;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    hdr.sh_magic != E2SCAN_STATE_MAGIC ||
+	    hdr.sh_version != E2SCAN_STATE_VERSION) {
+		fprintf(stderr, "'%s' is not an e2scan state file, "
+			"reading all directories\n", name);
+		goto out;
+	}
+	if (memcmp(hdr.sh_uuid, fs->super->s_uuid, sizeof(hdr.sh_uuid)) ||
+	    hdr.sh_inodes_count != fs->super->s_inodes_count) {
+		fprintf(stderr, "state '%s' is of another filesystem, "
+			"reading all directories\n", name);
+		goto out;
+	}
+	if (read_state(f, &hdr)) {
+		fprintf(stderr, "state '%s' is corrupted, "
+			"reading all directories\n", name);
+		free(old_state.dirs);
+		free(old_state.files);
+		memset(&old_state, 0, sizeof(old_state));
+		goto out;
+	}
+	old_state.time = hdr.sh_time;
+	old_state_loaded = 1;
+	*time = old_state.time;
+	fprintf(stderr, "previous state: %llu dirs, %llu files, from %s",
+		(unsigned long long)old_state.nr_dirs,
+		(unsigned long long)old_state.nr_files,
+		ctime(time));
+out:
+	fclose(f);
+	return old_state_loaded;
+}
+
+/*
+ * Called from the inode scan threads, so it only reads the old state.
+ * Time stamps of a second in which the previous run was going on can't
+ * tell whether the directory was changed after it was read.
+ */
+int state_dir_unchanged(ext2_ino_t ino, struct ext2_inode *inode)
+{
+	struct state_dir *d;
+
+	if (!old_state_loaded)
+		return 0;
+	d = find_dir(&old_state, ino);
+	return (d != NULL && d->generation == inode->i_generation &&
+		d->mtime == inode->i_mtime && d->ctime == inode->i_ctime &&
+		(time_t)inode->i_ctime < old_state.time);
+}
+
+/* directories are added in inode number order, once the scan is done */
+void state_add_dir(ext2_ino_t ino, __u32 generation, __u32 mtime,
+		   __u32 ctime, int skipped)
+{
+	struct state_dir *dirs, *d;
+
+	if (new_state.nr_dirs == new_state.max_dirs) {
+		new_state.max_dirs = new_state.max_dirs ?
+			new_state.max_dirs * 2 : 16384;
+		dirs = realloc(new_state.dirs,
+			       new_state.max_dirs * sizeof(*dirs));
+		if (dirs == NULL) {
+			fprintf(stderr, "malloc failed\n");
+			exit(1);
+		}
+		new_state.dirs = dirs;
+	}
+	d = &new_state.dirs[new_state.nr_dirs++];
+	memset(d, 0, sizeof(*d));
+	d->ino = ino;
+	d->generation = generation;
+	d->mtime = mtime;
+	d->ctime = ctime;
+	if (skipped)
+		ext2fs_mark_inode_bitmap(skipped_dirs, ino);
+}
+
+/*
+ * Files to be listed still need their names, so the blocks of every
+ * skipped directory holding one of them are added to the dblist after
+ * all.  Returns the number of directories which stay skipped.
+ */
+ext2_ino_t state_schedule_dirs(char *block_buf)
+{
+	struct state_file *sf;
+	ext2_ino_t parent, nr = 0;
+	__u64 i;
+
+	if (!old_state_loaded)
+		return 0;
+	for (i = 0; i < old_state.nr_files; i++) {
+		sf = &old_state.files[i];
+		if (!ext2fs_fast_test_inode_bitmap(fs->inode_map, sf->ino) ||
+		    !ext2fs_fast_test_inode_bitmap(skipped_dirs, sf->parent))
+			continue;
+		ext2fs_fast_unmark_inode_bitmap(skipped_dirs, sf->parent);
+		parent = sf->parent;
+		if (ext2fs_block_iterate2(fs, parent, 0, block_buf,
+					  block_iterate_cb, &parent)) {
+			fprintf(stderr, "ext2fs_block_iterate2 failed\n");
+			exit(1);
+		}
+	}
+	for (i = 0; i < new_state.nr_dirs; i++)
+		if (ext2fs_fast_test_inode_bitmap(skipped_dirs,
+						  new_state.dirs[i].ino))
+			nr++;
+	return nr;
+}
+
+/*
+ * Should names of files to be listed still be missing once the directory
+ * blocks are read, because the state did not know every directory they
+ * are in, the blocks of the directories which stayed skipped replace
+ * those in the dblist, to be read as well.  Returns the number of names
+ * not found: those found are cleared in inode_map.
+ */
+ext2_ino_t state_pending(char *block_buf)
+{
+	ext2_ino_t ino, pending = 0;
+	errcode_t retval;
+	__u64 i;
+
+	if (!old_state_loaded)
+		return 0;
+	for (ino = 1; ino <= fs->super->s_inodes_count; ino++)
+		if (ext2fs_fast_test_inode_bitmap(fs->inode_map, ino))
+			pending++;
+	if (pending == 0)
+		return 0;
+
+	ext2fs_free_dblist(fs->dblist);
+	retval = ext2fs_init_dblist(fs, NULL);
+	if (retval) {
+		com_err("ext2fs_init_dblist", retval,
+			"initializing dblist\n");
+		exit(1);
+	}
+	for (i = 0; i < new_state.nr_dirs; i++) {
+		ino = new_state.dirs[i].ino;
+		if (!ext2fs_fast_test_inode_bitmap(skipped_dirs, ino))
+			continue;
+		ext2fs_fast_unmark_inode_bitmap(skipped_dirs, ino);
+		if (ext2fs_block_iterate2(fs, ino, 0, block_buf,
+					  block_iterate_cb, &ino)) {
+			fprintf(stderr, "ext2fs_block_iterate2 failed\n");
+			exit(1);
+		}
+	}
+	return pending;
+}
+
+/*
+ * Enter the subdirectories of skipped directories as if their entries
+ * had been read from disk.
+ */
+void state_replay(void)
+{
+	struct state_dir *d, *nd;
+	__u64 i;
+
+	if (!old_state_loaded)
+		return;
+	for (i = 0; i < old_state.nr_dirs; i++) {
+		d = &old_state.dirs[i];
+		if (d->parent == 0 ||
+		    !ext2fs_fast_test_inode_bitmap(skipped_dirs, d->parent))
+			continue;
+		nd = find_dir(&new_state, d->ino);
+		if (nd == NULL || nd->generation != d->generation ||
+		    nd->parent != 0)
+			continue;
+		nd->parent = d->parent;
+		nd->namelen = d->namelen;
+		nd->name = d->name;
+		filelist_dirent(d->parent, d->ino, d->name, d->namelen, 1);
+	}
+}
+
+/* called for every entry of the directory blocks read */
+void state_add_entry(ext2_ino_t dirino, ext2_ino_t ino, const char *name,
+		     int namelen)
+{
+	struct state_dir *d;
+
+	d = find_dir(&new_state, ino);
+	if (d == NULL) {
+		add_file(&new_state, ino, dirino);
+		return;
+	}
+	if (d->parent == 0) {
+		d->parent = dirino;
+		d->namelen = namelen;
+		d->name = name_arena_copy(name, namelen);
+	}
+}
+
+static int compare_file(const void *a, const void *b)
+{
+	const struct state_file *f1 = a, *f2 = b;
+
+	if (f1->ino != f2->ino)
+		return f1->ino < f2->ino ? -1 : 1;
+	if (f1->parent != f2->parent)
+		return f1->parent < f2->parent ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Files in skipped directories are taken over from the old state, as are
+ * all the directories of a file to be listed whose name was not found.
+ * The new state is written next to the old one and renamed over it, so
+ * an interrupted run leaves the old state in place.
+ */
+int state_save(const char *name, time_t time)
+{
+	struct state_hdr hdr;
+	struct state_dir *d;
+	struct state_file *sf;
+	__u64 i, n;
+	ext2_ino_t ino, parent;
+	__u32 magic = E2SCAN_STATE_MAGIC;
+	char *tmp;
+	FILE *f;
+
+	for (i = 0; i < old_state.nr_files; i++) {
+		sf = &old_state.files[i];
+		if (ext2fs_fast_test_inode_bitmap(skipped_dirs, sf->parent) ||
+		    ext2fs_fast_test_inode_bitmap(fs->inode_map, sf->ino))
+			add_file(&new_state, sf->ino, sf->parent);
+	}
+	qsort(new_state.files, new_state.nr_files, sizeof(*sf), compare_file);
+	/* keep every parent of hard linked files, but each only once */
+	for (i = 0, n = 0; i < new_state.nr_files; i++)
+		if (n == 0 || compare_file(&new_state.files[i],
+					   &new_state.files[n - 1]))
+			new_state.files[n++] = new_state.files[i];
+	new_state.nr_files = n;
+
+	if (asprintf(&tmp, "%s.tmp", name) < 0) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	f = fopen(tmp, "w");
+	if (f == NULL) {
+		fprintf(stderr, "can't create state '%s': %s\n",
+			tmp, strerror(errno));
+		free(tmp);
+		return -1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.sh_magic = E2SCAN_STATE_MAGIC;
+	hdr.sh_version = E2SCAN_STATE_VERSION;
+	memcpy(hdr.sh_uuid, fs->super->s_uuid, sizeof(hdr.sh_uuid));
+	hdr.sh_inodes_count = fs->super->s_inodes_count;
+	hdr.sh_time = time;
+	hdr.sh_nr_dirs = new_state.nr_dirs;
+	hdr.sh_nr_files = new_state.nr_files;
+	fwrite(&hdr, sizeof(hdr), 1, f);
+
+	ino = 0;
+	for (i = 0; i < new_state.nr_dirs; i++) {
+		d = &new_state.dirs[i];
+		put_varint(f, d->ino - ino);
+		put_varint(f, d->parent);
+		put_varint(f, d->generation);
+		put_varint(f, d->mtime);
+		put_varint(f, d->ctime);
+		put_varint(f, d->parent ? d->namelen : 0);
+		if (d->parent)
+			fwrite(d->name, 1, d->namelen, f);
+		ino = d->ino;
+	}
+
+	ino = 0;
+	parent = 0;
+	for (i = 0; i < new_state.nr_files; i++) {
+		__s32 delta;
+
+		sf = &new_state.files[i];
+		delta = sf->parent - parent;
+		put_varint(f, sf->ino - ino);
+		put_varint(f, ((__u32)delta << 1) ^ (__u32)(delta >> 31));
+		ino = sf->ino;
+		parent = sf->parent;
+	}
+	fwrite(&magic, sizeof(magic), 1, f);
+
+	if (fflush(f) == 0 && !ferror(f) && fsync(fileno(f)) == 0) {
+		if (fclose(f) == 0 && rename(tmp, name) == 0)
+			f = NULL;
+	} else {
+		fclose(f);
+	}
+	if (f != NULL) {
+		fprintf(stderr, "can't write state '%s': %s\n",
+			tmp, strerror(errno));
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+	fprintf(stderr, "state saved: %llu dirs, %llu files\n",
+		(unsigned long long)new_state.nr_dirs,
+		(unsigned long long)new_state.nr_files);
+	return 0;
+}
@@ -494,6 +494,15 @@ typedef struct ext2_struct_inode_scan *ext2_inode_scan;
 
 typedef struct ext2_icount *ext2_icount_t;
 
+/*
+ * An inode whose counts differ, as returned by ext2fs_icount_compare_range
+ */
+struct ext2_icount_diff {
+	ext2_ino_t	ino;
+	__u16		count1;
+	__u16		count2;
+};
+
 /*
  * Flags for ext2fs_bmap
  */
@@ -1037,6 +1046,12 @@ extern errcode_t ext2fs_icount_decrement(ext2_icount_t icount, ext2_ino_t ino,
 extern errcode_t ext2fs_icount_store(ext2_icount_t icount, ext2_ino_t ino,
 				     __u16 count);
 extern ext2_ino_t ext2fs_get_icount_size(ext2_icount_t icount);
+extern errcode_t ext2fs_icount_compare_range(ext2_icount_t icount1,
+					     ext2_icount_t icount2,
+					     ext2fs_inode_bitmap map,
+					     ext2_ino_t start, unsigned int num,
+					     struct ext2_icount_diff *diffs,
+					     unsigned int *ret_num);
 errcode_t ext2fs_icount_validate(ext2_icount_t icount, FILE *);
 
 /* inode.c */
@@ -672,6 +672,99 @@ ext2_ino_t ext2fs_get_icount_size(ext2_icount_t icount)
 	return icount->size;
 }
 
+/*
+ * ext2fs_icount_compare_range() --- compare two icounts over the num
+ * 	inodes starting at start, looking only at the inodes set in map.
+ * 	The bitmaps are scanned a word at a time, and inodes whose count
+ * 	is one in both icounts are skipped without a lookup.  Each inode
+ * 	whose counts differ, or whose count in icount2 is zero, is
+ * 	returned in diffs, which must have room for num entries.
+ *
+ * 	Start must be the first inode of a byte in the bitmaps (i.e., one
+ * 	more than a multiple of 8), as the first inode of a group is.
+ */
+errcode_t ext2fs_icount_compare_range(ext2_icount_t icount1,
+				      ext2_icount_t icount2,
+				      ext2fs_inode_bitmap map,
+				      ext2_ino_t start, unsigned int num,
+				      struct ext2_icount_diff *diffs,
+				      unsigned int *ret_num)
+{
+	unsigned char	*buf, *used, *single1, *single2, c;
+	unsigned int	nbytes, nwords, i, j, bit, count = 0;
+	__u32		w, *uw, *w1, *w2;
+	ext2_ino_t	ino;
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(icount1, EXT2_ET_MAGIC_ICOUNT);
+	EXT2_CHECK_MAGIC(icount2, EXT2_ET_MAGIC_ICOUNT);
+
+	*ret_num = 0;
+	if (!start || ((start - 1) & 7))
+		return EXT2_ET_INVALID_ARGUMENT;
+	if (num == 0)
+		return 0;
+	if (start + num - 1 > icount1->num_inodes ||
+	    start + num - 1 > icount2->num_inodes)
+		return EXT2_ET_INVALID_ARGUMENT;
+
+	nbytes = (num + 7) >> 3;
+	nwords = (nbytes + 3) >> 2;
+	retval = ext2fs_get_array(3, nwords * sizeof(__u32), &buf);
+	if (retval)
+		return retval;
+	memset(buf, 0, 3 * nwords * sizeof(__u32));
+	used = buf;
+	single1 = used + nwords * sizeof(__u32);
+	single2 = single1 + nwords * sizeof(__u32);
+
+	retval = ext2fs_get_inode_bitmap_range(map, start, num, used);
+	if (!retval)
+		retval = ext2fs_get_inode_bitmap_range(icount1->single,
+						       start, num, single1);
+	if (!retval)
+		retval = ext2fs_get_inode_bitmap_range(icount2->single,
+						       start, num, single2);
+	if (retval)
+		goto errout;
+
+	/*
+	 * The bitwise operations are independent of byte order; only
+	 * the bits of non-zero words need to be picked apart bytewise.
+	 */
+	uw = (__u32 *) used;
+	w1 = (__u32 *) single1;
+	w2 = (__u32 *) single2;
+	for (i = 0; i < nwords; i++) {
+		w = uw[i] & ~(w1[i] & w2[i]);
+		if (!w)
+			continue;
+		for (j = i * 4; j < i * 4 + 4 && j < nbytes; j++) {
+			c = used[j] & ~(single1[j] & single2[j]);
+			for (bit = 0; c && bit < 8; bit++, c >>= 1) {
+				if (!(c & 1))
+					continue;
+				if ((j << 3) + bit >= num)
+					break;
+				ino = start + (j << 3) + bit;
+				ext2fs_icount_fetch(icount1, ino,
+						    &diffs[count].count1);
+				ext2fs_icount_fetch(icount2, ino,
+						    &diffs[count].count2);
+				if (diffs[count].count1 ==
+				    diffs[count].count2 &&
+				    diffs[count].count2)
+					continue;
+				diffs[count++].ino = ino;
+			}
+		}
+	}
+	*ret_num = count;
+errout:
+	ext2fs_free_mem(&buf);
+	return retval;
+}
+
 #ifdef DEBUG
 
 ext2_filsys	test_fs;
@@ -856,6 +949,73 @@ int run_test(int flags, int size, char *dir, struct test_program *prog)
 	return problem;
 }
 
+struct compare_test {
+	ext2_ino_t	ino;
+	__u16		count1;
+	__u16		count2;
+	int		in_map;
+	int		expected;
+};
+
+struct compare_test compare_prog[] = {
+	{ 2, 1, 1, 1, 0 },
+	{ 3, 1, 2, 1, 1 },
+	{ 4, 3, 3, 1, 0 },
+	{ 5, 1, 0, 1, 1 },
+	{ 6, 1, 0, 0, 0 },
+	{ 40, 2, 1, 1, 1 },
+	{ 41, 2, 2, 1, 0 },
+	{ 0, 0, 0, 0, 0 }
+};
+
+int run_compare_test(struct compare_test *prog)
+{
+	errcode_t	retval;
+	ext2_icount_t	icount1, icount2;
+	ext2fs_inode_bitmap map;
+	struct ext2_icount_diff *diffs;
+	struct compare_test *pc;
+	unsigned int	i, num, num_inodes;
+	int		found, problem = 0;
+
+	num_inodes = test_fs->super->s_inodes_per_group;
+	if (ext2fs_create_icount2(test_fs, 0, 0, 0, &icount1) ||
+	    ext2fs_create_icount2(test_fs, EXT2_ICOUNT_OPT_INCREMENT, 0, 0,
+				  &icount2) ||
+	    ext2fs_allocate_inode_bitmap(test_fs, "compare map", &map) ||
+	    ext2fs_get_array(num_inodes, sizeof(struct ext2_icount_diff),
+			     &diffs)) {
+		com_err("run_compare_test", 0, "while setting up");
+		exit(1);
+	}
+	for (pc = prog; pc->ino; pc++) {
+		ext2fs_icount_store(icount1, pc->ino, pc->count1);
+		ext2fs_icount_store(icount2, pc->ino, pc->count2);
+		if (pc->in_map)
+			ext2fs_mark_inode_bitmap(map, pc->ino);
+	}
+	retval = ext2fs_icount_compare_range(icount1, icount2, map, 1,
+					     num_inodes, diffs, &num);
+	if (retval) {
+		com_err("run_compare_test", retval,
+			"while calling icount_compare_range");
+		exit(1);
+	}
+	for (pc = prog; pc->ino; pc++) {
+		for (i = 0, found = 0; i < num; i++)
+			if (diffs[i].ino == pc->ino)
+				found++;
+		printf("icount_compare(%u) = %d (%s)\n", pc->ino, found,
+		       (found == pc->expected) ? "OK" : "NOT OK");
+		if (found != pc->expected)
+			problem++;
+	}
+	ext2fs_free_mem(&diffs);
+	ext2fs_free_inode_bitmap(map);
+	ext2fs_free_icount(icount1);
+	ext2fs_free_icount(icount2);
+	return problem;
+}
 
 int main(int argc, char **argv)
 {
@@ -872,6 +1032,8 @@ int main(int argc, char **argv)
 	failed += run_test(0, 0, ".", prog);
 	printf("\nMultiple bitmap test with tdb:\n");
 	failed += run_test(EXT2_ICOUNT_OPT_INCREMENT, 0, ".", prog);
+	printf("\nComparing icounts:\n");
+	failed += run_compare_test(compare_prog);
 	if (failed)
 		printf("FAILED!\n");
 	return failed;